@@ -1,18 +1,255 @@
+#include <algorithm>
+#include <chrono>
 #include <iostream>
+#include <sstream>
+#include <thread>
+#include <vector>
+#include <stdlib.h>
 #include "lj_driver.hpp"
+#include "lj_closure.h"
+#include "lj_scheduler.h"
+#include "lj_simd.h"
+#include "lj_transpiler.h"
+#include "lj_vm.h"
+
+//
+// Runs one script on a fresh driver and returns everything it printed,
+// including the error that stopped it.
+//
+static std::string RunScript(const std::string &file, bool closure, bool bytecode, bool jit, size_t gc_threshold,
+	size_t call_depth_limit, size_t memo_capacity, size_t parallel_workers)
+{
+	std::ostringstream out;
+	LJ::LJ_Driver driver;
+
+	driver.out_ = &out;
+	if (gc_threshold != 0)
+		driver.gc_.SetThreshold(gc_threshold);
+	driver.call_depth_limit_ = call_depth_limit;
+	driver.memo_capacity_ = memo_capacity;
+	driver.parallel_workers_ = parallel_workers;
+
+	try {
+		if (!driver.Parse(file)) {
+			if (closure) {
+				LJ::LJ_ClosureEngine engine(&driver);
+				engine.Execute();
+			}
+			else if (bytecode) {
+				LJ::LJ_VM vm(&driver);
+				vm.use_jit_ = jit;
+				vm.Execute();
+			}
+			else {
+				driver.Execute();
+			}
+		}
+	}
+	catch (LJ::LJ_Error &e) {
+		out << e.what() << std::endl;
+	}
+	return out.str();
+}
+
+//
+// Runs the same script on count drivers, one thread each, and checks that
+// every driver printed exactly what a single driver prints on its own.
+//
+static int StressTest(const std::string &file, int count, bool closure, bool bytecode, bool jit, size_t gc_threshold,
+	size_t call_depth_limit, size_t memo_capacity, size_t parallel_workers)
+{
+	std::string expected = RunScript(file, closure, bytecode, jit, gc_threshold, call_depth_limit, memo_capacity,
+		parallel_workers);
+	std::vector<std::string> results(count);
+	std::vector<std::thread> threads;
+	int failed = 0;
+
+	for (int i = 0; i < count; i++) {
+		threads.push_back(std::thread([&, i]() {
+			results[i] = RunScript(file, closure, bytecode, jit, gc_threshold, call_depth_limit, memo_capacity,
+				parallel_workers);
+		}));
+	}
+
+	for (int i = 0; i < count; i++) {
+		threads[i].join();
+		if (results[i] != expected) {
+			std::cerr << file << ": driver " << i << " diverged" << std::endl;
+			failed++;
+		}
+	}
+
+	std::cout << file << ": " << count - failed << "/" << count << " drivers matched" << std::endl;
+	return failed == 0 ? 0 : 1;
+}
+
+//
+// Runs count instances of a script as tasks multiplexed onto workers
+// threads, reports throughput and the latency from spawn to finish unless
+// quiet, and checks that every task printed what a single driver prints on
+// its own.
+//
+static int TaskBenchmark(const std::string &file, int count, size_t workers, bool quiet, bool closure, bool bytecode,
+	size_t gc_threshold, size_t call_depth_limit, size_t memo_capacity, size_t parallel_workers)
+{
+	std::string expected = RunScript(file, closure, bytecode, false, gc_threshold, call_depth_limit, memo_capacity,
+		parallel_workers);
+	LJ::LJ_Scheduler scheduler(workers);
+	std::vector<double> latency;
+	int failed = 0;
+
+	for (int i = 0; i < count; i++) {
+		LJ::LJ_Task *task = scheduler.Spawn(file);
+		task->closure_ = closure;
+		task->bytecode_ = bytecode;
+		if (gc_threshold != 0)
+			task->driver_->gc_.SetThreshold(gc_threshold);
+		task->driver_->call_depth_limit_ = call_depth_limit;
+		task->driver_->memo_capacity_ = memo_capacity;
+		task->driver_->parallel_workers_ = parallel_workers;
+	}
+
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	scheduler.Run();
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	for (int i = 0; i < count; i++) {
+		LJ::LJ_Task *task = scheduler.GetTasks()[i];
+		latency.push_back(task->GetLatency());
+		if (task->GetOutput() != expected) {
+			std::cerr << file << ": task " << i << " diverged" << std::endl;
+			failed++;
+		}
+	}
+	std::sort(latency.begin(), latency.end());
+
+	if (!quiet) {
+		std::cout << file << ": " << count << " tasks on " << scheduler.GetWorkerCount() << " workers in " << seconds
+			<< "s, " << count / seconds << " tasks/s" << std::endl;
+	}
+	if (!quiet && count != 0) {
+		std::cout << file << ": latency p50 " << latency[(count - 1) * 50 / 100] << "ms p99 "
+			<< latency[(count - 1) * 99 / 100] << "ms max " << latency[count - 1] << "ms" << std::endl;
+	}
+	std::cout << file << ": " << count - failed << "/" << count << " tasks matched" << std::endl;
+	return failed == 0 ? 0 : 1;
+}
 
 int main(int argc, char *argv[])
 {
 	int res = 0;
+	bool dump = false;
+	bool closure = false;
+	bool bytecode = false;
+	bool emit_cpp = false;
+	bool jit = LJ_JIT_SUPPORTED != 0;
+	int threads = 0;
+	int tasks = 0;
+	size_t workers = 0;
+	size_t gc_threshold = 0;
+	size_t call_depth_limit = DEFAULT_CALL_DEPTH_LIMIT;
+	size_t memo_capacity = DEFAULT_MEMO_CAPACITY;
+	bool memo_stats = false;
+	bool shape_stats = false;
+	bool quiet = false;
+	size_t parallel_workers = 0;
 	LJ::LJ_Driver driver;
-	for (++argv; argv[0]; ++argv) {
-		if (*argv == std::string("-p"))
-			driver.trace_parsing_ = true;
-		else if (*argv == std::string("-s"))
-			driver.trace_scanning_ = true;
-		else if (!driver.Parse(*argv)) {
-			driver.Dump();
+	try {
+		for (++argv; argv[0]; ++argv) {
+			if (*argv == std::string("-p"))
+				driver.trace_parsing_ = true;
+			else if (*argv == std::string("-s"))
+				driver.trace_scanning_ = true;
+			else if (*argv == std::string("-o"))
+				driver.trace_optimization_ = true;
+			else if (*argv == std::string("-d"))
+				dump = true;
+			else if (*argv == std::string("-c"))
+				closure = true;
+			else if (*argv == std::string("-b"))
+				bytecode = true;
+			else if (*argv == std::string("--jit"))
+				bytecode = jit = true;
+			else if (*argv == std::string("--no-jit"))
+				jit = false;
+			else if (*argv == std::string("--emit-cpp"))
+				emit_cpp = true;
+			else if (*argv == std::string("-g") && argv[1])
+				driver.gc_.SetThreshold(gc_threshold = (size_t)atol(*++argv));
+			else if (*argv == std::string("-r") && argv[1])
+				driver.call_depth_limit_ = call_depth_limit = (size_t)atol(*++argv);
+			else if (*argv == std::string("-m") && argv[1])
+				driver.memo_capacity_ = memo_capacity = (size_t)atol(*++argv);
+			else if (*argv == std::string("-j") && argv[1])
+				driver.parallel_workers_ = parallel_workers = (size_t)atol(*++argv);
+			else if (*argv == std::string("--simd") && argv[1]) {
+				std::string level = *++argv;
+				if (level == "scalar")
+					LJ::SetSimdLevel(LJ::SIMD_SCALAR);
+				else if (level == "sse2")
+					LJ::SetSimdLevel(LJ::SIMD_SSE2);
+				else if (level == "avx2")
+					LJ::SetSimdLevel(LJ::SIMD_AVX2);
+				else
+					std::cerr << "unknown simd level " << level << std::endl;
+			}
+			else if (*argv == std::string("--simd-stats"))
+				std::cout << "simd " << LJ::GetSimdLevelString(LJ::GetSimdLevel()) << std::endl;
+			else if (*argv == std::string("--memo-stats"))
+				memo_stats = true;
+			else if (*argv == std::string("--shape-stats"))
+				shape_stats = true;
+			else if (*argv == std::string("-t") && argv[1])
+				threads = atoi(*++argv);
+			else if (*argv == std::string("--tasks") && argv[1])
+				tasks = atoi(*++argv);
+			else if (*argv == std::string("-w") && argv[1])
+				workers = (size_t)atol(*++argv);
+			else if (*argv == std::string("-q"))
+				quiet = true;
+			else if (tasks > 0)
+				res |= TaskBenchmark(*argv, tasks, workers, quiet, closure, bytecode, gc_threshold, call_depth_limit,
+					memo_capacity, parallel_workers);
+			else if (threads > 0)
+				res |= StressTest(*argv, threads, closure, bytecode, jit, gc_threshold, call_depth_limit, memo_capacity,
+					parallel_workers);
+			else if (!driver.Parse(*argv)) {
+				if (emit_cpp) {
+					LJ::LJ_Transpiler transpiler(&driver);
+					transpiler.Emit(std::cout);
+				}
+				else if (closure) {
+					LJ::LJ_ClosureEngine engine(&driver);
+					engine.Compile();
+					if (dump)
+						driver.Dump();
+					engine.Execute();
+				}
+				else if (bytecode) {
+					LJ::LJ_VM vm(&driver);
+					vm.use_jit_ = jit;
+					vm.Compile();
+					if (dump)
+						vm.Dump();
+					vm.Execute();
+				}
+				else {
+					if (dump)
+						driver.Dump();
+					driver.Execute();
+				}
+				if (memo_stats && !emit_cpp)
+					driver.DumpMemoStats(std::cout);
+				if (shape_stats && !emit_cpp)
+					driver.DumpShapeStats(std::cout);
+			}
+			else
+				res = 1;
 		}
 	}
+	catch (LJ::LJ_Error &e) {
+		std::cerr << e.what() << std::endl;
+		res = 1;
+	}
 	return res;
 }
@@ -0,0 +1,380 @@
+#ifndef __LJ_AOT_H__
+#define __LJ_AOT_H__
+
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <initializer_list>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+
+//
+// Runtime library of the C++ files written by lj --emit-cpp. It is header
+// only and independent of the interpreter, a generated file builds with
+// nothing but this header and thread support. Values, operators, calls,
+// output and error messages behave like LJ_Driver's.
+//
+
+// Nested script calls allowed before one fails. A generated file defines
+// the limit lj ran with.
+#ifndef LJ_CALL_DEPTH_LIMIT
+#define LJ_CALL_DEPTH_LIMIT			100000
+#endif
+
+// Native stack calls may use before they continue on a fresh thread.
+#define LJ_STACK_SEGMENT_SIZE		(256 * 1024)
+
+namespace LJ {
+namespace AOT {
+
+	enum ValueType {
+		UNDEFINED_VALUE = 0,
+		BOOLEAN_VALUE = 1,
+		INT_VALUE,
+		DOUBLE_VALUE,
+		STRING_VALUE,
+		NULL_VALUE,
+	};
+
+	enum Operator {
+		ADD_OP = 0,
+		SUB_OP,
+		MUL_OP,
+		DIV_OP,
+		MOD_OP,
+		EQ_OP,
+		NE_OP,
+		GT_OP,
+		GE_OP,
+		LT_OP,
+		LE_OP,
+	};
+
+	class Value {
+	public:
+		ValueType type_;
+		union {
+			bool boolean_value_;
+			int64_t int_value_;
+			double double_value_;
+		};
+		std::shared_ptr<const std::string> string_value_;
+	};
+
+	inline Value Undefined()
+	{
+		Value v;
+		v.type_ = UNDEFINED_VALUE;
+		v.int_value_ = 0;
+		return v;
+	}
+
+	inline Value Bool(bool b)
+	{
+		Value v;
+		v.type_ = BOOLEAN_VALUE;
+		v.int_value_ = 0;
+		v.boolean_value_ = b;
+		return v;
+	}
+
+	inline Value Int(int64_t i)
+	{
+		Value v;
+		v.type_ = INT_VALUE;
+		v.int_value_ = i;
+		return v;
+	}
+
+	inline Value Double(double d)
+	{
+		Value v;
+		v.type_ = DOUBLE_VALUE;
+		v.double_value_ = d;
+		return v;
+	}
+
+	inline Value String(const std::string &s)
+	{
+		Value v;
+		v.type_ = STRING_VALUE;
+		v.int_value_ = 0;
+		v.string_value_ = std::make_shared<const std::string>(s);
+		return v;
+	}
+
+	inline Value Null()
+	{
+		Value v;
+		v.type_ = NULL_VALUE;
+		v.int_value_ = 0;
+		return v;
+	}
+
+	inline Value Box(int64_t i) { return Int(i); }
+	inline Value Box(double d) { return Double(d); }
+	inline Value Box(bool b) { return Bool(b); }
+	inline const Value &Box(const Value &v) { return v; }
+
+	// These wrap on overflow by going through uint64_t. The engines compute
+	// int + - * with plain signed arithmetic, whose overflow is undefined,
+	// so the two agree only where the C++ compiler happens to wrap too.
+	// Division overflow is an error on both sides, see DivInt below.
+	inline int64_t AddInt(int64_t a, int64_t b) { return (int64_t)((uint64_t)a + (uint64_t)b); }
+	inline int64_t SubInt(int64_t a, int64_t b) { return (int64_t)((uint64_t)a - (uint64_t)b); }
+	inline int64_t MulInt(int64_t a, int64_t b) { return (int64_t)((uint64_t)a * (uint64_t)b); }
+	inline int64_t NegInt(int64_t a) { return (int64_t)(0 - (uint64_t)a); }
+
+	inline void Error(const char *l, const char *m)
+	{
+		std::cout.flush();
+		std::cerr << l << ": " << m << std::endl;
+		exit(1);
+	}
+
+	// A zero divisor and INT64_MIN / -1 are errors, anything modulo -1 is 0,
+	// as in LJ_Driver::EvalBinaryInt.
+	inline int64_t DivInt(int64_t a, int64_t b, const char *l)
+	{
+		if (b == 0 || (b == -1 && a == INT64_MIN)) {
+			Error(l, "EvalBinaryInt error");
+		}
+		return a / b;
+	}
+
+	inline int64_t ModInt(int64_t a, int64_t b, const char *l)
+	{
+		if (b == 0) {
+			Error(l, "EvalBinaryInt error");
+		}
+		return b == -1 ? 0 : a % b;
+	}
+
+	struct CallState {
+		size_t depth_;
+		char *stack_base_;
+	};
+
+	inline CallState &GetCallState()
+	{
+		static CallState state = { 0, NULL };
+		return state;
+	}
+
+	// Made before the arguments are evaluated, like LJ_Driver::CallFunction.
+	inline void CheckCall(const char *l)
+	{
+		if (GetCallState().depth_ >= LJ_CALL_DEPTH_LIMIT) {
+			Error(l, "CallFunction error");
+		}
+	}
+
+	//
+	// Runs the call f one level deeper than the caller, or at the caller's
+	// level for a tail call. As in LJ_Driver::RunOnFreshStack, a call that
+	// finds the native stack segment used up continues on a new thread and
+	// is waited for, so deep recursion does not overflow.
+	//
+	template<class F>
+	inline Value RunCall(F f, size_t depth)
+	{
+		CallState &state = GetCallState();
+		char marker;
+		Value v;
+
+		if (state.stack_base_ == NULL) {
+			state.stack_base_ = &marker;
+		}
+		state.depth_ += depth;
+		if ((size_t)(state.stack_base_ - &marker) > LJ_STACK_SEGMENT_SIZE) {
+			char *saved_base = state.stack_base_;
+			std::thread segment([&]() {
+				char base;
+				state.stack_base_ = &base;
+				v = f();
+			});
+			segment.join();
+			state.stack_base_ = saved_base;
+		}
+		else {
+			v = f();
+		}
+		state.depth_ -= depth;
+		return v;
+	}
+
+	template<class F>
+	inline Value Call(F f)
+	{
+		return RunCall(f, 1);
+	}
+
+	template<class F>
+	inline Value TailCall(F f)
+	{
+		return RunCall(f, 0);
+	}
+
+	inline const Value &Check(const Value &v, const char *l)
+	{
+		if (v.type_ == UNDEFINED_VALUE) {
+			Error(l, "EvalIdentifierExpression error");
+		}
+		return v;
+	}
+
+	inline bool Test(const Value &v, const char *l, const char *m)
+	{
+		if (v.type_ != BOOLEAN_VALUE) {
+			Error(l, m);
+		}
+		return v.boolean_value_;
+	}
+
+	template<class T>
+	inline bool CompareOrdered(Operator op, T left, T right)
+	{
+		switch (op) {
+		case EQ_OP: return left == right;
+		case NE_OP: return left != right;
+		case GT_OP: return left > right;
+		case GE_OP: return left >= right;
+		case LT_OP: return left < right;
+		default: return left <= right;
+		}
+	}
+
+	inline Value BinaryInt(Operator op, int64_t left, int64_t right, const char *l)
+	{
+		switch (op) {
+		case ADD_OP: return Int(AddInt(left, right));
+		case SUB_OP: return Int(SubInt(left, right));
+		case MUL_OP: return Int(MulInt(left, right));
+		case DIV_OP: return Int(DivInt(left, right, l));
+		case MOD_OP: return Int(ModInt(left, right, l));
+		default: return Bool(CompareOrdered(op, left, right));
+		}
+	}
+
+	inline Value BinaryDouble(Operator op, double left, double right)
+	{
+		switch (op) {
+		case ADD_OP: return Double(left + right);
+		case SUB_OP: return Double(left - right);
+		case MUL_OP: return Double(left * right);
+		case DIV_OP: return Double(left / right);
+		case MOD_OP: return Double(fmod(left, right));
+		default: return Bool(CompareOrdered(op, left, right));
+		}
+	}
+
+	//
+	// Same dispatch as LJ_Driver::EvalBinaryOperator, l is the location of the
+	// left operand.
+	//
+	inline Value Binary(Operator op, const Value &left, const Value &right, const char *l)
+	{
+		if (left.type_ == INT_VALUE && right.type_ == INT_VALUE) {
+			return BinaryInt(op, left.int_value_, right.int_value_, l);
+		}
+		if (left.type_ == DOUBLE_VALUE && right.type_ == DOUBLE_VALUE) {
+			return BinaryDouble(op, left.double_value_, right.double_value_);
+		}
+		if (left.type_ == INT_VALUE && right.type_ == DOUBLE_VALUE) {
+			return BinaryDouble(op, (double)left.int_value_, right.double_value_);
+		}
+		if (left.type_ == DOUBLE_VALUE && right.type_ == INT_VALUE) {
+			return BinaryDouble(op, left.double_value_, (double)right.int_value_);
+		}
+		if (left.type_ == BOOLEAN_VALUE && right.type_ == BOOLEAN_VALUE) {
+			if (op != EQ_OP && op != NE_OP) {
+				Error(l, "EvalBinaryBoolean error");
+			}
+			return Bool((left.boolean_value_ == right.boolean_value_) == (op == EQ_OP));
+		}
+		if (left.type_ == STRING_VALUE && right.type_ == STRING_VALUE) {
+			if (op == ADD_OP) {
+				return String(*left.string_value_ + *right.string_value_);
+			}
+			if (op < EQ_OP) {
+				Error(l, "EvalBinaryBoolean error");
+			}
+			return Bool(CompareOrdered(op, left.string_value_->compare(*right.string_value_), 0));
+		}
+		if (left.type_ == NULL_VALUE || right.type_ == NULL_VALUE) {
+			bool both = left.type_ == NULL_VALUE && right.type_ == NULL_VALUE;
+			if (op != EQ_OP && op != NE_OP) {
+				Error(l, "EvalBinaryNull error");
+			}
+			return Bool(both == (op == EQ_OP));
+		}
+
+		Error(l, "EvalBinaryExpression error");
+		return Null();
+	}
+
+	inline bool Compare(Operator op, const Value &left, const Value &right, const char *l)
+	{
+		return Binary(op, left, right, l).boolean_value_;
+	}
+
+	inline Value Minus(const Value &v, const char *l)
+	{
+		if (v.type_ == INT_VALUE) {
+			return Int(NegInt(v.int_value_));
+		}
+		if (v.type_ == DOUBLE_VALUE) {
+			return Double(-v.double_value_);
+		}
+
+		Error(l, "EvalMinusExpression error");
+		return Null();
+	}
+
+	inline bool Not(const Value &v, const char *l)
+	{
+		return !Test(v, l, "EvalExclamationExpression error");
+	}
+
+	inline void PrintValue(std::ostream &os, const Value &v)
+	{
+		switch (v.type_) {
+		case BOOLEAN_VALUE:
+			os << (v.boolean_value_ ? "true" : "false");
+			break;
+		case INT_VALUE:
+			os << v.int_value_;
+			break;
+		case DOUBLE_VALUE:
+			os << v.double_value_;
+			break;
+		case STRING_VALUE:
+			os << *v.string_value_;
+			break;
+		default:
+			os << "null";
+			break;
+		}
+	}
+
+	inline Value Print(std::initializer_list<Value> args)
+	{
+		bool first = true;
+
+		for (const Value &v : args) {
+			if (!first) {
+				std::cout << " ";
+			}
+			PrintValue(std::cout, v);
+			first = false;
+		}
+		std::cout << std::endl;
+
+		return Null();
+	}
+}
+}
+
+#endif
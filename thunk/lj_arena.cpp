@@ -0,0 +1,55 @@
+#include <stdlib.h>
+#include "lj_arena.h"
+
+namespace LJ {
+
+	Arena::Arena()
+		: cursor_(NULL), limit_(NULL), chunks_(NULL), finalizers_(NULL), bytes_allocated_(0)
+	{
+
+	}
+
+	Arena::~Arena()
+	{
+		for (Finalizer *f = finalizers_; f != NULL; f = f->next_) {
+			f->proc_(f->object_);
+		}
+
+		while (chunks_ != NULL) {
+			Chunk *next = chunks_->next_;
+			free(chunks_);
+			chunks_ = next;
+		}
+	}
+
+	void Arena::NewChunk(size_t size)
+	{
+		size_t header = (sizeof(Chunk) + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1);
+		size_t chunk_size = size + header > ARENA_CHUNK_SIZE ? size + header : ARENA_CHUNK_SIZE;
+
+		Chunk *chunk = (Chunk *)malloc(chunk_size);
+		if (chunk == NULL) {
+			throw std::bad_alloc();
+		}
+
+		chunk->next_ = chunks_;
+		chunks_ = chunk;
+		cursor_ = (char *)chunk + header;
+		limit_ = (char *)chunk + chunk_size;
+		bytes_allocated_ += chunk_size;
+	}
+
+	void Arena::AddFinalizer(void (*proc)(void *), void *object)
+	{
+		Finalizer *f = (Finalizer *)Alloc(sizeof(Finalizer));
+		f->proc_ = proc;
+		f->object_ = object;
+		f->next_ = finalizers_;
+		finalizers_ = f;
+	}
+
+	std::string *Arena::NewString(const std::string &s)
+	{
+		return Track(new (*this) std::string(s));
+	}
+}
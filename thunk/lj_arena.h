@@ -0,0 +1,139 @@
+#ifndef __LJ_ARENA_H__
+#define __LJ_ARENA_H__
+
+#include <stddef.h>
+#include <new>
+#include <string>
+#include <type_traits>
+
+namespace LJ {
+
+#define ARENA_CHUNK_SIZE		(64 * 1024)
+#define ARENA_ALIGNMENT			8
+
+	//
+	// Bump allocator owning every AST node and list of a driver. Memory is
+	// only given back when the arena is destroyed, all chunks at once. Objects
+	// that are not trivially destructible register a finalizer through
+	// Track(), everything else is released without running any code.
+	//
+	class Arena {
+	public:
+		Arena();
+		~Arena();
+
+		void *Alloc(size_t size)
+		{
+			size = (size + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1);
+			if (size > (size_t)(limit_ - cursor_)) {
+				NewChunk(size);
+			}
+
+			void *p = cursor_;
+			cursor_ += size;
+			return p;
+		}
+
+		template<class T>
+		T *Track(T *object)
+		{
+			if (!std::is_trivially_destructible<T>::value) {
+				AddFinalizer(&Destroy<T>, object);
+			}
+			return object;
+		}
+
+		std::string *NewString(const std::string &s);
+
+		size_t GetBytesAllocated() const { return bytes_allocated_; }
+
+	private:
+		struct Chunk {
+			Chunk *next_;
+		};
+
+		struct Finalizer {
+			void (*proc_)(void *);
+			void *object_;
+			Finalizer *next_;
+		};
+
+		template<class T>
+		static void Destroy(void *object)
+		{
+			static_cast<T *>(object)->~T();
+		}
+
+		void NewChunk(size_t size);
+		void AddFinalizer(void (*proc)(void *), void *object);
+
+		char *cursor_;
+		char *limit_;
+		Chunk *chunks_;
+		Finalizer *finalizers_;
+		size_t bytes_allocated_;
+
+		Arena(const Arena &);
+		Arena &operator=(const Arena &);
+	};
+
+	//
+	// Vector of trivially destructible elements. The first N live inside the
+	// object, larger lists move to a buffer in the arena, old buffers are
+	// simply abandoned.
+	//
+	template<class T, size_t N = 4>
+	class ArenaVector {
+		static_assert(std::is_trivially_destructible<T>::value, "ArenaVector elements are never destroyed");
+
+	public:
+		typedef T *iterator;
+		typedef const T *const_iterator;
+
+		ArenaVector(Arena &arena) : arena_(&arena), data_(inline_), size_(0), capacity_(N) {}
+
+		void push_back(const T &v)
+		{
+			if (size_ == capacity_) {
+				T *data = (T *)arena_->Alloc(sizeof(T) * capacity_ * 2);
+				for (size_t i = 0; i < size_; i++) {
+					data[i] = data_[i];
+				}
+				data_ = data;
+				capacity_ *= 2;
+			}
+			data_[size_++] = v;
+		}
+
+		iterator begin() { return data_; }
+		iterator end() { return data_ + size_; }
+		const_iterator begin() const { return data_; }
+		const_iterator end() const { return data_ + size_; }
+		size_t size() const { return size_; }
+		bool empty() const { return size_ == 0; }
+		T& operator[](size_t index) { return data_[index]; }
+		T& front() { return data_[0]; }
+		T& back() { return data_[size_ - 1]; }
+
+	private:
+		Arena *arena_;
+		T *data_;
+		size_t size_;
+		size_t capacity_;
+		T inline_[N];
+
+		ArenaVector(const ArenaVector &);
+		ArenaVector &operator=(const ArenaVector &);
+	};
+}
+
+__inline void *operator new(size_t size, LJ::Arena &arena)
+{
+	return arena.Alloc(size);
+}
+
+__inline void operator delete(void *, LJ::Arena &)
+{
+}
+
+#endif
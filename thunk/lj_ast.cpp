@@ -28,11 +28,29 @@ namespace LJ {
 		case TRUE_EXPRESSION: return "TRUE_EXPRESSION";
 		case FALSE_EXPRESSION: return "FALSE_EXPRESSION";
 		case NULL_EXPRESSION: return "NULL_EXPRESSION";
+		case INDEX_EXPRESSION: return "INDEX_EXPRESSION";
+		case ARRAY_EXPRESSION: return "ARRAY_EXPRESSION";
+		case DICT_EXPRESSION: return "DICT_EXPRESSION";
+		case MEMBER_EXPRESSION: return "MEMBER_EXPRESSION";
+		case RECORD_EXPRESSION: return "RECORD_EXPRESSION";
 		}
 
 		return "EXPRESSION_ERROR";
 	}
 
+	char *GetInferredTypeString(int type)
+	{
+		switch (type) {
+		case UNINFERRED: return "uninferred";
+		case INT_INFERRED: return "int";
+		case DOUBLE_INFERRED: return "double";
+		case BOOLEAN_INFERRED: return "boolean";
+		case DYNAMIC_INFERRED: return "dynamic";
+		}
+
+		return "INFERRED_TYPE_ERROR";
+	}
+
 	char *GetStatementTypeString(int type)
 	{
 		switch (type) {
@@ -44,6 +62,8 @@ namespace LJ {
 		case RETURN_STATEMENT: return "RETURN_STATEMENT";
 		case BREAK_STATEMENT: return "BREAK_STATEMENT";
 		case CONTINUE_STATEMENT: return "CONTINUE_STATEMENT";
+		case FOREACH_STATEMENT: return "FOREACH_STATEMENT";
+		case YIELD_STATEMENT: return "YIELD_STATEMENT";
 		}
 
 		return "STATEMENT_ERROR";
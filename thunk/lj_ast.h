@@ -4,46 +4,67 @@
 #include <list>
 #include <set>
 #include <string>
+#include <vector>
 #include <iostream>
 #include "location.hh"
+#include "lj_port.h"
+#include "lj_arena.h"
+#include "lj_shape.h"
 
 typedef unsigned char boolean;
 
-#define MAKE_VALUE_EXP(t, u, v, l)		new ValueExpression<t, u>(v, l)
-#define MAKE_EXP(t, l)					new NullExpression<t>(l)
-#define MAKE_UNARY_EXP(t, e, l)			new UnaryExpression<t>(e, l)
-#define MAKE_BIN_EXP(t, e0, e1, l)		new BinaryExpression<t>(e0, e1, l)
-
-#define MAKE_EXP_STAT(e, l)				new ExpressionStatement(e, l)
-#define MAKE_GLOBAL_STAT(e, l)			new GlobalStatement(e, l)
-#define MAKE_RETURN_STAT(e, l)			new ReturnStatement(e, l)
-#define MAKE_If_STAT(e, t, elif, el, l)	new IfStatement(e, t, elif, el, l)
-#define MAKE_WHILE_STAT(e, b, l)		new WhileStatement(e, b, l)
-#define MAKE_FOR_STAT(i, e, p, b, l)	new ForStatement(i, e, p, b, l)
-#define MAKE_SIMPLE_STAT(t, l)			new SimpleStatement<t>(l)
+//
+// AST nodes and lists are allocated from the parsing driver's arena.
+//
+#define AST_ARENA						(driver.arena_)
+#define AST_NEW(...)					AST_ARENA.Track(new (AST_ARENA) __VA_ARGS__)
+
+#define MAKE_VALUE_EXP(t, u, v, l)		AST_NEW(ValueExpression<t, u>(v, l))
+#define MAKE_IDENTIFIER_EXP(v, l)		AST_NEW(IdentifierExpression(v, l))
+#define MAKE_EXP(t, l)					AST_NEW(EmptyExpression<t>(l))
+#define MAKE_UNARY_EXP(t, e, l)			AST_NEW(UnaryExpression<t>(e, l))
+#define MAKE_BIN_EXP(t, e0, e1, l)		AST_NEW(BinaryExpression<t>(e0, e1, l))
+#define MAKE_ARRAY_EXP(e, l)			AST_NEW(ArrayExpression(e, l))
+#define MAKE_DICT_EXP(e, l)				AST_NEW(DictExpression(e, l))
+#define MAKE_MEMBER_EXP(e, n, l)		AST_NEW(MemberExpression(e, n, l))
+#define MAKE_RECORD_EXP(r, n, e, l)		r = AST_NEW(RecordExpression(AST_NEW(IdentifierList(AST_ARENA)), AST_NEW(ArgumentList(AST_ARENA)), l)); r->AddField(AST_ARENA.NewString(n), e)
+#define ADD_RECORD_FIELD(r, o, n, e)	o->AddField(AST_ARENA.NewString(n), e); r = o;
+
+#define MAKE_EXP_STAT(e, l)				AST_NEW(ExpressionStatement(e, l))
+#define MAKE_GLOBAL_STAT(e, l)			AST_NEW(GlobalStatement(e, l))
+#define MAKE_RETURN_STAT(e, l)			AST_NEW(ReturnStatement(e, l))
+#define MAKE_YIELD_STAT(e, l)			AST_NEW(YieldStatement(e, l))
+#define MAKE_If_STAT(e, t, elif, el, l)	AST_NEW(IfStatement(e, t, elif, el, l))
+#define MAKE_WHILE_STAT(e, b, l)		AST_NEW(WhileStatement(e, b, l))
+#define MAKE_FOR_STAT(i, e, p, b, l)	AST_NEW(ForStatement(i, e, p, b, l))
+#define MAKE_FOREACH_STAT(v, f, t, b, p, l)	AST_NEW(ForeachStatement(v, f, t, b, p, l))
+#define MAKE_SIMPLE_STAT(t, l)			AST_NEW(SimpleStatement<t>(l))
 
 #define MAKE_FUNCTION_DEF(n, p, b, l)	FunctionDefinition *f = new FunctionDefinition(n, p, b, l); driver.AddFunction(f)
 
-#define MAKE_IDENTIFIER_LIST(r, n)		r = new IdentifierList; r->push_back(n)
-#define ADD_IDENTIFIER_LIST(r, o, n)	o->push_back(n); r = o;
+#define MAKE_IDENTIFIER_LIST(r, n)		r = AST_NEW(IdentifierList(AST_ARENA)); r->push_back(AST_ARENA.NewString(n))
+#define ADD_IDENTIFIER_LIST(r, o, n)	o->push_back(AST_ARENA.NewString(n)); r = o;
 
-#define MAKE_PARAMETER_LIST(r, n)		r = new ParameterList; r->push_back(n)
-#define ADD_PARAMETER_LIST(r, o, n)		o->push_back(n); r = o;
+#define MAKE_PARAMETER_LIST(r, n)		r = AST_NEW(ParameterList(AST_ARENA)); r->push_back(AST_ARENA.NewString(n))
+#define ADD_PARAMETER_LIST(r, o, n)		o->push_back(AST_ARENA.NewString(n)); r = o;
 
-#define MAKE_ELSEIF_LIST(r, n)			r = new ElseifList; r->push_back(n)
+#define MAKE_ELSEIF_LIST(r, n)			r = AST_NEW(ElseifList(AST_ARENA)); r->push_back(n)
 #define ADD_ELSEIF_LIST(r, o, n)		o->push_back(n); r = o;
-#define MAKE_ELSEIF(r, n, m, l)			r = new Elseif(n, m, l);
+#define MAKE_ELSEIF(r, n, m, l)			r = AST_NEW(Elseif(n, m, l));
 
-#define MAKE_BLOCK(r, m, l)				r = new Block(m, l)
+#define MAKE_BLOCK(r, m, l)				r = AST_NEW(Block(m, l))
 
-#define MAKE_ARGUMENT_LIST(r, n)		r = new ArgumentList; r->push_back(n)
+#define MAKE_ARGUMENT_LIST(r, n)		r = AST_NEW(ArgumentList(AST_ARENA)); r->push_back(n)
 #define ADD_ARGUMENT_LIST(r, o, n)		o->push_back(n); r = o;
 
-#define MAKE_STATEMENT_LIST(r, n)		r = new StatementList; r->push_back(n)
+#define MAKE_STATEMENT_LIST(r, n)		r = AST_NEW(StatementList(AST_ARENA)); r->push_back(n)
 #define ADD_STATEMENT_LIST(r, o, n)		o->push_back(n); r = o;
 
 namespace LJ {
 
+	class LJ_Driver;
+	class FunctionDefinition;
+
 	enum ExpressionType {
 
 		BOOLEAN_EXPRESSION = 1,
@@ -71,18 +92,37 @@ namespace LJ {
 		TRUE_EXPRESSION,
 		FALSE_EXPRESSION,
 		NULL_EXPRESSION,
+		INDEX_EXPRESSION,
+		ARRAY_EXPRESSION,
+		DICT_EXPRESSION,
+		MEMBER_EXPRESSION,
+		RECORD_EXPRESSION,
 	};
 
 	char *GetExpressionTypeString(int type);
 
+	//
+	// What LJ_TypeInference proved about the values an expression yields or
+	// a frame slot holds. UNINFERRED means the pass has not run or nothing
+	// reaches the node, DYNAMIC_INFERRED means any value, undefined included.
+	//
+	enum InferredType {
+		UNINFERRED = 0,
+		INT_INFERRED,
+		DOUBLE_INFERRED,
+		BOOLEAN_INFERRED,
+		DYNAMIC_INFERRED,
+	};
+
+	char *GetInferredTypeString(int type);
+
 	class Expression {
 	public:
-		Expression(const location &l) : loc_(l){}
-		virtual ~Expression() {}
+		Expression(const location &l) : loc_(l), inferred_type_(UNINFERRED) {}
 
 		virtual ExpressionType GetType() const = 0;
 		virtual void Dump(int indent) const = 0;
-		virtual void Eval(LJ_Driver *driver) const = 0;
+		virtual void Eval(LJ_Driver *driver) const {}
 
 		location& GetLocation() { return loc_; }
 		void SetLocation(location &val) { loc_ = val; }
@@ -94,15 +134,28 @@ namespace LJ {
 			}
 		}
 
+		void PrintInferredType() const
+		{
+			if (inferred_type_ != UNINFERRED) {
+				std::cout << " : " << GetInferredTypeString(inferred_type_);
+			}
+		}
+
+		InferredType GetInferredType() const { return inferred_type_; }
+		void SetInferredType(InferredType type) { inferred_type_ = type; }
+
+		virtual void *GetValue(int index) = 0;
+		virtual void SetValue(int index, void *value) {}
+
 	private:
 		location loc_;
+		InferredType inferred_type_;
 	};
 
 	template<ExpressionType T, class U>
 	class ValueExpression : public Expression {
 	public:
 		ValueExpression(U value, const location &l) : Expression(l), value_(value) {}
-		~ValueExpression() {}
 
 		ExpressionType GetType() const override {
 			return T;
@@ -110,11 +163,15 @@ namespace LJ {
 
 		void Dump(int indent) const override {
 			PrintIndent(indent);
-			std::cout << GetExpressionTypeString(GetType()) << " = [" << value_ << "]" << std::endl;
+			std::cout << GetExpressionTypeString(GetType()) << " = [" << value_ << "]";
+			PrintInferredType();
+			std::cout << std::endl;
 		}
 
 		U GetValue() { return value_; }
 
+		void *GetValue(int index) override { return &value_; }
+
 	protected:
 		U value_;
 	};
@@ -122,7 +179,6 @@ namespace LJ {
 	class BooleanExpression : public ValueExpression < BOOLEAN_EXPRESSION, boolean > {
 	public:
 		BooleanExpression(boolean value, const location &l) : ValueExpression(value, l) {}
-		~BooleanExpression() {}
 
 		void Eval(LJ_Driver *driver) const {}
 	};
@@ -130,7 +186,6 @@ namespace LJ {
 	class IntExpression : public ValueExpression < INT_EXPRESSION, __int64 > {
 	public:
 		IntExpression(__int64 value, const location &l) : ValueExpression(value, l) {}
-		~IntExpression() {}
 
 		void Eval(LJ_Driver *driver) const {}
 	};
@@ -138,7 +193,6 @@ namespace LJ {
 	class DoubleExpression : public ValueExpression < DOUBLE_EXPRESSION, double > {
 	public:
 		DoubleExpression(double value, const location &l) : ValueExpression(value, l) {}
-		~DoubleExpression() {}
 
 		void Eval(LJ_Driver *driver) const {}
 	};
@@ -146,24 +200,56 @@ namespace LJ {
 	class StringExpression : public ValueExpression < STRING_EXPRESSION, std::string > {
 	public:
 		StringExpression(std::string &value, const location &l) : ValueExpression(value, l) {}
-		~StringExpression() {}
 
 		void Eval(LJ_Driver *driver) const {}
 	};
 
+	//
+	// Where LJ_Resolver placed an identifier: a slot of the enclosing
+	// function's frame or a slot of the driver's global table.
+	//
+	enum SlotType {
+		UNRESOLVED_SLOT = 0,
+		LOCAL_SLOT,
+		GLOBAL_SLOT,
+	};
+
 	class IdentifierExpression : public ValueExpression < IDENTIFIER_EXPRESSION, std::string > {
 	public:
-		IdentifierExpression(std::string &value, const location &l) : ValueExpression(value, l) {}
-		~IdentifierExpression() {}
+		IdentifierExpression(std::string &value, const location &l) :
+			ValueExpression(value, l), slot_type_(UNRESOLVED_SLOT), slot_index_(-1) {}
+
+		void Dump(int indent) const override {
+			PrintIndent(indent);
+			std::cout << GetExpressionTypeString(GetType()) << " = [" << value_ << "]";
+			if (slot_type_ == LOCAL_SLOT) {
+				std::cout << " local " << slot_index_;
+			}
+			else if (slot_type_ == GLOBAL_SLOT) {
+				std::cout << " global " << slot_index_;
+			}
+			PrintInferredType();
+			std::cout << std::endl;
+		}
 
 		void Eval(LJ_Driver *driver) const {}
+
+		void SetSlot(SlotType type, int index) {
+			slot_type_ = type;
+			slot_index_ = index;
+		}
+		SlotType GetSlotType() const { return slot_type_; }
+		int GetSlotIndex() const { return slot_index_; }
+
+	private:
+		SlotType slot_type_;
+		int slot_index_;
 	};
 
 	template<ExpressionType T>
 	class EmptyExpression : public Expression {
 	public:
 		EmptyExpression(const location &l) : Expression(l) {}
-		~EmptyExpression() {}
 
 		ExpressionType GetType() const override {
 			return T;
@@ -171,14 +257,17 @@ namespace LJ {
 
 		void Dump(int indent) const override {
 			PrintIndent(indent);
-			std::cout << GetExpressionTypeString(GetType()) << std::endl;
+			std::cout << GetExpressionTypeString(GetType());
+			PrintInferredType();
+			std::cout << std::endl;
 		}
+
+		void *GetValue(int index) override { return NULL; }
 	};
 
 	class NullExpression : public EmptyExpression < NULL_EXPRESSION > {
 	public:
 		NullExpression(const location &l) : EmptyExpression(l) {}
-		~NullExpression() {}
 
 		void Eval(LJ_Driver *driver) const {}
 	};
@@ -186,7 +275,6 @@ namespace LJ {
 	class TrueExpression : public EmptyExpression < TRUE_EXPRESSION > {
 	public:
 		TrueExpression(const location &l) : EmptyExpression(l) {}
-		~TrueExpression() {}
 
 		void Eval(LJ_Driver *driver) const {}
 	};
@@ -194,7 +282,6 @@ namespace LJ {
 	class FalseExpression : public EmptyExpression < FALSE_EXPRESSION > {
 	public:
 		FalseExpression(const location &l) : EmptyExpression(l) {}
-		~FalseExpression() {}
 
 		void Eval(LJ_Driver *driver) const {}
 	};
@@ -203,7 +290,6 @@ namespace LJ {
 	class UnaryExpression : public Expression {
 	public:
 		UnaryExpression(Expression *expr, const location &l) : Expression(l), expr_(expr) {}
-		~UnaryExpression() { delete expr_; }
 
 		ExpressionType GetType() const override {
 			return T;
@@ -211,14 +297,19 @@ namespace LJ {
 
 		void Dump(int indent) const override {
 			PrintIndent(indent++);
-			std::cout << GetExpressionTypeString(GetType()) << std::endl;
+			std::cout << GetExpressionTypeString(GetType());
+			PrintInferredType();
+			std::cout << std::endl;
 			expr_->Dump(indent);
 		}
 
-		Expression* GetExpression() override {
+		Expression* GetExpression() {
 			return expr_;
 		}
 
+		void *GetValue(int index) override { return expr_; }
+		void SetValue(int index, void *value) override { expr_ = (Expression *)value; }
+
 	protected:
 		Expression *expr_;
 	};
@@ -226,7 +317,6 @@ namespace LJ {
 	class MinusExpression : public UnaryExpression < MINUS_EXPRESSION > {
 	public:
 		MinusExpression(Expression *expr, const location &l) : UnaryExpression(expr, l) {}
-		~MinusExpression() {}
 
 		void Eval(LJ_Driver *driver) const {}
 	};
@@ -234,7 +324,6 @@ namespace LJ {
 	class ExclamationExpression : public UnaryExpression < EXCLAMATION_EXPRESSION > {
 	public:
 		ExclamationExpression(Expression *expr, const location &l) : UnaryExpression(expr, l) {}
-		~ExclamationExpression() {}
 
 		void Eval(LJ_Driver *driver) const {}
 	};
@@ -242,41 +331,81 @@ namespace LJ {
 	template<class T>
 	void DeleteElems(T &e)
 	{
-		for (T::iterator it = e.begin(); it != e.end(); ++it) {
+		for (typename T::iterator it = e.begin(); it != e.end(); ++it) {
 			delete *it;
 		}
 	}
 
-	template<ExpressionType T>
-	class BinaryExpression : public Expression {
-	public:
-	public:
-		BinaryExpression(Expression *left, Expression *right, const location &l) : Expression(l), left_(left), right_(right) {}
-		~BinaryExpression() {
-			delete left_;
-			delete right_;
-		}
+	//
+	// Operand types an arithmetic or comparison node has specialized itself
+	// for. A node starts UNSPECIALIZED, takes the state matching the first
+	// operands it sees and drops to GENERIC_OPERANDS once its guard fails.
+	//
+	enum OperandState {
+		UNSPECIALIZED = 0,
+		INT_OPERANDS,
+		DOUBLE_OPERANDS,
+		STRING_OPERANDS,
+		GENERIC_OPERANDS,
+	};
 
-		ExpressionType GetType() const override {
-			return T;
-		}
+	class BinaryExpressionBase : public Expression {
+	public:
+		BinaryExpressionBase(Expression *left, Expression *right, const location &l) :
+			Expression(l), left_(left), right_(right), operand_state_(UNSPECIALIZED) {}
 
 		void Dump(int indent) const override {
 			PrintIndent(indent++);
-			std::cout << GetExpressionTypeString(GetType()) << std::endl;
+			std::cout << GetExpressionTypeString(GetType());
+			PrintInferredType();
+			std::cout << std::endl;
 			left_->Dump(indent);
 			right_->Dump(indent);
 		}
 
+		void *GetValue(int index) override {
+			if (index == 0) {
+				return left_;
+			}
+			else {
+				return right_;
+			}
+		}
+
+		void SetValue(int index, void *value) override {
+			if (index == 0) {
+				left_ = (Expression *)value;
+			}
+			else {
+				right_ = (Expression *)value;
+			}
+		}
+
+		Expression *GetLeft() { return left_; }
+		Expression *GetRight() { return right_; }
+
+		OperandState GetOperandState() const { return operand_state_; }
+		void SetOperandState(OperandState state) { operand_state_ = state; }
+
 	protected:
 		Expression *left_;
 		Expression *right_;
+		OperandState operand_state_;
+	};
+
+	template<ExpressionType T>
+	class BinaryExpression : public BinaryExpressionBase {
+	public:
+		BinaryExpression(Expression *left, Expression *right, const location &l) : BinaryExpressionBase(left, right, l) {}
+
+		ExpressionType GetType() const override {
+			return T;
+		}
 	};
 
 	class AssignExpression : public BinaryExpression < ASSIGN_EXPRESSION > {
 	public:
 		AssignExpression(Expression *left, Expression *right, const location &l) : BinaryExpression(left, right, l) {}
-		~AssignExpression() {}
 
 		void Eval(LJ_Driver *driver) const {}
 	};
@@ -284,7 +413,6 @@ namespace LJ {
 	class AddExpression : public BinaryExpression < ADD_EXPRESSION > {
 	public:
 		AddExpression(Expression *left, Expression *right, const location &l) : BinaryExpression(left, right, l) {}
-		~AddExpression() {}
 
 		void Eval(LJ_Driver *driver) const {}
 	};
@@ -292,7 +420,6 @@ namespace LJ {
 	class SubExpression : public BinaryExpression < SUB_EXPRESSION > {
 	public:
 		SubExpression(Expression *left, Expression *right, const location &l) : BinaryExpression(left, right, l) {}
-		~SubExpression() {}
 
 		void Eval(LJ_Driver *driver) const {}
 	};
@@ -300,7 +427,6 @@ namespace LJ {
 	class MulExpression : public BinaryExpression < MUL_EXPRESSION > {
 	public:
 		MulExpression(Expression *left, Expression *right, const location &l) : BinaryExpression(left, right, l) {}
-		~MulExpression() {}
 
 		void Eval(LJ_Driver *driver) const {}
 	};
@@ -308,7 +434,6 @@ namespace LJ {
 	class DivExpression : public BinaryExpression < DIV_EXPRESSION > {
 	public:
 		DivExpression(Expression *left, Expression *right, const location &l) : BinaryExpression(left, right, l) {}
-		~DivExpression() {}
 
 		void Eval(LJ_Driver *driver) const {}
 	};
@@ -316,7 +441,6 @@ namespace LJ {
 	class ModExpression : public BinaryExpression < MOD_EXPRESSION > {
 	public:
 		ModExpression(Expression *left, Expression *right, const location &l) : BinaryExpression(left, right, l) {}
-		~ModExpression() {}
 
 		void Eval(LJ_Driver *driver) const {}
 	};
@@ -324,7 +448,6 @@ namespace LJ {
 	class EQExpression : public BinaryExpression < EQ_EXPRESSION > {
 	public:
 		EQExpression(Expression *left, Expression *right, const location &l) : BinaryExpression(left, right, l) {}
-		~EQExpression() {}
 
 		void Eval(LJ_Driver *driver) const {}
 	};
@@ -332,7 +455,6 @@ namespace LJ {
 	class NEExpression : public BinaryExpression < NE_EXPRESSION > {
 	public:
 		NEExpression(Expression *left, Expression *right, const location &l) : BinaryExpression(left, right, l) {}
-		~NEExpression() {}
 
 		void Eval(LJ_Driver *driver) const {}
 	};
@@ -340,7 +462,6 @@ namespace LJ {
 	class GTExpression : public BinaryExpression < GT_EXPRESSION > {
 	public:
 		GTExpression(Expression *left, Expression *right, const location &l) : BinaryExpression(left, right, l) {}
-		~GTExpression() {}
 
 		void Eval(LJ_Driver *driver) const {}
 	};
@@ -348,7 +469,6 @@ namespace LJ {
 	class GEExpression : public BinaryExpression < GE_EXPRESSION > {
 	public:
 		GEExpression(Expression *left, Expression *right, const location &l) : BinaryExpression(left, right, l) {}
-		~GEExpression() {}
 
 		void Eval(LJ_Driver *driver) const {}
 	};
@@ -356,7 +476,6 @@ namespace LJ {
 	class LTExpression : public BinaryExpression < LT_EXPRESSION > {
 	public:
 		LTExpression(Expression *left, Expression *right, const location &l) : BinaryExpression(left, right, l) {}
-		~LTExpression() {}
 
 		void Eval(LJ_Driver *driver) const {}
 	};
@@ -364,7 +483,6 @@ namespace LJ {
 	class LEExpression : public BinaryExpression < LE_EXPRESSION > {
 	public:
 		LEExpression(Expression *left, Expression *right, const location &l) : BinaryExpression(left, right, l) {}
-		~LEExpression() {}
 
 		void Eval(LJ_Driver *driver) const {}
 	};
@@ -372,7 +490,6 @@ namespace LJ {
 	class LogicalAndExpression : public BinaryExpression < LOGICAL_AND_EXPRESSION > {
 	public:
 		LogicalAndExpression(Expression *left, Expression *right, const location &l) : BinaryExpression(left, right, l) {}
-		~LogicalAndExpression() {}
 
 		void Eval(LJ_Driver *driver) const {}
 	};
@@ -380,21 +497,25 @@ namespace LJ {
 	class LogicalOrExpression : public BinaryExpression < LOGICAL_OR_EXPRESSION > {
 	public:
 		LogicalOrExpression(Expression *left, Expression *right, const location &l) : BinaryExpression(left, right, l) {}
-		~LogicalOrExpression() {}
 
 		void Eval(LJ_Driver *driver) const {}
 	};
 
-	typedef std::list<Expression *> ArgumentList;
+	// The left operand is the array, the right one the index.
+	class IndexExpression : public BinaryExpression < INDEX_EXPRESSION > {
+	public:
+		IndexExpression(Expression *left, Expression *right, const location &l) : BinaryExpression(left, right, l) {}
+
+		void Eval(LJ_Driver *driver) const {}
+	};
+
+	typedef ArenaVector<Expression *> ArgumentList;
+	typedef ArenaVector<std::string *> IdentifierList;
 	template<>
 	class BinaryExpression<FUNCTION_CALL_EXPRESSION> : public Expression{
 	public:
 	public:
-		BinaryExpression(const std::string &n0, ArgumentList *a1, const location &l) : Expression(l), n0_(n0), a1_(a1) {}
-		~BinaryExpression() {
-			DeleteElems(*a1_);
-			delete a1_;
-		}
+		BinaryExpression(const std::string &n0, ArgumentList *a1, const location &l) : Expression(l), n0_(n0), a1_(a1), function_(NULL) {}
 
 		ExpressionType GetType() const override {
 			return FUNCTION_CALL_EXPRESSION;
@@ -402,7 +523,12 @@ namespace LJ {
 
 		void Dump(int indent) const override {
 			PrintIndent(indent++);
-			std::cout << GetExpressionTypeString(GetType()) << " = [" << n0_ << "]" << std::endl;
+			std::cout << GetExpressionTypeString(GetType()) << " = [" << n0_ << "]";
+			PrintInferredType();
+			std::cout << std::endl;
+			if (a1_ == NULL) {
+				return;
+			}
 			for (ArgumentList::iterator it = a1_->begin(); it != a1_->end(); ++it) {
 				(*it)->Dump(indent);
 			}
@@ -420,9 +546,161 @@ namespace LJ {
 		std::string& GetFunctionName() { return n0_; }
 		ArgumentList * GetArgList() { return a1_; }
 
+		FunctionDefinition * GetFunction() { return function_; }
+		void SetFunction(FunctionDefinition *f) { function_ = f; }
+
 	private:
 		std::string n0_;
 		ArgumentList *a1_;
+		FunctionDefinition *function_;
+	};
+
+	class ArrayExpression : public Expression {
+	public:
+		ArrayExpression(ArgumentList *elements, const location &l) : Expression(l), elements_(elements) {}
+
+		ExpressionType GetType() const override {
+			return ARRAY_EXPRESSION;
+		}
+
+		void Dump(int indent) const override {
+			PrintIndent(indent++);
+			std::cout << GetExpressionTypeString(GetType());
+			PrintInferredType();
+			std::cout << std::endl;
+			for (ArgumentList::iterator it = elements_->begin(); it != elements_->end(); ++it) {
+				(*it)->Dump(indent);
+			}
+		}
+
+		void* GetValue(int index) override {
+			return elements_;
+		}
+
+		ArgumentList * GetElements() { return elements_; }
+
+	private:
+		ArgumentList *elements_;
+	};
+
+	//
+	// A dict literal. entries_ holds each key followed by its value, so its
+	// expressions can be walked like the elements of an array literal.
+	//
+	class DictExpression : public Expression {
+	public:
+		DictExpression(ArgumentList *entries, const location &l) : Expression(l), entries_(entries) {}
+
+		ExpressionType GetType() const override {
+			return DICT_EXPRESSION;
+		}
+
+		void Dump(int indent) const override {
+			PrintIndent(indent++);
+			std::cout << GetExpressionTypeString(GetType());
+			PrintInferredType();
+			std::cout << std::endl;
+			for (ArgumentList::iterator it = entries_->begin(); it != entries_->end(); ++it) {
+				(*it)->Dump(indent);
+			}
+		}
+
+		void* GetValue(int index) override {
+			return entries_;
+		}
+
+		ArgumentList * GetEntries() { return entries_; }
+
+	private:
+		ArgumentList *entries_;
+	};
+
+	//
+	// obj.name. cache_ remembers the slot of name in the shapes of the records
+	// the access has met, the engines look there before asking the shape.
+	//
+	class MemberExpression : public Expression {
+	public:
+		MemberExpression(Expression *object, const std::string &name, const location &l) : Expression(l), object_(object), name_(name) {}
+
+		ExpressionType GetType() const override {
+			return MEMBER_EXPRESSION;
+		}
+
+		void Dump(int indent) const override {
+			PrintIndent(indent++);
+			std::cout << GetExpressionTypeString(GetType()) << " = [" << name_ << "]";
+			if (cache_.count_ != 0) {
+				std::cout << " cached " << cache_.count_;
+			}
+			PrintInferredType();
+			std::cout << std::endl;
+			object_->Dump(indent);
+		}
+
+		void* GetValue(int index) override {
+			return object_;
+		}
+
+		void SetValue(int index, void *value) override {
+			object_ = (Expression *)value;
+		}
+
+		const std::string& GetName() const { return name_; }
+		InlineCache& GetCache() { return cache_; }
+
+	private:
+		Expression *object_;
+		std::string name_;
+		InlineCache cache_;
+	};
+
+	//
+	// A record literal. values_ lines up with names_ and is walked like the
+	// elements of an array literal; LJ_Resolver sets shape_ to the shape the
+	// fields make in order.
+	//
+	class RecordExpression : public Expression {
+	public:
+		RecordExpression(IdentifierList *names, ArgumentList *values, const location &l) : Expression(l), names_(names), values_(values), shape_(NULL) {}
+
+		ExpressionType GetType() const override {
+			return RECORD_EXPRESSION;
+		}
+
+		void Dump(int indent) const override {
+			PrintIndent(indent++);
+			std::cout << GetExpressionTypeString(GetType()) << " = [";
+			for (IdentifierList::iterator it = names_->begin(); it != names_->end(); ++it) {
+				std::cout << (it != names_->begin() ? ", " : "") << **it;
+			}
+			std::cout << "]";
+			PrintInferredType();
+			std::cout << std::endl;
+			for (ArgumentList::iterator it = values_->begin(); it != values_->end(); ++it) {
+				(*it)->Dump(indent);
+			}
+		}
+
+		void* GetValue(int index) override {
+			return values_;
+		}
+
+		void AddField(std::string *name, Expression *value) {
+			names_->push_back(name);
+			values_->push_back(value);
+		}
+
+		IdentifierList * GetNames() { return names_; }
+		ArgumentList * GetValues() { return values_; }
+
+		Shape * GetShape() { return shape_; }
+		void SetShape(Shape *shape) { shape_ = shape; }
+
+	private:
+		IdentifierList *names_;
+		ArgumentList *values_;
+		Shape *shape_;
 	};
 
 	enum StatementType {
@@ -434,6 +712,8 @@ namespace LJ {
 		RETURN_STATEMENT,
 		BREAK_STATEMENT,
 		CONTINUE_STATEMENT,
+		FOREACH_STATEMENT,
+		YIELD_STATEMENT,
 	};
 
 	char *GetStatementTypeString(int type);
@@ -441,7 +721,6 @@ namespace LJ {
 	class Statement {
 	public:
 		Statement(const location &l) : loc_(l) {}
-		virtual ~Statement() {}
 
 		virtual StatementType GetType() const = 0;
 		virtual void Dump(int indent) const = 0;
@@ -456,24 +735,23 @@ namespace LJ {
 		}
 
 		virtual void *GetValue(int index) = 0;
+		virtual void SetValue(int index, void *value) {}
 
 	private:
 		location loc_;
 	};
 
-	typedef std::list<Statement *> StatementList;
-	typedef std::list<std::string> IdentifierList;
+	typedef ArenaVector<Statement *> StatementList;
 
 	class Block {
 	public:
 		Block(StatementList *s, const location &l) : statement_list_(s), loc_(l) {}
-		~Block() {
-			DeleteElems(*statement_list_);
-			delete statement_list_;
-		}
 
 		void Dump(int indent) const {
 			std::cout << "BLOCK" << std::endl;
+			if (statement_list_ == NULL) {
+				return;
+			}
 			for (StatementList::iterator it = statement_list_->begin();
 				it != statement_list_->end(); ++it) {
 				(*it)->Dump(indent);
@@ -481,6 +759,7 @@ namespace LJ {
 		}
 
 		void *GetValue(int index) { return statement_list_; }
+		void SetValue(int index, void *value) { statement_list_ = (StatementList *)value; }
 
 	private:
 		StatementList *statement_list_;
@@ -491,9 +770,6 @@ namespace LJ {
 	class Elseif {
 	public:
 		Elseif(Expression *e, Block *b, const location &l) : e_(e), b_(b), loc_(l){}
-		~Elseif() {
-			delete b_;
-		}
 
 		location& GetLocation() { return loc_; }
 		void SetLocation(location &val) { loc_ = val; }
@@ -511,7 +787,15 @@ namespace LJ {
 			else {
 				return b_;
 			}
+		}
 
+		void SetValue(int index, void *value) {
+			if (index == 0) {
+				e_ = (Expression *)value;
+			}
+			else {
+				b_ = (Block *)value;
+			}
 		}
 
 	private:
@@ -519,15 +803,12 @@ namespace LJ {
 		Block *b_;
 		location loc_;
 	};
-	typedef std::list<Elseif *> ElseifList;
+	typedef ArenaVector<Elseif *> ElseifList;
 
 
 	class ExpressionStatement : public Statement {
 	public:
 		ExpressionStatement(Expression *e, const location &l) : Statement(l), e_(e) {}
-		~ExpressionStatement() {
-			delete e_;
-		}
 
 		StatementType GetType() const override {
 			return EXPRESSION_STATEMENT;
@@ -540,6 +821,7 @@ namespace LJ {
 		}
 
 		void *GetValue(int index) override { return e_; }
+		void SetValue(int index, void *value) override { e_ = (Expression *)value; }
 
 	private:
 		Expression *e_;
@@ -548,9 +830,6 @@ namespace LJ {
 	class ReturnStatement : public Statement {
 	public:
 		ReturnStatement(Expression *e, const location &l) : Statement(l), e_(e) {}
-		~ReturnStatement() {
-			delete e_;
-		}
 
 		StatementType GetType() const override {
 			return RETURN_STATEMENT;
@@ -559,11 +838,38 @@ namespace LJ {
 		void Dump(int indent) const override {
 			PrintIndent(indent++);
 			std::cout << GetStatementTypeString(GetType()) << std::endl;
-			e_->Dump(indent);
+			if (e_ != NULL) {
+				e_->Dump(indent);
+			}
 		}
 
 		void *GetValue(int index) override { return e_; }
+		void SetValue(int index, void *value) override { e_ = (Expression *)value; }
 
+	private:
+		Expression *e_;
+	};
+
+	//
+	// yield e suspends the generator running the enclosing function and
+	// hands e to whoever resumed it, see LJ_Driver::ResumeGenerator.
+	//
+	class YieldStatement : public Statement {
+	public:
+		YieldStatement(Expression *e, const location &l) : Statement(l), e_(e) {}
+
+		StatementType GetType() const override {
+			return YIELD_STATEMENT;
+		}
+
+		void Dump(int indent) const override {
+			PrintIndent(indent++);
+			std::cout << GetStatementTypeString(GetType()) << std::endl;
+			e_->Dump(indent);
+		}
+
+		void *GetValue(int index) override { return e_; }
+		void SetValue(int index, void *value) override { e_ = (Expression *)value; }
 
 	private:
 		Expression *e_;
@@ -572,9 +878,6 @@ namespace LJ {
 	class GlobalStatement : public Statement {
 	public:
 		GlobalStatement(IdentifierList *id_list, const location &l) : Statement(l), identifier_list_(id_list) {}
-		~GlobalStatement() {
-			delete identifier_list_;
-		}
 
 		StatementType GetType() const override {
 			return GLOBAL_STATEMENT;
@@ -589,7 +892,7 @@ namespace LJ {
 			std::cout << "[";
 			for (IdentifierList::iterator it = identifier_list_->begin();
 				it != identifier_list_->end(); ++it) {
-				std::cout << *it << ", ";
+				std::cout << **it << ", ";
 			}
 			std::cout << "]";
 		}
@@ -604,13 +907,6 @@ namespace LJ {
 	public:
 		IfStatement(Expression *e, Block *then_b, ElseifList *elseif_list, Block *else_b, const location &l) :
 			Statement(l), e_(e), then_b_(then_b), elseif_list_(elseif_list), else_b_(else_b) {}
-		~IfStatement() {
-			delete e_;
-			delete then_b_;
-			DeleteElems(*elseif_list_);
-			delete elseif_list_;
-			delete else_b_;
-		}
 
 		StatementType GetType() const override {
 			return IF_STATEMENT;
@@ -655,6 +951,21 @@ namespace LJ {
 			}
 		}
 
+		void SetValue(int index, void *value) override {
+			if (index == 0) {
+				e_ = (Expression *)value;
+			}
+			else if (index == 1) {
+				then_b_ = (Block *)value;
+			}
+			else if (index == 2) {
+				elseif_list_ = (ElseifList *)value;
+			}
+			else {
+				else_b_ = (Block *)value;
+			}
+		}
+
 	private:
 		Expression *e_;
 		Block *then_b_;
@@ -666,10 +977,6 @@ namespace LJ {
 	public:
 		WhileStatement(Expression *e, Block *b, const location &l) :
 			Statement(l), e_(e), b_(b) {}
-		~WhileStatement() {
-			delete e_;
-			delete b_;
-		}
 
 		StatementType GetType() const override {
 			return WHILE_STATEMENT;
@@ -694,6 +1001,15 @@ namespace LJ {
 			}
 		}
 
+		void SetValue(int index, void *value) override {
+			if (index == 0) {
+				e_ = (Expression *)value;
+			}
+			else {
+				b_ = (Block *)value;
+			}
+		}
+
 	private:
 		Expression *e_;
 		Block *b_;
@@ -703,12 +1019,6 @@ namespace LJ {
 	public:
 		ForStatement(Expression *init_e, Expression *condition_e, Expression *post_e, Block *b, const location &l) :
 			Statement(l), init_e_(init_e), condition_e_(condition_e), post_e_(post_e), b_(b) {}
-		~ForStatement() {
-			delete init_e_;
-			delete condition_e_;
-			delete post_e_;
-			delete b_;
-		}
 
 		StatementType GetType() const override {
 			return FOR_STATEMENT;
@@ -750,6 +1060,21 @@ namespace LJ {
 			}
 		}
 
+		void SetValue(int index, void *value) override {
+			if (index == 0) {
+				init_e_ = (Expression *)value;
+			}
+			else if (index == 1) {
+				condition_e_ = (Expression *)value;
+			}
+			else if (index == 2) {
+				post_e_ = (Expression *)value;
+			}
+			else {
+				b_ = (Block *)value;
+			}
+		}
+
 	private:
 		Expression *init_e_;
 		Expression *condition_e_;
@@ -757,11 +1082,90 @@ namespace LJ {
 		Block *b_;
 	};
 
+	//
+	// foreach (v : from, to) runs its block once for every int in [from, to).
+	// The iterations of a parallel foreach are independent and may run on
+	// several threads, see LJ_ParallelForeach. foreach (v : g) has no to
+	// expression and runs its block once for every value the generator g
+	// yields.
+	//
+	class ForeachStatement : public Statement {
+	public:
+		ForeachStatement(Expression *var_e, Expression *from_e, Expression *to_e, Block *b, boolean parallel, const location &l) :
+			Statement(l), var_e_(var_e), from_e_(from_e), to_e_(to_e), b_(b), parallel_(parallel) {}
+
+		StatementType GetType() const override {
+			return FOREACH_STATEMENT;
+		}
+
+		void Dump(int indent) const override {
+			PrintIndent(indent++);
+			std::cout << GetStatementTypeString(GetType());
+			if (parallel_) {
+				std::cout << " parallel";
+			}
+			std::cout << std::endl;
+			var_e_->Dump(indent);
+			from_e_->Dump(indent);
+			if (to_e_ != NULL) {
+				to_e_->Dump(indent);
+			}
+			if (b_ != NULL) {
+				PrintIndent(indent);
+				b_->Dump(indent);
+			}
+		}
+
+		void *GetValue(int index) override {
+			if (index == 0) {
+				return var_e_;
+			}
+			else if (index == 1) {
+				return from_e_;
+			}
+			else if (index == 2) {
+				return to_e_;
+			}
+			else {
+				return b_;
+			}
+		}
+
+		void SetValue(int index, void *value) override {
+			if (index == 0) {
+				var_e_ = (Expression *)value;
+			}
+			else if (index == 1) {
+				from_e_ = (Expression *)value;
+			}
+			else if (index == 2) {
+				to_e_ = (Expression *)value;
+			}
+			else {
+				b_ = (Block *)value;
+			}
+		}
+
+		boolean IsParallel() const { return parallel_; }
+		boolean IteratesGenerator() const { return to_e_ == NULL; }
+
+		// Filled in by LJ_Resolver for a parallel foreach, the variables the
+		// body only updates as v = v + e.
+		std::vector<IdentifierExpression *>& GetReductions() { return reductions_; }
+
+	private:
+		Expression *var_e_;
+		Expression *from_e_;
+		Expression *to_e_;
+		Block *b_;
+		boolean parallel_;
+		std::vector<IdentifierExpression *> reductions_;
+	};
+
 	template<StatementType T>
 	class SimpleStatement : public Statement {
 	public:
 		SimpleStatement(const location &l) : Statement(l) {}
-		~SimpleStatement() {}
 
 		StatementType GetType() const override {
 			return T;
@@ -775,23 +1179,21 @@ namespace LJ {
 		void *GetValue(int index) override { return NULL; }
 	};
 
-	typedef std::list<std::string> ParameterList;
+	typedef ArenaVector<std::string *> ParameterList;
 
 	enum FunctionType {
-		FUNCTION_DEFINITION = 1
+		FUNCTION_DEFINITION = 1,
+		NATIVE_FUNCTION,
 	};
 
 	class FunctionDefinition {
 	public:
 		FunctionDefinition(const std::string &name, ParameterList *p, Block *b, const location &l) :
-			name_(name), p_(p), b_(b), loc_(l) {}
-		~FunctionDefinition() {
-			delete p_;
-			delete b_;
-		}
+			loc_(l), p_(p), name_(name), b_(b), slot_count_(0), pure_(0), memo_(0), generator_(0), return_type_(UNINFERRED) {}
+		virtual ~FunctionDefinition() {}
 		location& GetLocation() { return loc_; }
 		void SetLocation(location &val) { loc_ = val; }
-		FunctionType GetType() {
+		virtual FunctionType GetType() {
 			return FUNCTION_DEFINITION;
 		}
 
@@ -799,11 +1201,40 @@ namespace LJ {
 		ParameterList * GetParamList() { return p_; }
 		Block * GetBlock() { return b_; }
 
+		int GetSlotCount() const { return slot_count_; }
+		void SetSlotCount(int count) { slot_count_ = count; }
+
+		// Set by LJ_Resolver for a function that reads and writes no global
+		// and calls only pure functions, its result depends on its arguments.
+		boolean IsPure() const { return pure_; }
+		void SetPure(boolean pure) { pure_ = pure; }
+
+		// Set by the parser for a function defined with memo, whose results
+		// are cached by its arguments. LJ_Resolver makes sure it is pure.
+		boolean IsMemo() const { return memo_; }
+		void SetMemo(boolean memo) { memo_ = memo; }
+
+		// Set by LJ_Resolver for a function whose body yields, a call
+		// returns a generator instead of running the body.
+		boolean IsGenerator() const { return generator_; }
+		void SetGenerator(boolean generator) { generator_ = generator; }
+
+		// Filled in by LJ_TypeInference, one entry per frame slot.
+		std::vector<InferredType>& GetSlotTypes() { return slot_types_; }
+		InferredType GetReturnType() const { return return_type_; }
+		void SetReturnType(InferredType type) { return_type_ = type; }
+
 	private:
 		location loc_;
 		ParameterList *p_;
 		std::string name_;
 		Block *b_;
+		int slot_count_;
+		boolean pure_;
+		boolean memo_;
+		boolean generator_;
+		std::vector<InferredType> slot_types_;
+		InferredType return_type_;
 	};
 }
 
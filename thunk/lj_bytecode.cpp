@@ -0,0 +1,102 @@
+#include "lj_bytecode.h"
+namespace LJ {
+	const char *GetOpCodeString(int op)
+	{
+		switch (op) {
+		case OP_MOVE: return "MOVE";
+		case OP_LOADK: return "LOADK";
+		case OP_LOADBOOL: return "LOADBOOL";
+		case OP_LOADNULL: return "LOADNULL";
+		case OP_GETGLOBAL: return "GETGLOBAL";
+		case OP_SETGLOBAL: return "SETGLOBAL";
+		case OP_ADD: return "ADD";
+		case OP_SUB: return "SUB";
+		case OP_MUL: return "MUL";
+		case OP_DIV: return "DIV";
+		case OP_MOD: return "MOD";
+		case OP_EQ: return "EQ";
+		case OP_NE: return "NE";
+		case OP_GT: return "GT";
+		case OP_GE: return "GE";
+		case OP_LT: return "LT";
+		case OP_LE: return "LE";
+		case OP_MINUS: return "MINUS";
+		case OP_NOT: return "NOT";
+		case OP_TESTBOOL: return "TESTBOOL";
+		case OP_JMP: return "JMP";
+		case OP_JMPFALSE: return "JMPFALSE";
+		case OP_JMPTRUE: return "JMPTRUE";
+		case OP_CALL: return "CALL";
+		case OP_TAILCALL: return "TAILCALL";
+		case OP_RETURN: return "RETURN";
+		case OP_RETURNNULL: return "RETURNNULL";
+		case OP_FORPREP: return "FORPREP";
+		case OP_PARALLEL: return "PARALLEL";
+		case OP_NEXT: return "NEXT";
+		case OP_NEWARRAY: return "NEWARRAY";
+		case OP_GETINDEX: return "GETINDEX";
+		case OP_SETINDEX: return "SETINDEX";
+		case OP_NEWDICT: return "NEWDICT";
+		case OP_GETFIELD: return "GETFIELD";
+		case OP_SETFIELD: return "SETFIELD";
+		case OP_NEWRECORD: return "NEWRECORD";
+		}
+
+		return "OP_ERROR";
+	}
+
+	const char *GetConditionErrorString(int type)
+	{
+		switch (type) {
+		case LOGICAL_CONDITION_ERROR: return "EvalLogicalAndOrExpression error";
+		case IF_CONDITION_ERROR: return "ExecuteIfStatement error";
+		case ELSEIF_CONDITION_ERROR: return "ExecuteElseif error";
+		case WHILE_CONDITION_ERROR: return "ExecuteWhileStatement error";
+		case FOR_CONDITION_ERROR: return "ExecuteForStatement error";
+		}
+
+		return "CONDITION_ERROR";
+	}
+
+	void FunctionProto::Dump(const std::vector<std::string> &global_names) const
+	{
+		std::cout << "FUNCTION = [" << name_ << "] params " << param_count_
+			<< ", registers " << register_count_ << std::endl;
+
+		for (size_t pc = 0; pc < code_.size(); pc++) {
+			const Instruction &i = code_[pc];
+			std::cout << "  " << pc << "\t" << GetOpCodeString(i.op_) << "\t" << i.a_;
+
+			switch (i.op_) {
+			case OP_LOADK:
+			case OP_GETGLOBAL:
+			case OP_SETGLOBAL:
+				std::cout << " " << i.bx_;
+				if (i.op_ != OP_LOADK) {
+					std::cout << "\t; " << global_names[i.bx_];
+				}
+				break;
+			case OP_JMP:
+			case OP_JMPFALSE:
+			case OP_JMPTRUE:
+				std::cout << " " << i.bx_ << "\t; to " << (int)pc + 1 + i.bx_;
+				break;
+			case OP_CALL:
+			case OP_TAILCALL:
+				std::cout << " " << i.b_ << " " << i.c_ << "\t; "
+					<< (callees_[i.c_] != NULL ? callees_[i.c_]->name_ : "?");
+				break;
+			case OP_GETFIELD:
+				std::cout << " " << i.b_ << " " << i.c_ << "\t; ." << members_[i.c_]->GetName();
+				break;
+			case OP_SETFIELD:
+				std::cout << " " << i.b_ << " " << i.c_ << "\t; ." << members_[i.b_]->GetName();
+				break;
+			default:
+				std::cout << " " << i.b_ << " " << i.c_;
+				break;
+			}
+			std::cout << std::endl;
+		}
+	}
+}
@@ -0,0 +1,120 @@
+#ifndef __LJ_BYTECODE_H__
+#define __LJ_BYTECODE_H__
+
+#include <string>
+#include <vector>
+#include <iostream>
+#include "location.hh"
+#include "lj_ast.h"
+#include "lj_val.h"
+
+namespace LJ {
+
+	//
+	// Register based instruction set. R(x) is a register of the current frame,
+	// K(x) a constant of the current function, G(x) slot x of the driver's
+	// global table, P(x) a parallel foreach of the current function, M(x) a
+	// member expression of it and L(x) a record literal of it.
+	//
+	enum OpCode {
+		OP_MOVE = 0,		// R(A) = R(B)
+		OP_LOADK,			// R(A) = K(Bx)
+		OP_LOADBOOL,		// R(A) = (boolean)B
+		OP_LOADNULL,		// R(A) = null
+		OP_GETGLOBAL,		// R(A) = G(Bx)
+		OP_SETGLOBAL,		// G(Bx) = R(A)
+		OP_ADD,				// R(A) = R(B) + R(C)
+		OP_SUB,				// R(A) = R(B) - R(C)
+		OP_MUL,				// R(A) = R(B) * R(C)
+		OP_DIV,				// R(A) = R(B) / R(C)
+		OP_MOD,				// R(A) = R(B) % R(C)
+		OP_EQ,				// R(A) = R(B) == R(C)
+		OP_NE,				// R(A) = R(B) != R(C)
+		OP_GT,				// R(A) = R(B) > R(C)
+		OP_GE,				// R(A) = R(B) >= R(C)
+		OP_LT,				// R(A) = R(B) < R(C)
+		OP_LE,				// R(A) = R(B) <= R(C)
+		OP_MINUS,			// R(A) = -R(B)
+		OP_NOT,				// R(A) = !R(B)
+		OP_TESTBOOL,		// error E unless R(A) is a boolean
+		OP_JMP,				// pc += sBx
+		OP_JMPFALSE,		// if (!R(A)) pc += sBx, error E unless R(A) is a boolean
+		OP_JMPTRUE,			// if (R(A)) pc += sBx, error E unless R(A) is a boolean
+		OP_CALL,			// R(A) = callee C (R(A), ..., R(A + B - 1))
+		OP_TAILCALL,		// return callee C (R(A), ..., R(A + B - 1)) in the current frame
+		OP_RETURN,			// return R(A)
+		OP_RETURNNULL,		// return null
+		OP_FORPREP,			// error unless R(A) and R(B) are ints
+		OP_PARALLEL,		// run parallel foreach P(B) over [R(A), R(A + 1))
+		OP_NEXT,			// R(A) = next value of generator R(B), R(A + 1) = whether there was one
+		OP_NEWARRAY,		// R(A) = [R(A), ..., R(A + B - 1)]
+		OP_GETINDEX,		// R(A) = R(B)[R(C)]
+		OP_SETINDEX,		// R(A)[R(B)] = R(C)
+		OP_NEWDICT,			// R(A) = {R(A): R(A + 1), ..., R(A + 2B - 2): R(A + 2B - 1)}
+		OP_GETFIELD,		// R(A) = R(B).M(C)
+		OP_SETFIELD,		// R(A).M(B) = R(C)
+		OP_NEWRECORD,		// R(A) = L(B) with its fields from R(A), R(A + 1), ...
+		OP_COUNT_PLUS_1
+	};
+
+	//
+	// Error codes carried in E by OP_TESTBOOL, OP_JMPFALSE and OP_JMPTRUE, so the
+	// VM reports the same message as the statement executors.
+	//
+	enum ConditionErrorType {
+		LOGICAL_CONDITION_ERROR = 0,
+		IF_CONDITION_ERROR,
+		ELSEIF_CONDITION_ERROR,
+		WHILE_CONDITION_ERROR,
+		FOR_CONDITION_ERROR,
+	};
+
+	const char *GetOpCodeString(int op);
+	const char *GetConditionErrorString(int type);
+
+	struct Instruction {
+		unsigned char op_;
+		unsigned char ext_;
+		unsigned short a_;
+		union {
+			struct {
+				unsigned short b_;
+				unsigned short c_;
+			};
+			int bx_;
+		};
+	};
+
+	//
+	// Native code made by LJ_JIT. Runs the function from pc on the frame at
+	// base and returns the pc of the first instruction it leaves to the VM.
+	//
+	typedef size_t (*JitEntry)(Value *base, size_t pc);
+
+	class FunctionProto {
+	public:
+		FunctionProto(FunctionDefinition *def) :
+			definition_(def), param_count_(0), register_count_(0),
+			call_count_(0), loop_count_(0), jit_entry_(NULL) {}
+		~FunctionProto() {}
+
+		void Dump(const std::vector<std::string> &global_names) const;
+
+		FunctionDefinition *definition_;
+		std::string name_;
+		int param_count_;
+		int register_count_;
+		std::vector<Instruction> code_;
+		std::vector<location> locations_;
+		std::vector<Value> constants_;
+		std::vector<FunctionProto *> callees_;
+		std::vector<ForeachStatement *> parallel_loops_;
+		std::vector<MemberExpression *> members_;
+		std::vector<RecordExpression *> records_;
+		int call_count_;
+		int loop_count_;
+		JitEntry jit_entry_;
+	};
+}
+
+#endif
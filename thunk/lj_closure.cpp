@@ -0,0 +1,969 @@
+#include <math.h>
+#include "lj_driver.hpp"
+#include "lj_closure.h"
+#include "lj_native.h"
+#include "lj_parallel.h"
+
+namespace LJ {
+
+	template<ExpressionType OP>
+	static __inline Value BinaryInt(__int64 left, __int64 right)
+	{
+		switch (OP) {
+		case ADD_EXPRESSION: return IntValue(left + right);
+		case SUB_EXPRESSION: return IntValue(left - right);
+		case MUL_EXPRESSION: return IntValue(left * right);
+		case DIV_EXPRESSION: return IntValue(left / right);
+		case MOD_EXPRESSION: return IntValue(left % right);
+		case EQ_EXPRESSION: return BooleanValue(left == right);
+		case NE_EXPRESSION: return BooleanValue(left != right);
+		case GT_EXPRESSION: return BooleanValue(left > right);
+		case GE_EXPRESSION: return BooleanValue(left >= right);
+		case LT_EXPRESSION: return BooleanValue(left < right);
+		default: return BooleanValue(left <= right);
+		}
+	}
+
+	template<ExpressionType OP>
+	static __inline Value BinaryDouble(double left, double right)
+	{
+		switch (OP) {
+		case ADD_EXPRESSION: return DoubleValue(left + right);
+		case SUB_EXPRESSION: return DoubleValue(left - right);
+		case MUL_EXPRESSION: return DoubleValue(left * right);
+		case DIV_EXPRESSION: return DoubleValue(left / right);
+		case MOD_EXPRESSION: return DoubleValue(fmod(left, right));
+		case EQ_EXPRESSION: return BooleanValue(left == right);
+		case NE_EXPRESSION: return BooleanValue(left != right);
+		case GT_EXPRESSION: return BooleanValue(left > right);
+		case GE_EXPRESSION: return BooleanValue(left >= right);
+		case LT_EXPRESSION: return BooleanValue(left < right);
+		default: return BooleanValue(left <= right);
+		}
+	}
+
+	//
+	// One closure per operator, so the int and double paths are straight
+	// line code. Every other operand mix goes through EvalBinaryOperator.
+	//
+	template<ExpressionType OP>
+	static ExpressionClosure MakeBinaryClosure(LJ_Driver *driver, ExpressionClosure left, ExpressionClosure right,
+		const location &l, boolean guard)
+	{
+		return [=](size_t base) -> Value {
+			Value left_val = left(base);
+			Value right_val;
+
+			if (guard) {
+				GCRootGuard root(driver->gc_, &left_val);
+				right_val = right(base);
+			}
+			else {
+				right_val = right(base);
+			}
+
+			// Dividing by 0 or -1 is left to EvalBinaryOperator, which
+			// raises the errors.
+			if (left_val.type_ == INT_VALUE && right_val.type_ == INT_VALUE
+				&& ((OP != DIV_EXPRESSION && OP != MOD_EXPRESSION)
+					|| (TO_INT_VALUE(right_val) != 0 && TO_INT_VALUE(right_val) != -1))) {
+				return BinaryInt<OP>(TO_INT_VALUE(left_val), TO_INT_VALUE(right_val));
+			}
+			if (left_val.type_ == DOUBLE_VALUE && right_val.type_ == DOUBLE_VALUE) {
+				return BinaryDouble<OP>(TO_DOUBLE_VALUE(left_val), TO_DOUBLE_VALUE(right_val));
+			}
+			return driver->EvalBinaryOperator(OP, left_val, right_val, l);
+		};
+	}
+
+	LJ_ClosureEngine::LJ_ClosureEngine(LJ_Driver *driver)
+		: driver_(driver), return_value_(NullValue()), in_function_(0), function_(NULL), tail_callee_(NULL), call_depth_(0)
+	{
+
+	}
+
+	LJ_ClosureEngine::~LJ_ClosureEngine()
+	{
+		DeleteElems(functions_);
+	}
+
+	void LJ_ClosureEngine::Compile()
+	{
+		std::list<FunctionDefinition *> &function_list = driver_->GetFunctionList();
+
+		// Closures are created first so calls can bind to them before, or
+		// while, their bodies are compiled.
+		for (std::list<FunctionDefinition *>::iterator it = function_list.begin();
+			it != function_list.end(); ++it) {
+
+			if ((*it)->GetType() != FUNCTION_DEFINITION || driver_->FindFunction((*it)->GetFunctionName()) != *it) {
+				continue;
+			}
+
+			FunctionClosure *function = new FunctionClosure(*it);
+			if ((*it)->IsMemo() && driver_->memo_capacity_ != 0) {
+				function->memo_ = driver_->GetMemoCache(*it);
+			}
+			functions_.push_back(function);
+			function_map_[*it] = function;
+		}
+
+		// Generator bodies suspend in the middle of statements, they always
+		// run on the tree walker, see LJ_Driver::ResumeGenerator.
+		in_function_ = 1;
+		for (std::vector<FunctionClosure *>::iterator it = functions_.begin(); it != functions_.end(); ++it) {
+			if ((*it)->definition_->IsGenerator()) {
+				continue;
+			}
+			function_ = (*it)->definition_;
+			(*it)->body_ = CompileStatementList((StatementList *)(*it)->definition_->GetBlock()->GetValue(0));
+		}
+
+		in_function_ = 0;
+		function_ = NULL;
+		main_ = CompileStatementList(driver_->statement_list_);
+	}
+
+	void LJ_ClosureEngine::Execute()
+	{
+		char marker;
+
+		if (!main_) {
+			Compile();
+		}
+
+		driver_->stack_base_ = &marker;
+		main_(driver_->value_stack_.Size());
+		driver_->stack_base_ = NULL;
+	}
+
+	boolean LJ_ClosureEngine::MayAllocate(Expression *expr)
+	{
+		switch (expr->GetType()) {
+		case STRING_EXPRESSION:
+		case ADD_EXPRESSION:
+		case FUNCTION_CALL_EXPRESSION:
+		case ARRAY_EXPRESSION:
+		case DICT_EXPRESSION:
+		case RECORD_EXPRESSION:
+			return 1;
+		case ASSIGN_EXPRESSION:
+		case SUB_EXPRESSION:
+		case MUL_EXPRESSION:
+		case DIV_EXPRESSION:
+		case MOD_EXPRESSION:
+		case EQ_EXPRESSION:
+		case NE_EXPRESSION:
+		case GT_EXPRESSION:
+		case GE_EXPRESSION:
+		case LT_EXPRESSION:
+		case LE_EXPRESSION:
+		case LOGICAL_AND_EXPRESSION:
+		case LOGICAL_OR_EXPRESSION:
+		case INDEX_EXPRESSION:
+			return MayAllocate((Expression *)expr->GetValue(0)) || MayAllocate((Expression *)expr->GetValue(1));
+		case MINUS_EXPRESSION:
+		case EXCLAMATION_EXPRESSION:
+		case MEMBER_EXPRESSION:
+			return MayAllocate((Expression *)expr->GetValue(0));
+		default:
+			return 0;
+		}
+	}
+
+	StatementClosure LJ_ClosureEngine::CompileStatementList(StatementList *list)
+	{
+		std::vector<StatementClosure> statements;
+
+		if (list != NULL) {
+			for (StatementList::iterator it = list->begin(); it != list->end(); ++it) {
+				if ((*it)->GetType() != GLOBAL_STATEMENT) {
+					statements.push_back(CompileStatement(*it));
+				}
+			}
+		}
+
+		switch (statements.size()) {
+		case 0:
+			return [](size_t) { return NORMAL_STATEMENT_RESULT; };
+		case 1:
+			return statements[0];
+		default:
+			return [statements](size_t base) {
+				for (std::vector<StatementClosure>::const_iterator it = statements.begin(); it != statements.end(); ++it) {
+					StatementResultType result = (*it)(base);
+					if (result != NORMAL_STATEMENT_RESULT) {
+						return result;
+					}
+				}
+				return NORMAL_STATEMENT_RESULT;
+			};
+		}
+	}
+
+	StatementClosure LJ_ClosureEngine::CompileStatement(Statement *statement)
+	{
+		switch (statement->GetType()) {
+		case EXPRESSION_STATEMENT: {
+			ExpressionClosure expr = CompileExpression((Expression *)statement->GetValue(0));
+			return [expr](size_t base) {
+				expr(base);
+				return NORMAL_STATEMENT_RESULT;
+			};
+		}
+		case IF_STATEMENT:
+			return CompileIfStatement(statement);
+		case WHILE_STATEMENT:
+			return CompileWhileStatement(statement);
+		case FOR_STATEMENT:
+			return CompileForStatement(statement);
+		case FOREACH_STATEMENT:
+			return CompileForeachStatement(statement);
+		case RETURN_STATEMENT:
+			return CompileReturnStatement(statement);
+		case BREAK_STATEMENT:
+			return [](size_t) { return BREAK_STATEMENT_RESULT; };
+		case CONTINUE_STATEMENT:
+			return [](size_t) { return CONTINUE_STATEMENT_RESULT; };
+		default:
+			LJ_TRAP();
+			return StatementClosure();
+		}
+	}
+
+	StatementClosure LJ_ClosureEngine::CompileIfStatement(Statement *statement)
+	{
+		struct ElseifClosure {
+			ExpressionClosure condition_;
+			StatementClosure block_;
+			location loc_;
+		};
+
+		LJ_Driver *driver = driver_;
+		location l = statement->GetLocation();
+		ExpressionClosure condition = CompileExpression((Expression *)statement->GetValue(0));
+		StatementClosure then_block = CompileStatementList((StatementList *)((Block *)statement->GetValue(1))->GetValue(0));
+		StatementClosure else_block;
+		std::vector<ElseifClosure> elseifs;
+
+		ElseifList *elseif_list = (ElseifList *)statement->GetValue(2);
+		if (elseif_list != NULL) {
+			for (ElseifList::iterator it = elseif_list->begin(); it != elseif_list->end(); ++it) {
+				ElseifClosure elseif;
+				elseif.condition_ = CompileExpression((Expression *)(*it)->GetValue(0));
+				elseif.block_ = CompileStatementList((StatementList *)((Block *)(*it)->GetValue(1))->GetValue(0));
+				elseif.loc_ = (*it)->GetLocation();
+				elseifs.push_back(elseif);
+			}
+		}
+		if (statement->GetValue(3) != NULL) {
+			else_block = CompileStatementList((StatementList *)((Block *)statement->GetValue(3))->GetValue(0));
+		}
+
+		return [=](size_t base) {
+			Value v = condition(base);
+			if (v.type_ != BOOLEAN_VALUE) {
+				driver->Error(l, "ExecuteIfStatement error");
+			}
+			if (TO_BOOLEAN_VALUE(v)) {
+				return then_block(base);
+			}
+
+			for (std::vector<ElseifClosure>::const_iterator it = elseifs.begin(); it != elseifs.end(); ++it) {
+				v = it->condition_(base);
+				if (v.type_ != BOOLEAN_VALUE) {
+					driver->Error(it->loc_, "ExecuteElseif error");
+				}
+				if (TO_BOOLEAN_VALUE(v)) {
+					return it->block_(base);
+				}
+			}
+
+			return else_block ? else_block(base) : NORMAL_STATEMENT_RESULT;
+		};
+	}
+
+	StatementClosure LJ_ClosureEngine::CompileWhileStatement(Statement *statement)
+	{
+		LJ_Driver *driver = driver_;
+		location l = statement->GetLocation();
+		ExpressionClosure condition = CompileExpression((Expression *)statement->GetValue(0));
+		StatementClosure block = CompileStatementList((StatementList *)((Block *)statement->GetValue(1))->GetValue(0));
+
+		return [=](size_t base) {
+			for (;;) {
+				Value v = condition(base);
+				if (v.type_ != BOOLEAN_VALUE) {
+					driver->Error(l, "ExecuteWhileStatement error");
+				}
+				if (!TO_BOOLEAN_VALUE(v)) {
+					break;
+				}
+
+				StatementResultType result = block(base);
+				if (result == RETURN_STATEMENT_RESULT) {
+					return result;
+				}
+				if (result == BREAK_STATEMENT_RESULT) {
+					break;
+				}
+				driver->Safepoint();
+			}
+			return NORMAL_STATEMENT_RESULT;
+		};
+	}
+
+	StatementClosure LJ_ClosureEngine::CompileForStatement(Statement *statement)
+	{
+		LJ_Driver *driver = driver_;
+		location l = statement->GetLocation();
+		ExpressionClosure init;
+		ExpressionClosure condition;
+		ExpressionClosure post;
+		StatementClosure block = CompileStatementList((StatementList *)((Block *)statement->GetValue(3))->GetValue(0));
+
+		if (statement->GetValue(0) != NULL) {
+			init = CompileExpression((Expression *)statement->GetValue(0));
+		}
+		if (statement->GetValue(1) != NULL) {
+			condition = CompileExpression((Expression *)statement->GetValue(1));
+		}
+		if (statement->GetValue(2) != NULL) {
+			post = CompileExpression((Expression *)statement->GetValue(2));
+		}
+
+		return [=](size_t base) {
+			if (init) {
+				init(base);
+			}
+			for (;;) {
+				if (condition) {
+					Value v = condition(base);
+					if (v.type_ != BOOLEAN_VALUE) {
+						driver->Error(l, "ExecuteForStatement error");
+					}
+					if (!TO_BOOLEAN_VALUE(v)) {
+						break;
+					}
+				}
+
+				StatementResultType result = block(base);
+				if (result == RETURN_STATEMENT_RESULT) {
+					return result;
+				}
+				if (result == BREAK_STATEMENT_RESULT) {
+					break;
+				}
+				driver->Safepoint();
+
+				if (post) {
+					post(base);
+				}
+			}
+			return NORMAL_STATEMENT_RESULT;
+		};
+	}
+
+	//
+	// A parallel foreach hands its body to the tree walking workers of
+	// LJ_ParallelForeach, they start from the frame at base.
+	//
+	StatementClosure LJ_ClosureEngine::CompileForeachStatement(Statement *statement)
+	{
+		LJ_Driver *driver = driver_;
+		location l = statement->GetLocation();
+		ForeachStatement *foreach = static_cast<ForeachStatement *>(statement);
+		IdentifierExpression *var = static_cast<IdentifierExpression *>((Expression *)statement->GetValue(0));
+		FunctionDefinition *func = function_;
+		ExpressionClosure from = CompileExpression((Expression *)statement->GetValue(1));
+		StatementClosure block = CompileStatementList((StatementList *)((Block *)statement->GetValue(3))->GetValue(0));
+		ValueStack *stack = &driver_->value_stack_;
+		boolean local = var->GetSlotType() == LOCAL_SLOT;
+		size_t slot = var->GetSlotIndex();
+		Value *global = local ? NULL : &driver_->global_value_[slot];
+
+		if (foreach->IteratesGenerator()) {
+			return [=](size_t base) {
+				Value g = from(base);
+				Value v;
+				GCRootGuard guard(driver->gc_, &g);
+
+				if (g.type_ != GENERATOR_VALUE) {
+					driver->Error(l, "ExecuteForeachStatement error");
+				}
+				while (driver->ResumeGenerator(TO_GENERATOR_VALUE(g), &v, l)) {
+					*(local ? &(*stack)[base + slot] : global) = v;
+
+					StatementResultType result = block(base);
+					if (result == RETURN_STATEMENT_RESULT) {
+						return result;
+					}
+					if (result == BREAK_STATEMENT_RESULT) {
+						break;
+					}
+					driver->Safepoint();
+				}
+				return NORMAL_STATEMENT_RESULT;
+			};
+		}
+
+		ExpressionClosure to = CompileExpression((Expression *)statement->GetValue(2));
+		return [=](size_t base) {
+			Value from_val = from(base);
+			Value to_val = to(base);
+			if (from_val.type_ != INT_VALUE || to_val.type_ != INT_VALUE) {
+				driver->Error(l, "ExecuteForeachStatement error");
+			}
+
+			if (foreach->IsParallel()) {
+				LJ_ParallelForeach pool(driver, foreach);
+				pool.Run(TO_INT_VALUE(from_val), TO_INT_VALUE(to_val), func, func != NULL ? &(*stack)[base] : NULL);
+				return NORMAL_STATEMENT_RESULT;
+			}
+
+			for (__int64 i = TO_INT_VALUE(from_val); i < TO_INT_VALUE(to_val); i++) {
+				*(local ? &(*stack)[base + slot] : global) = IntValue(i);
+
+				StatementResultType result = block(base);
+				if (result == RETURN_STATEMENT_RESULT) {
+					return result;
+				}
+				if (result == BREAK_STATEMENT_RESULT) {
+					break;
+				}
+				driver->Safepoint();
+			}
+			return NORMAL_STATEMENT_RESULT;
+		};
+	}
+
+	StatementClosure LJ_ClosureEngine::CompileReturnStatement(Statement *statement)
+	{
+		LJ_ClosureEngine *engine = this;
+		Expression *call = (Expression *)statement->GetValue(0);
+
+		// return f(...) inside a function pushes the arguments and leaves the
+		// call to CallFunction, which runs it in place of the current one.
+		if (in_function_ && call != NULL && call->GetType() == FUNCTION_CALL_EXPRESSION) {
+			BinaryExpression<FUNCTION_CALL_EXPRESSION> *expr = static_cast<BinaryExpression<FUNCTION_CALL_EXPRESSION> *>(call);
+			if (expr->GetFunction() != NULL && expr->GetFunction()->GetType() == FUNCTION_DEFINITION
+				&& !expr->GetFunction()->IsGenerator()) {
+				ValueStack *stack = &driver_->value_stack_;
+				FunctionClosure *callee = function_map_[expr->GetFunction()];
+				std::vector<ExpressionClosure> args;
+
+				if (expr->GetArgList() != NULL) {
+					for (ArgumentList::iterator it = expr->GetArgList()->begin(); it != expr->GetArgList()->end(); ++it) {
+						args.push_back(CompileExpression(*it));
+					}
+				}
+
+				return [engine, stack, args, callee](size_t base) {
+					for (std::vector<ExpressionClosure>::const_iterator it = args.begin(); it != args.end(); ++it) {
+						stack->Push((*it)(base));
+					}
+					engine->tail_callee_ = callee;
+					return RETURN_STATEMENT_RESULT;
+				};
+			}
+		}
+
+		if (statement->GetValue(0) == NULL) {
+			return [engine](size_t) {
+				engine->return_value_ = NullValue();
+				return RETURN_STATEMENT_RESULT;
+			};
+		}
+
+		ExpressionClosure expr = CompileExpression((Expression *)statement->GetValue(0));
+		return [engine, expr](size_t base) {
+			engine->return_value_ = expr(base);
+			return RETURN_STATEMENT_RESULT;
+		};
+	}
+
+	ExpressionClosure LJ_ClosureEngine::CompileExpression(Expression *expr)
+	{
+		LJ_Driver *driver = driver_;
+
+		switch (expr->GetType()) {
+		case BOOLEAN_EXPRESSION: {
+			Value v = BooleanValue(*(boolean *)expr->GetValue(0));
+			return [v](size_t) { return v; };
+		}
+		case INT_EXPRESSION: {
+			Value v = IntValue(*(__int64 *)expr->GetValue(0));
+			return [v](size_t) { return v; };
+		}
+		case DOUBLE_EXPRESSION: {
+			Value v = DoubleValue(*(double *)expr->GetValue(0));
+			return [v](size_t) { return v; };
+		}
+		case STRING_EXPRESSION: {
+			// Strings are collected, each evaluation makes a new one like the
+			// tree walker does.
+			std::string s = *(std::string *)expr->GetValue(0);
+			return [driver, s](size_t) { return NewStringValue(driver->gc_, s); };
+		}
+		case IDENTIFIER_EXPRESSION:
+			return CompileIdentifierExpression(expr);
+		case ASSIGN_EXPRESSION:
+			return CompileAssignExpression(expr);
+		case ADD_EXPRESSION:
+		case SUB_EXPRESSION:
+		case MUL_EXPRESSION:
+		case DIV_EXPRESSION:
+		case MOD_EXPRESSION:
+		case EQ_EXPRESSION:
+		case NE_EXPRESSION:
+		case GT_EXPRESSION:
+		case GE_EXPRESSION:
+		case LT_EXPRESSION:
+		case LE_EXPRESSION:
+			return CompileBinaryExpression(expr);
+		case LOGICAL_AND_EXPRESSION:
+		case LOGICAL_OR_EXPRESSION:
+			return CompileLogicalAndOrExpression(expr);
+		case MINUS_EXPRESSION: {
+			Expression *operand_expr = (Expression *)expr->GetValue(0);
+			ExpressionClosure operand = CompileExpression(operand_expr);
+			location operand_loc = operand_expr->GetLocation();
+			return [driver, operand, operand_loc](size_t base) {
+				Value v = operand(base);
+				if (v.type_ == INT_VALUE) {
+					return IntValue(-TO_INT_VALUE(v));
+				}
+				if (v.type_ == DOUBLE_VALUE) {
+					return DoubleValue(-TO_DOUBLE_VALUE(v));
+				}
+				driver->Error(operand_loc, "EvalMinusExpression error");
+				return v;
+			};
+		}
+		case EXCLAMATION_EXPRESSION: {
+			Expression *operand_expr = (Expression *)expr->GetValue(0);
+			ExpressionClosure operand = CompileExpression(operand_expr);
+			location operand_loc = operand_expr->GetLocation();
+			return [driver, operand, operand_loc](size_t base) {
+				Value v = operand(base);
+				if (v.type_ != BOOLEAN_VALUE) {
+					driver->Error(operand_loc, "EvalExclamationExpression error");
+				}
+				return BooleanValue(!TO_BOOLEAN_VALUE(v));
+			};
+		}
+		case FUNCTION_CALL_EXPRESSION:
+			return CompileFunctionCallExpression(expr);
+		case TRUE_EXPRESSION:
+			return [](size_t) { return BooleanValue(1); };
+		case FALSE_EXPRESSION:
+			return [](size_t) { return BooleanValue(0); };
+		case NULL_EXPRESSION:
+			return [](size_t) { return NullValue(); };
+		case INDEX_EXPRESSION:
+			return CompileIndexExpression(expr);
+		case ARRAY_EXPRESSION:
+			return CompileArrayExpression(expr);
+		case DICT_EXPRESSION:
+			return CompileDictExpression(expr);
+		case MEMBER_EXPRESSION:
+			return CompileMemberExpression(expr);
+		case RECORD_EXPRESSION:
+			return CompileRecordExpression(expr);
+		default:
+			LJ_TRAP();
+			return ExpressionClosure();
+		}
+	}
+
+	ExpressionClosure LJ_ClosureEngine::CompileIdentifierExpression(Expression *expr)
+	{
+		IdentifierExpression *identifier = static_cast<IdentifierExpression *>(expr);
+		LJ_Driver *driver = driver_;
+		location l = expr->GetLocation();
+		size_t slot = identifier->GetSlotIndex();
+
+		if (identifier->GetSlotType() == LOCAL_SLOT) {
+			ValueStack *stack = &driver_->value_stack_;
+			return [driver, stack, slot, l](size_t base) {
+				const Value &v = (*stack)[base + slot];
+				if (v.type_ == UNDEFINED_VALUE) {
+					driver->Error(l, "EvalIdentifierExpression error");
+				}
+				return v;
+			};
+		}
+
+		// Globals are all known after resolving, the vector does not move.
+		Value *global = &driver_->global_value_[slot];
+		return [driver, global, l](size_t) {
+			if (global->type_ == UNDEFINED_VALUE) {
+				driver->Error(l, "EvalIdentifierExpression error");
+			}
+			return *global;
+		};
+	}
+
+	ExpressionClosure LJ_ClosureEngine::CompileAssignExpression(Expression *expr)
+	{
+		LJ_Driver *driver = driver_;
+		Expression *left = (Expression *)expr->GetValue(0);
+		ExpressionClosure right = CompileExpression((Expression *)expr->GetValue(1));
+
+		// The value is pinned while the array and index are evaluated, the
+		// array while the index is.
+		if (left->GetType() == INDEX_EXPRESSION) {
+			ExpressionClosure array = CompileExpression((Expression *)left->GetValue(0));
+			ExpressionClosure index = CompileExpression((Expression *)left->GetValue(1));
+			location l = left->GetLocation();
+			boolean guard = MayAllocate(left);
+			return [driver, right, array, index, l, guard](size_t base) {
+				Value v = right(base);
+				Value a, i;
+
+				if (guard) {
+					GCRootGuard value_root(driver->gc_, &v);
+					a = array(base);
+					GCRootGuard array_root(driver->gc_, &a);
+					i = index(base);
+				}
+				else {
+					a = array(base);
+					i = index(base);
+				}
+
+				driver->SetElement(a, i, v, l);
+				return v;
+			};
+		}
+
+		if (left->GetType() == MEMBER_EXPRESSION) {
+			MemberExpression *member = static_cast<MemberExpression *>(left);
+			ExpressionClosure object = CompileExpression((Expression *)left->GetValue(0));
+			boolean guard = MayAllocate(left);
+			return [driver, right, object, member, guard](size_t base) {
+				Value v = right(base);
+				Value r;
+
+				if (guard) {
+					GCRootGuard value_root(driver->gc_, &v);
+					r = object(base);
+				}
+				else {
+					r = object(base);
+				}
+
+				driver->SetField(r, member, v);
+				return v;
+			};
+		}
+
+		if (left->GetType() != IDENTIFIER_EXPRESSION) {
+			location l = left->GetLocation();
+			return [driver, right, l](size_t base) {
+				Value v = right(base);
+				driver->Error(l, "GetLValue error");
+				return v;
+			};
+		}
+
+		IdentifierExpression *identifier = static_cast<IdentifierExpression *>(left);
+		size_t slot = identifier->GetSlotIndex();
+
+		if (identifier->GetSlotType() == LOCAL_SLOT) {
+			ValueStack *stack = &driver_->value_stack_;
+			return [stack, slot, right](size_t base) {
+				Value v = right(base);
+				(*stack)[base + slot] = v;
+				return v;
+			};
+		}
+
+		Value *global = &driver_->global_value_[slot];
+		return [global, right](size_t base) {
+			Value v = right(base);
+			*global = v;
+			return v;
+		};
+	}
+
+	ExpressionClosure LJ_ClosureEngine::CompileIndexExpression(Expression *expr)
+	{
+		LJ_Driver *driver = driver_;
+		Expression *index_expr = (Expression *)expr->GetValue(1);
+		ExpressionClosure array = CompileExpression((Expression *)expr->GetValue(0));
+		ExpressionClosure index = CompileExpression(index_expr);
+		location l = expr->GetLocation();
+		boolean guard = MayAllocate(index_expr);
+
+		return [driver, array, index, l, guard](size_t base) {
+			Value a = array(base);
+			Value i;
+
+			if (guard) {
+				GCRootGuard root(driver->gc_, &a);
+				i = index(base);
+			}
+			else {
+				i = index(base);
+			}
+			return driver->GetElement(a, i, l);
+		};
+	}
+
+	ExpressionClosure LJ_ClosureEngine::CompileArrayExpression(Expression *expr)
+	{
+		LJ_Driver *driver = driver_;
+		ValueStack *stack = &driver_->value_stack_;
+		ArgumentList *element_list = static_cast<ArrayExpression *>(expr)->GetElements();
+		std::vector<ExpressionClosure> elements;
+
+		for (ArgumentList::iterator it = element_list->begin(); it != element_list->end(); ++it) {
+			elements.push_back(CompileExpression(*it));
+		}
+
+		// Elements wait on the value stack, which keeps them alive.
+		return [driver, stack, elements](size_t base) {
+			size_t elem_base = stack->Size();
+			for (std::vector<ExpressionClosure>::const_iterator it = elements.begin(); it != elements.end(); ++it) {
+				stack->Push((*it)(base));
+			}
+
+			Value v = NewArrayValue(driver->gc_, elements.size() != 0 ? &(*stack)[elem_base] : NULL, elements.size());
+			stack->Pop(elements.size());
+			return v;
+		};
+	}
+
+	ExpressionClosure LJ_ClosureEngine::CompileDictExpression(Expression *expr)
+	{
+		LJ_Driver *driver = driver_;
+		ValueStack *stack = &driver_->value_stack_;
+		ArgumentList *entry_list = static_cast<DictExpression *>(expr)->GetEntries();
+		std::vector<ExpressionClosure> entries;
+		location l = expr->GetLocation();
+
+		for (ArgumentList::iterator it = entry_list->begin(); it != entry_list->end(); ++it) {
+			entries.push_back(CompileExpression(*it));
+		}
+
+		// Keys and values wait on the value stack like array elements.
+		return [driver, stack, entries, l](size_t base) {
+			size_t entry_base = stack->Size();
+			for (std::vector<ExpressionClosure>::const_iterator it = entries.begin(); it != entries.end(); ++it) {
+				stack->Push((*it)(base));
+			}
+
+			Value v = driver->NewDict(entries.size() != 0 ? &(*stack)[entry_base] : NULL, entries.size() / 2, l);
+			stack->Pop(entries.size());
+			return v;
+		};
+	}
+
+	ExpressionClosure LJ_ClosureEngine::CompileMemberExpression(Expression *expr)
+	{
+		LJ_Driver *driver = driver_;
+		MemberExpression *member = static_cast<MemberExpression *>(expr);
+		ExpressionClosure object = CompileExpression((Expression *)expr->GetValue(0));
+
+		return [driver, object, member](size_t base) {
+			return driver->GetField(object(base), member);
+		};
+	}
+
+	ExpressionClosure LJ_ClosureEngine::CompileRecordExpression(Expression *expr)
+	{
+		LJ_Driver *driver = driver_;
+		ValueStack *stack = &driver_->value_stack_;
+		RecordExpression *record = static_cast<RecordExpression *>(expr);
+		std::vector<ExpressionClosure> values;
+
+		for (ArgumentList::iterator it = record->GetValues()->begin(); it != record->GetValues()->end(); ++it) {
+			values.push_back(CompileExpression(*it));
+		}
+
+		// Field values wait on the value stack like array elements.
+		return [driver, stack, values, record](size_t base) {
+			size_t value_base = stack->Size();
+			for (std::vector<ExpressionClosure>::const_iterator it = values.begin(); it != values.end(); ++it) {
+				stack->Push((*it)(base));
+			}
+
+			Value v = driver->NewRecord(record, &(*stack)[value_base]);
+			stack->Pop(values.size());
+			return v;
+		};
+	}
+
+	ExpressionClosure LJ_ClosureEngine::CompileBinaryExpression(Expression *expr)
+	{
+		Expression *left_expr = (Expression *)expr->GetValue(0);
+		Expression *right_expr = (Expression *)expr->GetValue(1);
+		ExpressionClosure left = CompileExpression(left_expr);
+		ExpressionClosure right = CompileExpression(right_expr);
+		location &l = left_expr->GetLocation();
+		boolean guard = MayAllocate(right_expr);
+
+		switch (expr->GetType()) {
+		case ADD_EXPRESSION: return MakeBinaryClosure<ADD_EXPRESSION>(driver_, left, right, l, guard);
+		case SUB_EXPRESSION: return MakeBinaryClosure<SUB_EXPRESSION>(driver_, left, right, l, guard);
+		case MUL_EXPRESSION: return MakeBinaryClosure<MUL_EXPRESSION>(driver_, left, right, l, guard);
+		case DIV_EXPRESSION: return MakeBinaryClosure<DIV_EXPRESSION>(driver_, left, right, l, guard);
+		case MOD_EXPRESSION: return MakeBinaryClosure<MOD_EXPRESSION>(driver_, left, right, l, guard);
+		case EQ_EXPRESSION: return MakeBinaryClosure<EQ_EXPRESSION>(driver_, left, right, l, guard);
+		case NE_EXPRESSION: return MakeBinaryClosure<NE_EXPRESSION>(driver_, left, right, l, guard);
+		case GT_EXPRESSION: return MakeBinaryClosure<GT_EXPRESSION>(driver_, left, right, l, guard);
+		case GE_EXPRESSION: return MakeBinaryClosure<GE_EXPRESSION>(driver_, left, right, l, guard);
+		case LT_EXPRESSION: return MakeBinaryClosure<LT_EXPRESSION>(driver_, left, right, l, guard);
+		case LE_EXPRESSION: return MakeBinaryClosure<LE_EXPRESSION>(driver_, left, right, l, guard);
+		default:
+			LJ_TRAP();
+			return ExpressionClosure();
+		}
+	}
+
+	ExpressionClosure LJ_ClosureEngine::CompileLogicalAndOrExpression(Expression *expr)
+	{
+		LJ_Driver *driver = driver_;
+		Expression *left_expr = (Expression *)expr->GetValue(0);
+		Expression *right_expr = (Expression *)expr->GetValue(1);
+		ExpressionClosure left = CompileExpression(left_expr);
+		ExpressionClosure right = CompileExpression(right_expr);
+		location left_loc = left_expr->GetLocation();
+		location right_loc = right_expr->GetLocation();
+		boolean short_value = expr->GetType() == LOGICAL_OR_EXPRESSION;
+
+		return [=](size_t base) {
+			Value v = left(base);
+			if (v.type_ != BOOLEAN_VALUE) {
+				driver->Error(left_loc, "EvalLogicalAndOrExpression error");
+			}
+			if (TO_BOOLEAN_VALUE(v) == short_value) {
+				return BooleanValue(short_value);
+			}
+
+			v = right(base);
+			if (v.type_ != BOOLEAN_VALUE) {
+				driver->Error(right_loc, "EvalLogicalAndOrExpression error");
+			}
+			return BooleanValue(TO_BOOLEAN_VALUE(v));
+		};
+	}
+
+	ExpressionClosure LJ_ClosureEngine::CompileFunctionCallExpression(Expression *e)
+	{
+		BinaryExpression<FUNCTION_CALL_EXPRESSION> *expr = static_cast<BinaryExpression<FUNCTION_CALL_EXPRESSION> *>(e);
+		FunctionDefinition *func = expr->GetFunction();
+		LJ_Driver *driver = driver_;
+		ValueStack *stack = &driver_->value_stack_;
+		location l = expr->GetLocation();
+		std::vector<ExpressionClosure> args;
+
+		if (func == NULL) {
+			return [driver, l](size_t) {
+				driver->Error(l, "EvalFunctionCallExpression error");
+				return NullValue();
+			};
+		}
+
+		if (expr->GetArgList() != NULL) {
+			for (ArgumentList::iterator it = expr->GetArgList()->begin(); it != expr->GetArgList()->end(); ++it) {
+				args.push_back(CompileExpression(*it));
+			}
+		}
+
+		// Arguments are pushed on the value stack, which keeps them alive and
+		// makes them the callee's first slots.
+		if (func->GetType() == NATIVE_FUNCTION) {
+			NativeFunctionProc proc = static_cast<NativeFunction *>(func)->GetProc();
+			return [driver, stack, args, proc, l](size_t base) {
+				size_t arg_base = stack->Size();
+				for (std::vector<ExpressionClosure>::const_iterator it = args.begin(); it != args.end(); ++it) {
+					stack->Push((*it)(base));
+				}
+
+				Value v = proc(driver, (int)args.size(), args.size() != 0 ? &(*stack)[arg_base] : NULL, l);
+				stack->Pop(args.size());
+				return v;
+			};
+		}
+
+		if (func->IsGenerator()) {
+			return [driver, stack, args, func](size_t base) {
+				size_t arg_base = stack->Size();
+				for (std::vector<ExpressionClosure>::const_iterator it = args.begin(); it != args.end(); ++it) {
+					stack->Push((*it)(base));
+				}
+
+				Value v = NewGeneratorValue(driver->gc_, func, args.size() != 0 ? &(*stack)[arg_base] : NULL, args.size());
+				stack->Pop(args.size());
+				return v;
+			};
+		}
+
+		FunctionClosure *callee = function_map_[func];
+		LJ_ClosureEngine *engine = this;
+		return [engine, args, callee, l](size_t base) {
+			return engine->CallFunction(callee, args, base, l);
+		};
+	}
+
+	Value LJ_ClosureEngine::CallFunction(FunctionClosure *callee, const std::vector<ExpressionClosure> &args, size_t base,
+		const location &l)
+	{
+		ValueStack &stack = driver_->value_stack_;
+		size_t callee_base = stack.Size();
+		MemoCache *memo = callee->memo_;
+		std::string key;
+
+		if (call_depth_ >= driver_->call_depth_limit_) {
+			driver_->Error(l, "CallFunction error");
+		}
+		if (driver_->NativeStackExhausted()) {
+			Value v;
+			driver_->RunOnFreshStack([&]() { v = CallFunction(callee, args, base, l); });
+			return v;
+		}
+		driver_->Safepoint();
+
+		for (std::vector<ExpressionClosure>::const_iterator it = args.begin(); it != args.end(); ++it) {
+			stack.Push((*it)(base));
+		}
+
+		if (memo != NULL) {
+			Value v;
+			MemoCache::MakeKey(args.size() != 0 ? &stack[callee_base] : NULL, args.size(), &key);
+			if (memo->Lookup(key, &v)) {
+				stack.Pop(args.size());
+				return v;
+			}
+		}
+		stack.Grow(callee->slot_count_ - args.size(), UndefinedValue());
+
+		call_depth_++;
+		StatementResultType result = callee->body_(callee_base);
+
+		// A tail call replaces the frame, its arguments move down to the base.
+		while (tail_callee_ != NULL) {
+			callee = tail_callee_;
+			tail_callee_ = NULL;
+
+			size_t arg_base = stack.Size() - callee->param_count_;
+			for (int i = 0; i < callee->param_count_; i++) {
+				stack[callee_base + i] = stack[arg_base + i];
+			}
+			stack.Pop(stack.Size() - (callee_base + callee->param_count_));
+			stack.Grow(callee->slot_count_ - callee->param_count_, UndefinedValue());
+
+			result = callee->body_(callee_base);
+		}
+		call_depth_--;
+
+		Value v = result == RETURN_STATEMENT_RESULT ? return_value_ : NullValue();
+		stack.Pop(stack.Size() - callee_base);
+		if (memo != NULL) {
+			memo->Insert(key, v);
+		}
+		return v;
+	}
+}
@@ -0,0 +1,87 @@
+#ifndef __LJ_CLOSURE_H__
+#define __LJ_CLOSURE_H__
+
+#include <functional>
+#include <map>
+#include <vector>
+#include "lj_ast.h"
+#include "lj_memo.h"
+#include "lj_val.h"
+
+namespace LJ {
+
+	class LJ_Driver;
+
+	typedef std::function<Value(size_t base)> ExpressionClosure;
+	typedef std::function<StatementResultType(size_t base)> StatementClosure;
+
+	class FunctionClosure {
+	public:
+		FunctionClosure(FunctionDefinition *definition) :
+			definition_(definition), slot_count_(definition->GetSlotCount()),
+			param_count_(definition->GetParamList() != NULL ? (int)definition->GetParamList()->size() : 0),
+			memo_(NULL) {}
+
+		FunctionDefinition *definition_;
+		int slot_count_;
+		int param_count_;
+		StatementClosure body_;
+		// The driver's cache for a memo function, NULL for any other.
+		MemoCache *memo_;
+	};
+
+	//
+	// Executes a driver's program as a tree of closures built once from the
+	// AST. Every closure holds its children's closures and everything it
+	// reads from its node, so running it needs neither the switch on node
+	// types nor GetValue casts. Frames and call arguments live on the
+	// driver's value stack like in the tree walker, an operand that is still
+	// needed while its sibling may allocate is pinned with a GCRootGuard.
+	//
+	class LJ_ClosureEngine {
+	public:
+		LJ_ClosureEngine(LJ_Driver *driver);
+		~LJ_ClosureEngine();
+
+		void Compile();
+		void Execute();
+
+	private:
+		StatementClosure CompileStatementList(StatementList *list);
+		StatementClosure CompileStatement(Statement *statement);
+		StatementClosure CompileIfStatement(Statement *statement);
+		StatementClosure CompileWhileStatement(Statement *statement);
+		StatementClosure CompileForStatement(Statement *statement);
+		StatementClosure CompileForeachStatement(Statement *statement);
+		StatementClosure CompileReturnStatement(Statement *statement);
+
+		ExpressionClosure CompileExpression(Expression *expr);
+		ExpressionClosure CompileIdentifierExpression(Expression *expr);
+		ExpressionClosure CompileAssignExpression(Expression *expr);
+		ExpressionClosure CompileIndexExpression(Expression *expr);
+		ExpressionClosure CompileArrayExpression(Expression *expr);
+		ExpressionClosure CompileDictExpression(Expression *expr);
+		ExpressionClosure CompileMemberExpression(Expression *expr);
+		ExpressionClosure CompileRecordExpression(Expression *expr);
+		ExpressionClosure CompileBinaryExpression(Expression *expr);
+		ExpressionClosure CompileLogicalAndOrExpression(Expression *expr);
+		ExpressionClosure CompileFunctionCallExpression(Expression *expr);
+
+		boolean MayAllocate(Expression *expr);
+
+		Value CallFunction(FunctionClosure *callee, const std::vector<ExpressionClosure> &args, size_t base,
+			const location &l);
+
+		LJ_Driver *driver_;
+		std::vector<FunctionClosure *> functions_;
+		std::map<FunctionDefinition *, FunctionClosure *> function_map_;
+		StatementClosure main_;
+		Value return_value_;
+		boolean in_function_;
+		FunctionDefinition *function_;
+		FunctionClosure *tail_callee_;
+		size_t call_depth_;
+	};
+}
+
+#endif
@@ -0,0 +1,859 @@
+#include "lj_driver.hpp"
+#include "lj_compiler.h"
+#include "lj_native.h"
+
+namespace LJ {
+
+	LJ_Compiler::LJ_Compiler(LJ_Driver *driver)
+		: driver_(driver), proto_(NULL), local_register_count_(0), free_register_(0)
+	{
+
+	}
+
+	LJ_Compiler::~LJ_Compiler()
+	{
+	}
+
+	FunctionProto *LJ_Compiler::Compile(std::vector<FunctionProto *> &protos)
+	{
+		std::list<FunctionDefinition *> &function_list = driver_->GetFunctionList();
+
+		for (std::list<FunctionDefinition *>::iterator it = function_list.begin();
+			it != function_list.end(); ++it) {
+
+			if (driver_->FindFunction((*it)->GetFunctionName()) != *it) {
+				continue;
+			}
+
+			FunctionProto *proto = new FunctionProto(*it);
+			proto->name_ = (*it)->GetFunctionName();
+			if ((*it)->GetParamList() != NULL) {
+				proto->param_count_ = (int)(*it)->GetParamList()->size();
+			}
+			function_map_[*it] = proto;
+			protos.push_back(proto);
+		}
+
+		for (std::vector<FunctionProto *>::iterator it = protos.begin(); it != protos.end(); ++it) {
+			if ((*it)->definition_->GetType() == FUNCTION_DEFINITION) {
+				CompileFunction((*it)->definition_, *it);
+			}
+		}
+
+		FunctionProto *main_proto = new FunctionProto(NULL);
+		main_proto->name_ = "main";
+		protos.push_back(main_proto);
+		CompileMain(driver_->statement_list_, main_proto);
+
+		return main_proto;
+	}
+
+	void LJ_Compiler::BeginProto(FunctionProto *proto)
+	{
+		proto_ = proto;
+		local_register_count_ = 0;
+		free_register_ = 0;
+		callee_map_.clear();
+		loop_stack_.clear();
+	}
+
+	void LJ_Compiler::EndProto()
+	{
+		Emit(OP_RETURNNULL, 0, 0, 0, location());
+		if (proto_->register_count_ == 0) {
+			proto_->register_count_ = 1;
+		}
+	}
+
+	void LJ_Compiler::CompileFunction(FunctionDefinition *func, FunctionProto *proto)
+	{
+		StatementList *list = (StatementList *)func->GetBlock()->GetValue(0);
+
+		BeginProto(proto);
+
+		// OP_CALL makes a generator without entering the proto, the body
+		// runs on the tree walker.
+		if (func->IsGenerator()) {
+			EndProto();
+			return;
+		}
+
+		// LJ_Resolver numbered the frame slots, they become the local registers.
+		free_register_ = func->GetSlotCount();
+		local_register_count_ = free_register_;
+		proto_->register_count_ = free_register_;
+
+		CompileStatementList(list);
+		EndProto();
+	}
+
+	void LJ_Compiler::CompileMain(StatementList *list, FunctionProto *proto)
+	{
+		BeginProto(proto);
+		CompileStatementList(list);
+		EndProto();
+	}
+
+	bool LJ_Compiler::HasAssignment(Expression *expr)
+	{
+		switch (expr->GetType()) {
+		case ASSIGN_EXPRESSION:
+			return true;
+		case ADD_EXPRESSION:
+		case SUB_EXPRESSION:
+		case MUL_EXPRESSION:
+		case DIV_EXPRESSION:
+		case MOD_EXPRESSION:
+		case EQ_EXPRESSION:
+		case NE_EXPRESSION:
+		case GT_EXPRESSION:
+		case GE_EXPRESSION:
+		case LT_EXPRESSION:
+		case LE_EXPRESSION:
+		case LOGICAL_AND_EXPRESSION:
+		case LOGICAL_OR_EXPRESSION:
+		case INDEX_EXPRESSION:
+			return HasAssignment((Expression *)expr->GetValue(0)) || HasAssignment((Expression *)expr->GetValue(1));
+		case MINUS_EXPRESSION:
+		case EXCLAMATION_EXPRESSION:
+		case MEMBER_EXPRESSION:
+			return HasAssignment((Expression *)expr->GetValue(0));
+		case FUNCTION_CALL_EXPRESSION:
+		case ARRAY_EXPRESSION:
+		case DICT_EXPRESSION:
+		case RECORD_EXPRESSION: {
+			ArgumentList *arg_list = (ArgumentList *)expr->GetValue(expr->GetType() == FUNCTION_CALL_EXPRESSION ? 1 : 0);
+			if (arg_list != NULL) {
+				for (ArgumentList::iterator it = arg_list->begin(); it != arg_list->end(); ++it) {
+					if (HasAssignment(*it)) {
+						return true;
+					}
+				}
+			}
+			return false;
+		}
+		default:
+			return false;
+		}
+	}
+
+	int LJ_Compiler::AllocRegister()
+	{
+		int r = free_register_++;
+		if (free_register_ > proto_->register_count_) {
+			proto_->register_count_ = free_register_;
+		}
+		return r;
+	}
+
+	int LJ_Compiler::FindLocal(Expression *expr)
+	{
+		IdentifierExpression *identifier = static_cast<IdentifierExpression *>(expr);
+
+		if (identifier->GetSlotType() != LOCAL_SLOT) {
+			return -1;
+		}
+		return identifier->GetSlotIndex();
+	}
+
+	int LJ_Compiler::AddConstant(const Value &v)
+	{
+		proto_->constants_.push_back(v);
+		return (int)proto_->constants_.size() - 1;
+	}
+
+	int LJ_Compiler::AddCallee(FunctionDefinition *func)
+	{
+		std::map<FunctionDefinition *, int>::iterator it = callee_map_.find(func);
+		if (it != callee_map_.end()) {
+			return it->second;
+		}
+
+		std::map<FunctionDefinition *, FunctionProto *>::iterator f = function_map_.find(func);
+		proto_->callees_.push_back(f != function_map_.end() ? f->second : NULL);
+		int index = (int)proto_->callees_.size() - 1;
+		callee_map_[func] = index;
+		return index;
+	}
+
+	size_t LJ_Compiler::Emit(OpCode op, int a, int b, int c, const location &l)
+	{
+		Instruction i;
+		i.op_ = (unsigned char)op;
+		i.ext_ = 0;
+		i.a_ = (unsigned short)a;
+		i.b_ = (unsigned short)b;
+		i.c_ = (unsigned short)c;
+		proto_->code_.push_back(i);
+		proto_->locations_.push_back(l);
+		return proto_->code_.size() - 1;
+	}
+
+	size_t LJ_Compiler::EmitBx(OpCode op, int a, int bx, const location &l)
+	{
+		Instruction i;
+		i.op_ = (unsigned char)op;
+		i.ext_ = 0;
+		i.a_ = (unsigned short)a;
+		i.bx_ = bx;
+		proto_->code_.push_back(i);
+		proto_->locations_.push_back(l);
+		return proto_->code_.size() - 1;
+	}
+
+	size_t LJ_Compiler::EmitJump(OpCode op, int a, int c, const location &l)
+	{
+		size_t pc = EmitBx(op, a, 0, l);
+		proto_->code_[pc].ext_ = (unsigned char)c;
+		return pc;
+	}
+
+	void LJ_Compiler::PatchJump(size_t jump, size_t target)
+	{
+		proto_->code_[jump].bx_ = (int)target - (int)jump - 1;
+	}
+
+	void LJ_Compiler::PatchJumps(std::vector<size_t> &jumps, size_t target)
+	{
+		for (std::vector<size_t>::iterator it = jumps.begin(); it != jumps.end(); ++it) {
+			PatchJump(*it, target);
+		}
+	}
+
+	int LJ_Compiler::ExpressionToAnyRegister(Expression *expr)
+	{
+		if (expr->GetType() == IDENTIFIER_EXPRESSION) {
+			int r = FindLocal(expr);
+			if (r >= 0) {
+				return r;
+			}
+		}
+
+		int r = AllocRegister();
+		ExpressionToRegister(expr, r);
+		return r;
+	}
+
+	void LJ_Compiler::ExpressionToRegister(Expression *expr, int dest)
+	{
+		switch (expr->GetType()) {
+		case BOOLEAN_EXPRESSION:
+			Emit(OP_LOADBOOL, dest, *(boolean *)expr->GetValue(0), 0, expr->GetLocation());
+			break;
+		case INT_EXPRESSION:
+			EmitBx(OP_LOADK, dest, AddConstant(IntValue(*(__int64 *)expr->GetValue(0))), expr->GetLocation());
+			break;
+		case DOUBLE_EXPRESSION:
+			EmitBx(OP_LOADK, dest, AddConstant(DoubleValue(*(double *)expr->GetValue(0))), expr->GetLocation());
+			break;
+		case STRING_EXPRESSION:
+			EmitBx(OP_LOADK, dest, AddConstant(NewStringValue(driver_->gc_, *(std::string *)expr->GetValue(0))), expr->GetLocation());
+			break;
+		case IDENTIFIER_EXPRESSION: {
+			int r = FindLocal(expr);
+			if (r >= 0) {
+				if (r != dest) {
+					Emit(OP_MOVE, dest, r, 0, expr->GetLocation());
+				}
+			}
+			else {
+				EmitBx(OP_GETGLOBAL, dest, static_cast<IdentifierExpression *>(expr)->GetSlotIndex(), expr->GetLocation());
+			}
+			break;
+		}
+		case ASSIGN_EXPRESSION:
+			CompileAssignExpression(expr, dest);
+			break;
+		case ADD_EXPRESSION:
+			CompileBinaryExpression(OP_ADD, expr, dest);
+			break;
+		case SUB_EXPRESSION:
+			CompileBinaryExpression(OP_SUB, expr, dest);
+			break;
+		case MUL_EXPRESSION:
+			CompileBinaryExpression(OP_MUL, expr, dest);
+			break;
+		case DIV_EXPRESSION:
+			CompileBinaryExpression(OP_DIV, expr, dest);
+			break;
+		case MOD_EXPRESSION:
+			CompileBinaryExpression(OP_MOD, expr, dest);
+			break;
+		case EQ_EXPRESSION:
+			CompileBinaryExpression(OP_EQ, expr, dest);
+			break;
+		case NE_EXPRESSION:
+			CompileBinaryExpression(OP_NE, expr, dest);
+			break;
+		case GT_EXPRESSION:
+			CompileBinaryExpression(OP_GT, expr, dest);
+			break;
+		case GE_EXPRESSION:
+			CompileBinaryExpression(OP_GE, expr, dest);
+			break;
+		case LT_EXPRESSION:
+			CompileBinaryExpression(OP_LT, expr, dest);
+			break;
+		case LE_EXPRESSION:
+			CompileBinaryExpression(OP_LE, expr, dest);
+			break;
+		case LOGICAL_AND_EXPRESSION:
+		case LOGICAL_OR_EXPRESSION:
+			CompileLogicalAndOrExpression(expr, dest);
+			break;
+		case MINUS_EXPRESSION:
+		case EXCLAMATION_EXPRESSION: {
+			// The engines report a bad operand at the operand.
+			Expression *operand = (Expression *)expr->GetValue(0);
+			int saved = free_register_;
+			int r = ExpressionToAnyRegister(operand);
+			Emit(expr->GetType() == MINUS_EXPRESSION ? OP_MINUS : OP_NOT, dest, r, 0, operand->GetLocation());
+			free_register_ = saved;
+			break;
+		}
+		case FUNCTION_CALL_EXPRESSION:
+			CompileFunctionCallExpression(expr, dest, OP_CALL);
+			break;
+		case TRUE_EXPRESSION:
+			Emit(OP_LOADBOOL, dest, 1, 0, expr->GetLocation());
+			break;
+		case FALSE_EXPRESSION:
+			Emit(OP_LOADBOOL, dest, 0, 0, expr->GetLocation());
+			break;
+		case NULL_EXPRESSION:
+			Emit(OP_LOADNULL, dest, 0, 0, expr->GetLocation());
+			break;
+		case INDEX_EXPRESSION:
+			CompileIndexExpression(expr, dest);
+			break;
+		case ARRAY_EXPRESSION:
+		case DICT_EXPRESSION:
+		case RECORD_EXPRESSION:
+			CompileArrayExpression(expr, dest);
+			break;
+		case MEMBER_EXPRESSION:
+			CompileMemberExpression(expr, dest);
+			break;
+		default:
+			LJ_TRAP();
+		}
+	}
+
+	void LJ_Compiler::CompileAssignExpression(Expression *expr, int dest)
+	{
+		Expression *left = (Expression *)expr->GetValue(0);
+		Expression *right = (Expression *)expr->GetValue(1);
+
+		if (left->GetType() == INDEX_EXPRESSION) {
+			CompileSetIndexExpression(expr, dest);
+			return;
+		}
+		if (left->GetType() == MEMBER_EXPRESSION) {
+			CompileSetFieldExpression(expr, dest);
+			return;
+		}
+
+		if (left->GetType() != IDENTIFIER_EXPRESSION) {
+			driver_->Error(left->GetLocation(), "GetLValue error");
+		}
+
+		int r = FindLocal(left);
+		if (r >= 0) {
+			ExpressionToRegister(right, r);
+			if (dest >= 0 && dest != r) {
+				Emit(OP_MOVE, dest, r, 0, expr->GetLocation());
+			}
+		}
+		else {
+			int saved = free_register_;
+			int src = dest >= 0 ? dest : AllocRegister();
+			ExpressionToRegister(right, src);
+			EmitBx(OP_SETGLOBAL, src, static_cast<IdentifierExpression *>(left)->GetSlotIndex(), expr->GetLocation());
+			free_register_ = saved;
+		}
+	}
+
+	//
+	// The value is evaluated before the array and the index, like in the
+	// tree walker, and copied out when they may reassign the local it is in.
+	//
+	void LJ_Compiler::CompileSetIndexExpression(Expression *expr, int dest)
+	{
+		Expression *left = (Expression *)expr->GetValue(0);
+		Expression *right = (Expression *)expr->GetValue(1);
+		Expression *array = (Expression *)left->GetValue(0);
+		Expression *index = (Expression *)left->GetValue(1);
+		int saved = free_register_;
+		int src, a;
+
+		if (HasAssignment(left)) {
+			src = AllocRegister();
+			ExpressionToRegister(right, src);
+		}
+		else {
+			src = ExpressionToAnyRegister(right);
+		}
+		if (HasAssignment(index)) {
+			a = AllocRegister();
+			ExpressionToRegister(array, a);
+		}
+		else {
+			a = ExpressionToAnyRegister(array);
+		}
+		int i = ExpressionToAnyRegister(index);
+
+		Emit(OP_SETINDEX, a, i, src, left->GetLocation());
+		if (dest >= 0 && dest != src) {
+			Emit(OP_MOVE, dest, src, 0, expr->GetLocation());
+		}
+		free_register_ = saved;
+	}
+
+	// Ordered like CompileSetIndexExpression, the record takes the array's place.
+	void LJ_Compiler::CompileSetFieldExpression(Expression *expr, int dest)
+	{
+		Expression *left = (Expression *)expr->GetValue(0);
+		Expression *right = (Expression *)expr->GetValue(1);
+		int saved = free_register_;
+		int src;
+
+		if (HasAssignment(left)) {
+			src = AllocRegister();
+			ExpressionToRegister(right, src);
+		}
+		else {
+			src = ExpressionToAnyRegister(right);
+		}
+		int r = ExpressionToAnyRegister((Expression *)left->GetValue(0));
+
+		proto_->members_.push_back(static_cast<MemberExpression *>(left));
+		Emit(OP_SETFIELD, r, (int)proto_->members_.size() - 1, src, left->GetLocation());
+		if (dest >= 0 && dest != src) {
+			Emit(OP_MOVE, dest, src, 0, expr->GetLocation());
+		}
+		free_register_ = saved;
+	}
+
+	void LJ_Compiler::CompileMemberExpression(Expression *expr, int dest)
+	{
+		int saved = free_register_;
+		int r = ExpressionToAnyRegister((Expression *)expr->GetValue(0));
+
+		proto_->members_.push_back(static_cast<MemberExpression *>(expr));
+		Emit(OP_GETFIELD, dest, r, (int)proto_->members_.size() - 1, expr->GetLocation());
+		free_register_ = saved;
+	}
+
+	void LJ_Compiler::CompileIndexExpression(Expression *expr, int dest)
+	{
+		Expression *array = (Expression *)expr->GetValue(0);
+		Expression *index = (Expression *)expr->GetValue(1);
+		int saved = free_register_;
+		int a;
+
+		if (HasAssignment(index)) {
+			a = AllocRegister();
+			ExpressionToRegister(array, a);
+		}
+		else {
+			a = ExpressionToAnyRegister(array);
+		}
+		int i = ExpressionToAnyRegister(index);
+
+		Emit(OP_GETINDEX, dest, a, i, expr->GetLocation());
+		free_register_ = saved;
+	}
+
+	//
+	// Also compiles dict literals, their keys and values take consecutive
+	// registers like array elements and B counts the pairs, and record
+	// literals, whose field values do the same.
+	//
+	void LJ_Compiler::CompileArrayExpression(Expression *expr, int dest)
+	{
+		ArgumentList *elements = (ArgumentList *)expr->GetValue(0);
+		int saved = free_register_;
+		int base = dest >= local_register_count_ && dest == free_register_ - 1 ? dest : AllocRegister();
+		int count = 0;
+
+		for (ArgumentList::iterator it = elements->begin(); it != elements->end(); ++it) {
+			int r = count == 0 ? base : AllocRegister();
+			ExpressionToRegister(*it, r);
+			count++;
+		}
+
+		if (expr->GetType() == DICT_EXPRESSION) {
+			Emit(OP_NEWDICT, base, count / 2, 0, expr->GetLocation());
+		}
+		else if (expr->GetType() == RECORD_EXPRESSION) {
+			proto_->records_.push_back(static_cast<RecordExpression *>(expr));
+			Emit(OP_NEWRECORD, base, (int)proto_->records_.size() - 1, 0, expr->GetLocation());
+		}
+		else {
+			Emit(OP_NEWARRAY, base, count, 0, expr->GetLocation());
+		}
+		if (dest != base) {
+			Emit(OP_MOVE, dest, base, 0, expr->GetLocation());
+		}
+		free_register_ = saved;
+	}
+
+	void LJ_Compiler::CompileBinaryExpression(OpCode op, Expression *expr, int dest)
+	{
+		Expression *left = (Expression *)expr->GetValue(0);
+		Expression *right = (Expression *)expr->GetValue(1);
+		int saved = free_register_;
+		int l;
+
+		// The right operand may reassign a local used on the left, so the
+		// left value is copied out first, as the tree walker would have it
+		// on its value stack already.
+		if (HasAssignment(right)) {
+			l = AllocRegister();
+			ExpressionToRegister(left, l);
+		}
+		else {
+			l = ExpressionToAnyRegister(left);
+		}
+		int r = ExpressionToAnyRegister(right);
+
+		Emit(op, dest, l, r, left->GetLocation());
+		free_register_ = saved;
+	}
+
+	void LJ_Compiler::CompileLogicalAndOrExpression(Expression *expr, int dest)
+	{
+		Expression *left = (Expression *)expr->GetValue(0);
+		Expression *right = (Expression *)expr->GetValue(1);
+		int saved = free_register_;
+		int t = dest < local_register_count_ ? AllocRegister() : dest;
+
+		ExpressionToRegister(left, t);
+		size_t jump = EmitJump(expr->GetType() == LOGICAL_AND_EXPRESSION ? OP_JMPFALSE : OP_JMPTRUE,
+			t, LOGICAL_CONDITION_ERROR, left->GetLocation());
+		ExpressionToRegister(right, t);
+		size_t test = Emit(OP_TESTBOOL, t, 0, 0, right->GetLocation());
+		proto_->code_[test].ext_ = LOGICAL_CONDITION_ERROR;
+		PatchJump(jump, CurrentPc());
+
+		if (t != dest) {
+			Emit(OP_MOVE, dest, t, 0, expr->GetLocation());
+		}
+		free_register_ = saved;
+	}
+
+	void LJ_Compiler::CompileFunctionCallExpression(Expression *expr, int dest, OpCode op)
+	{
+		ArgumentList *arg_list = (ArgumentList *)expr->GetValue(1);
+		int saved = free_register_;
+		int base = dest >= local_register_count_ && dest == free_register_ - 1 ? dest : AllocRegister();
+		int arg_count = 0;
+
+		if (arg_list != NULL) {
+			for (ArgumentList::iterator it = arg_list->begin(); it != arg_list->end(); ++it) {
+				int r = arg_count == 0 ? base : AllocRegister();
+				ExpressionToRegister(*it, r);
+				arg_count++;
+			}
+		}
+
+		Emit(op, base, arg_count, AddCallee(static_cast<BinaryExpression<FUNCTION_CALL_EXPRESSION> *>(expr)->GetFunction()), expr->GetLocation());
+		if (dest >= 0 && dest != base) {
+			Emit(OP_MOVE, dest, base, 0, expr->GetLocation());
+		}
+		free_register_ = saved;
+	}
+
+	void LJ_Compiler::CompileCondition(Expression *expr, const location &l, ConditionErrorType error, std::vector<size_t> &false_jumps)
+	{
+		int saved = free_register_;
+		int r = ExpressionToAnyRegister(expr);
+		false_jumps.push_back(EmitJump(OP_JMPFALSE, r, error, l));
+		free_register_ = saved;
+	}
+
+	void LJ_Compiler::CompileIfStatement(Statement *statement)
+	{
+		std::vector<size_t> end_jumps;
+		std::vector<size_t> false_jumps;
+
+		CompileCondition((Expression *)statement->GetValue(0), statement->GetLocation(), IF_CONDITION_ERROR, false_jumps);
+		CompileStatementList((StatementList *)((Block *)statement->GetValue(1))->GetValue(0));
+
+		ElseifList *elseif_list = (ElseifList *)statement->GetValue(2);
+		if (elseif_list != NULL) {
+			for (ElseifList::iterator it = elseif_list->begin(); it != elseif_list->end(); ++it) {
+				end_jumps.push_back(EmitJump(OP_JMP, 0, 0, statement->GetLocation()));
+				PatchJumps(false_jumps, CurrentPc());
+				false_jumps.clear();
+
+				CompileCondition((Expression *)(*it)->GetValue(0), (*it)->GetLocation(), ELSEIF_CONDITION_ERROR, false_jumps);
+				CompileStatementList((StatementList *)((Block *)(*it)->GetValue(1))->GetValue(0));
+			}
+		}
+
+		if (statement->GetValue(3) != NULL) {
+			end_jumps.push_back(EmitJump(OP_JMP, 0, 0, statement->GetLocation()));
+			PatchJumps(false_jumps, CurrentPc());
+			false_jumps.clear();
+
+			CompileStatementList((StatementList *)((Block *)statement->GetValue(3))->GetValue(0));
+		}
+
+		PatchJumps(false_jumps, CurrentPc());
+		PatchJumps(end_jumps, CurrentPc());
+	}
+
+	void LJ_Compiler::CompileWhileStatement(Statement *statement)
+	{
+		std::vector<size_t> false_jumps;
+		size_t top = CurrentPc();
+
+		CompileCondition((Expression *)statement->GetValue(0), statement->GetLocation(), WHILE_CONDITION_ERROR, false_jumps);
+
+		loop_stack_.push_back(LoopState());
+		CompileStatementList((StatementList *)((Block *)statement->GetValue(1))->GetValue(0));
+		PatchJump(EmitJump(OP_JMP, 0, 0, statement->GetLocation()), top);
+
+		PatchJumps(loop_stack_.back().continue_jumps_, top);
+		PatchJumps(loop_stack_.back().break_jumps_, CurrentPc());
+		loop_stack_.pop_back();
+
+		PatchJumps(false_jumps, CurrentPc());
+	}
+
+	void LJ_Compiler::CompileForStatement(Statement *statement)
+	{
+		std::vector<size_t> false_jumps;
+		int saved = free_register_;
+
+		if (statement->GetValue(0) != NULL) {
+			ExpressionToRegister((Expression *)statement->GetValue(0), AllocRegister());
+			free_register_ = saved;
+		}
+
+		size_t top = CurrentPc();
+		if (statement->GetValue(1) != NULL) {
+			CompileCondition((Expression *)statement->GetValue(1), statement->GetLocation(), FOR_CONDITION_ERROR, false_jumps);
+		}
+
+		loop_stack_.push_back(LoopState());
+		CompileStatementList((StatementList *)((Block *)statement->GetValue(3))->GetValue(0));
+
+		PatchJumps(loop_stack_.back().continue_jumps_, CurrentPc());
+		if (statement->GetValue(2) != NULL) {
+			ExpressionToRegister((Expression *)statement->GetValue(2), AllocRegister());
+			free_register_ = saved;
+		}
+		PatchJump(EmitJump(OP_JMP, 0, 0, statement->GetLocation()), top);
+
+		PatchJumps(loop_stack_.back().break_jumps_, CurrentPc());
+		loop_stack_.pop_back();
+
+		PatchJumps(false_jumps, CurrentPc());
+	}
+
+	//
+	// The bounds live in two registers above the locals. The counter is the
+	// from register, the loop variable gets a copy of it every round.
+	//
+	void LJ_Compiler::CompileForeachStatement(Statement *statement)
+	{
+		ForeachStatement *foreach = static_cast<ForeachStatement *>(statement);
+		Expression *var = (Expression *)statement->GetValue(0);
+		location l = statement->GetLocation();
+		int saved = free_register_;
+
+		if (foreach->IteratesGenerator()) {
+			CompileGeneratorForeach(statement);
+			return;
+		}
+
+		int from = AllocRegister();
+		int to = AllocRegister();
+
+		ExpressionToRegister((Expression *)statement->GetValue(1), from);
+		ExpressionToRegister((Expression *)statement->GetValue(2), to);
+		Emit(OP_FORPREP, from, to, 0, l);
+
+		if (foreach->IsParallel()) {
+			proto_->parallel_loops_.push_back(foreach);
+			Emit(OP_PARALLEL, from, (int)proto_->parallel_loops_.size() - 1, 0, l);
+			free_register_ = saved;
+			return;
+		}
+
+		int one = AllocRegister();
+		int condition = AllocRegister();
+		EmitBx(OP_LOADK, one, AddConstant(IntValue(1)), l);
+
+		size_t top = CurrentPc();
+		Emit(OP_LT, condition, from, to, l);
+		size_t exit = EmitJump(OP_JMPFALSE, condition, FOR_CONDITION_ERROR, l);
+
+		int local = FindLocal(var);
+		if (local >= 0) {
+			Emit(OP_MOVE, local, from, 0, l);
+		}
+		else {
+			EmitBx(OP_SETGLOBAL, from, static_cast<IdentifierExpression *>(var)->GetSlotIndex(), l);
+		}
+
+		loop_stack_.push_back(LoopState());
+		CompileStatementList((StatementList *)((Block *)statement->GetValue(3))->GetValue(0));
+
+		PatchJumps(loop_stack_.back().continue_jumps_, CurrentPc());
+		Emit(OP_ADD, from, from, one, l);
+		PatchJump(EmitJump(OP_JMP, 0, 0, l), top);
+
+		PatchJumps(loop_stack_.back().break_jumps_, CurrentPc());
+		loop_stack_.pop_back();
+
+		PatchJump(exit, CurrentPc());
+		free_register_ = saved;
+	}
+
+	//
+	// The generator stays in a register above the locals, OP_NEXT puts the
+	// value it yields and whether there was one in the two above it.
+	//
+	void LJ_Compiler::CompileGeneratorForeach(Statement *statement)
+	{
+		Expression *var = (Expression *)statement->GetValue(0);
+		location l = statement->GetLocation();
+		int saved = free_register_;
+		int generator = AllocRegister();
+		int value = AllocRegister();
+		int more = AllocRegister();
+
+		ExpressionToRegister((Expression *)statement->GetValue(1), generator);
+
+		size_t top = CurrentPc();
+		Emit(OP_NEXT, value, generator, 0, l);
+		size_t exit = EmitJump(OP_JMPFALSE, more, FOR_CONDITION_ERROR, l);
+
+		int local = FindLocal(var);
+		if (local >= 0) {
+			Emit(OP_MOVE, local, value, 0, l);
+		}
+		else {
+			EmitBx(OP_SETGLOBAL, value, static_cast<IdentifierExpression *>(var)->GetSlotIndex(), l);
+		}
+
+		loop_stack_.push_back(LoopState());
+		CompileStatementList((StatementList *)((Block *)statement->GetValue(3))->GetValue(0));
+
+		PatchJumps(loop_stack_.back().continue_jumps_, top);
+		PatchJump(EmitJump(OP_JMP, 0, 0, l), top);
+
+		PatchJumps(loop_stack_.back().break_jumps_, CurrentPc());
+		loop_stack_.pop_back();
+
+		PatchJump(exit, CurrentPc());
+		free_register_ = saved;
+	}
+
+	void LJ_Compiler::CompileReturnStatement(Statement *statement)
+	{
+		Expression *expr = (Expression *)statement->GetValue(0);
+		int saved = free_register_;
+
+		// A call to a script function in tail position reuses the frame.
+		if (expr != NULL && expr->GetType() == FUNCTION_CALL_EXPRESSION && proto_->definition_ != NULL) {
+			FunctionDefinition *func = static_cast<BinaryExpression<FUNCTION_CALL_EXPRESSION> *>(expr)->GetFunction();
+			if (func != NULL && func->GetType() == FUNCTION_DEFINITION && !func->IsGenerator()) {
+				CompileFunctionCallExpression(expr, AllocRegister(), OP_TAILCALL);
+				free_register_ = saved;
+				return;
+			}
+		}
+
+		if (expr != NULL) {
+			Emit(OP_RETURN, ExpressionToAnyRegister(expr), 0, 0, statement->GetLocation());
+		}
+		else {
+			Emit(OP_RETURNNULL, 0, 0, 0, statement->GetLocation());
+		}
+		free_register_ = saved;
+	}
+
+	void LJ_Compiler::CompileBreakStatement(Statement *statement)
+	{
+		// Outside of a loop the tree walker leaves the enclosing function.
+		if (loop_stack_.size() == 0) {
+			Emit(OP_RETURNNULL, 0, 0, 0, statement->GetLocation());
+			return;
+		}
+
+		loop_stack_.back().break_jumps_.push_back(EmitJump(OP_JMP, 0, 0, statement->GetLocation()));
+	}
+
+	void LJ_Compiler::CompileContinueStatement(Statement *statement)
+	{
+		if (loop_stack_.size() == 0) {
+			Emit(OP_RETURNNULL, 0, 0, 0, statement->GetLocation());
+			return;
+		}
+
+		loop_stack_.back().continue_jumps_.push_back(EmitJump(OP_JMP, 0, 0, statement->GetLocation()));
+	}
+
+	void LJ_Compiler::CompileStatement(Statement *statement)
+	{
+		int saved = free_register_;
+
+		switch (statement->GetType()) {
+		case EXPRESSION_STATEMENT: {
+			Expression *expr = (Expression *)statement->GetValue(0);
+			if (expr->GetType() == ASSIGN_EXPRESSION) {
+				CompileAssignExpression(expr, -1);
+			}
+			else if (expr->GetType() == FUNCTION_CALL_EXPRESSION) {
+				CompileFunctionCallExpression(expr, -1, OP_CALL);
+			}
+			else {
+				ExpressionToRegister(expr, AllocRegister());
+			}
+			break;
+		}
+		case GLOBAL_STATEMENT:
+			break;
+		case IF_STATEMENT:
+			CompileIfStatement(statement);
+			break;
+		case WHILE_STATEMENT:
+			CompileWhileStatement(statement);
+			break;
+		case FOR_STATEMENT:
+			CompileForStatement(statement);
+			break;
+		case FOREACH_STATEMENT:
+			CompileForeachStatement(statement);
+			break;
+		case RETURN_STATEMENT:
+			CompileReturnStatement(statement);
+			break;
+		case BREAK_STATEMENT:
+			CompileBreakStatement(statement);
+			break;
+		case CONTINUE_STATEMENT:
+			CompileContinueStatement(statement);
+			break;
+		default:
+			LJ_TRAP();
+		}
+
+		free_register_ = saved;
+	}
+
+	void LJ_Compiler::CompileStatementList(StatementList *list)
+	{
+		if (list == NULL) {
+			return;
+		}
+
+		for (StatementList::iterator it = list->begin(); it != list->end(); ++it) {
+			CompileStatement(*it);
+		}
+	}
+}
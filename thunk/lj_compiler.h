@@ -0,0 +1,87 @@
+#ifndef __LJ_COMPILER_H__
+#define __LJ_COMPILER_H__
+
+#include <map>
+#include <string>
+#include <vector>
+#include "lj_ast.h"
+#include "lj_bytecode.h"
+
+namespace LJ {
+
+	class LJ_Driver;
+
+	//
+	// Translates the parsed StatementList and FunctionDefinitions of a driver
+	// into FunctionProtos for LJ_VM. The frame slots given out by LJ_Resolver
+	// are the fixed local registers of a function, expression temporaries are
+	// allocated above them in stack order.
+	//
+	class LJ_Compiler {
+	public:
+		LJ_Compiler(LJ_Driver *driver);
+		~LJ_Compiler();
+
+		FunctionProto *Compile(std::vector<FunctionProto *> &protos);
+
+	private:
+		struct LoopState {
+			std::vector<size_t> break_jumps_;
+			std::vector<size_t> continue_jumps_;
+		};
+
+		void CompileFunction(FunctionDefinition *func, FunctionProto *proto);
+		void CompileMain(StatementList *list, FunctionProto *proto);
+		void BeginProto(FunctionProto *proto);
+		void EndProto();
+
+		bool HasAssignment(Expression *expr);
+
+		int AllocRegister();
+		int FindLocal(Expression *expr);
+		int AddConstant(const Value &v);
+		int AddCallee(FunctionDefinition *func);
+
+		size_t Emit(OpCode op, int a, int b, int c, const location &l);
+		size_t EmitBx(OpCode op, int a, int bx, const location &l);
+		size_t EmitJump(OpCode op, int a, int c, const location &l);
+		void PatchJump(size_t jump, size_t target);
+		void PatchJumps(std::vector<size_t> &jumps, size_t target);
+		size_t CurrentPc() { return proto_->code_.size(); }
+
+		int ExpressionToAnyRegister(Expression *expr);
+		void ExpressionToRegister(Expression *expr, int dest);
+		void CompileAssignExpression(Expression *expr, int dest);
+		void CompileSetIndexExpression(Expression *expr, int dest);
+		void CompileIndexExpression(Expression *expr, int dest);
+		void CompileArrayExpression(Expression *expr, int dest);
+		void CompileSetFieldExpression(Expression *expr, int dest);
+		void CompileMemberExpression(Expression *expr, int dest);
+		void CompileBinaryExpression(OpCode op, Expression *expr, int dest);
+		void CompileLogicalAndOrExpression(Expression *expr, int dest);
+		void CompileFunctionCallExpression(Expression *expr, int dest, OpCode op);
+		void CompileCondition(Expression *expr, const location &l, ConditionErrorType error, std::vector<size_t> &false_jumps);
+
+		void CompileStatement(Statement *statement);
+		void CompileStatementList(StatementList *list);
+		void CompileIfStatement(Statement *statement);
+		void CompileWhileStatement(Statement *statement);
+		void CompileForStatement(Statement *statement);
+		void CompileForeachStatement(Statement *statement);
+		void CompileGeneratorForeach(Statement *statement);
+		void CompileReturnStatement(Statement *statement);
+		void CompileBreakStatement(Statement *statement);
+		void CompileContinueStatement(Statement *statement);
+
+		LJ_Driver *driver_;
+		std::map<FunctionDefinition *, FunctionProto *> function_map_;
+
+		FunctionProto *proto_;
+		int local_register_count_;
+		int free_register_;
+		std::map<FunctionDefinition *, int> callee_map_;
+		std::vector<LoopState> loop_stack_;
+	};
+}
+
+#endif
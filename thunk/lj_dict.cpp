@@ -0,0 +1,172 @@
+#include <utility>
+#include "lj_driver.hpp"
+
+// Slots of the first table, a power of two like every later size.
+#define DICT_MIN_CAPACITY	8
+
+namespace LJ {
+
+	// Finalizer of splitmix64, consecutive ints land far apart.
+	static size_t HashInt(unsigned __int64 x)
+	{
+		x ^= x >> 30;
+		x *= 0xbf58476d1ce4e5b9ULL;
+		x ^= x >> 27;
+		x *= 0x94d049bb133111ebULL;
+		x ^= x >> 31;
+		return (size_t)x;
+	}
+
+	// 64 bit FNV-1a.
+	static size_t HashString(const std::string &s)
+	{
+		unsigned __int64 h = 0xcbf29ce484222325ULL;
+
+		for (size_t i = 0; i < s.size(); i++) {
+			h ^= (unsigned char)s[i];
+			h *= 0x100000001b3ULL;
+		}
+		return (size_t)h;
+	}
+
+	static boolean KeyEquals(const Value &a, const Value &b)
+	{
+		if (a.type_ != b.type_) {
+			return 0;
+		}
+		if (a.type_ == INT_VALUE) {
+			return TO_INT_VALUE(a) == TO_INT_VALUE(b);
+		}
+		return a.string_value_ == b.string_value_ || TO_STRING_VALUE(a) == TO_STRING_VALUE(b);
+	}
+
+	size_t DictObject::Hash(const Value &key)
+	{
+		size_t hash;
+
+		if (key.type_ == INT_VALUE) {
+			hash = HashInt((unsigned __int64)TO_INT_VALUE(key));
+		}
+		else {
+			StringObject *s = key.string_value_;
+			if (s->hash_ == 0) {
+				hash = HashString(s->value_);
+				s->hash_ = hash != 0 ? hash : 1;
+			}
+			return s->hash_;
+		}
+		return hash != 0 ? hash : 1;
+	}
+
+	//
+	// The slot of key, or entries_.size() when it is not in the table. The
+	// probe stops at an empty slot or at an entry nearer its home slot than
+	// key would be at this point, key would have taken that slot.
+	//
+	size_t DictObject::Lookup(const Value &key, size_t hash) const
+	{
+		size_t mask = entries_.size() - 1;
+
+		if (count_ == 0) {
+			return entries_.size();
+		}
+
+		for (size_t i = hash & mask, distance = 0;; i = (i + 1) & mask, distance++) {
+			const DictEntry &e = entries_[i];
+			if (e.hash_ == 0 || ((i - e.hash_) & mask) < distance) {
+				return entries_.size();
+			}
+			if (e.hash_ == hash && KeyEquals(e.key_, key)) {
+				return i;
+			}
+		}
+	}
+
+	Value *DictObject::Find(const Value &key)
+	{
+		size_t i = Lookup(key, Hash(key));
+		return i != entries_.size() ? &entries_[i].value_ : NULL;
+	}
+
+	void DictObject::Set(const Value &key, const Value &value)
+	{
+		size_t hash = Hash(key);
+		size_t i = Lookup(key, hash);
+
+		if (i != entries_.size()) {
+			entries_[i].value_ = value;
+			return;
+		}
+
+		if ((count_ + 1) * 8 > entries_.size() * 7) {
+			Grow();
+		}
+
+		DictEntry entry;
+		entry.hash_ = hash;
+		entry.key_ = key;
+		entry.value_ = value;
+		Insert(entry);
+		count_++;
+	}
+
+	//
+	// Backward shift deletion: the entries after the removed one move back a
+	// slot until one is empty or already in its home slot.
+	//
+	boolean DictObject::Remove(const Value &key)
+	{
+		size_t i = Lookup(key, Hash(key));
+		size_t mask = entries_.size() - 1;
+
+		if (i == entries_.size()) {
+			return 0;
+		}
+
+		for (;;) {
+			size_t next = (i + 1) & mask;
+			const DictEntry &e = entries_[next];
+			if (e.hash_ == 0 || ((next - e.hash_) & mask) == 0) {
+				break;
+			}
+			entries_[i] = e;
+			i = next;
+		}
+		entries_[i] = DictEntry();
+		count_--;
+		return 1;
+	}
+
+	// There is a free slot, the caller made sure of it.
+	void DictObject::Insert(DictEntry entry)
+	{
+		size_t mask = entries_.size() - 1;
+
+		for (size_t i = entry.hash_ & mask, distance = 0;; i = (i + 1) & mask, distance++) {
+			DictEntry &e = entries_[i];
+			if (e.hash_ == 0) {
+				e = entry;
+				return;
+			}
+
+			size_t e_distance = (i - e.hash_) & mask;
+			if (e_distance < distance) {
+				std::swap(e, entry);
+				distance = e_distance;
+			}
+		}
+	}
+
+	void DictObject::Grow()
+	{
+		std::vector<DictEntry> old;
+
+		old.swap(entries_);
+		entries_.resize(old.empty() ? DICT_MIN_CAPACITY : old.size() * 2, DictEntry());
+		for (std::vector<DictEntry>::iterator it = old.begin(); it != old.end(); ++it) {
+			if (it->hash_ != 0) {
+				Insert(*it);
+			}
+		}
+	}
+}
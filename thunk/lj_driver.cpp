@@ -1,142 +1,457 @@
 #include "lj_driver.hpp"
 #include "lj_parser.hpp"
+#include "lj_native.h"
+#include "lj_resolver.h"
+#include "lj_optimizer.h"
+#include "lj_inference.h"
+#include "lj_parallel.h"
+#include "lj_scheduler.h"
 
 #include <math.h>
+#include <stdint.h>
+#include <algorithm>
+#include <exception>
+#include <sstream>
+#include <thread>
 
 namespace LJ {
 
 	LJ_Driver::LJ_Driver()
-		: trace_scanning_(false), trace_parsing_(false), statement_list_(NULL)
+		: trace_scanning_(false), scanner_(NULL), trace_parsing_(false), trace_optimization_(false),
+		out_(&std::cout), call_depth_limit_(DEFAULT_CALL_DEPTH_LIMIT), stack_base_(NULL),
+		memo_capacity_(DEFAULT_MEMO_CAPACITY), parallel_workers_(0), task_(NULL), safepoint_budget_(0), inline_caches_(1), statement_list_(NULL),
+		value_stack_(VALUE_STACK_INITIAL_SIZE), tail_call_(NULL), stack_armed_(0)
 	{
-
+		frame_stack_.reserve(FRAME_STACK_INITIAL_SIZE);
+		AddNativeFunctions(this);
+		gc_.AddRootSet(this);
 	}
 
 	LJ_Driver::~LJ_Driver()
 	{
+		ScanEnd();
+		gc_.RemoveRootSet(this);
+		DeleteElems(function_list_);
+		for (std::map<FunctionDefinition *, MemoCache *>::iterator it = memo_caches_.begin(); it != memo_caches_.end(); ++it) {
+			delete it->second;
+		}
+	}
+
+	void LJ_Driver::MarkRoots(LJ_GC *gc)
+	{
+		// Function frames are part of the value stack.
+		for (size_t i = 0; i < value_stack_.Size(); i++) {
+			gc->MarkValue(value_stack_[i]);
+		}
+
+		for (std::vector<Value>::iterator it = global_value_.begin(); it != global_value_.end(); ++it) {
+			gc->MarkValue(*it);
+		}
+
+		for (std::map<FunctionDefinition *, MemoCache *>::iterator it = memo_caches_.begin(); it != memo_caches_.end(); ++it) {
+			it->second->Mark(gc);
+		}
+
+		for (std::vector<ResumePoint>::iterator it = resume_points_.begin(); it != resume_points_.end(); ++it) {
+			gc->MarkValue(it->value_);
+		}
 	}
 
 	int LJ_Driver::Parse(const std::string &f)
 	{
 		file_ = f;
 		ScanBegin();
-		Parser parser(*this);
+		Parser parser(*this, scanner_);
 		parser.set_debug_level(trace_parsing_);
 		int res = parser.parse();
 		ScanEnd();
+
+		if (res == 0) {
+			LJ_Resolver resolver(this);
+			resolver.Resolve();
+
+			LJ_Optimizer optimizer(this);
+			if (trace_optimization_) {
+				std::cout << "=== BEFORE OPTIMIZATION ===" << std::endl;
+				optimizer.Dump();
+			}
+			optimizer.Optimize();
+			if (trace_optimization_) {
+				std::cout << "=== AFTER OPTIMIZATION ===" << std::endl;
+				optimizer.Dump();
+			}
+
+			LJ_TypeInference inference(this);
+			inference.Infer();
+			if (trace_optimization_) {
+				std::cout << "=== INFERRED TYPES ===" << std::endl;
+				inference.Dump();
+			}
+		}
 		return res;
 	}
 
 	void LJ_Driver::Error(const location& l, const std::string& m)
 	{
-		std::cerr << l << ": " << m << std::endl;
-		exit(0);
+		std::ostringstream os;
+		os << l << ": " << m;
+		throw LJ_Error(os.str());
 	}
 
 	void LJ_Driver::Error(const std::string& m)
 	{
-		std::cerr << m << std::endl;
-		exit(0);
+		throw LJ_Error(m);
+	}
+
+	int LJ_Driver::ResolveGlobal(const std::string &name)
+	{
+		std::map<std::string, int>::iterator it = global_index_.find(name);
+		if (it != global_index_.end()) {
+			return it->second;
+		}
+
+		int index = (int)global_value_.size();
+		global_value_.push_back(UndefinedValue());
+		global_names_.push_back(name);
+		global_index_[name] = index;
+		return index;
 	}
 
 	void LJ_Driver::AddFunction(FunctionDefinition *f)
 	{
 		function_list_.push_back(f);
-	}
 
+		// The first definition of a name wins.
+		function_table_.insert(std::make_pair(f->GetFunctionName(), f));
+	}
 
+	FunctionDefinition *LJ_Driver::FindFunction(const std::string &name)
+	{
+		std::unordered_map<std::string, FunctionDefinition *>::iterator it = function_table_.find(name);
+		if (it == function_table_.end()) {
+			return NULL;
+		}
+		return it->second;
+	}
 
 	void LJ_Driver::Dump()
 	{
+		if (statement_list_ == NULL) {
+			return;
+		}
+
 		for (auto &i : *statement_list_) {
 			i->Dump(0);
 		}
 	}
 
-	void LJ_Driver::EvalBooleanExpression(boolean boolean_value)
+	void LJ_Driver::Execute()
 	{
-		BooleanValue *v = NEW_BOOLEAN_VALUE();
-		v->value_ = boolean_value;
-		value_stack_.push((ValueBase *)v);
+		char marker;
+
+		stack_base_ = &marker;
+		ExecuteStatementList(statement_list_);
+		stack_base_ = NULL;
 	}
 
-	void LJ_Driver::EvalIntExpression(__int64 int_value)
+	//
+	// A call that returns from the next segment arms the current stack.
+	// Until a call is made in its lower half again, every call in its upper
+	// half moves to the segment, so recursion that keeps crossing the
+	// boundary crosses higher up, where it makes far fewer calls.
+	//
+	boolean LJ_Driver::NativeStackExhausted()
 	{
-		IntValue *v = NEW_INT_VALUE();
-		v->value_ = int_value;
-		value_stack_.push((ValueBase *)v);
+		char marker;
+		size_t used;
+
+		if (stack_base_ == NULL) {
+			return 0;
+		}
+		used = (size_t)(stack_base_ - &marker);
+		if (used > NATIVE_STACK_SEGMENT_SIZE) {
+			return 1;
+		}
+		if (!stack_armed_) {
+			return 0;
+		}
+		if (used > NATIVE_STACK_SEGMENT_SIZE / 2) {
+			return 1;
+		}
+		stack_armed_ = 0;
+		return 0;
 	}
 
-	void LJ_Driver::EvalDoubleExpression(double double_value)
+	//
+	// Runs f on the next stack segment and waits for it, so deep recursion
+	// continues on a fresh native stack instead of overflowing the current
+	// one. Only one thread runs the driver at a time, an error raised by f is
+	// rethrown here.
+	//
+	// The engines keep their call frames on the native stack, so a segment
+	// is another thread's stack rather than a continuation on the heap. The
+	// task's context cannot move to that thread, so task_ is cleared while f
+	// runs: a task deep enough to be on a segment does not yield, and sleep
+	// blocks its worker until the recursion unwinds below the segment.
+	//
+	void LJ_Driver::RunOnFreshStack(const std::function<void()> &f)
 	{
-		DoubleValue *v = NEW_DOUBLE_VALUE();
-		v->value_ = double_value;
-		value_stack_.push((ValueBase *)v);
+		char *saved_base = stack_base_;
+		LJ_Task *saved_task = task_;
+		std::exception_ptr error;
+
+		StackSegment *segment = StackSegment::Take();
+
+		task_ = NULL;
+		segment->Run([&]() {
+			char marker;
+			stack_base_ = &marker;
+			stack_armed_ = 0;
+			try {
+				f();
+			}
+			catch (...) {
+				error = std::current_exception();
+			}
+		});
+
+		StackSegment::Give(segment);
+		stack_base_ = saved_base;
+		stack_armed_ = 1;
+		task_ = saved_task;
+		if (error) {
+			std::rethrow_exception(error);
+		}
 	}
 
-	void LJ_Driver::EvalStringExpression(const std::string &string_value)
+	static struct StackSegmentPool {
+		~StackSegmentPool() { DeleteElems(idle_); }
+
+		std::mutex lock_;
+		std::vector<StackSegment *> idle_;
+	} stack_segment_pool;
+
+	StackSegment * StackSegment::Take()
 	{
-		StringValue *v = NEW_STRING_VALUE();
-		v->value_ = string_value;
-		value_stack_.push((ValueBase *)v);
+		{
+			std::lock_guard<std::mutex> guard(stack_segment_pool.lock_);
+			if (!stack_segment_pool.idle_.empty()) {
+				StackSegment *segment = stack_segment_pool.idle_.back();
+				stack_segment_pool.idle_.pop_back();
+				return segment;
+			}
+		}
+
+		return new StackSegment;
 	}
 
-	void LJ_Driver::EvalNullExpression()
+	void StackSegment::Give(StackSegment *segment)
 	{
-		NullValue *v = NEW_NULL_VALUE();
-		value_stack_.push((ValueBase *)v);
+		{
+			std::lock_guard<std::mutex> guard(stack_segment_pool.lock_);
+			if (stack_segment_pool.idle_.size() < STACK_SEGMENT_POOL_SIZE) {
+				stack_segment_pool.idle_.push_back(segment);
+				return;
+			}
+		}
+
+		delete segment;
 	}
 
-	void LJ_Driver::EvalIdentifierExpression(Expression *expr)
+	StackSegment::StackSegment()
+		: work_(NULL), done_(0), exit_(0), thread_([this]() { Main(); })
+	{
+
+	}
+
+	StackSegment::~StackSegment()
 	{
-		ValueBase *v;
+		{
+			std::lock_guard<std::mutex> guard(lock_);
+			exit_ = 1;
+		}
+		wake_.notify_all();
+		thread_.join();
+	}
 
-		std::map<std::string, ValueBase *>::iterator it;
-		it = local_value_stack_.top().find(*((std::string *)expr->GetValue(0)));
-		if (it != local_value_stack_.top().end()) {
-			v = it->second;
+	void StackSegment::Run(const std::function<void()> &f)
+	{
+		done_ = 0;
+		{
+			std::lock_guard<std::mutex> guard(lock_);
+			work_ = &f;
 		}
-		else {
-			it = global_value_.find(*((std::string *)expr->GetValue(0)));
-			if (it != global_value_.end()) {
-				v = it->second;
+		wake_.notify_all();
+		Wait([this]() { return done_ != 0; });
+	}
+
+	void StackSegment::Main()
+	{
+		for (;;) {
+			Wait([this]() { return work_ != NULL || exit_; });
+
+			const std::function<void()> *work = work_.exchange(NULL);
+			if (work == NULL) {
+				return;
 			}
-			else {
-				Error(expr->GetLocation(), "EvalIdentifierExpression error");
+			(*work)();
+			{
+				std::lock_guard<std::mutex> guard(lock_);
+				done_ = 1;
 			}
+			wake_.notify_all();
 		}
+	}
 
+	template<class P>
+	void StackSegment::Wait(P ready)
+	{
+		for (int i = 0; i < STACK_SEGMENT_SPINS; i++) {
+			if (ready()) {
+				return;
+			}
+			std::this_thread::yield();
+		}
 
-		value_stack_.push(v);
+		std::unique_lock<std::mutex> guard(lock_);
+		wake_.wait(guard, ready);
 	}
 
-	ValueBase ** LJ_Driver::GetIdentifierLValue(const std::string &identifier)
+	void LJ_Driver::YieldTask()
 	{
-		std::map<std::string, ValueBase *>::iterator it;
-		it = local_value_stack_.top().find(identifier);
-		if (it == local_value_stack_.top().end()) {
-			return &it->second;
+		task_->Yield();
+	}
+
+	MemoCache * LJ_Driver::GetMemoCache(FunctionDefinition *func)
+	{
+		MemoCache *&cache = memo_caches_[func];
+
+		if (cache == NULL) {
+			cache = new MemoCache(memo_capacity_);
 		}
-		else {
-			it = global_value_.find(identifier);
-			if (it != global_value_.end()) {
-				return &it->second;
+		return cache;
+	}
+
+	void LJ_Driver::DumpMemoStats(std::ostream &os)
+	{
+		for (std::map<FunctionDefinition *, MemoCache *>::iterator it = memo_caches_.begin(); it != memo_caches_.end(); ++it) {
+			os << "MEMO = [" << it->first->GetFunctionName() << "] hits " << it->second->hits_
+				<< ", misses " << it->second->misses_ << ", evictions " << it->second->evictions_ << std::endl;
+		}
+	}
+
+	void LJ_Driver::DumpShapeStats(std::ostream &os)
+	{
+		os << "SHAPES = [" << shapes_.GetShapeCount() << "] hits " << shape_stats_.hits_
+			<< ", misses " << shape_stats_.misses_ << ", transitions " << shape_stats_.transitions_ << std::endl;
+	}
+
+	Value LJ_Driver::GetFieldMiss(const Value &record, MemberExpression *expr)
+	{
+		shape_stats_.misses_++;
+		if (record.type_ != RECORD_VALUE) {
+			Error(expr->GetLocation(), "EvalMemberExpression error");
+		}
+
+		RecordObject *r = TO_RECORD_VALUE(record);
+		int slot = r->shape_->Find(expr->GetName());
+		if (slot < 0) {
+			Error(expr->GetLocation(), "EvalMemberExpression error");
+		}
+		if (inline_caches_) {
+			expr->GetCache().Add(r->shape_, NULL, (size_t)slot);
+		}
+		return r->slots_[slot];
+	}
+
+	void LJ_Driver::SetFieldMiss(const Value &record, MemberExpression *expr, const Value &v)
+	{
+		shape_stats_.misses_++;
+		if (record.type_ != RECORD_VALUE) {
+			Error(expr->GetLocation(), "EvalMemberExpression error");
+		}
+
+		RecordObject *r = TO_RECORD_VALUE(record);
+		int slot = r->shape_->Find(expr->GetName());
+		if (slot >= 0) {
+			if (inline_caches_) {
+				expr->GetCache().Add(r->shape_, NULL, (size_t)slot);
 			}
+			r->slots_[slot] = v;
+			return;
+		}
+
+		Shape *next = r->shape_->AddField(expr->GetName());
+		if (inline_caches_) {
+			expr->GetCache().Add(r->shape_, next, r->slots_.size());
+		}
+		size_t size = r->GetSize();
+		r->slots_.push_back(v);
+		r->shape_ = next;
+		shape_stats_.transitions_++;
+		if (r->GetSize() != size) {
+			gc_.Resize(r, size);
+		}
+	}
+
+	void LJ_Driver::EvalBooleanExpression(boolean boolean_value)
+	{
+		value_stack_.Push(BooleanValue(boolean_value));
+	}
+
+	void LJ_Driver::EvalIntExpression(__int64 int_value)
+	{
+		value_stack_.Push(IntValue(int_value));
+	}
+
+	void LJ_Driver::EvalDoubleExpression(double double_value)
+	{
+		value_stack_.Push(DoubleValue(double_value));
+	}
+
+	void LJ_Driver::EvalStringExpression(const std::string &string_value)
+	{
+		value_stack_.Push(NEW_STRING_VALUE(string_value));
+	}
+
+	void LJ_Driver::EvalNullExpression()
+	{
+		value_stack_.Push(NullValue());
+	}
+
+	void LJ_Driver::EvalIdentifierExpression(Expression *expr)
+	{
+		IdentifierExpression *identifier = static_cast<IdentifierExpression *>(expr);
+		Value v;
+
+		if (identifier->GetSlotType() == LOCAL_SLOT) {
+			v = value_stack_[frame_stack_.back().base_ + identifier->GetSlotIndex()];
+		}
+		else {
+			v = global_value_[identifier->GetSlotIndex()];
 		}
 
-		std::pair<const std::string, ValueBase *> v(identifier, NULL);
+		if (v.GetType() == UNDEFINED_VALUE) {
+			Error(expr->GetLocation(), "EvalIdentifierExpression error");
+		}
+
+		value_stack_.Push(v);
+	}
 
-		if (local_value_stack_.size() == 0) {
-			return &global_value_.insert(v).first->second;
+	Value * LJ_Driver::GetIdentifierLValue(IdentifierExpression *expr)
+	{
+		if (expr->GetSlotType() == LOCAL_SLOT) {
+			return &value_stack_[frame_stack_.back().base_ + expr->GetSlotIndex()];
 		}
 		else {
-			return &local_value_stack_.top().insert(v).first->second;
+			return &global_value_[expr->GetSlotIndex()];
 		}
 	}
 
-	ValueBase ** LJ_Driver::GetLValue(Expression *expr)
+	Value * LJ_Driver::GetLValue(Expression *expr)
 	{
 		if (expr->GetType() == IDENTIFIER_EXPRESSION) {
-			return GetIdentifierLValue(*((std::string *)expr->GetValue(0)));
+			return GetIdentifierLValue(static_cast<IdentifierExpression *>(expr));
 		}
 		else {
 			Error(expr->GetLocation(), "GetLValue error");
@@ -146,25 +461,104 @@ namespace LJ {
 
 	void LJ_Driver::EvalAssignExpression(Expression *left, Expression *right)
 	{
-		ValueBase *src;
-		ValueBase **dest;
+		Value src;
+		Value *dest;
 
 		EvalExpression(right);
-		src = value_stack_.top();
+		src = value_stack_.Top();
+
+		// A packed element has no Value to point to, it is stored through
+		// its array instead. The value stays on the stack as the result.
+		if (left->GetType() == INDEX_EXPRESSION) {
+			EvalExpression((Expression *)left->GetValue(0));
+			EvalExpression((Expression *)left->GetValue(1));
+			SetElement(value_stack_[value_stack_.Size() - 2], value_stack_.Top(), src, left->GetLocation());
+			value_stack_.Pop(2);
+			return;
+		}
+		if (left->GetType() == MEMBER_EXPRESSION) {
+			EvalExpression((Expression *)left->GetValue(0));
+			SetField(value_stack_.Top(), static_cast<MemberExpression *>(left), src);
+			value_stack_.Pop();
+			return;
+		}
 
 		dest = GetLValue(left);
 		*dest = src;
 	}
 
+	void LJ_Driver::EvalIndexExpression(Expression *expr)
+	{
+		Value v;
+
+		EvalExpression((Expression *)expr->GetValue(0));
+		EvalExpression((Expression *)expr->GetValue(1));
+		v = GetElement(value_stack_[value_stack_.Size() - 2], value_stack_.Top(), expr->GetLocation());
+		value_stack_.Pop(2);
+		value_stack_.Push(v);
+	}
+
+	void LJ_Driver::EvalArrayExpression(Expression *expr)
+	{
+		ArgumentList *elements = static_cast<ArrayExpression *>(expr)->GetElements();
+		size_t count = elements->size();
+		Value v;
+
+		for (ArgumentList::iterator it = elements->begin(); it != elements->end(); ++it) {
+			EvalExpression(*it);
+		}
+		v = NewArrayValue(gc_, count ? &value_stack_[value_stack_.Size() - count] : NULL, count);
+		value_stack_.Pop(count);
+		value_stack_.Push(v);
+	}
 
-	ValueBase* LJ_Driver::EvalBinaryBoolean(ExpressionType op, boolean left, boolean right, const location &l)
+	void LJ_Driver::EvalDictExpression(Expression *expr)
 	{
-		BooleanValue *v = NEW_BOOLEAN_VALUE();
+		ArgumentList *entries = static_cast<DictExpression *>(expr)->GetEntries();
+		size_t count = entries->size();
+		Value v;
+
+		for (ArgumentList::iterator it = entries->begin(); it != entries->end(); ++it) {
+			EvalExpression(*it);
+		}
+		v = NewDict(count ? &value_stack_[value_stack_.Size() - count] : NULL, count / 2, expr->GetLocation());
+		value_stack_.Pop(count);
+		value_stack_.Push(v);
+	}
+
+	void LJ_Driver::EvalMemberExpression(Expression *expr)
+	{
+		Value v;
+
+		EvalExpression((Expression *)expr->GetValue(0));
+		v = GetField(value_stack_.Top(), static_cast<MemberExpression *>(expr));
+		value_stack_.Pop();
+		value_stack_.Push(v);
+	}
+
+	void LJ_Driver::EvalRecordExpression(Expression *expr)
+	{
+		ArgumentList *values = static_cast<RecordExpression *>(expr)->GetValues();
+		size_t count = values->size();
+		Value v;
+
+		for (ArgumentList::iterator it = values->begin(); it != values->end(); ++it) {
+			EvalExpression(*it);
+		}
+		v = NewRecord(static_cast<RecordExpression *>(expr), &value_stack_[value_stack_.Size() - count]);
+		value_stack_.Pop(count);
+		value_stack_.Push(v);
+	}
+
+
+	Value LJ_Driver::EvalBinaryBoolean(ExpressionType op, boolean left, boolean right, const location &l)
+	{
+		Value v;
 
 		if (op == EQ_EXPRESSION) {
-			v->value_ = left == right;
+			v = BooleanValue(left == right);
 		} else if (op == NE_EXPRESSION) {
-			v->value_ = left != right;
+			v = BooleanValue(left != right);
 		} else {
 			Error(l, "EvalBinaryBoolean error");
 		}
@@ -172,22 +566,9 @@ namespace LJ {
 		return v;
 	}
 
-	ValueBase* LJ_Driver::EvalBinaryInt(ExpressionType op, __int64 left, __int64 right, const location &l)
+	Value LJ_Driver::EvalBinaryInt(ExpressionType op, __int64 left, __int64 right, const location &l)
 	{
-		ValueBase *v;
-
-		IntValue *int_value = NULL;
-		BooleanValue *boolean_value = NULL;
-
-		if (IsMathOperator(op)) {
-			int_value = NEW_INT_VALUE();
-			v = int_value;
-		} else if (IsCompareOperator(op)) {
-			boolean_value = NEW_BOOLEAN_VALUE();
-			v = boolean_value;
-		} else {
-			__asm int 3
-		}
+		Value v;
 
 		switch (op) {
 		case BOOLEAN_EXPRESSION:
@@ -196,71 +577,66 @@ namespace LJ {
 		case STRING_EXPRESSION:
 		case IDENTIFIER_EXPRESSION:
 		case ASSIGN_EXPRESSION:
-			__asm int 3
+			LJ_TRAP();
 			break;
 		case ADD_EXPRESSION:
-			int_value->value_ = left + right;
+			v = IntValue(left + right);
 			break;
 		case SUB_EXPRESSION:
-			int_value->value_ = left - right;
+			v = IntValue(left - right);
 			break;
 		case MUL_EXPRESSION:
-			int_value->value_ = left * right;
+			v = IntValue(left * right);
 			break;
+		// A zero divisor and INT64_MIN / -1 would trap, they are errors.
+		// Anything modulo -1 is 0, INT64_MIN % -1 traps too.
 		case DIV_EXPRESSION:
-			int_value->value_ = left / right;
+			if (right == 0 || (right == -1 && left == INT64_MIN)) {
+				Error(l, "EvalBinaryInt error");
+			}
+			v = IntValue(left / right);
 			break;
 		case MOD_EXPRESSION:
-			int_value->value_ = left % right;
+			if (right == 0) {
+				Error(l, "EvalBinaryInt error");
+			}
+			v = IntValue(right == -1 ? 0 : left % right);
 			break;
 		case LOGICAL_AND_EXPRESSION:
 		case LOGICAL_OR_EXPRESSION:
-			__asm int 3
+			LJ_TRAP();
 			break;
 		case EQ_EXPRESSION:
-			boolean_value->value_ = left == right;
+			v = BooleanValue(left == right);
 			break;
 		case NE_EXPRESSION:
-			boolean_value->value_ = left != right;
+			v = BooleanValue(left != right);
 			break;
 		case GT_EXPRESSION:
-			boolean_value->value_ = left > right;
+			v = BooleanValue(left > right);
 			break;
 		case GE_EXPRESSION:
-			boolean_value->value_ = left >= right;
+			v = BooleanValue(left >= right);
 			break;
 		case LT_EXPRESSION:
-			boolean_value->value_ = left < right;
+			v = BooleanValue(left < right);
 			break;
 		case LE_EXPRESSION:
-			boolean_value->value_ = left <= right;
+			v = BooleanValue(left <= right);
 			break;
 		case MINUS_EXPRESSION:
 		case FUNCTION_CALL_EXPRESSION:
 		case NULL_EXPRESSION:
 		default:
-			__asm int 3;
+			LJ_TRAP();
 		}
 
 		return v;
 	}
 
-	ValueBase* LJ_Driver::EvalBinaryDouble(ExpressionType op, double left, double right, const location &l)
+	Value LJ_Driver::EvalBinaryDouble(ExpressionType op, double left, double right, const location &l)
 	{
-		ValueBase *v;
-
-		DoubleValue *double_value = NULL;
-		BooleanValue *boolean_value = NULL;
-
-		if (IsMathOperator(op)) {
-			double_value = NEW_DOUBLE_VALUE();
-			v = double_value;
-		} else if (IsCompareOperator(op)) {
-			boolean_value = NEW_BOOLEAN_VALUE();
-			v = boolean_value;
-		} else {
-			__asm int 3
-		}
+		Value v;
 
 		switch (op) {
 		case BOOLEAN_EXPRESSION:
@@ -269,73 +645,73 @@ namespace LJ {
 		case STRING_EXPRESSION:
 		case IDENTIFIER_EXPRESSION:
 		case ASSIGN_EXPRESSION:
-			__asm int 3;
+			LJ_TRAP();
 			break;
 		case ADD_EXPRESSION:
-			double_value->value_ = left + right;
+			v = DoubleValue(left + right);
 			break;
 		case SUB_EXPRESSION:
-			double_value->value_ = left - right;
+			v = DoubleValue(left - right);
 			break;
 		case MUL_EXPRESSION:
-			double_value->value_ = left * right;
+			v = DoubleValue(left * right);
 			break;
 		case DIV_EXPRESSION:
-			double_value->value_ = left / right;
+			v = DoubleValue(left / right);
 			break;
 		case MOD_EXPRESSION:
-			double_value->value_ = fmod(left, right);
+			v = DoubleValue(fmod(left, right));
 			break;
 		case LOGICAL_AND_EXPRESSION:
 		case LOGICAL_OR_EXPRESSION:
-			__asm int 3;
+			LJ_TRAP();
 			break;
 		case EQ_EXPRESSION:
-			boolean_value->value_ = left == right;
+			v = BooleanValue(left == right);
 			break;
 		case NE_EXPRESSION:
-			boolean_value->value_ = left != right;
+			v = BooleanValue(left != right);
 			break;
 		case GT_EXPRESSION:
-			boolean_value->value_ = left > right;
+			v = BooleanValue(left > right);
 			break;
 		case GE_EXPRESSION:
-			boolean_value->value_ = left >= right;
+			v = BooleanValue(left >= right);
 			break;
 		case LT_EXPRESSION:
-			boolean_value->value_ = left < right;
+			v = BooleanValue(left < right);
 			break;
 		case LE_EXPRESSION:
-			boolean_value->value_ = left <= right;
+			v = BooleanValue(left <= right);
 			break;
 		case MINUS_EXPRESSION:
 		case FUNCTION_CALL_EXPRESSION:
 		case NULL_EXPRESSION:
 
 		default:
-			__asm int 3;
+			LJ_TRAP();
 		}
 
 		return v;
 	}
 
-	ValueBase* LJ_Driver::EvalCompareString(ExpressionType op, std::string &left, std::string &right, const location &l)
+	Value LJ_Driver::EvalCompareString(ExpressionType op, std::string &left, std::string &right, const location &l)
 	{
-		BooleanValue *v = NEW_BOOLEAN_VALUE();
+		Value v;
 		int cmp = left.compare(right);
 
 		if (op == EQ_EXPRESSION) {
-			v->value_ = (cmp == 0);
+			v = BooleanValue(cmp == 0);
 		} else if (op == NE_EXPRESSION) {
-			v->value_ = (cmp != 0);
+			v = BooleanValue(cmp != 0);
 		} else if (op == GT_EXPRESSION) {
-			v->value_ = (cmp > 0);
+			v = BooleanValue(cmp > 0);
 		} else if (op == GE_EXPRESSION) {
-			v->value_ = (cmp >= 0);
+			v = BooleanValue(cmp >= 0);
 		} else if (op == LT_EXPRESSION) {
-			v->value_ = (cmp < 0);
+			v = BooleanValue(cmp < 0);
 		} else if (op == LE_EXPRESSION) {
-			v->value_ = (cmp <= 0);
+			v = BooleanValue(cmp <= 0);
 		} else {
 			Error(l, "EvalBinaryBoolean error");
 		}
@@ -343,14 +719,14 @@ namespace LJ {
 		return v;
 	}
 
-	ValueBase* LJ_Driver::EvalBinaryNull(ExpressionType op, ValueBase *left, ValueBase *right, const location &l)
+	Value LJ_Driver::EvalBinaryNull(ExpressionType op, const Value &left, const Value &right, const location &l)
 	{
-		BooleanValue *v = NEW_BOOLEAN_VALUE();
+		Value v;
 
 		if (op == EQ_EXPRESSION) {
-			v->value_ = left->GetType() == NULL_VALUE && right->GetType() == NULL_VALUE;
+			v = BooleanValue(left.GetType() == NULL_VALUE && right.GetType() == NULL_VALUE);
 		} else if (op == NE_EXPRESSION) {
-			v->value_ =  !(left->GetType() == NULL_VALUE && right->GetType() == NULL_VALUE);
+			v = BooleanValue(!(left.GetType() == NULL_VALUE && right.GetType() == NULL_VALUE));
 		} else {
 			Error(l, "EvalBinaryNull error");
 		}
@@ -358,191 +734,532 @@ namespace LJ {
 		return v;
 	}
 
-	ValueBase* LJ_Driver::ChainString(std::string &left, std::string &right)
+	//
+	// Short results are copied as before. A longer one is a rope over both
+	// sides, except that a flat right side first takes in the last pieces
+	// of the left rope that are no longer than it, or than ROPE_LEAF_LENGTH,
+	// like the carries of a binary counter. A string built by appending is
+	// then a rope of O(log n) pieces, so collections do not trace one node
+	// per append, and every character is copied O(log n) times.
+	//
+	Value LJ_Driver::ChainString(StringObject *left, StringObject *right)
 	{
-		StringValue *v = NEW_STRING_VALUE();
-		v->value_ = left + right;
-		return v;
-	}
+		size_t length = left->GetLength() + right->GetLength();
+
+		// Strings this short are never ropes.
+		if (length <= ROPE_LEAF_LENGTH) {
+			std::string flat;
+			flat.reserve(length);
+			flat.append(left->value_);
+			flat.append(right->value_);
+			return NEW_STRING_VALUE(flat);
+		}
 
-	void LJ_Driver::EvalBinaryExpression(ExpressionType op, Expression *left, Expression *right)
-	{
-		ValueBase *left_val;
-		ValueBase *right_val;
-		ValueBase *result;
+		// The closure engine holds operands in locals only.
+		Value left_val = StringValue(left);
+		Value right_val = StringValue(right);
+		GCRootGuard left_root(gc_, &left_val);
+		GCRootGuard right_root(gc_, &right_val);
+
+		// Pieces taken in, last one first. rest is what stays a rope, NULL
+		// once all of left is taken in.
+		std::vector<StringObject *> pieces;
+		StringObject *rest = left;
+		size_t merged = right->GetLength();
+
+		while (!right->IsRope() && rest != NULL) {
+			StringObject *last = rest->IsRope() ? rest->right_ : rest;
+			if (last->GetLength() > std::max(merged, (size_t)ROPE_LEAF_LENGTH)) {
+				break;
+			}
+			pieces.push_back(last);
+			merged += last->GetLength();
+			rest = rest->IsRope() ? rest->left_ : NULL;
+		}
+		if (pieces.empty()) {
+			return NewRopeValue(gc_, left, right);
+		}
 
-		EvalExpression(left);
-		EvalExpression(right);
+		std::string flat;
+		flat.reserve(merged);
+		for (std::vector<StringObject *>::reverse_iterator it = pieces.rbegin(); it != pieces.rend(); ++it) {
+			(*it)->AppendTo(flat);
+		}
+		flat.append(right->value_);
 
-		right_val = value_stack_.top();
-		left_val = *(value_stack_._Get_container().end() - 2);
+		Value piece = NEW_STRING_VALUE(flat);
+		if (rest == NULL) {
+			return piece;
+		}
+		GCRootGuard piece_root(gc_, &piece);
+		return NewRopeValue(gc_, rest, piece.string_value_);
+	}
+
+	Value LJ_Driver::EvalBinaryOperator(ExpressionType op, const Value &left_val, const Value &right_val, const location &l)
+	{
+		Value result;
 
-		if (left_val->GetType() == INT_VALUE && right_val->GetType() == INT_VALUE) {
-			result = EvalBinaryInt(op, TO_INT_VALUE(left_val)->value_, 
-				TO_INT_VALUE(right_val)->value_, left->GetLocation());
+		if (left_val.GetType() == INT_VALUE && right_val.GetType() == INT_VALUE) {
+			result = EvalBinaryInt(op, TO_INT_VALUE(left_val), 
+				TO_INT_VALUE(right_val), l);
 		} 
-		else if (left_val->GetType() == DOUBLE_VALUE && right_val->GetType() == DOUBLE_VALUE) {
-			result = EvalBinaryDouble(op, TO_DOUBLE_VALUE(left_val)->value_,
-				TO_DOUBLE_VALUE(right_val)->value_, left->GetLocation());
+		else if (left_val.GetType() == DOUBLE_VALUE && right_val.GetType() == DOUBLE_VALUE) {
+			result = EvalBinaryDouble(op, TO_DOUBLE_VALUE(left_val),
+				TO_DOUBLE_VALUE(right_val), l);
 		} 
-		else if (left_val->GetType() == INT_VALUE && right_val->GetType() == DOUBLE_VALUE) {
-			result = EvalBinaryDouble(op, (double)TO_INT_VALUE(left_val)->value_,
-				TO_DOUBLE_VALUE(right_val)->value_, left->GetLocation());
+		else if (left_val.GetType() == INT_VALUE && right_val.GetType() == DOUBLE_VALUE) {
+			result = EvalBinaryDouble(op, (double)TO_INT_VALUE(left_val),
+				TO_DOUBLE_VALUE(right_val), l);
 		} 
-		else if (left_val->GetType() == DOUBLE_VALUE && right_val->GetType() == INT_VALUE) {
-			result = EvalBinaryDouble(op, TO_DOUBLE_VALUE(left_val)->value_,
-				(double)TO_INT_VALUE(right_val)->value_, left->GetLocation());
+		else if (left_val.GetType() == DOUBLE_VALUE && right_val.GetType() == INT_VALUE) {
+			result = EvalBinaryDouble(op, TO_DOUBLE_VALUE(left_val),
+				(double)TO_INT_VALUE(right_val), l);
 		} 
-		else if (left_val->GetType() == BOOLEAN_VALUE && right_val->GetType() == BOOLEAN_VALUE) {
+		else if (left_val.GetType() == BOOLEAN_VALUE && right_val.GetType() == BOOLEAN_VALUE) {
 
-			result = EvalBinaryBoolean(op, TO_BOOLEAN_VALUE(left_val)->value_,
-				TO_BOOLEAN_VALUE(right_val)->value_, left->GetLocation());
+			result = EvalBinaryBoolean(op, TO_BOOLEAN_VALUE(left_val),
+				TO_BOOLEAN_VALUE(right_val), l);
 		} 
-		else if (left_val->GetType() == STRING_VALUE && op == ADD_EXPRESSION) {
-			result = ChainString(TO_STRING_VALUE(left_val)->value_,
-				TO_STRING_VALUE(right_val)->value_);
+		else if (left_val.GetType() == STRING_VALUE && right_val.GetType() == STRING_VALUE
+			&& op == ADD_EXPRESSION) {
+			result = ChainString(left_val.string_value_, right_val.string_value_);
 		} 
-		else if (left_val->GetType() == STRING_VALUE && right_val->GetType() == STRING_VALUE) {
-			result = EvalCompareString(op, TO_STRING_VALUE(left_val)->value_, 
-				TO_STRING_VALUE(right_val)->value_, left->GetLocation());
+		else if (left_val.GetType() == STRING_VALUE && right_val.GetType() == STRING_VALUE) {
+			result = EvalCompareString(op, FLAT_STRING_VALUE(left_val), 
+				FLAT_STRING_VALUE(right_val), l);
 		} 
-		else if (left_val->GetType() == NULL_VALUE || right_val->GetType() == NULL_VALUE) {
-			result = EvalBinaryNull(op, left_val, right_val, left->GetLocation());
+		else if (left_val.GetType() == NULL_VALUE || right_val.GetType() == NULL_VALUE) {
+			result = EvalBinaryNull(op, left_val, right_val, l);
 		} 
 		else {
-			Error(left->GetLocation(), "EvalBinaryExpression error");
+			Error(l, "EvalBinaryExpression error");
 		}
 
-		value_stack_.pop();
-		value_stack_.pop();
+		return result;
+	}
 
-		value_stack_.push(result);
+	static OperandState SpecializeOperands(const Value &left_val, const Value &right_val)
+	{
+		if (left_val.GetType() != right_val.GetType()) {
+			return GENERIC_OPERANDS;
+		}
+
+		switch (left_val.GetType()) {
+		case INT_VALUE:
+			return INT_OPERANDS;
+		case DOUBLE_VALUE:
+			return DOUBLE_OPERANDS;
+		case STRING_VALUE:
+			return STRING_OPERANDS;
+		default:
+			return GENERIC_OPERANDS;
+		}
+	}
+
+	void LJ_Driver::EvalBinaryExpression(Expression *e)
+	{
+		BinaryExpressionBase *expr = static_cast<BinaryExpressionBase *>(e);
+		ExpressionType op = expr->GetType();
+		Value result;
+
+		EvalExpression(expr->GetLeft());
+		EvalExpression(expr->GetRight());
+
+		Value &left_val = value_stack_[value_stack_.Size() - 2];
+		Value &right_val = value_stack_.Top();
+
+		// A specialized node only checks its guard, a failed guard turns it
+		// generic for good. Workers of a parallel foreach only look.
+		switch (expr->GetOperandState()) {
+		case INT_OPERANDS:
+			if (left_val.GetType() == INT_VALUE && right_val.GetType() == INT_VALUE) {
+				result = EvalBinaryInt(op, TO_INT_VALUE(left_val), TO_INT_VALUE(right_val), expr->GetLeft()->GetLocation());
+				goto FUNC_END;
+			}
+			if (inline_caches_) {
+				expr->SetOperandState(GENERIC_OPERANDS);
+			}
+			break;
+		case DOUBLE_OPERANDS:
+			if (left_val.GetType() == DOUBLE_VALUE && right_val.GetType() == DOUBLE_VALUE) {
+				result = EvalBinaryDouble(op, TO_DOUBLE_VALUE(left_val), TO_DOUBLE_VALUE(right_val), expr->GetLeft()->GetLocation());
+				goto FUNC_END;
+			}
+			if (inline_caches_) {
+				expr->SetOperandState(GENERIC_OPERANDS);
+			}
+			break;
+		case STRING_OPERANDS:
+			if (left_val.GetType() == STRING_VALUE && right_val.GetType() == STRING_VALUE) {
+				if (op == ADD_EXPRESSION) {
+					result = ChainString(left_val.string_value_, right_val.string_value_);
+				}
+				else {
+					result = EvalCompareString(op, FLAT_STRING_VALUE(left_val), FLAT_STRING_VALUE(right_val), expr->GetLeft()->GetLocation());
+				}
+				goto FUNC_END;
+			}
+			if (inline_caches_) {
+				expr->SetOperandState(GENERIC_OPERANDS);
+			}
+			break;
+		case UNSPECIALIZED:
+			if (inline_caches_) {
+				expr->SetOperandState(SpecializeOperands(left_val, right_val));
+			}
+			break;
+		default:
+			break;
+		}
+
+		result = EvalBinaryOperator(op, left_val, right_val, expr->GetLeft()->GetLocation());
+
+	FUNC_END:
+		value_stack_.Pop(2);
+		value_stack_.Push(result);
+	}
+
+	//
+	// Evaluates an expression LJ_TypeInference typed int without touching
+	// the value stack. Its operands are ints as well, and a local it reads
+	// is an int on every path that gets here, so nothing is checked.
+	//
+	__int64 LJ_Driver::EvalUnboxedInt(Expression *expr)
+	{
+		switch (expr->GetType()) {
+		case INT_EXPRESSION:
+			return *(__int64 *)expr->GetValue(0);
+		case IDENTIFIER_EXPRESSION:
+			return TO_INT_VALUE(value_stack_[frame_stack_.back().base_ + static_cast<IdentifierExpression *>(expr)->GetSlotIndex()]);
+		case ASSIGN_EXPRESSION: {
+			__int64 v = EvalUnboxedInt((Expression *)expr->GetValue(1));
+			*GetLValue((Expression *)expr->GetValue(0)) = IntValue(v);
+			return v;
+		}
+		case ADD_EXPRESSION: {
+			__int64 left = EvalUnboxedInt((Expression *)expr->GetValue(0));
+			return left + EvalUnboxedInt((Expression *)expr->GetValue(1));
+		}
+		case SUB_EXPRESSION: {
+			__int64 left = EvalUnboxedInt((Expression *)expr->GetValue(0));
+			return left - EvalUnboxedInt((Expression *)expr->GetValue(1));
+		}
+		case MUL_EXPRESSION: {
+			__int64 left = EvalUnboxedInt((Expression *)expr->GetValue(0));
+			return left * EvalUnboxedInt((Expression *)expr->GetValue(1));
+		}
+		case DIV_EXPRESSION:
+		case MOD_EXPRESSION: {
+			Expression *left_expr = (Expression *)expr->GetValue(0);
+			__int64 left = EvalUnboxedInt(left_expr);
+			__int64 right = EvalUnboxedInt((Expression *)expr->GetValue(1));
+			return TO_INT_VALUE(EvalBinaryInt(expr->GetType(), left, right, left_expr->GetLocation()));
+		}
+		case MINUS_EXPRESSION:
+			return -EvalUnboxedInt((Expression *)expr->GetValue(0));
+		default:
+			return TO_INT_VALUE(GetEvalExpression(expr));
+		}
+	}
+
+	//
+	// Same for an expression typed double or int, an int is converted the
+	// way EvalBinaryOperator converts a mixed operand.
+	//
+	double LJ_Driver::EvalUnboxedDouble(Expression *expr)
+	{
+		if (expr->GetInferredType() == INT_INFERRED) {
+			return (double)EvalUnboxedInt(expr);
+		}
+
+		switch (expr->GetType()) {
+		case DOUBLE_EXPRESSION:
+			return *(double *)expr->GetValue(0);
+		case IDENTIFIER_EXPRESSION:
+			return TO_DOUBLE_VALUE(value_stack_[frame_stack_.back().base_ + static_cast<IdentifierExpression *>(expr)->GetSlotIndex()]);
+		case ASSIGN_EXPRESSION: {
+			double v = EvalUnboxedDouble((Expression *)expr->GetValue(1));
+			*GetLValue((Expression *)expr->GetValue(0)) = DoubleValue(v);
+			return v;
+		}
+		case ADD_EXPRESSION: {
+			double left = EvalUnboxedDouble((Expression *)expr->GetValue(0));
+			return left + EvalUnboxedDouble((Expression *)expr->GetValue(1));
+		}
+		case SUB_EXPRESSION: {
+			double left = EvalUnboxedDouble((Expression *)expr->GetValue(0));
+			return left - EvalUnboxedDouble((Expression *)expr->GetValue(1));
+		}
+		case MUL_EXPRESSION: {
+			double left = EvalUnboxedDouble((Expression *)expr->GetValue(0));
+			return left * EvalUnboxedDouble((Expression *)expr->GetValue(1));
+		}
+		case DIV_EXPRESSION: {
+			double left = EvalUnboxedDouble((Expression *)expr->GetValue(0));
+			return left / EvalUnboxedDouble((Expression *)expr->GetValue(1));
+		}
+		case MOD_EXPRESSION: {
+			double left = EvalUnboxedDouble((Expression *)expr->GetValue(0));
+			return fmod(left, EvalUnboxedDouble((Expression *)expr->GetValue(1)));
+		}
+		case MINUS_EXPRESSION:
+			return -EvalUnboxedDouble((Expression *)expr->GetValue(0));
+		default:
+			return TO_DOUBLE_VALUE(GetEvalExpression(expr));
+		}
 	}
 
 	void LJ_Driver::EvalLogicalAndOrExpression(ExpressionType op, Expression *left, Expression *right)
 	{
-		ValueBase *left_val;
-		ValueBase *right_val;
+		Value left_val;
+		Value right_val;
 		
-		BooleanValue *v = NEW_BOOLEAN_VALUE();
+		Value v;
 
 		EvalExpression(left);
-		left_val = value_stack_.top();
-		value_stack_.pop();
+		left_val = value_stack_.Top();
+		value_stack_.Pop();
 
-		if (left_val->GetType() != BOOLEAN_VALUE) {
+		if (left_val.GetType() != BOOLEAN_VALUE) {
 			Error(left->GetLocation(), "EvalLogicalAndOrExpression error");
 		}
 		if (op == LOGICAL_AND_EXPRESSION) {
-			if (!TO_BOOLEAN_VALUE(left_val)->value_) {
-				v->value_ = 0;
+			if (!TO_BOOLEAN_VALUE(left_val)) {
+				v = BooleanValue(0);
 				goto FUNC_END;
 			}
 		} 
 		else if (op == LOGICAL_OR_EXPRESSION) {
-			if (TO_BOOLEAN_VALUE(left_val)->value_) {
-				v->value_ = 1;
+			if (TO_BOOLEAN_VALUE(left_val)) {
+				v = BooleanValue(1);
 				goto FUNC_END;
 			}
 		} else {
-			__asm int 3;
+			LJ_TRAP();
 		}
 
 		EvalExpression(right);
-		right_val = value_stack_.top();
-		value_stack_.pop();
+		right_val = value_stack_.Top();
+		value_stack_.Pop();
 
-		v->value_ = TO_BOOLEAN_VALUE(right_val)->value_;
+		if (right_val.GetType() != BOOLEAN_VALUE) {
+			Error(right->GetLocation(), "EvalLogicalAndOrExpression error");
+		}
+		v = BooleanValue(TO_BOOLEAN_VALUE(right_val));
 
 FUNC_END:
-		value_stack_.push(v);
+		value_stack_.Push(v);
 	}
 
 	void LJ_Driver::EvalMinusExpression(Expression *expr)
 	{
-		ValueBase* v;
-		ValueBase* result;
+		Value v;
+		Value result;
 		EvalExpression(expr);
-		v = value_stack_.top();
-		value_stack_.pop();
-		if (v->GetType() == INT_VALUE) {
-			IntValue *int_value = NEW_INT_VALUE();
-			int_value->value_ = -TO_INT_VALUE(v)->value_;
-			result = int_value;
-		} else if (v->GetType() == DOUBLE_VALUE) {
-			DoubleValue *double_value = NEW_DOUBLE_VALUE();
-			double_value->value_ = -TO_DOUBLE_VALUE(v)->value_;
-			result = double_value;
+		v = value_stack_.Top();
+		value_stack_.Pop();
+		if (v.GetType() == INT_VALUE) {
+			result = IntValue(-TO_INT_VALUE(v));
+		} else if (v.GetType() == DOUBLE_VALUE) {
+			result = DoubleValue(-TO_DOUBLE_VALUE(v));
 		} else {
 			Error(expr->GetLocation(), "EvalMinusExpression error");
 		}
 
-		value_stack_.push(result);
+		value_stack_.Push(result);
 	}
 
-	void LJ_Driver::CallFunction(Expression *e, FunctionDefinition *func)
+	void LJ_Driver::EvalExclamationExpression(Expression *expr)
 	{
-		BinaryExpression<FUNCTION_CALL_EXPRESSION> *expr = dynamic_cast<BinaryExpression<FUNCTION_CALL_EXPRESSION> *>(e);
+		Value v;
+		EvalExpression(expr);
+		v = value_stack_.Top();
+		value_stack_.Pop();
+		if (v.GetType() != BOOLEAN_VALUE) {
+			Error(expr->GetLocation(), "EvalExclamationExpression error");
+		}
 
-		ValueBase *v;
-		ArgumentList::iterator arg_p;
-		ParameterList::iterator param_p;
+		value_stack_.Push(BooleanValue(!TO_BOOLEAN_VALUE(v)));
+	}
 
-		for (arg_p = expr->GetArgList()->begin(), param_p = func->GetParamList()->begin(); 
-			arg_p != expr->GetArgList()->end(); ++arg_p, ++param_p) {
-			ValueBase *arg_val;
+	void LJ_Driver::CallFunction(Expression *e, FunctionDefinition *func)
+	{
+		BinaryExpression<FUNCTION_CALL_EXPRESSION> *expr = static_cast<BinaryExpression<FUNCTION_CALL_EXPRESSION> *>(e);
 
-			if (param_p == func->GetParamList()->end()) {
-				Error(expr->GetLocation(), "CallFunction error");
+		Value v;
+		size_t base = value_stack_.Size();
+		size_t arg_count = expr->GetArgList() != NULL ? expr->GetArgList()->size() : 0;
+		MemoCache *memo = NULL;
+		std::string key;
+
+		if (frame_stack_.size() >= call_depth_limit_) {
+			Error(expr->GetLocation(), "CallFunction error");
+		}
+		if (NativeStackExhausted()) {
+			RunOnFreshStack([&]() { CallFunction(e, func); });
+			return;
+		}
+		Safepoint();
+
+		// The evaluated arguments are the callee's first slots, the remaining
+		// slots are pushed undefined above them.
+		if (arg_count != 0) {
+			for (ArgumentList::iterator arg_p = expr->GetArgList()->begin();
+				arg_p != expr->GetArgList()->end(); ++arg_p) {
+				EvalExpression(*arg_p);
 			}
-			EvalExpression(*arg_p);
-			arg_val = value_stack_.top();
-			value_stack_.pop();
+		}
 
-			local_value_stack_.top()[*param_p] = arg_val;
+		if (func->IsGenerator()) {
+			v = NewGeneratorValue(gc_, func, arg_count != 0 ? &value_stack_[base] : NULL, arg_count);
+			value_stack_.Pop(arg_count);
+			value_stack_.Push(v);
+			return;
 		}
 
-		if (param_p != func->GetParamList()->end()) {
-			Error(expr->GetLocation(), "CallFunction error");
+		// A memo function called with known arguments is not run again.
+		if (func->IsMemo() && memo_capacity_ != 0) {
+			memo = GetMemoCache(func);
+			MemoCache::MakeKey(arg_count != 0 ? &value_stack_[base] : NULL, arg_count, &key);
+			if (memo->Lookup(key, &v)) {
+				value_stack_.Pop(arg_count);
+				value_stack_.Push(v);
+				return;
+			}
 		}
+
+		value_stack_.Grow(func->GetSlotCount() - arg_count, UndefinedValue());
+		frame_stack_.push_back(LocalFrame(func, base));
+
 		StatementResult result = ExecuteStatementList((StatementList *)func->GetBlock()->GetValue(0));
+
+		// A tail call replaces the frame, its arguments move down to the base.
+		while (tail_call_ != NULL) {
+			expr = static_cast<BinaryExpression<FUNCTION_CALL_EXPRESSION> *>(tail_call_);
+			tail_call_ = NULL;
+			func = expr->GetFunction();
+			arg_count = expr->GetArgList() != NULL ? expr->GetArgList()->size() : 0;
+
+			size_t args = value_stack_.Size() - arg_count;
+			for (size_t i = 0; i < arg_count; i++) {
+				value_stack_[base + i] = value_stack_[args + i];
+			}
+			value_stack_.Pop(value_stack_.Size() - (base + arg_count));
+			value_stack_.Grow(func->GetSlotCount() - arg_count, UndefinedValue());
+			frame_stack_.back() = LocalFrame(func, base);
+
+			result = ExecuteStatementList((StatementList *)func->GetBlock()->GetValue(0));
+		}
+
 		if (result.type_ == RETURN_STATEMENT_RESULT) {
 			v = result.value_;
 		} else {
-			v = NEW_NULL_VALUE();
+			v = NullValue();
 		}
 
-		value_stack_.push(v);
+		frame_stack_.pop_back();
+		value_stack_.Pop(value_stack_.Size() - base);
+
+		if (memo != NULL) {
+			memo->Insert(key, v);
+		}
+		value_stack_.Push(v);
 	}
 
-	void LJ_Driver::EvalFunctionCallExpression(Expression *e)
+	//
+	// Runs g until its next yield and stores the yielded value in out.
+	// Returns false, and leaves out alone, once the body has finished. The
+	// slots move onto the value stack for the run and back afterwards.
+	//
+	boolean LJ_Driver::ResumeGenerator(GeneratorObject *g, Value *out, const location &l)
 	{
-		BinaryExpression<FUNCTION_CALL_EXPRESSION> *expr = dynamic_cast<BinaryExpression<FUNCTION_CALL_EXPRESSION> *>(e);
-		FunctionDefinition *func = NULL;
+		size_t base = value_stack_.Size();
+		boolean suspended;
 
-		for (std::list<FunctionDefinition *>::iterator it = function_list_.begin();
-			it != function_list_.end(); ++it) {
+		if (g->state_ == GENERATOR_RUNNING) {
+			Error(l, "ResumeGenerator error");
+		}
+		if (g->state_ == GENERATOR_DONE) {
+			return 0;
+		}
+		if (frame_stack_.size() >= call_depth_limit_) {
+			Error(l, "CallFunction error");
+		}
+		if (NativeStackExhausted()) {
+			RunOnFreshStack([&]() { suspended = ResumeGenerator(g, out, l); });
+			return suspended;
+		}
 
-				if ((*it)->GetFunctionName() == expr->GetFunctionName()) {
-					func = *it;
-					break;
-				}
+		for (std::vector<Value>::iterator it = g->slots_.begin(); it != g->slots_.end(); ++it) {
+			value_stack_.Push(*it);
+		}
+		frame_stack_.push_back(LocalFrame(g->func_, base));
+		resume_points_.swap(g->resume_);
+		g->state_ = GENERATOR_RUNNING;
+
+		StatementResult result = ExecuteStatementList((StatementList *)g->func_->GetBlock()->GetValue(0));
+
+		resume_points_.swap(g->resume_);
+		suspended = result.type_ == SUSPEND_STATEMENT_RESULT;
+		if (suspended) {
+			for (size_t i = 0; i < g->slots_.size(); i++) {
+				g->slots_[i] = value_stack_[base + i];
+			}
+			g->state_ = GENERATOR_SUSPENDED;
+			*out = result.value_;
+		}
+		else {
+			// A finished generator lets go of everything its frame held.
+			std::fill(g->slots_.begin(), g->slots_.end(), UndefinedValue());
+			g->resume_.clear();
+			g->state_ = GENERATOR_DONE;
+		}
+
+		frame_stack_.pop_back();
+		value_stack_.Pop(value_stack_.Size() - base);
+		return suspended;
+	}
+
+	void LJ_Driver::CallNativeFunction(Expression *e, FunctionDefinition *func)
+	{
+		BinaryExpression<FUNCTION_CALL_EXPRESSION> *expr = static_cast<BinaryExpression<FUNCTION_CALL_EXPRESSION> *>(e);
+		size_t base = value_stack_.Size();
+		size_t arg_count = expr->GetArgList() != NULL ? expr->GetArgList()->size() : 0;
+
+		if (arg_count != 0) {
+			for (ArgumentList::iterator arg_p = expr->GetArgList()->begin();
+				arg_p != expr->GetArgList()->end(); ++arg_p) {
+				EvalExpression(*arg_p);
+			}
 		}
 
+		// Native functions read their arguments in place and must not push.
+		NativeFunction *native = static_cast<NativeFunction *>(func);
+		Value v = native->GetProc()(this, (int)arg_count, arg_count != 0 ? &value_stack_[base] : NULL, expr->GetLocation());
+
+		value_stack_.Pop(arg_count);
+		value_stack_.Push(v);
+	}
+
+	void LJ_Driver::EvalFunctionCallExpression(Expression *e)
+	{
+		BinaryExpression<FUNCTION_CALL_EXPRESSION> *expr = static_cast<BinaryExpression<FUNCTION_CALL_EXPRESSION> *>(e);
+		FunctionDefinition *func = expr->GetFunction();
+
 		if (func == NULL) {
 			Error(expr->GetLocation(), "EvalFunctionCallExpression error");
 		}
 
-		local_value_stack_.push(std::map<std::string, ValueBase *>());
-
 		switch (func->GetType()) {
 		case FUNCTION_DEFINITION:
 			CallFunction(expr, func);
 			break;
+		case NATIVE_FUNCTION:
+			CallNativeFunction(expr, func);
+			break;
 		default:
-			__asm int 3;
+			LJ_TRAP();
 		}
-		local_value_stack_.pop();
 	}
 
 	void LJ_Driver::EvalExpression(Expression *expr)
@@ -564,20 +1281,36 @@ FUNC_END:
 			EvalIdentifierExpression(expr);
 			break;
 		case ASSIGN_EXPRESSION:
-			EvalAssignExpression((Expression *)expr->GetValue(0), (Expression *)expr->GetValue(1));
-			break;
 		case ADD_EXPRESSION:
 		case SUB_EXPRESSION:
 		case MUL_EXPRESSION:
 		case DIV_EXPRESSION:
 		case MOD_EXPRESSION:
+			if (expr->GetInferredType() == INT_INFERRED) {
+				value_stack_.Push(IntValue(EvalUnboxedInt(expr)));
+			}
+			else if (expr->GetInferredType() == DOUBLE_INFERRED) {
+				value_stack_.Push(DoubleValue(EvalUnboxedDouble(expr)));
+			}
+			else if (expr->GetType() == ASSIGN_EXPRESSION) {
+				EvalAssignExpression((Expression *)expr->GetValue(0), (Expression *)expr->GetValue(1));
+			}
+			else {
+				EvalBinaryExpression(expr);
+			}
+			break;
 		case EQ_EXPRESSION:
 		case NE_EXPRESSION:
 		case GT_EXPRESSION:
 		case GE_EXPRESSION:
 		case LT_EXPRESSION:
 		case LE_EXPRESSION:
-			EvalBinaryExpression(expr->GetType(), (Expression *)expr->GetValue(0), (Expression *)expr->GetValue(1));
+			if (HasNumericOperands(expr)) {
+				value_stack_.Push(BooleanValue(EvalCompareCondition(expr)));
+			}
+			else {
+				EvalBinaryExpression(expr);
+			}
 			break;
 		case LOGICAL_AND_EXPRESSION:
 		case LOGICAL_OR_EXPRESSION:
@@ -586,71 +1319,198 @@ FUNC_END:
 		case MINUS_EXPRESSION:
 			EvalMinusExpression((Expression *)expr->GetValue(0));
 			break;
+		case EXCLAMATION_EXPRESSION:
+			EvalExclamationExpression((Expression *)expr->GetValue(0));
+			break;
 		case FUNCTION_CALL_EXPRESSION:
 			EvalFunctionCallExpression(expr);
 			break;
+		case TRUE_EXPRESSION:
+			EvalBooleanExpression(1);
+			break;
+		case FALSE_EXPRESSION:
+			EvalBooleanExpression(0);
+			break;
 		case NULL_EXPRESSION:
 			EvalNullExpression();
 			break;
+		case INDEX_EXPRESSION:
+			EvalIndexExpression(expr);
+			break;
+		case ARRAY_EXPRESSION:
+			EvalArrayExpression(expr);
+			break;
+		case DICT_EXPRESSION:
+			EvalDictExpression(expr);
+			break;
+		case MEMBER_EXPRESSION:
+			EvalMemberExpression(expr);
+			break;
+		case RECORD_EXPRESSION:
+			EvalRecordExpression(expr);
+			break;
 		default:
-			__asm int 3;
+			LJ_TRAP();
 		}
 	}
 
-	ValueBase *LJ_Driver::GetEvalExpression(Expression *expr)
+	Value LJ_Driver::GetEvalExpression(Expression *expr)
 	{
 		EvalExpression(expr);
-		ValueBase *v = value_stack_.top();
-		value_stack_.pop();
+		Value v = value_stack_.Top();
+		value_stack_.Pop();
 		return v;
 	}
 
-	StatementResult LJ_Driver::ExecuteExpressionStatement(Statement *statement)
+	boolean LJ_Driver::EvalCompareCondition(Expression *e)
 	{
-		ValueBase *v;
+		BinaryExpressionBase *expr = static_cast<BinaryExpressionBase *>(e);
+		ExpressionType op = expr->GetType();
+		boolean result;
+
+		// Operands proven numeric are compared unboxed.
+		if (HasNumericOperands(expr)) {
+			if (expr->GetLeft()->GetInferredType() == INT_INFERRED && expr->GetRight()->GetInferredType() == INT_INFERRED) {
+				__int64 left = EvalUnboxedInt(expr->GetLeft());
+				__int64 right = EvalUnboxedInt(expr->GetRight());
+				switch (op) {
+				case EQ_EXPRESSION: return left == right;
+				case NE_EXPRESSION: return left != right;
+				case GT_EXPRESSION: return left > right;
+				case GE_EXPRESSION: return left >= right;
+				case LT_EXPRESSION: return left < right;
+				default: return left <= right;
+				}
+			}
+			double left = EvalUnboxedDouble(expr->GetLeft());
+			double right = EvalUnboxedDouble(expr->GetRight());
+			switch (op) {
+			case EQ_EXPRESSION: return left == right;
+			case NE_EXPRESSION: return left != right;
+			case GT_EXPRESSION: return left > right;
+			case GE_EXPRESSION: return left >= right;
+			case LT_EXPRESSION: return left < right;
+			default: return left <= right;
+			}
+		}
 
-		v = GetEvalExpression((Expression *)statement->GetValue(0));
+		EvalExpression(expr->GetLeft());
+		EvalExpression(expr->GetRight());
+
+		Value &left_val = value_stack_[value_stack_.Size() - 2];
+		Value &right_val = value_stack_.Top();
+
+		if (left_val.GetType() == INT_VALUE && right_val.GetType() == INT_VALUE) {
+			__int64 left = TO_INT_VALUE(left_val);
+			__int64 right = TO_INT_VALUE(right_val);
+			switch (op) {
+			case EQ_EXPRESSION: result = left == right; break;
+			case NE_EXPRESSION: result = left != right; break;
+			case GT_EXPRESSION: result = left > right; break;
+			case GE_EXPRESSION: result = left >= right; break;
+			case LT_EXPRESSION: result = left < right; break;
+			default: result = left <= right; break;
+			}
+		}
+		else if (left_val.GetType() == DOUBLE_VALUE && right_val.GetType() == DOUBLE_VALUE) {
+			double left = TO_DOUBLE_VALUE(left_val);
+			double right = TO_DOUBLE_VALUE(right_val);
+			switch (op) {
+			case EQ_EXPRESSION: result = left == right; break;
+			case NE_EXPRESSION: result = left != right; break;
+			case GT_EXPRESSION: result = left > right; break;
+			case GE_EXPRESSION: result = left >= right; break;
+			case LT_EXPRESSION: result = left < right; break;
+			default: result = left <= right; break;
+			}
+		}
+		else {
+			result = TO_BOOLEAN_VALUE(EvalBinaryOperator(op, left_val, right_val, expr->GetLeft()->GetLocation()));
+		}
 
-		return StatementResult(NORMAL_STATEMENT_RESULT, v);
+		value_stack_.Pop(2);
+		return result;
 	}
 
-	StatementResult	LJ_Driver::ExecuteGlobalStatement(Statement *statement)
+	//
+	// Evaluates the condition of a branch straight to a native boolean.
+	// Comparisons, logical operators and negation never build a boolean
+	// Value, anything else is evaluated as usual and must yield a boolean,
+	// otherwise error is raised at l.
+	//
+	boolean LJ_Driver::EvalCondition(Expression *expr, const location &l, const char *error)
 	{
-		if (local_value_stack_.size() == 0) {
-			Error(statement->GetLocation(), "ExecuteGlobalStatement error");
+		switch (expr->GetType()) {
+		case TRUE_EXPRESSION:
+			return 1;
+		case FALSE_EXPRESSION:
+			return 0;
+		case EQ_EXPRESSION:
+		case NE_EXPRESSION:
+		case GT_EXPRESSION:
+		case GE_EXPRESSION:
+		case LT_EXPRESSION:
+		case LE_EXPRESSION:
+			return EvalCompareCondition(expr);
+		case LOGICAL_AND_EXPRESSION:
+		case LOGICAL_OR_EXPRESSION: {
+			Expression *left = (Expression *)expr->GetValue(0);
+			Expression *right = (Expression *)expr->GetValue(1);
+			boolean v = EvalCondition(left, left->GetLocation(), "EvalLogicalAndOrExpression error");
+			if (v == (expr->GetType() == LOGICAL_OR_EXPRESSION)) {
+				return v;
+			}
+			return EvalCondition(right, right->GetLocation(), "EvalLogicalAndOrExpression error");
 		}
-
-		IdentifierList * identifier_list = (IdentifierList *)statement->GetValue(0);
-		for (IdentifierList::iterator it = identifier_list->begin();
-			it != identifier_list->end(); ++it) {
-
-			if (global_value_.find(*it) == global_value_.end()) {
-				Error(statement->GetLocation(), "ExecuteGlobalStatement error");
+		case EXCLAMATION_EXPRESSION: {
+			Expression *operand = (Expression *)expr->GetValue(0);
+			return !EvalCondition(operand, operand->GetLocation(), "EvalExclamationExpression error");
+		}
+		default: {
+			Value v = GetEvalExpression(expr);
+			if (v.GetType() != BOOLEAN_VALUE) {
+				Error(l, error);
 			}
+			return TO_BOOLEAN_VALUE(v);
+		}
 		}
+	}
+
+	StatementResult LJ_Driver::ExecuteExpressionStatement(Statement *statement)
+	{
+		Value v;
+
+		v = GetEvalExpression((Expression *)statement->GetValue(0));
 
-		return StatementResult(NORMAL_STATEMENT_RESULT, NULL);
+		return StatementResult(NORMAL_STATEMENT_RESULT, v);
 	}
 
-	StatementResult LJ_Driver::ExecuteElseif(ElseifList *elseif_list, boolean *executed)
+	StatementResult	LJ_Driver::ExecuteGlobalStatement(Statement *statement)
 	{
-		StatementResult result(NORMAL_STATEMENT_RESULT, NULL);
+		// Global declarations are applied by LJ_Resolver before execution.
+		return StatementResult(NORMAL_STATEMENT_RESULT);
+	}
+
+	//
+	// Sets branch to the number of the elseif that ran, counted from 1, or
+	// to 0 when none did.
+	//
+	StatementResult LJ_Driver::ExecuteElseif(ElseifList *elseif_list, size_t *branch)
+	{
+		StatementResult result(NORMAL_STATEMENT_RESULT);
 		
-		*executed = 0;
+		*branch = 0;
+		if (elseif_list == NULL) {
+			goto FUNC_END;
+		}
+
 		for (ElseifList::iterator it = elseif_list->begin();
 			it != elseif_list->end(); ++it) {
 
-			ValueBase *v = GetEvalExpression((Expression *)(*it)->GetValue(0));
-			if (v->GetType() != BOOLEAN_VALUE) {
-				Error((*it)->GetLocation(), "ExecuteElseif error");
-			}
-
-			if (TO_BOOLEAN_VALUE(v)->value_) {
+			if (EvalCondition((Expression *)(*it)->GetValue(0), (*it)->GetLocation(), "ExecuteElseif error")) {
 				result = ExecuteStatementList((StatementList *)((Block *)(*it)->GetValue(1))->GetValue(0));
-				*executed = 1;
-				if (result.type_ != NORMAL_STATEMENT_RESULT) {
-					goto FUNC_END;
-				}
+				*branch = it - elseif_list->begin() + 1;
+				goto FUNC_END;
 			}
 		}
 
@@ -658,55 +1518,74 @@ FUNC_END:
 		return result;
 	}
 
+	//
+	// Branch 0 is the then block, the elseifs follow and the else block is
+	// last.
+	//
+	StatementList *LJ_Driver::GetIfBranch(Statement *statement, size_t branch)
+	{
+		ElseifList *elseif_list = (ElseifList *)statement->GetValue(2);
+		size_t elseif_count = elseif_list != NULL ? elseif_list->size() : 0;
+
+		if (branch == 0) {
+			return (StatementList *)((Block *)statement->GetValue(1))->GetValue(0);
+		}
+		else if (branch <= elseif_count) {
+			return (StatementList *)((Block *)(*elseif_list)[branch - 1]->GetValue(1))->GetValue(0);
+		}
+		return (StatementList *)((Block *)statement->GetValue(3))->GetValue(0);
+	}
+
 	StatementResult LJ_Driver::ExecuteIfStatement(Statement *statement)
 	{
-		StatementResult result(NORMAL_STATEMENT_RESULT, NULL);
-	
-		ValueBase *v = GetEvalExpression((Expression *)statement->GetValue(0));
-		if (v->GetType() != BOOLEAN_VALUE) {
-			Error(statement->GetLocation(), "ExecuteIfStatement error");
+		StatementResult result(NORMAL_STATEMENT_RESULT);
+		size_t branch = 0;
+
+		// A resumed generator goes straight back into the branch it left.
+		if (!resume_points_.empty()) {
+			branch = resume_points_.back().index_;
+			resume_points_.pop_back();
+			result = ExecuteStatementList(GetIfBranch(statement, branch));
 		}
-		
-		if (TO_BOOLEAN_VALUE(v)->value_) {
-			result = ExecuteStatementList((StatementList *)((Block *)statement->GetValue(1))->GetValue(0));
+		else if (EvalCondition((Expression *)statement->GetValue(0), statement->GetLocation(), "ExecuteIfStatement error")) {
+			result = ExecuteStatementList(GetIfBranch(statement, 0));
 		}
 		else {
-			boolean elseif_executed;
-			result = ExecuteElseif((ElseifList *)statement->GetValue(2), &elseif_executed);
-			if (result.type_ != NORMAL_STATEMENT_RESULT) {
-				goto FUNC_END;
-			}
-			if (!elseif_executed && statement->GetValue(3) != NULL) {
-				result = ExecuteStatementList((StatementList *)((Block *)statement->GetValue(3))->GetValue(0));
+			result = ExecuteElseif((ElseifList *)statement->GetValue(2), &branch);
+			if (branch == 0 && statement->GetValue(3) != NULL) {
+				ElseifList *elseif_list = (ElseifList *)statement->GetValue(2);
+				branch = (elseif_list != NULL ? elseif_list->size() : 0) + 1;
+				result = ExecuteStatementList(GetIfBranch(statement, branch));
 			}
 		}
 
-	FUNC_END:
+		if (result.type_ == SUSPEND_STATEMENT_RESULT) {
+			resume_points_.push_back(ResumePoint(branch));
+		}
 		return result;
 	}
 
 	StatementResult LJ_Driver::ExecuteWhileStatement(Statement *statement)
 	{
-		StatementResult result(NORMAL_STATEMENT_RESULT, NULL);
+		StatementResult result(NORMAL_STATEMENT_RESULT);
+		boolean resumed = !resume_points_.empty();
 		
 		for (;;) {
-			ValueBase *v = GetEvalExpression((Expression *)statement->GetValue(0));
-			if (v->GetType() != BOOLEAN_VALUE) {
-				Error(statement->GetLocation(), "ExecuteWhileStatement error");
-			}
-			
-			if (!TO_BOOLEAN_VALUE(v)->value_) {
+			if (!resumed && !EvalCondition((Expression *)statement->GetValue(0), statement->GetLocation(), "ExecuteWhileStatement error")) {
 				break;
 			}
+			resumed = 0;
 
 			result = ExecuteStatementList((StatementList *)((Block *)statement->GetValue(1))->GetValue(0));
-			if (result.type_ == RETURN_STATEMENT_RESULT) {
+			if (result.type_ == RETURN_STATEMENT_RESULT || result.type_ == SUSPEND_STATEMENT_RESULT) {
 				break;
 			}
 			else if (result.type_ == BREAK_STATEMENT_RESULT) {
 				result.type_ = NORMAL_STATEMENT_RESULT;
 				break;
 			}
+			result.type_ = NORMAL_STATEMENT_RESULT;
+			Safepoint();
 		}
 
 		return result;
@@ -714,30 +1593,29 @@ FUNC_END:
 
 	StatementResult LJ_Driver::ExecuteForStatement(Statement *statement)
 	{
-		StatementResult result(NORMAL_STATEMENT_RESULT, NULL);
+		StatementResult result(NORMAL_STATEMENT_RESULT);
+		boolean resumed = !resume_points_.empty();
 
-		if (statement->GetValue(0) != NULL) {
+		if (!resumed && statement->GetValue(0) != NULL) {
 			GetEvalExpression((Expression *)statement->GetValue(0));
 		}
 		for (;;) {
-			if (statement->GetValue(1) != NULL) {
-				ValueBase *v = GetEvalExpression((Expression *)statement->GetValue(0));
-				if (v->GetType() != BOOLEAN_VALUE) {
-					Error(statement->GetLocation(), "ExecuteForStatement error");
-				}
-				
-				if (!TO_BOOLEAN_VALUE(v)->value_) {
-					break;
-				}
+			if (!resumed && statement->GetValue(1) != NULL
+				&& !EvalCondition((Expression *)statement->GetValue(1), statement->GetLocation(), "ExecuteForStatement error")) {
+				break;
 			}
+			resumed = 0;
+
 			result = ExecuteStatementList((StatementList *)((Block *)statement->GetValue(3))->GetValue(0));
-			if (result.type_ == RETURN_STATEMENT_RESULT) {
+			if (result.type_ == RETURN_STATEMENT_RESULT || result.type_ == SUSPEND_STATEMENT_RESULT) {
 				break;
 			}
 			else if (result.type_ == BREAK_STATEMENT_RESULT) {
 				result.type_ = NORMAL_STATEMENT_RESULT;
 				break;
 			}
+			result.type_ = NORMAL_STATEMENT_RESULT;
+			Safepoint();
 
 			if (statement->GetValue(2) != NULL) {
 				GetEvalExpression((Expression *)statement->GetValue(2));
@@ -749,32 +1627,172 @@ FUNC_END:
 
 	StatementResult LJ_Driver::ExecuteReturnStatement(Statement *statement)
 	{
-		StatementResult result(RETURN_STATEMENT_RESULT, NULL);
+		Expression *expr = (Expression *)statement->GetValue(0);
+
+		// return f(...) inside a function only evaluates the arguments,
+		// CallFunction runs the call in place of the current one. Neither a
+		// generator's frame nor a call that makes a generator is replaced.
+		if (expr != NULL && expr->GetType() == FUNCTION_CALL_EXPRESSION && frame_stack_.size() != 0
+			&& !frame_stack_.back().func_->IsGenerator()) {
+			BinaryExpression<FUNCTION_CALL_EXPRESSION> *call = static_cast<BinaryExpression<FUNCTION_CALL_EXPRESSION> *>(expr);
+			if (call->GetFunction() != NULL && call->GetFunction()->GetType() == FUNCTION_DEFINITION
+				&& !call->GetFunction()->IsGenerator()) {
+				if (call->GetArgList() != NULL) {
+					for (ArgumentList::iterator it = call->GetArgList()->begin(); it != call->GetArgList()->end(); ++it) {
+						EvalExpression(*it);
+					}
+				}
+				tail_call_ = expr;
+				return StatementResult(RETURN_STATEMENT_RESULT);
+			}
+		}
 
-		if (statement->GetValue(0) != NULL) {
-			
-			ValueBase *v = GetEvalExpression((Expression *)statement->GetValue(0));
+		if (expr != NULL) {
+			Value v = GetEvalExpression(expr);
 			return StatementResult(RETURN_STATEMENT_RESULT, v);
 		}
 		else {
-			ValueBase *v = new Value < NullType, NULL_VALUE>;
-			return StatementResult(RETURN_STATEMENT_RESULT, v);
+			return StatementResult(RETURN_STATEMENT_RESULT, NullValue());
 		}
 	}
 
+	StatementResult LJ_Driver::ExecuteForeachStatement(Statement *statement)
+	{
+		StatementResult result(NORMAL_STATEMENT_RESULT);
+		ForeachStatement *foreach = static_cast<ForeachStatement *>(statement);
+		boolean resumed = !resume_points_.empty();
+		__int64 i;
+		__int64 to;
+
+		if (foreach->IteratesGenerator()) {
+			return ExecuteGeneratorForeach(statement);
+		}
+
+		// A resumed generator continues the round it suspended in.
+		if (resumed) {
+			i = resume_points_.back().counter_;
+			to = resume_points_.back().limit_;
+			resume_points_.pop_back();
+		}
+		else {
+			Value from_val = GetEvalExpression((Expression *)statement->GetValue(1));
+			Value to_val = GetEvalExpression((Expression *)statement->GetValue(2));
+
+			if (from_val.GetType() != INT_VALUE || to_val.GetType() != INT_VALUE) {
+				Error(statement->GetLocation(), "ExecuteForeachStatement error");
+			}
+			i = TO_INT_VALUE(from_val);
+			to = TO_INT_VALUE(to_val);
+		}
+
+		if (foreach->IsParallel()) {
+			LJ_ParallelForeach pool(this, foreach);
+
+			if (frame_stack_.empty()) {
+				pool.Run(i, to, NULL, NULL);
+			}
+			else {
+				pool.Run(i, to, frame_stack_.back().func_, &value_stack_[frame_stack_.back().base_]);
+			}
+			return result;
+		}
+
+		for (; i < to; i++) {
+			if (!resumed) {
+				*GetLValue((Expression *)statement->GetValue(0)) = IntValue(i);
+			}
+			resumed = 0;
+
+			result = ExecuteStatementList((StatementList *)((Block *)statement->GetValue(3))->GetValue(0));
+			if (result.type_ == RETURN_STATEMENT_RESULT) {
+				break;
+			}
+			else if (result.type_ == SUSPEND_STATEMENT_RESULT) {
+				resume_points_.push_back(ResumePoint(i, to));
+				break;
+			}
+			else if (result.type_ == BREAK_STATEMENT_RESULT) {
+				result.type_ = NORMAL_STATEMENT_RESULT;
+				break;
+			}
+			result.type_ = NORMAL_STATEMENT_RESULT;
+			Safepoint();
+		}
+
+		return result;
+	}
+
+	//
+	// foreach (v : g) resumes g once per round. The generator stays rooted
+	// while the body runs, nothing else need refer to it.
+	//
+	StatementResult LJ_Driver::ExecuteGeneratorForeach(Statement *statement)
+	{
+		StatementResult result(NORMAL_STATEMENT_RESULT);
+		boolean resumed = !resume_points_.empty();
+		Value g = NullValue();
+		Value v = NullValue();
+		GCRootGuard guard(gc_, &g);
+
+		if (resumed) {
+			g = resume_points_.back().value_;
+			resume_points_.pop_back();
+		}
+		else {
+			g = GetEvalExpression((Expression *)statement->GetValue(1));
+			if (g.GetType() != GENERATOR_VALUE) {
+				Error(statement->GetLocation(), "ExecuteForeachStatement error");
+			}
+		}
+
+		for (;;) {
+			if (!resumed) {
+				if (!ResumeGenerator(TO_GENERATOR_VALUE(g), &v, statement->GetLocation())) {
+					break;
+				}
+				*GetLValue((Expression *)statement->GetValue(0)) = v;
+			}
+			resumed = 0;
+
+			result = ExecuteStatementList((StatementList *)((Block *)statement->GetValue(3))->GetValue(0));
+			if (result.type_ == RETURN_STATEMENT_RESULT) {
+				break;
+			}
+			else if (result.type_ == SUSPEND_STATEMENT_RESULT) {
+				resume_points_.push_back(ResumePoint(g));
+				break;
+			}
+			else if (result.type_ == BREAK_STATEMENT_RESULT) {
+				result.type_ = NORMAL_STATEMENT_RESULT;
+				break;
+			}
+			result.type_ = NORMAL_STATEMENT_RESULT;
+			Safepoint();
+		}
+
+		return result;
+	}
+
+	StatementResult LJ_Driver::ExecuteYieldStatement(Statement *statement)
+	{
+		Value v = GetEvalExpression((Expression *)statement->GetValue(0));
+
+		return StatementResult(SUSPEND_STATEMENT_RESULT, v);
+	}
+
 	StatementResult LJ_Driver::ExecuteBreakStatement(Statement *statement)
 	{
-		return StatementResult(BREAK_STATEMENT_RESULT, NULL);
+		return StatementResult(BREAK_STATEMENT_RESULT);
 	}
 
 	StatementResult LJ_Driver::ExecuteContinueStatement(Statement *statement)
 	{
-		return StatementResult(CONTINUE_STATEMENT_RESULT, NULL);
+		return StatementResult(CONTINUE_STATEMENT_RESULT);
 	}
 
 	StatementResult LJ_Driver::ExecuteStatement(Statement *statement)
 	{
-		StatementResult result(NORMAL_STATEMENT_RESULT, NULL);
+		StatementResult result(NORMAL_STATEMENT_RESULT);
 
 		switch (statement->GetType()) {
 		case EXPRESSION_STATEMENT:
@@ -792,9 +1810,15 @@ FUNC_END:
 		case FOR_STATEMENT:
 			result = ExecuteForStatement(statement);
 			break;
+		case FOREACH_STATEMENT:
+			result = ExecuteForeachStatement(statement);
+			break;
 		case RETURN_STATEMENT:
 			result = ExecuteReturnStatement(statement);
 			break;
+		case YIELD_STATEMENT:
+			result = ExecuteYieldStatement(statement);
+			break;
 		case BREAK_STATEMENT:
 			result = ExecuteBreakStatement(statement);
 			break;
@@ -802,7 +1826,7 @@ FUNC_END:
 			result = ExecuteContinueStatement(statement);
 			break;
 		default:
-			__asm int 3;
+			LJ_TRAP();
 		}
 
 		return result;
@@ -810,11 +1834,29 @@ FUNC_END:
 
 	StatementResult LJ_Driver::ExecuteStatementList(StatementList *list)
 	{
-		StatementResult result(NORMAL_STATEMENT_RESULT, NULL);
+		StatementResult result(NORMAL_STATEMENT_RESULT);
+		GCRootGuard guard(gc_, &result.value_);
+		StatementList::iterator it;
+
+		if (list == NULL) {
+			goto FUNC_END;
+		}
 
-		for (StatementList::iterator it = list->begin();
-			it != list->end(); ++it) {
+		// A resumed generator skips what it ran before it suspended.
+		it = list->begin();
+		if (!resume_points_.empty()) {
+			it += resume_points_.back().index_;
+			resume_points_.pop_back();
+		}
+
+		for (; it != list->end(); ++it) {
 			result = ExecuteStatement(*it);
+			if (result.type_ == SUSPEND_STATEMENT_RESULT) {
+				// After a yield the list goes on with the next statement,
+				// anything else suspended in the middle of the statement.
+				resume_points_.push_back(ResumePoint((size_t)(it - list->begin()) + ((*it)->GetType() == YIELD_STATEMENT)));
+				goto FUNC_END;
+			}
 			if (result.type_ != NORMAL_STATEMENT_RESULT)
 				goto FUNC_END;
 		}
@@ -1,22 +1,120 @@
 #ifndef __LJ_DRIVER_H__
 #define __LJ_DRIVER_H__
 #include <string>
+#include <iostream>
 #include <map>
-#include <stack>
+#include <set>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <stdexcept>
+#include <vector>
 
 typedef unsigned char boolean;
 
 #include "lj_parser.hpp"
 #include "lj_ast.h"
 #include "lj_val.h"
+#include "lj_gc.h"
+#include "lj_memo.h"
 
 // Tell Flex the lexer's prototype ...
-# define YY_DECL LJ::Parser::symbol_type yylex(LJ::LJ_Driver& driver)
+# define YY_DECL LJ::Parser::symbol_type yylex(LJ::LJ_Driver& driver, void *yyscanner)
 // ... and declare it for the parser's sake.
 YY_DECL;
 
 namespace LJ {
-	class LJ_Driver
+
+	class LJ_Task;
+
+#define VALUE_STACK_INITIAL_SIZE	1024
+#define FRAME_STACK_INITIAL_SIZE	256
+
+// Nested script calls allowed before CallFunction fails.
+#define DEFAULT_CALL_DEPTH_LIMIT	100000
+
+// Native stack a thread may use for script calls before they continue on
+// a fresh thread, well below the smallest default thread stack.
+#define NATIVE_STACK_SEGMENT_SIZE	(256 * 1024)
+
+// Times a stack segment thread, or the thread waiting for it, yields for
+// the other side before it blocks.
+#define STACK_SEGMENT_SPINS			100
+
+// Idle stack segments kept for the next deep call of any driver, enough
+// for one recursion down to DEFAULT_CALL_DEPTH_LIMIT to cross back and
+// forth without starting threads. Segments returned beyond it are joined.
+#define STACK_SEGMENT_POOL_SIZE		64
+
+// Results each memo function keeps cached, 0 turns memoization off.
+#define DEFAULT_MEMO_CAPACITY		1024
+
+// Longest string ChainString copies into one piece. Anything longer is a
+// rope, and a flat string added to a rope always takes in its pieces up to
+// this short.
+#define ROPE_LEAF_LENGTH			256
+
+	class LocalFrame {
+	public:
+		LocalFrame(FunctionDefinition *func, size_t base) :
+			func_(func), base_(base) {}
+
+		FunctionDefinition *func_;
+		size_t base_;
+	};
+
+	//
+	// A thread deep script calls continue on once the native stack below
+	// has used up its segment. Segments are shared by all drivers: a call
+	// takes one from a small pool and gives it back when it returns, so
+	// recursion that keeps crossing the same boundary hands its calls over
+	// instead of starting a thread each, and a finished driver holds none.
+	// Both sides yield to each other for a while before they block, which
+	// keeps a short call on the segment cheap.
+	//
+	class StackSegment {
+	public:
+		StackSegment();
+		~StackSegment();
+
+		// An idle segment from the pool, or a new one if it is empty.
+		static StackSegment *Take();
+		// Returns segment to the pool, or joins it once the pool is full.
+		static void Give(StackSegment *segment);
+
+		// Runs f on the segment's thread and waits for it, f must not throw.
+		void Run(const std::function<void()> &f);
+
+	private:
+		void Main();
+		template<class P> void Wait(P ready);
+
+		// Set under lock_, read without it while spinning.
+		std::mutex lock_;
+		std::condition_variable wake_;
+		std::atomic<const std::function<void()> *> work_;
+		std::atomic<boolean> done_;
+		std::atomic<boolean> exit_;
+		std::thread thread_;
+	};
+
+	//
+	// Thrown by LJ_Driver::Error. The driver that raised it is left unusable,
+	// every other driver in the process keeps running.
+	//
+	class LJ_Error : public std::runtime_error {
+	public:
+		LJ_Error(const std::string &m) : std::runtime_error(m) {}
+	};
+
+	//
+	// One interpreter instance. A driver owns all of its state, so separate
+	// drivers can parse and run on separate threads.
+	//
+	class LJ_Driver : public GCRootSet
 	{
 	public:
 		LJ_Driver();
@@ -25,17 +123,76 @@ namespace LJ {
 		void ScanBegin();
 		void ScanEnd();
 		bool trace_scanning_;
+		void *scanner_;
+		location loc_;
 
 		int Parse(const std::string& f);
 		std::string file_;
 		bool trace_parsing_;
+		bool trace_optimization_;
 
 		void Error(const location& l, const std::string& m);
 		void Error(const std::string& m);
 
 		void Dump();
 
+		void Execute();
+
+		std::ostream *out_;
+
+		size_t call_depth_limit_;
+		char *stack_base_;
+		boolean NativeStackExhausted();
+		void RunOnFreshStack(const std::function<void()> &f);
+
+		size_t memo_capacity_;
+		MemoCache *GetMemoCache(FunctionDefinition *func);
+		void DumpMemoStats(std::ostream &os);
+
+		// Threads a parallel foreach runs on, 0 uses one per hardware thread.
+		size_t parallel_workers_;
+
+		// Set while the driver runs as a task of LJ_Scheduler. Loops and calls
+		// pass a safepoint, and the task yields its worker when the budget the
+		// scheduler gave it runs out.
+		LJ_Task *task_;
+		size_t safepoint_budget_;
+		void Safepoint() {
+			if (task_ != NULL && --safepoint_budget_ == 0) {
+				YieldTask();
+			}
+		}
+		void YieldTask();
+
+		// Element access shared by all engines. An array takes an int index
+		// in range, a dict an int or string key, and reading a key it does
+		// not have is an error too. Errors are raised at l.
+		Value GetElement(const Value &array, const Value &index, const location &l);
+		void SetElement(const Value &array, const Value &index, const Value &v, const location &l);
+
+		// A dict of count key value pairs, entries holds them in turn.
+		Value NewDict(const Value *entries, size_t count, const location &l);
+
+		// Field access shared by all engines, through the inline cache of
+		// expr. Reading a field the record does not have is an error, storing
+		// one adds it. Workers of a parallel foreach share the AST with the
+		// driver that started them, they clear inline_caches_ and only look
+		// at these caches and at the operand states of binary expressions.
+		Value GetField(const Value &record, MemberExpression *expr);
+		void SetField(const Value &record, MemberExpression *expr, const Value &v);
+		Value NewRecord(RecordExpression *expr, const Value *values);
+		ShapeTree shapes_;
+		ShapeStats shape_stats_;
+		boolean inline_caches_;
+		void DumpShapeStats(std::ostream &os);
+
+		void MarkRoots(LJ_GC *gc) override;
+
+		int ResolveGlobal(const std::string &name);
+
 		void AddFunction(FunctionDefinition *f);
+		FunctionDefinition *FindFunction(const std::string &name);
+		std::list<FunctionDefinition *>& GetFunctionList() { return function_list_; }
 
 		void EvalBooleanExpression(boolean boolean_value);
 		void EvalIntExpression(__int64 int_value);
@@ -43,48 +200,95 @@ namespace LJ {
 		void EvalStringExpression(const std::string &string_value);
 		void EvalNullExpression();
 		void EvalIdentifierExpression(Expression *expr);
-		ValueBase ** GetIdentifierLValue(const std::string &identifier);
-		ValueBase ** GetLValue(Expression *expr);
+		Value * GetIdentifierLValue(IdentifierExpression *expr);
+		Value * GetLValue(Expression *expr);
 		void EvalAssignExpression(Expression *left, Expression *right);
-		ValueBase* EvalBinaryBoolean(ExpressionType op, boolean left, boolean right, const location &l);
-		ValueBase* EvalBinaryInt(ExpressionType op, __int64 left, __int64 right, const location &l);
-		ValueBase* EvalBinaryDouble(ExpressionType op, double left, double right, const location &l);
-		ValueBase* LJ_Driver::EvalCompareString(ExpressionType op, std::string &left, std::string &right, const location &l);
-		ValueBase* LJ_Driver::EvalBinaryNull(ExpressionType op, ValueBase *left, ValueBase *right, const location &l);
-		void LJ_Driver::EvalBinaryExpression(ExpressionType op, Expression *left, Expression *right);
-		ValueBase* LJ_Driver::ChainString(std::string &left, std::string &right);
-		void LJ_Driver::EvalLogicalAndOrExpression(ExpressionType op, Expression *left, Expression *right);
-		void LJ_Driver::EvalMinusExpression(Expression *expr);
-		void LJ_Driver::CallFunction(Expression *e, FunctionDefinition *func);
-		void LJ_Driver::EvalFunctionCallExpression(Expression *expr);
-		void LJ_Driver::EvalExpression(Expression *expr);
-		ValueBase *GetEvalExpression(Expression *expr);
+		void EvalIndexExpression(Expression *expr);
+		void EvalArrayExpression(Expression *expr);
+		void EvalDictExpression(Expression *expr);
+		void EvalMemberExpression(Expression *expr);
+		void EvalRecordExpression(Expression *expr);
+		Value EvalBinaryBoolean(ExpressionType op, boolean left, boolean right, const location &l);
+		Value EvalBinaryInt(ExpressionType op, __int64 left, __int64 right, const location &l);
+		Value EvalBinaryDouble(ExpressionType op, double left, double right, const location &l);
+		Value EvalCompareString(ExpressionType op, std::string &left, std::string &right, const location &l);
+		Value EvalBinaryNull(ExpressionType op, const Value &left, const Value &right, const location &l);
+		Value EvalBinaryOperator(ExpressionType op, const Value &left_val, const Value &right_val, const location &l);
+		void EvalBinaryExpression(Expression *expr);
+		Value ChainString(StringObject *left, StringObject *right);
+		__int64 EvalUnboxedInt(Expression *expr);
+		double EvalUnboxedDouble(Expression *expr);
+		void EvalLogicalAndOrExpression(ExpressionType op, Expression *left, Expression *right);
+		void EvalMinusExpression(Expression *expr);
+		void EvalExclamationExpression(Expression *expr);
+		void CallFunction(Expression *e, FunctionDefinition *func);
+		void CallNativeFunction(Expression *e, FunctionDefinition *func);
+		void EvalFunctionCallExpression(Expression *expr);
+		void EvalExpression(Expression *expr);
+		Value GetEvalExpression(Expression *expr);
+		boolean EvalCompareCondition(Expression *expr);
+		boolean EvalCondition(Expression *expr, const location &l, const char *error);
 		StatementResult ExecuteExpressionStatement(Statement *statement);
 		StatementResult ExecuteGlobalStatement(Statement *statement);
-		StatementResult ExecuteElseif(ElseifList *elsif_list, boolean *executed);
+		StatementResult ExecuteElseif(ElseifList *elsif_list, size_t *branch);
+		StatementList *GetIfBranch(Statement *statement, size_t branch);
 		StatementResult ExecuteIfStatement(Statement *statement);
 		StatementResult ExecuteWhileStatement(Statement *statement);
 		StatementResult ExecuteForStatement(Statement *statement);
+		StatementResult ExecuteForeachStatement(Statement *statement);
+		StatementResult ExecuteGeneratorForeach(Statement *statement);
 		StatementResult ExecuteReturnStatement(Statement *statement);
+		StatementResult ExecuteYieldStatement(Statement *statement);
 		StatementResult ExecuteBreakStatement(Statement *statement);
 		StatementResult ExecuteContinueStatement(Statement *statement);
 		StatementResult ExecuteStatement(Statement *statement);
 		StatementResult ExecuteStatementList(StatementList *list);
+		Arena arena_;
 		StatementList *statement_list_;
 
-		std::list<ValueBase *> value_list_;
+		LJ_GC gc_;
+
+		ValueStack value_stack_;
 
-		std::stack<ValueBase *> value_stack_;
+		std::vector<Value> global_value_;
 
-		std::map<std::string, ValueBase *> global_value_;
+		std::vector<std::string> global_names_;
 
-		std::stack<std::map<std::string, ValueBase *>> local_value_stack_;
+		std::map<std::string, int> global_index_;
+
+		std::vector<LocalFrame> frame_stack_;
+
+		// Set by a return statement in tail position, the pending call's
+		// arguments are on top of the value stack.
+		Expression *tail_call_;
+
+		boolean ResumeGenerator(GeneratorObject *g, Value *out, const location &l);
+
+		// Filled while a suspending generator unwinds, innermost statement
+		// first, and emptied again from the back as it is resumed. Not empty
+		// means the statement being entered is one the generator suspended in.
+		std::vector<ResumePoint> resume_points_;
 
 	private:
 		std::list<FunctionDefinition *> function_list_;
+		std::unordered_map<std::string, FunctionDefinition *> function_table_;
+		std::map<FunctionDefinition *, MemoCache *> memo_caches_;
 
+		Value GetFieldMiss(const Value &record, MemberExpression *expr);
+		void SetFieldMiss(const Value &record, MemberExpression *expr, const Value &v);
+
+		// Set once a call came back from the next segment, see
+		// NativeStackExhausted.
+		boolean stack_armed_;
 	};
 
+#define IsNumericInferred(t) \
+	((t) == INT_INFERRED || (t) == DOUBLE_INFERRED)
+
+#define HasNumericOperands(expr) \
+	(IsNumericInferred(((Expression *)(expr)->GetValue(0))->GetInferredType())\
+	&& IsNumericInferred(((Expression *)(expr)->GetValue(1))->GetInferredType()))
+
 #define IsMathOperator(op) \
 	((op) == ADD_EXPRESSION || (op) == SUB_EXPRESSION\
 	|| (op) == MUL_EXPRESSION || (op) == DIV_EXPRESSION\
@@ -99,53 +303,298 @@ namespace LJ {
 	((op) == LOGICAL_AND_EXPRESSION || (op) == LOGICAL_OR_EXPRESSION)
 
 
-	__inline BooleanValue * NewBooleanValue(std::list<ValueBase *> &value_list)
+	__inline Value NewStringValue(LJ_GC &gc, const std::string &str)
+	{
+		gc.CheckCollect();
+		StringObject *s = new StringObject;
+		s->value_ = str;
+		gc.Register(s);
+		return StringValue(s);
+	}
+
+#define NEW_STRING_VALUE(s)		NewStringValue(gc_, s)
+
+	// left and right must stay reachable, the collection may run first.
+	__inline Value NewRopeValue(LJ_GC &gc, StringObject *left, StringObject *right)
 	{
-		BooleanValue *v = new BooleanValue; 
-		value_list.push_back(static_cast<ValueBase *>(v));
-		return v;
+		gc.CheckCollect();
+		StringObject *s = new StringObject;
+		s->left_ = left;
+		s->right_ = right;
+		s->length_ = left->GetLength() + right->GetLength();
+		gc.Register(s);
+		return StringValue(s);
 	}
 
-	__inline IntValue * NewIntValue(std::list<ValueBase *> &value_list)
+	// The characters of the string v, which is flattened first if needed.
+	__inline std::string &FlatString(LJ_GC &gc, const Value &v)
 	{
-		IntValue *v = new IntValue; 
-		value_list.push_back(static_cast<ValueBase *>(v));
-		return v;
+		v.string_value_->Flatten(gc);
+		return v.string_value_->value_;
 	}
 
-	__inline DoubleValue * NewDoubleValueValue(std::list<ValueBase *> &value_list)
+#define FLAT_STRING_VALUE(v)	FlatString(gc_, v)
+
+	// Dicts hash and compare string keys as they are, so they get flat ones.
+	__inline void FlattenKey(LJ_GC &gc, const Value &key)
 	{
-		DoubleValue *v = new DoubleValue; 
-		value_list.push_back(static_cast<ValueBase *>(v));
-		return v;
+		if (key.type_ == STRING_VALUE) {
+			key.string_value_->Flatten(gc);
+		}
 	}
 
-	__inline StringValue * NewStringValueValue(std::list<ValueBase *> &value_list)
+	//
+	// A call to a generator function binds the arguments to the first
+	// slots of a new generator, its body runs on the first resume.
+	//
+	__inline Value NewGeneratorValue(LJ_GC &gc, FunctionDefinition *func, const Value *args, size_t arg_count)
 	{
-		StringValue *v = new StringValue; 
-		value_list.push_back(static_cast<ValueBase *>(v));
-		return v;
+		gc.CheckCollect();
+		GeneratorObject *g = new GeneratorObject(func);
+		g->slots_.reserve(func->GetSlotCount());
+		g->slots_.assign(args, args + arg_count);
+		g->slots_.resize(func->GetSlotCount(), UndefinedValue());
+		gc.Register(g);
+		return GeneratorValue(g);
 	}
 
-	__inline NullValue * NewNullValue(std::list<ValueBase *> &value_list)
+	//
+	// An array literal is packed when all of its elements are ints or all
+	// are doubles, [] starts out as an int array.
+	//
+	__inline Value NewArrayValue(LJ_GC &gc, const Value *elems, size_t count)
 	{
-		NullValue *v = new NullValue; 
-		value_list.push_back(static_cast<ValueBase *>(v));
-		return v;
+		ArrayKind kind = count != 0 && elems[0].type_ == DOUBLE_VALUE ? DOUBLE_ARRAY : INT_ARRAY;
+
+		for (size_t i = 0; i < count; i++) {
+			if (elems[i].type_ != (kind == INT_ARRAY ? INT_VALUE : DOUBLE_VALUE)) {
+				kind = BOXED_ARRAY;
+				break;
+			}
+		}
+
+		gc.CheckCollect();
+		ArrayObject *a = new ArrayObject(kind);
+		switch (kind) {
+		case INT_ARRAY:
+			a->ints_.resize(count);
+			for (size_t i = 0; i < count; i++) {
+				a->ints_[i] = TO_INT_VALUE(elems[i]);
+			}
+			break;
+		case DOUBLE_ARRAY:
+			a->doubles_.resize(count);
+			for (size_t i = 0; i < count; i++) {
+				a->doubles_[i] = TO_DOUBLE_VALUE(elems[i]);
+			}
+			break;
+		default:
+			a->values_.assign(elems, elems + count);
+			break;
+		}
+		gc.Register(a);
+		return ArrayValue(a);
 	}
 
+	// A packed array of length zeros for a native to fill in.
+	__inline ArrayObject *NewPackedArray(LJ_GC &gc, ArrayKind kind, size_t length)
+	{
+		gc.CheckCollect();
+		ArrayObject *a = new ArrayObject(kind);
+		if (kind == INT_ARRAY) {
+			a->ints_.resize(length);
+		}
+		else {
+			a->doubles_.resize(length);
+		}
+		gc.Register(a);
+		return a;
+	}
 
-#define NEW_BOOLEAN_VALUE()		NewBooleanValue(value_list_)
-#define NEW_INT_VALUE()			NewIntValue(value_list_)
-#define NEW_STRING_VALUE()		NewStringValueValue(value_list_)
-#define NEW_DOUBLE_VALUE()		NewDoubleValueValue(value_list_)
-#define NEW_NULL_VALUE()		NewNullValue(value_list_)
+	__inline void SetArrayElement(LJ_GC &gc, ArrayObject *a, size_t index, const Value &v)
+	{
+		switch (a->kind_) {
+		case INT_ARRAY:
+			if (v.type_ == INT_VALUE) {
+				a->ints_[index] = TO_INT_VALUE(v);
+				return;
+			}
+			break;
+		case DOUBLE_ARRAY:
+			if (v.type_ == DOUBLE_VALUE) {
+				a->doubles_[index] = TO_DOUBLE_VALUE(v);
+				return;
+			}
+			break;
+		default:
+			a->values_[index] = v;
+			return;
+		}
+
+		size_t size = a->GetSize();
+		a->Box();
+		gc.Resize(a, size);
+		a->values_[index] = v;
+	}
 
-#define TO_BOOLEAN_VALUE(v)		dynamic_cast<BooleanValue *>(v)
-#define TO_INT_VALUE(v)			dynamic_cast<IntValue *>(v)
-#define TO_DOUBLE_VALUE(v)		dynamic_cast<DoubleValue *>(v)
-#define TO_STRING_VALUE(v)		dynamic_cast<StringValue *>(v)
-#define TO_NULL_VALUE(v)		dynamic_cast<NullValue *>(v)
+	__inline void PushArrayElement(LJ_GC &gc, ArrayObject *a, const Value &v)
+	{
+		size_t size = a->GetSize();
+
+		if (a->GetLength() == 0) {
+			a->kind_ = v.type_ == INT_VALUE ? INT_ARRAY : v.type_ == DOUBLE_VALUE ? DOUBLE_ARRAY : BOXED_ARRAY;
+		}
+		else if (!a->Fits(v)) {
+			a->Box();
+		}
+
+		switch (a->kind_) {
+		case INT_ARRAY:
+			a->ints_.push_back(TO_INT_VALUE(v));
+			break;
+		case DOUBLE_ARRAY:
+			a->doubles_.push_back(TO_DOUBLE_VALUE(v));
+			break;
+		default:
+			a->values_.push_back(v);
+			break;
+		}
+		if (a->GetSize() != size) {
+			gc.Resize(a, size);
+		}
+	}
+
+	__inline void SetDictElement(LJ_GC &gc, DictObject *d, const Value &key, const Value &v)
+	{
+		size_t size = d->GetSize();
+
+		FlattenKey(gc, key);
+		d->Set(key, v);
+		if (d->GetSize() != size) {
+			gc.Resize(d, size);
+		}
+	}
+
+	__inline Value LJ_Driver::GetElement(const Value &array, const Value &index, const location &l)
+	{
+		if (array.type_ == DICT_VALUE) {
+			Value *v = NULL;
+			if (DictObject::IsKey(index)) {
+				FlattenKey(gc_, index);
+				v = TO_DICT_VALUE(array)->Find(index);
+			}
+			if (v == NULL) {
+				Error(l, "EvalIndexExpression error");
+			}
+			return *v;
+		}
+		if (array.type_ != ARRAY_VALUE || index.type_ != INT_VALUE
+			|| (unsigned __int64)TO_INT_VALUE(index) >= TO_ARRAY_VALUE(array)->GetLength()) {
+			Error(l, "EvalIndexExpression error");
+		}
+		return TO_ARRAY_VALUE(array)->Get((size_t)TO_INT_VALUE(index));
+	}
+
+	__inline void LJ_Driver::SetElement(const Value &array, const Value &index, const Value &v, const location &l)
+	{
+		if (array.type_ == DICT_VALUE) {
+			if (!DictObject::IsKey(index)) {
+				Error(l, "EvalIndexExpression error");
+			}
+			SetDictElement(gc_, TO_DICT_VALUE(array), index, v);
+			return;
+		}
+		if (array.type_ != ARRAY_VALUE || index.type_ != INT_VALUE
+			|| (unsigned __int64)TO_INT_VALUE(index) >= TO_ARRAY_VALUE(array)->GetLength()) {
+			Error(l, "EvalIndexExpression error");
+		}
+		SetArrayElement(gc_, TO_ARRAY_VALUE(array), (size_t)TO_INT_VALUE(index), v);
+	}
+
+	//
+	// Keys are checked before the dict is allocated, a later entry with the
+	// same key as an earlier one replaces it.
+	//
+	__inline Value LJ_Driver::NewDict(const Value *entries, size_t count, const location &l)
+	{
+		for (size_t i = 0; i < count; i++) {
+			if (!DictObject::IsKey(entries[2 * i])) {
+				Error(l, "EvalDictExpression error");
+			}
+		}
+
+		for (size_t i = 0; i < count; i++) {
+			FlattenKey(gc_, entries[2 * i]);
+		}
+
+		gc_.CheckCollect();
+		DictObject *d = new DictObject;
+		for (size_t i = 0; i < count; i++) {
+			d->Set(entries[2 * i], entries[2 * i + 1]);
+		}
+		gc_.Register(d);
+		return DictValue(d);
+	}
+
+	__inline Value LJ_Driver::GetField(const Value &record, MemberExpression *expr)
+	{
+		if (record.type_ == RECORD_VALUE) {
+			RecordObject *r = TO_RECORD_VALUE(record);
+			InlineCache &cache = expr->GetCache();
+			for (size_t i = 0; i < cache.count_; i++) {
+				if (cache.entries_[i].shape_ == r->shape_) {
+					shape_stats_.hits_++;
+					return r->slots_[cache.entries_[i].slot_];
+				}
+			}
+		}
+		return GetFieldMiss(record, expr);
+	}
+
+	//
+	// A cached store either finds the field in place or, when it added the
+	// field to records of this shape before, appends the slot and moves the
+	// record along the same transition.
+	//
+	__inline void LJ_Driver::SetField(const Value &record, MemberExpression *expr, const Value &v)
+	{
+		if (record.type_ == RECORD_VALUE) {
+			RecordObject *r = TO_RECORD_VALUE(record);
+			InlineCache &cache = expr->GetCache();
+			for (size_t i = 0; i < cache.count_; i++) {
+				const InlineCacheEntry &e = cache.entries_[i];
+				if (e.shape_ != r->shape_) {
+					continue;
+				}
+				shape_stats_.hits_++;
+				if (e.transition_ == NULL) {
+					r->slots_[e.slot_] = v;
+					return;
+				}
+				size_t size = r->GetSize();
+				r->slots_.push_back(v);
+				r->shape_ = e.transition_;
+				shape_stats_.transitions_++;
+				if (r->GetSize() != size) {
+					gc_.Resize(r, size);
+				}
+				return;
+			}
+		}
+		SetFieldMiss(record, expr, v);
+	}
+
+	// values holds one value for each field of the literal, in order.
+	__inline Value LJ_Driver::NewRecord(RecordExpression *expr, const Value *values)
+	{
+		Shape *shape = expr->GetShape();
+
+		gc_.CheckCollect();
+		RecordObject *r = new RecordObject(shape);
+		r->slots_.assign(values, values + shape->GetFieldCount());
+		gc_.Register(r);
+		return RecordValue(r);
+	}
 
 }
 
@@ -0,0 +1,178 @@
+#include <algorithm>
+#include "lj_driver.hpp"
+#include "lj_gc.h"
+
+#define GC_DEFAULT_THRESHOLD	(1024 * 1024)
+
+namespace LJ {
+
+	LJ_GC::LJ_GC()
+		: objects_(NULL), bytes_allocated_(0), threshold_(GC_DEFAULT_THRESHOLD),
+		next_collect_(GC_DEFAULT_THRESHOLD), collection_count_(0)
+	{
+
+	}
+
+	LJ_GC::~LJ_GC()
+	{
+		while (objects_ != NULL) {
+			HeapObject *next = objects_->next_;
+			delete objects_;
+			objects_ = next;
+		}
+	}
+
+	void LJ_GC::AddRootSet(GCRootSet *root_set)
+	{
+		root_sets_.push_back(root_set);
+	}
+
+	void LJ_GC::RemoveRootSet(GCRootSet *root_set)
+	{
+		std::vector<GCRootSet *>::iterator it = std::find(root_sets_.begin(), root_sets_.end(), root_set);
+		if (it != root_sets_.end()) {
+			root_sets_.erase(it);
+		}
+	}
+
+	void LJ_GC::PushRoot(Value *v)
+	{
+		roots_.push_back(v);
+	}
+
+	void LJ_GC::PopRoot()
+	{
+		roots_.pop_back();
+	}
+
+	void LJ_GC::SetThreshold(size_t threshold)
+	{
+		threshold_ = threshold;
+		next_collect_ = bytes_allocated_ + threshold;
+	}
+
+	void LJ_GC::CheckCollect()
+	{
+		if (bytes_allocated_ >= next_collect_) {
+			Collect();
+		}
+	}
+
+	void LJ_GC::Register(HeapObject *object)
+	{
+		object->next_ = objects_;
+		objects_ = object;
+		bytes_allocated_ += object->GetSize();
+	}
+
+	//
+	// Accounts for an object that grew or shrank after it was registered,
+	// so the sweep takes off what GetSize reports then.
+	//
+	void LJ_GC::Resize(HeapObject *object, size_t old_size)
+	{
+		bytes_allocated_ = bytes_allocated_ - old_size + object->GetSize();
+	}
+
+	void LJ_GC::MarkValue(const Value &v)
+	{
+		HeapObject *object = v.GetObject();
+		if (object != NULL) {
+			MarkObject(object);
+		}
+	}
+
+	void LJ_GC::MarkObject(HeapObject *object)
+	{
+		if (object->marked_) {
+			return;
+		}
+
+		object->marked_ = 1;
+		gray_stack_.push_back(object);
+	}
+
+	void LJ_GC::Collect()
+	{
+		for (std::vector<GCRootSet *>::iterator it = root_sets_.begin(); it != root_sets_.end(); ++it) {
+			(*it)->MarkRoots(this);
+		}
+
+		for (std::vector<Value *>::iterator it = roots_.begin(); it != roots_.end(); ++it) {
+			MarkValue(**it);
+		}
+
+		while (gray_stack_.size() != 0) {
+			HeapObject *object = gray_stack_.back();
+			gray_stack_.pop_back();
+			object->Trace(this);
+		}
+
+		Sweep();
+		collection_count_++;
+
+		// The heap may grow by the threshold, or by the live size when that
+		// is larger, before the next collection.
+		next_collect_ = bytes_allocated_ + std::max(threshold_, bytes_allocated_);
+	}
+
+	void LJ_GC::Sweep()
+	{
+		HeapObject **link = &objects_;
+
+		while (*link != NULL) {
+			HeapObject *object = *link;
+			if (object->marked_) {
+				object->marked_ = 0;
+				link = &object->next_;
+			}
+			else {
+				*link = object->next_;
+				bytes_allocated_ -= object->GetSize();
+				delete object;
+			}
+		}
+	}
+
+	void StringObject::Trace(LJ_GC *gc)
+	{
+		if (left_ != NULL) {
+			gc->MarkObject(left_);
+			gc->MarkObject(right_);
+		}
+	}
+
+	void GeneratorObject::Trace(LJ_GC *gc)
+	{
+		for (std::vector<Value>::iterator it = slots_.begin(); it != slots_.end(); ++it) {
+			gc->MarkValue(*it);
+		}
+		for (std::vector<ResumePoint>::iterator it = resume_.begin(); it != resume_.end(); ++it) {
+			gc->MarkValue(it->value_);
+		}
+	}
+
+	void ArrayObject::Trace(LJ_GC *gc)
+	{
+		for (std::vector<Value>::iterator it = values_.begin(); it != values_.end(); ++it) {
+			gc->MarkValue(*it);
+		}
+	}
+
+	void DictObject::Trace(LJ_GC *gc)
+	{
+		for (std::vector<DictEntry>::iterator it = entries_.begin(); it != entries_.end(); ++it) {
+			if (it->hash_ != 0) {
+				gc->MarkValue(it->key_);
+				gc->MarkValue(it->value_);
+			}
+		}
+	}
+
+	void RecordObject::Trace(LJ_GC *gc)
+	{
+		for (std::vector<Value>::iterator it = slots_.begin(); it != slots_.end(); ++it) {
+			gc->MarkValue(*it);
+		}
+	}
+}
@@ -0,0 +1,70 @@
+#ifndef __LJ_GC_H__
+#define __LJ_GC_H__
+
+#include <vector>
+#include "lj_val.h"
+
+namespace LJ {
+
+	class LJ_GC;
+
+	class GCRootSet {
+	public:
+		virtual ~GCRootSet() {}
+
+		virtual void MarkRoots(LJ_GC *gc) = 0;
+	};
+
+	//
+	// Tracing mark-and-sweep collector. Everything reachable from the
+	// registered root sets and the pushed value roots survives a collection,
+	// which runs before an allocation once the heap has grown past the
+	// threshold.
+	//
+	class LJ_GC {
+	public:
+		LJ_GC();
+		~LJ_GC();
+
+		void AddRootSet(GCRootSet *root_set);
+		void RemoveRootSet(GCRootSet *root_set);
+		void PushRoot(Value *v);
+		void PopRoot();
+
+		void CheckCollect();
+		void Register(HeapObject *object);
+		void Resize(HeapObject *object, size_t old_size);
+		void Collect();
+
+		void MarkValue(const Value &v);
+		void MarkObject(HeapObject *object);
+
+		void SetThreshold(size_t threshold);
+		size_t GetThreshold() const { return threshold_; }
+		size_t GetBytesAllocated() const { return bytes_allocated_; }
+		size_t GetCollectionCount() const { return collection_count_; }
+
+	private:
+		void Sweep();
+
+		HeapObject *objects_;
+		std::vector<HeapObject *> gray_stack_;
+		std::vector<GCRootSet *> root_sets_;
+		std::vector<Value *> roots_;
+		size_t bytes_allocated_;
+		size_t threshold_;
+		size_t next_collect_;
+		size_t collection_count_;
+	};
+
+	class GCRootGuard {
+	public:
+		GCRootGuard(LJ_GC &gc, Value *v) : gc_(gc) { gc_.PushRoot(v); }
+		~GCRootGuard() { gc_.PopRoot(); }
+
+	private:
+		LJ_GC &gc_;
+	};
+}
+
+#endif
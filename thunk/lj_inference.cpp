@@ -0,0 +1,527 @@
+#include "lj_driver.hpp"
+#include "lj_inference.h"
+
+namespace LJ {
+
+	LJ_TypeInference::LJ_TypeInference(LJ_Driver *driver)
+		: driver_(driver), function_(NULL), break_states_(NULL), continue_states_(NULL), changed_(0)
+	{
+
+	}
+
+	LJ_TypeInference::~LJ_TypeInference()
+	{
+
+	}
+
+	void LJ_TypeInference::Infer()
+	{
+		std::list<FunctionDefinition *> &function_list = driver_->GetFunctionList();
+
+		// A function shadowed by a later one of the same name is never called.
+		for (std::list<FunctionDefinition *>::iterator it = function_list.begin();
+			it != function_list.end(); ++it) {
+
+			if ((*it)->GetType() != FUNCTION_DEFINITION || driver_->FindFunction((*it)->GetFunctionName()) != *it) {
+				continue;
+			}
+
+			functions_.push_back(*it);
+			param_types_[*it].assign((*it)->GetParamList() != NULL ? (*it)->GetParamList()->size() : 0, UNINFERRED);
+			(*it)->SetReturnType(UNINFERRED);
+		}
+
+		// Parameter and return types only ever widen, so this terminates.
+		do {
+			changed_ = 0;
+			for (std::vector<FunctionDefinition *>::iterator it = functions_.begin(); it != functions_.end(); ++it) {
+				InferFunction(*it);
+			}
+			InferMain();
+		} while (changed_);
+	}
+
+	void LJ_TypeInference::Dump()
+	{
+		for (std::vector<FunctionDefinition *>::iterator it = functions_.begin(); it != functions_.end(); ++it) {
+			std::vector<InferredType> &slot_types = (*it)->GetSlotTypes();
+
+			std::cout << "FUNCTION_DEFINITION = [" << (*it)->GetFunctionName() << "] : "
+				<< GetInferredTypeString((*it)->GetReturnType()) << std::endl;
+			for (size_t i = 0; i < slot_types.size(); i++) {
+				std::cout << "  LOCAL " << i << " : " << GetInferredTypeString(slot_types[i]) << std::endl;
+			}
+			(*it)->GetBlock()->Dump(1);
+		}
+
+		driver_->Dump();
+	}
+
+	InferredType LJ_TypeInference::Join(InferredType a, InferredType b)
+	{
+		if (a == UNINFERRED) {
+			return b;
+		}
+		if (b == UNINFERRED || a == b) {
+			return a;
+		}
+		return DYNAMIC_INFERRED;
+	}
+
+	LJ_TypeInference::TypeState LJ_TypeInference::Join(const TypeState &a, const TypeState &b)
+	{
+		if (!a.reachable_) {
+			return b;
+		}
+		if (!b.reachable_) {
+			return a;
+		}
+
+		TypeState state = a;
+		for (size_t i = 0; i < state.slots_.size(); i++) {
+			state.slots_[i] = Join(a.slots_[i], b.slots_[i]);
+		}
+		return state;
+	}
+
+	void LJ_TypeInference::Widen(InferredType *type, InferredType with)
+	{
+		InferredType joined = Join(*type, with);
+
+		if (joined != *type) {
+			*type = joined;
+			changed_ = 1;
+		}
+	}
+
+	void LJ_TypeInference::RecordSlot(int slot, InferredType type)
+	{
+		std::vector<InferredType> &slot_types = function_->GetSlotTypes();
+
+		slot_types[slot] = Join(slot_types[slot], type);
+	}
+
+	void LJ_TypeInference::InferFunction(FunctionDefinition *func)
+	{
+		std::vector<InferredType> &params = param_types_[func];
+		TypeState state;
+
+		function_ = func;
+		func->GetSlotTypes().assign(func->GetSlotCount(), UNINFERRED);
+
+		// Locals start undefined, reading one before it is assigned fails.
+		state.reachable_ = 1;
+		state.slots_.assign(func->GetSlotCount(), DYNAMIC_INFERRED);
+		for (size_t i = 0; i < params.size(); i++) {
+			state.slots_[i] = params[i];
+			RecordSlot((int)i, params[i]);
+		}
+
+		InferStatementList((StatementList *)func->GetBlock()->GetValue(0), state);
+
+		// Falling off the end returns null.
+		if (state.reachable_) {
+			InferredType return_type = func->GetReturnType();
+			Widen(&return_type, DYNAMIC_INFERRED);
+			func->SetReturnType(return_type);
+		}
+	}
+
+	void LJ_TypeInference::InferMain()
+	{
+		TypeState state;
+
+		function_ = NULL;
+		state.reachable_ = 1;
+		InferStatementList(driver_->statement_list_, state);
+	}
+
+	void LJ_TypeInference::InferStatementList(StatementList *list, TypeState &state)
+	{
+		if (list == NULL) {
+			return;
+		}
+
+		// Statements no path reaches keep their expressions uninferred.
+		for (StatementList::iterator it = list->begin(); it != list->end() && state.reachable_; ++it) {
+			InferStatement(*it, state);
+		}
+	}
+
+	void LJ_TypeInference::InferStatement(Statement *statement, TypeState &state)
+	{
+		switch (statement->GetType()) {
+		case EXPRESSION_STATEMENT:
+			InferExpression((Expression *)statement->GetValue(0), state);
+			break;
+		case GLOBAL_STATEMENT:
+			break;
+		case IF_STATEMENT:
+			InferIfStatement(statement, state);
+			break;
+		case WHILE_STATEMENT:
+			InferLoop((Expression *)statement->GetValue(0), NULL,
+				(StatementList *)((Block *)statement->GetValue(1))->GetValue(0), state);
+			break;
+		case FOR_STATEMENT:
+			if (statement->GetValue(0) != NULL) {
+				InferExpression((Expression *)statement->GetValue(0), state);
+			}
+			InferLoop((Expression *)statement->GetValue(1), (Expression *)statement->GetValue(2),
+				(StatementList *)((Block *)statement->GetValue(3))->GetValue(0), state);
+			break;
+		case FOREACH_STATEMENT:
+			InferForeachStatement(statement, state);
+			break;
+		case RETURN_STATEMENT:
+			InferReturnStatement(statement, state);
+			break;
+		case YIELD_STATEMENT:
+			InferExpression((Expression *)statement->GetValue(0), state);
+			break;
+		case BREAK_STATEMENT:
+			break_states_->push_back(state);
+			state.reachable_ = 0;
+			break;
+		case CONTINUE_STATEMENT:
+			continue_states_->push_back(state);
+			state.reachable_ = 0;
+			break;
+		default:
+			LJ_TRAP();
+		}
+	}
+
+	void LJ_TypeInference::InferIfStatement(Statement *statement, TypeState &state)
+	{
+		TypeState out;
+		TypeState branch;
+
+		InferExpression((Expression *)statement->GetValue(0), state);
+		branch = state;
+		InferStatementList((StatementList *)((Block *)statement->GetValue(1))->GetValue(0), branch);
+		out = Join(out, branch);
+
+		ElseifList *elseif_list = (ElseifList *)statement->GetValue(2);
+		if (elseif_list != NULL) {
+			for (ElseifList::iterator it = elseif_list->begin(); it != elseif_list->end(); ++it) {
+				InferExpression((Expression *)(*it)->GetValue(0), state);
+				branch = state;
+				InferStatementList((StatementList *)((Block *)(*it)->GetValue(1))->GetValue(0), branch);
+				out = Join(out, branch);
+			}
+		}
+
+		if (statement->GetValue(3) != NULL) {
+			InferStatementList((StatementList *)((Block *)statement->GetValue(3))->GetValue(0), state);
+		}
+		state = Join(out, state);
+	}
+
+	//
+	// Runs the body until the state at the loop head stops changing. The
+	// last round sees the final head state, so its annotations stand. A
+	// counter is set to counter_type at the head of every round, after the
+	// exit.
+	//
+	void LJ_TypeInference::InferLoop(Expression *condition, Expression *post, StatementList *body, TypeState &state,
+		IdentifierExpression *counter, InferredType counter_type)
+	{
+		std::vector<TypeState> *saved_break_states = break_states_;
+		std::vector<TypeState> *saved_continue_states = continue_states_;
+		std::vector<TypeState> break_states;
+		std::vector<TypeState> continue_states;
+		TypeState head = state;
+		TypeState exit;
+
+		break_states_ = &break_states;
+		continue_states_ = &continue_states;
+
+		for (;;) {
+			TypeState s = head;
+
+			break_states.clear();
+			continue_states.clear();
+
+			if (condition != NULL) {
+				InferExpression(condition, s);
+				exit = s;
+			}
+			else if (counter != NULL) {
+				exit = s;
+			}
+			else {
+				exit = TypeState();
+			}
+
+			if (counter != NULL) {
+				if (counter->GetSlotType() == LOCAL_SLOT) {
+					s.slots_[counter->GetSlotIndex()] = counter_type;
+					RecordSlot(counter->GetSlotIndex(), counter_type);
+					counter->SetInferredType(counter_type);
+				}
+				else {
+					counter->SetInferredType(DYNAMIC_INFERRED);
+				}
+			}
+
+			InferStatementList(body, s);
+			for (std::vector<TypeState>::iterator it = continue_states.begin(); it != continue_states.end(); ++it) {
+				s = Join(s, *it);
+			}
+			if (post != NULL && s.reachable_) {
+				InferExpression(post, s);
+			}
+
+			TypeState next = Join(head, s);
+			if (next == head) {
+				break;
+			}
+			head = next;
+		}
+
+		for (std::vector<TypeState>::iterator it = break_states.begin(); it != break_states.end(); ++it) {
+			exit = Join(exit, *it);
+		}
+		state = exit;
+
+		break_states_ = saved_break_states;
+		continue_states_ = saved_continue_states;
+	}
+
+	//
+	// The body of a parallel foreach starts from the state before the loop
+	// with its reductions at 0, and since its writes stay in the workers
+	// that state is also what follows the loop, with the reductions summed
+	// to anything. The values a generator yields may be anything.
+	//
+	void LJ_TypeInference::InferForeachStatement(Statement *statement, TypeState &state)
+	{
+		ForeachStatement *foreach = static_cast<ForeachStatement *>(statement);
+		std::vector<IdentifierExpression *> &reductions = foreach->GetReductions();
+		TypeState entry;
+
+		InferExpression((Expression *)statement->GetValue(1), state);
+		if (foreach->IteratesGenerator()) {
+			InferLoop(NULL, NULL, (StatementList *)((Block *)statement->GetValue(3))->GetValue(0), state,
+				static_cast<IdentifierExpression *>((Expression *)statement->GetValue(0)), DYNAMIC_INFERRED);
+			return;
+		}
+		InferExpression((Expression *)statement->GetValue(2), state);
+		entry = state;
+
+		if (foreach->IsParallel()) {
+			for (std::vector<IdentifierExpression *>::iterator it = reductions.begin(); it != reductions.end(); ++it) {
+				if ((*it)->GetSlotType() == LOCAL_SLOT) {
+					state.slots_[(*it)->GetSlotIndex()] = INT_INFERRED;
+				}
+			}
+		}
+
+		InferLoop(NULL, NULL, (StatementList *)((Block *)statement->GetValue(3))->GetValue(0), state,
+			static_cast<IdentifierExpression *>((Expression *)statement->GetValue(0)));
+
+		if (foreach->IsParallel()) {
+			state = entry;
+			for (std::vector<IdentifierExpression *>::iterator it = reductions.begin(); it != reductions.end(); ++it) {
+				if ((*it)->GetSlotType() == LOCAL_SLOT) {
+					state.slots_[(*it)->GetSlotIndex()] = DYNAMIC_INFERRED;
+					RecordSlot((*it)->GetSlotIndex(), DYNAMIC_INFERRED);
+				}
+			}
+		}
+	}
+
+	void LJ_TypeInference::InferReturnStatement(Statement *statement, TypeState &state)
+	{
+		Expression *expr = (Expression *)statement->GetValue(0);
+		InferredType type = expr != NULL ? InferExpression(expr, state) : DYNAMIC_INFERRED;
+
+		if (function_ != NULL) {
+			InferredType return_type = function_->GetReturnType();
+			Widen(&return_type, type);
+			function_->SetReturnType(return_type);
+		}
+		state.reachable_ = 0;
+	}
+
+	InferredType LJ_TypeInference::InferExpression(Expression *expr, TypeState &state)
+	{
+		InferredType type;
+
+		switch (expr->GetType()) {
+		case BOOLEAN_EXPRESSION:
+		case TRUE_EXPRESSION:
+		case FALSE_EXPRESSION:
+			type = BOOLEAN_INFERRED;
+			break;
+		case INT_EXPRESSION:
+			type = INT_INFERRED;
+			break;
+		case DOUBLE_EXPRESSION:
+			type = DOUBLE_INFERRED;
+			break;
+		case STRING_EXPRESSION:
+		case NULL_EXPRESSION:
+			type = DYNAMIC_INFERRED;
+			break;
+		case IDENTIFIER_EXPRESSION:
+			type = InferIdentifierExpression(expr, state);
+			break;
+		case ASSIGN_EXPRESSION:
+			type = InferAssignExpression(expr, state);
+			break;
+		case ADD_EXPRESSION:
+		case SUB_EXPRESSION:
+		case MUL_EXPRESSION:
+		case DIV_EXPRESSION:
+		case MOD_EXPRESSION:
+			type = InferArithmeticExpression(expr, state);
+			break;
+		case EQ_EXPRESSION:
+		case NE_EXPRESSION:
+		case GT_EXPRESSION:
+		case GE_EXPRESSION:
+		case LT_EXPRESSION:
+		case LE_EXPRESSION:
+			// A comparison either fails or yields a boolean.
+			InferExpression((Expression *)expr->GetValue(0), state);
+			InferExpression((Expression *)expr->GetValue(1), state);
+			type = BOOLEAN_INFERRED;
+			break;
+		case LOGICAL_AND_EXPRESSION:
+		case LOGICAL_OR_EXPRESSION: {
+			InferExpression((Expression *)expr->GetValue(0), state);
+			TypeState right = state;
+			InferExpression((Expression *)expr->GetValue(1), right);
+			state = Join(state, right);
+			type = BOOLEAN_INFERRED;
+			break;
+		}
+		case MINUS_EXPRESSION:
+			type = InferExpression((Expression *)expr->GetValue(0), state);
+			if (type != INT_INFERRED && type != DOUBLE_INFERRED && type != UNINFERRED) {
+				type = DYNAMIC_INFERRED;
+			}
+			break;
+		case EXCLAMATION_EXPRESSION:
+			InferExpression((Expression *)expr->GetValue(0), state);
+			type = BOOLEAN_INFERRED;
+			break;
+		case FUNCTION_CALL_EXPRESSION:
+			type = InferFunctionCallExpression(expr, state);
+			break;
+		case INDEX_EXPRESSION:
+			// Any store may box a packed array, so an element is dynamic.
+			InferExpression((Expression *)expr->GetValue(0), state);
+			InferExpression((Expression *)expr->GetValue(1), state);
+			type = DYNAMIC_INFERRED;
+			break;
+		case MEMBER_EXPRESSION:
+			InferExpression((Expression *)expr->GetValue(0), state);
+			type = DYNAMIC_INFERRED;
+			break;
+		case ARRAY_EXPRESSION:
+		case DICT_EXPRESSION:
+		case RECORD_EXPRESSION: {
+			ArgumentList *elements = (ArgumentList *)expr->GetValue(0);
+			for (ArgumentList::iterator it = elements->begin(); it != elements->end(); ++it) {
+				InferExpression(*it, state);
+			}
+			type = DYNAMIC_INFERRED;
+			break;
+		}
+		default:
+			LJ_TRAP();
+			type = DYNAMIC_INFERRED;
+		}
+
+		expr->SetInferredType(type);
+		return type;
+	}
+
+	InferredType LJ_TypeInference::InferIdentifierExpression(Expression *expr, TypeState &state)
+	{
+		IdentifierExpression *identifier = static_cast<IdentifierExpression *>(expr);
+
+		if (identifier->GetSlotType() != LOCAL_SLOT) {
+			return DYNAMIC_INFERRED;
+		}
+
+		InferredType type = state.slots_[identifier->GetSlotIndex()];
+		RecordSlot(identifier->GetSlotIndex(), type);
+		return type;
+	}
+
+	InferredType LJ_TypeInference::InferAssignExpression(Expression *expr, TypeState &state)
+	{
+		Expression *left = (Expression *)expr->GetValue(0);
+		InferredType type = InferExpression((Expression *)expr->GetValue(1), state);
+
+		// The element is stored through its array after the value is known,
+		// the unboxed paths have nothing to store into. Fields likewise.
+		if (left->GetType() == INDEX_EXPRESSION || left->GetType() == MEMBER_EXPRESSION) {
+			InferExpression(left, state);
+			return DYNAMIC_INFERRED;
+		}
+
+		if (left->GetType() != IDENTIFIER_EXPRESSION) {
+			return type;
+		}
+
+		IdentifierExpression *identifier = static_cast<IdentifierExpression *>(left);
+		if (identifier->GetSlotType() == LOCAL_SLOT) {
+			state.slots_[identifier->GetSlotIndex()] = type;
+			RecordSlot(identifier->GetSlotIndex(), type);
+			left->SetInferredType(type);
+		}
+		else {
+			left->SetInferredType(DYNAMIC_INFERRED);
+		}
+		return type;
+	}
+
+	//
+	// int op int is an int, int and double mixed are a double, like in
+	// EvalBinaryOperator. Anything else may be a string, null or an error.
+	//
+	InferredType LJ_TypeInference::InferArithmeticExpression(Expression *expr, TypeState &state)
+	{
+		InferredType left = InferExpression((Expression *)expr->GetValue(0), state);
+		InferredType right = InferExpression((Expression *)expr->GetValue(1), state);
+
+		if (left == UNINFERRED || right == UNINFERRED) {
+			return UNINFERRED;
+		}
+		if (left == INT_INFERRED && right == INT_INFERRED) {
+			return INT_INFERRED;
+		}
+		if ((left == INT_INFERRED || left == DOUBLE_INFERRED) && (right == INT_INFERRED || right == DOUBLE_INFERRED)) {
+			return DOUBLE_INFERRED;
+		}
+		return DYNAMIC_INFERRED;
+	}
+
+	InferredType LJ_TypeInference::InferFunctionCallExpression(Expression *e, TypeState &state)
+	{
+		BinaryExpression<FUNCTION_CALL_EXPRESSION> *expr = static_cast<BinaryExpression<FUNCTION_CALL_EXPRESSION> *>(e);
+		FunctionDefinition *func = expr->GetFunction();
+		std::map<FunctionDefinition *, std::vector<InferredType> >::iterator params = param_types_.find(func);
+		int i = 0;
+
+		if (expr->GetArgList() != NULL) {
+			for (ArgumentList::iterator it = expr->GetArgList()->begin(); it != expr->GetArgList()->end(); ++it, i++) {
+				InferredType type = InferExpression(*it, state);
+				if (params != param_types_.end()) {
+					Widen(&params->second[i], type);
+				}
+			}
+		}
+
+		// A call to a generator function returns the generator.
+		if (params == param_types_.end() || func->IsGenerator()) {
+			return DYNAMIC_INFERRED;
+		}
+		return func->GetReturnType();
+	}
+}
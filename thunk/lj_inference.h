@@ -0,0 +1,79 @@
+#ifndef __LJ_INFERENCE_H__
+#define __LJ_INFERENCE_H__
+
+#include <map>
+#include <vector>
+#include "lj_ast.h"
+
+namespace LJ {
+
+	class LJ_Driver;
+
+	//
+	// Runs after LJ_Optimizer and annotates every reachable expression and
+	// every frame slot with an InferredType. Locals are followed through the
+	// statements of their function, so a slot may be an int in one place and
+	// a double in another. Literals, the operator rules of
+	// EvalBinaryExpression and, across functions, the argument types of all
+	// call sites and the types of all returns feed the analysis. Globals are
+	// always dynamic. Everything is recomputed until no parameter or return
+	// type changes.
+	//
+	class LJ_TypeInference {
+	public:
+		LJ_TypeInference(LJ_Driver *driver);
+		~LJ_TypeInference();
+
+		void Infer();
+		void Dump();
+
+	private:
+		//
+		// Types of the current function's slots at one point of the program,
+		// an unreachable state joins as the identity.
+		//
+		struct TypeState {
+			TypeState() : reachable_(0) {}
+
+			bool operator==(const TypeState &other) const {
+				return reachable_ == other.reachable_ && slots_ == other.slots_;
+			}
+
+			boolean reachable_;
+			std::vector<InferredType> slots_;
+		};
+
+		static InferredType Join(InferredType a, InferredType b);
+		static TypeState Join(const TypeState &a, const TypeState &b);
+
+		void InferFunction(FunctionDefinition *func);
+		void InferMain();
+
+		void InferStatementList(StatementList *list, TypeState &state);
+		void InferStatement(Statement *statement, TypeState &state);
+		void InferIfStatement(Statement *statement, TypeState &state);
+		void InferLoop(Expression *condition, Expression *post, StatementList *body, TypeState &state,
+			IdentifierExpression *counter = NULL, InferredType counter_type = INT_INFERRED);
+		void InferForeachStatement(Statement *statement, TypeState &state);
+		void InferReturnStatement(Statement *statement, TypeState &state);
+
+		InferredType InferExpression(Expression *expr, TypeState &state);
+		InferredType InferIdentifierExpression(Expression *expr, TypeState &state);
+		InferredType InferAssignExpression(Expression *expr, TypeState &state);
+		InferredType InferArithmeticExpression(Expression *expr, TypeState &state);
+		InferredType InferFunctionCallExpression(Expression *expr, TypeState &state);
+
+		void RecordSlot(int slot, InferredType type);
+		void Widen(InferredType *type, InferredType with);
+
+		LJ_Driver *driver_;
+		std::vector<FunctionDefinition *> functions_;
+		std::map<FunctionDefinition *, std::vector<InferredType> > param_types_;
+		FunctionDefinition *function_;
+		std::vector<TypeState> *break_states_;
+		std::vector<TypeState> *continue_states_;
+		boolean changed_;
+	};
+}
+
+#endif
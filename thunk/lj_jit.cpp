@@ -0,0 +1,513 @@
+#include <stddef.h>
+#include <string.h>
+#include "lj_jit.h"
+
+#if LJ_JIT_SUPPORTED
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#endif
+#endif
+
+namespace LJ {
+
+	// Registers of the generated code. r10 holds the frame base for the whole
+	// function, nothing else lives across instructions.
+#define RAX		0
+#define RCX		1
+#define RDX		2
+#define XMM0	0
+
+	// Condition codes of jcc and setcc.
+#define CC_E	0x4
+#define CC_NE	0x5
+#define CC_AE	0x3
+#define CC_A	0x7
+#define CC_P	0xA
+#define CC_NP	0xB
+#define CC_L	0xC
+#define CC_GE	0xD
+#define CC_LE	0xE
+#define CC_G	0xF
+
+#define TYPE_OFFSET(r)		((int)((r) * sizeof(Value) + offsetof(Value, type_)))
+#define PAYLOAD_OFFSET(r)	((int)((r) * sizeof(Value) + offsetof(Value, int_value_)))
+
+	static_assert(sizeof(ValueType) == 4, "the JIT compares value types as dwords");
+	static_assert(sizeof(Value) == 16, "the JIT addresses registers in 16 byte steps");
+
+	LJ_JIT::LJ_JIT()
+		: proto_(NULL)
+	{
+
+	}
+
+	LJ_JIT::~LJ_JIT()
+	{
+#if LJ_JIT_SUPPORTED
+		for (std::vector<std::pair<void *, size_t> >::iterator it = blocks_.begin(); it != blocks_.end(); ++it) {
+#ifdef _WIN32
+			VirtualFree(it->first, 0, MEM_RELEASE);
+#else
+			munmap(it->first, it->second);
+#endif
+		}
+#endif
+	}
+
+	void LJ_JIT::Emit8(unsigned char b)
+	{
+		code_.push_back(b);
+	}
+
+	void LJ_JIT::Emit32(int v)
+	{
+		for (int i = 0; i < 4; i++) {
+			Emit8((unsigned char)(v >> (i * 8)));
+		}
+	}
+
+	void LJ_JIT::Emit64(__int64 v)
+	{
+		for (int i = 0; i < 8; i++) {
+			Emit8((unsigned char)(v >> (i * 8)));
+		}
+	}
+
+	//
+	// Emits an instruction whose r/m operand is [r10 + disp32]. prefix and op1
+	// are left out when 0.
+	//
+	void LJ_JIT::EmitMem(unsigned char prefix, unsigned char rex, unsigned char op0, unsigned char op1,
+		int reg, int disp)
+	{
+		if (prefix != 0) {
+			Emit8(prefix);
+		}
+		Emit8(rex);
+		Emit8(op0);
+		if (op1 != 0) {
+			Emit8(op1);
+		}
+		Emit8((unsigned char)(0x80 | ((reg & 7) << 3) | 2));
+		Emit32(disp);
+	}
+
+	void LJ_JIT::EmitTypeGuard(int reg, ValueType type, size_t pc)
+	{
+		// cmp dword [r10 + type], imm32; jne exit
+		EmitMem(0, 0x41, 0x81, 0, 7, TYPE_OFFSET(reg));
+		Emit32(type);
+		EmitJcc(CC_NE, pc, true);
+	}
+
+	void LJ_JIT::EmitStoreType(int reg, ValueType type)
+	{
+		// mov dword [r10 + type], imm32
+		EmitMem(0, 0x41, 0xC7, 0, 0, TYPE_OFFSET(reg));
+		Emit32(type);
+	}
+
+	void LJ_JIT::EmitJump(size_t target)
+	{
+		Fixup f = { 0, target, false };
+
+		Emit8(0xE9);
+		f.pos_ = code_.size();
+		Emit32(0);
+		fixups_.push_back(f);
+	}
+
+	void LJ_JIT::EmitJcc(int cc, size_t target, bool exit)
+	{
+		Fixup f = { 0, target, exit };
+
+		Emit8(0x0F);
+		Emit8((unsigned char)(0x80 | cc));
+		f.pos_ = code_.size();
+		Emit32(0);
+		fixups_.push_back(f);
+	}
+
+	size_t LJ_JIT::EmitJccForward(int cc)
+	{
+		Emit8(0x0F);
+		Emit8((unsigned char)(0x80 | cc));
+		Emit32(0);
+		return code_.size() - 4;
+	}
+
+	void LJ_JIT::BindForward(size_t pos)
+	{
+		int rel = (int)(code_.size() - (pos + 4));
+		memcpy(&code_[pos], &rel, 4);
+	}
+
+	void LJ_JIT::EmitExit(size_t pc)
+	{
+		// mov eax, pc; ret
+		Emit8(0xB8);
+		Emit32((int)pc);
+		Emit8(0xC3);
+	}
+
+	void LJ_JIT::CompileArith(const Instruction &i, size_t pc)
+	{
+		size_t not_int;
+
+		EmitMem(0, 0x41, 0x81, 0, 7, TYPE_OFFSET(i.b_));
+		Emit32(INT_VALUE);
+		not_int = EmitJccForward(CC_NE);
+		EmitTypeGuard(i.c_, INT_VALUE, pc);
+
+		EmitMem(0, 0x49, 0x8B, 0, RAX, PAYLOAD_OFFSET(i.b_));
+		switch (i.op_) {
+		case OP_ADD:
+			EmitMem(0, 0x49, 0x03, 0, RAX, PAYLOAD_OFFSET(i.c_));
+			break;
+		case OP_SUB:
+			EmitMem(0, 0x49, 0x2B, 0, RAX, PAYLOAD_OFFSET(i.c_));
+			break;
+		default:
+			EmitMem(0, 0x49, 0x0F, 0xAF, RAX, PAYLOAD_OFFSET(i.c_));
+			break;
+		}
+		EmitMem(0, 0x49, 0x89, 0, RAX, PAYLOAD_OFFSET(i.a_));
+		EmitStoreType(i.a_, INT_VALUE);
+		EmitJump(pc + 1);
+
+		BindForward(not_int);
+		EmitTypeGuard(i.b_, DOUBLE_VALUE, pc);
+		EmitTypeGuard(i.c_, DOUBLE_VALUE, pc);
+		EmitMem(0xF2, 0x41, 0x0F, 0x10, XMM0, PAYLOAD_OFFSET(i.b_));
+		switch (i.op_) {
+		case OP_ADD:
+			EmitMem(0xF2, 0x41, 0x0F, 0x58, XMM0, PAYLOAD_OFFSET(i.c_));
+			break;
+		case OP_SUB:
+			EmitMem(0xF2, 0x41, 0x0F, 0x5C, XMM0, PAYLOAD_OFFSET(i.c_));
+			break;
+		default:
+			EmitMem(0xF2, 0x41, 0x0F, 0x59, XMM0, PAYLOAD_OFFSET(i.c_));
+			break;
+		}
+		EmitMem(0xF2, 0x41, 0x0F, 0x11, XMM0, PAYLOAD_OFFSET(i.a_));
+		EmitStoreType(i.a_, DOUBLE_VALUE);
+	}
+
+	//
+	// Integer division by 0 or -1 is left to the VM. Double MOD needs fmod
+	// and always leaves.
+	//
+	void LJ_JIT::CompileDivMod(const Instruction &i, size_t pc)
+	{
+		size_t not_int;
+
+		EmitMem(0, 0x41, 0x81, 0, 7, TYPE_OFFSET(i.b_));
+		Emit32(INT_VALUE);
+		if (i.op_ == OP_MOD) {
+			EmitJcc(CC_NE, pc, true);
+			not_int = 0;
+		}
+		else {
+			not_int = EmitJccForward(CC_NE);
+		}
+		EmitTypeGuard(i.c_, INT_VALUE, pc);
+
+		EmitMem(0, 0x49, 0x8B, 0, RAX, PAYLOAD_OFFSET(i.b_));
+		EmitMem(0, 0x49, 0x8B, 0, RCX, PAYLOAD_OFFSET(i.c_));
+		// test rcx, rcx; je exit; cmp rcx, -1; je exit
+		Emit8(0x48); Emit8(0x85); Emit8(0xC9);
+		EmitJcc(CC_E, pc, true);
+		Emit8(0x48); Emit8(0x83); Emit8(0xF9); Emit8(0xFF);
+		EmitJcc(CC_E, pc, true);
+		// cqo; idiv rcx
+		Emit8(0x48); Emit8(0x99);
+		Emit8(0x48); Emit8(0xF7); Emit8(0xF9);
+		EmitMem(0, 0x49, 0x89, 0, i.op_ == OP_DIV ? RAX : RDX, PAYLOAD_OFFSET(i.a_));
+		EmitStoreType(i.a_, INT_VALUE);
+
+		if (i.op_ == OP_MOD) {
+			return;
+		}
+
+		EmitJump(pc + 1);
+		BindForward(not_int);
+		EmitTypeGuard(i.b_, DOUBLE_VALUE, pc);
+		EmitTypeGuard(i.c_, DOUBLE_VALUE, pc);
+		EmitMem(0xF2, 0x41, 0x0F, 0x10, XMM0, PAYLOAD_OFFSET(i.b_));
+		EmitMem(0xF2, 0x41, 0x0F, 0x5E, XMM0, PAYLOAD_OFFSET(i.c_));
+		EmitMem(0xF2, 0x41, 0x0F, 0x11, XMM0, PAYLOAD_OFFSET(i.a_));
+		EmitStoreType(i.a_, DOUBLE_VALUE);
+	}
+
+	//
+	// Double comparisons follow the C++ operators the VM uses, so every
+	// comparison with NaN but != is false.
+	//
+	void LJ_JIT::CompileCompare(const Instruction &i, size_t pc)
+	{
+		static const int int_cc[] = { CC_E, CC_NE, CC_G, CC_GE, CC_L, CC_LE };
+		int op = i.op_ - OP_EQ;
+		size_t not_int;
+		size_t done;
+
+		EmitMem(0, 0x41, 0x81, 0, 7, TYPE_OFFSET(i.b_));
+		Emit32(INT_VALUE);
+		not_int = EmitJccForward(CC_NE);
+		EmitTypeGuard(i.c_, INT_VALUE, pc);
+
+		// mov rax, b; cmp rax, c; setcc al
+		EmitMem(0, 0x49, 0x8B, 0, RAX, PAYLOAD_OFFSET(i.b_));
+		EmitMem(0, 0x49, 0x3B, 0, RAX, PAYLOAD_OFFSET(i.c_));
+		Emit8(0x0F); Emit8((unsigned char)(0x90 | int_cc[op])); Emit8(0xC0);
+		Emit8(0xE9);
+		done = code_.size();
+		Emit32(0);
+
+		BindForward(not_int);
+		EmitTypeGuard(i.b_, DOUBLE_VALUE, pc);
+		EmitTypeGuard(i.c_, DOUBLE_VALUE, pc);
+
+		// LT and LE compare with swapped operands so unordered is false.
+		if (i.op_ == OP_LT || i.op_ == OP_LE) {
+			EmitMem(0xF2, 0x41, 0x0F, 0x10, XMM0, PAYLOAD_OFFSET(i.c_));
+			EmitMem(0x66, 0x41, 0x0F, 0x2E, XMM0, PAYLOAD_OFFSET(i.b_));
+		}
+		else {
+			EmitMem(0xF2, 0x41, 0x0F, 0x10, XMM0, PAYLOAD_OFFSET(i.b_));
+			EmitMem(0x66, 0x41, 0x0F, 0x2E, XMM0, PAYLOAD_OFFSET(i.c_));
+		}
+
+		switch (i.op_) {
+		case OP_EQ:
+			// sete al; setnp cl; and al, cl
+			Emit8(0x0F); Emit8(0x90 | CC_E); Emit8(0xC0);
+			Emit8(0x0F); Emit8(0x90 | CC_NP); Emit8(0xC1);
+			Emit8(0x20); Emit8(0xC8);
+			break;
+		case OP_NE:
+			// setne al; setp cl; or al, cl
+			Emit8(0x0F); Emit8(0x90 | CC_NE); Emit8(0xC0);
+			Emit8(0x0F); Emit8(0x90 | CC_P); Emit8(0xC1);
+			Emit8(0x08); Emit8(0xC8);
+			break;
+		case OP_GT:
+		case OP_LT:
+			Emit8(0x0F); Emit8(0x90 | CC_A); Emit8(0xC0);
+			break;
+		default:
+			Emit8(0x0F); Emit8(0x90 | CC_AE); Emit8(0xC0);
+			break;
+		}
+
+		BindForward(done);
+		// movzx eax, al
+		Emit8(0x0F); Emit8(0xB6); Emit8(0xC0);
+		EmitMem(0, 0x49, 0x89, 0, RAX, PAYLOAD_OFFSET(i.a_));
+		EmitStoreType(i.a_, BOOLEAN_VALUE);
+	}
+
+	//
+	// Returns false when the instruction has no native template and always
+	// leaves to the VM.
+	//
+	bool LJ_JIT::CompileInstruction(const Instruction &i, size_t pc)
+	{
+		size_t not_int;
+
+		switch (i.op_) {
+		case OP_MOVE:
+			EmitMem(0, 0x41, 0x81, 0, 7, TYPE_OFFSET(i.b_));
+			Emit32(UNDEFINED_VALUE);
+			EmitJcc(CC_E, pc, true);
+			EmitMem(0, 0x49, 0x8B, 0, RAX, TYPE_OFFSET(i.b_));
+			EmitMem(0, 0x49, 0x89, 0, RAX, TYPE_OFFSET(i.a_));
+			EmitMem(0, 0x49, 0x8B, 0, RAX, PAYLOAD_OFFSET(i.b_));
+			EmitMem(0, 0x49, 0x89, 0, RAX, PAYLOAD_OFFSET(i.a_));
+			return true;
+		case OP_LOADK: {
+			// Constants never change once compiled, their payload is an immediate.
+			const Value &k = proto_->constants_[i.bx_];
+			__int64 payload;
+			memcpy(&payload, &k.int_value_, sizeof(payload));
+			EmitStoreType(i.a_, k.GetType());
+			Emit8(0x48); Emit8(0xB8); Emit64(payload);
+			EmitMem(0, 0x49, 0x89, 0, RAX, PAYLOAD_OFFSET(i.a_));
+			return true;
+		}
+		case OP_LOADBOOL:
+			EmitStoreType(i.a_, BOOLEAN_VALUE);
+			EmitMem(0, 0x49, 0xC7, 0, 0, PAYLOAD_OFFSET(i.a_));
+			Emit32(i.b_ != 0);
+			return true;
+		case OP_LOADNULL:
+			EmitStoreType(i.a_, NULL_VALUE);
+			EmitMem(0, 0x49, 0xC7, 0, 0, PAYLOAD_OFFSET(i.a_));
+			Emit32(0);
+			return true;
+		case OP_ADD:
+		case OP_SUB:
+		case OP_MUL:
+			CompileArith(i, pc);
+			return true;
+		case OP_DIV:
+		case OP_MOD:
+			CompileDivMod(i, pc);
+			return true;
+		case OP_EQ:
+		case OP_NE:
+		case OP_GT:
+		case OP_GE:
+		case OP_LT:
+		case OP_LE:
+			CompileCompare(i, pc);
+			return true;
+		case OP_MINUS:
+			EmitMem(0, 0x41, 0x81, 0, 7, TYPE_OFFSET(i.b_));
+			Emit32(INT_VALUE);
+			not_int = EmitJccForward(CC_NE);
+			// mov rax, b; neg rax
+			EmitMem(0, 0x49, 0x8B, 0, RAX, PAYLOAD_OFFSET(i.b_));
+			Emit8(0x48); Emit8(0xF7); Emit8(0xD8);
+			EmitMem(0, 0x49, 0x89, 0, RAX, PAYLOAD_OFFSET(i.a_));
+			EmitStoreType(i.a_, INT_VALUE);
+			EmitJump(pc + 1);
+
+			BindForward(not_int);
+			EmitTypeGuard(i.b_, DOUBLE_VALUE, pc);
+			// mov rax, b; mov rcx, sign bit; xor rax, rcx
+			EmitMem(0, 0x49, 0x8B, 0, RAX, PAYLOAD_OFFSET(i.b_));
+			Emit8(0x48); Emit8(0xB9); Emit64((__int64)0x8000000000000000ULL);
+			Emit8(0x48); Emit8(0x31); Emit8(0xC8);
+			EmitMem(0, 0x49, 0x89, 0, RAX, PAYLOAD_OFFSET(i.a_));
+			EmitStoreType(i.a_, DOUBLE_VALUE);
+			return true;
+		case OP_NOT:
+			EmitTypeGuard(i.b_, BOOLEAN_VALUE, pc);
+			// cmp byte b, 0; sete al; movzx eax, al
+			EmitMem(0, 0x41, 0x80, 0, 7, PAYLOAD_OFFSET(i.b_));
+			Emit8(0);
+			Emit8(0x0F); Emit8(0x90 | CC_E); Emit8(0xC0);
+			Emit8(0x0F); Emit8(0xB6); Emit8(0xC0);
+			EmitMem(0, 0x49, 0x89, 0, RAX, PAYLOAD_OFFSET(i.a_));
+			EmitStoreType(i.a_, BOOLEAN_VALUE);
+			return true;
+		case OP_TESTBOOL:
+			EmitTypeGuard(i.a_, BOOLEAN_VALUE, pc);
+			return true;
+		case OP_JMP:
+			EmitJump(pc + 1 + i.bx_);
+			return true;
+		case OP_JMPFALSE:
+		case OP_JMPTRUE:
+			EmitTypeGuard(i.a_, BOOLEAN_VALUE, pc);
+			EmitMem(0, 0x41, 0x80, 0, 7, PAYLOAD_OFFSET(i.a_));
+			Emit8(0);
+			EmitJcc(i.op_ == OP_JMPFALSE ? CC_E : CC_NE, pc + 1 + i.bx_, false);
+			return true;
+		default:
+			return false;
+		}
+	}
+
+	bool LJ_JIT::Compile(FunctionProto *proto)
+	{
+#if LJ_JIT_SUPPORTED
+		size_t count = proto->code_.size();
+		std::vector<size_t> exits(count + 1, 0);
+		size_t table_disp;
+		size_t table_offset;
+		size_t size;
+		unsigned char *mem;
+
+		proto_ = proto;
+		code_.clear();
+		fixups_.clear();
+		labels_.assign(count + 1, 0);
+
+#ifdef _WIN32
+		// mov r10, rcx; mov eax, edx
+		Emit8(0x49); Emit8(0x89); Emit8(0xCA);
+		Emit8(0x89); Emit8(0xD0);
+#else
+		// mov r10, rdi; mov eax, esi
+		Emit8(0x49); Emit8(0x89); Emit8(0xFA);
+		Emit8(0x89); Emit8(0xF0);
+#endif
+		// lea r11, [rip + table]; jmp [r11 + rax * 8]
+		Emit8(0x4C); Emit8(0x8D); Emit8(0x1D);
+		table_disp = code_.size();
+		Emit32(0);
+		Emit8(0x41); Emit8(0xFF); Emit8(0x24); Emit8(0xC3);
+
+		for (size_t pc = 0; pc < count; pc++) {
+			labels_[pc] = code_.size();
+			if (!CompileInstruction(proto->code_[pc], pc)) {
+				EmitExit(pc);
+			}
+		}
+		labels_[count] = code_.size();
+		EmitExit(count);
+
+		for (std::vector<Fixup>::iterator it = fixups_.begin(); it != fixups_.end(); ++it) {
+			size_t target;
+			int rel;
+
+			if (it->exit_) {
+				if (exits[it->target_] == 0) {
+					exits[it->target_] = code_.size();
+					EmitExit(it->target_);
+				}
+				target = exits[it->target_];
+			}
+			else {
+				target = labels_[it->target_];
+			}
+
+			rel = (int)(target - (it->pos_ + 4));
+			memcpy(&code_[it->pos_], &rel, 4);
+		}
+
+		while (code_.size() % sizeof(void *) != 0) {
+			Emit8(0xCC);
+		}
+		table_offset = code_.size();
+		int rel = (int)(table_offset - (table_disp + 4));
+		memcpy(&code_[table_disp], &rel, 4);
+
+		size = table_offset + count * sizeof(void *);
+#ifdef _WIN32
+		mem = (unsigned char *)VirtualAlloc(NULL, size, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+		if (mem == NULL) {
+			return false;
+		}
+#else
+		mem = (unsigned char *)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (mem == MAP_FAILED) {
+			return false;
+		}
+#endif
+
+		memcpy(mem, &code_[0], code_.size());
+		for (size_t pc = 0; pc < count; pc++) {
+			void *entry = mem + labels_[pc];
+			memcpy(mem + table_offset + pc * sizeof(void *), &entry, sizeof(void *));
+		}
+
+#ifdef _WIN32
+		DWORD old_protect;
+		VirtualProtect(mem, size, PAGE_EXECUTE_READ, &old_protect);
+#else
+		mprotect(mem, size, PROT_READ | PROT_EXEC);
+#endif
+
+		blocks_.push_back(std::make_pair((void *)mem, size));
+		proto->jit_entry_ = (JitEntry)mem;
+		return true;
+#else
+		return false;
+#endif
+	}
+}
@@ -0,0 +1,69 @@
+#ifndef __LJ_JIT_H__
+#define __LJ_JIT_H__
+
+#include <vector>
+#include "lj_bytecode.h"
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define LJ_JIT_SUPPORTED	1
+#else
+#define LJ_JIT_SUPPORTED	0
+#endif
+
+#define JIT_CALL_THRESHOLD	64
+#define JIT_LOOP_THRESHOLD	1024
+
+namespace LJ {
+
+	//
+	// Baseline template JIT for x86-64. Every instruction of a FunctionProto
+	// becomes a fixed sequence of machine code working on the VM's register
+	// file. Moves, loads, branches and int or double arithmetic and
+	// comparisons run natively behind type guards. Calls, returns, globals
+	// and every operand mix without a fast path leave native code with the pc
+	// of that instruction, the VM executes it and enters native code again
+	// after it. Native code never allocates and never reports an error, so
+	// leaving it needs no state besides the pc. For the same reason a function
+	// whose loop gets hot can switch to native code in the middle of a call.
+	//
+	class LJ_JIT {
+	public:
+		LJ_JIT();
+		~LJ_JIT();
+
+		bool Compile(FunctionProto *proto);
+
+	private:
+		struct Fixup {
+			size_t pos_;
+			size_t target_;
+			bool exit_;
+		};
+
+		void Emit8(unsigned char b);
+		void Emit32(int v);
+		void Emit64(__int64 v);
+		void EmitMem(unsigned char prefix, unsigned char rex, unsigned char op0, unsigned char op1,
+			int reg, int disp);
+		void EmitTypeGuard(int reg, ValueType type, size_t pc);
+		void EmitStoreType(int reg, ValueType type);
+		void EmitJump(size_t target);
+		void EmitJcc(int cc, size_t target, bool exit);
+		size_t EmitJccForward(int cc);
+		void BindForward(size_t pos);
+		void EmitExit(size_t pc);
+
+		void CompileArith(const Instruction &i, size_t pc);
+		void CompileDivMod(const Instruction &i, size_t pc);
+		void CompileCompare(const Instruction &i, size_t pc);
+		bool CompileInstruction(const Instruction &i, size_t pc);
+
+		FunctionProto *proto_;
+		std::vector<unsigned char> code_;
+		std::vector<size_t> labels_;
+		std::vector<Fixup> fixups_;
+		std::vector<std::pair<void *, size_t> > blocks_;
+	};
+}
+
+#endif
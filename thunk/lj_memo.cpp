@@ -0,0 +1,95 @@
+#include "lj_driver.hpp"
+#include "lj_memo.h"
+
+namespace LJ {
+
+	MemoCache::MemoCache(size_t capacity)
+		: hits_(0), misses_(0), evictions_(0), capacity_(capacity)
+	{
+
+	}
+
+	MemoCache::~MemoCache()
+	{
+
+	}
+
+	//
+	// Each argument is its type followed by its payload. Doubles compare by
+	// their bits, so 0.0 and -0.0 are different keys.
+	//
+	void MemoCache::MakeKey(const Value *args, size_t count, std::string *key)
+	{
+		key->clear();
+		for (size_t i = 0; i < count; i++) {
+			const Value &v = args[i];
+
+			key->push_back((char)v.GetType());
+			switch (v.GetType()) {
+			case BOOLEAN_VALUE:
+				key->push_back((char)TO_BOOLEAN_VALUE(v));
+				break;
+			case INT_VALUE:
+			case DOUBLE_VALUE:
+				key->append((const char *)&v.int_value_, sizeof(v.int_value_));
+				break;
+			case STRING_VALUE: {
+				size_t length = v.string_value_->GetLength();
+				key->append((const char *)&length, sizeof(length));
+				v.string_value_->AppendTo(*key);
+				break;
+			}
+			case GENERATOR_VALUE:
+			case ARRAY_VALUE:
+			case DICT_VALUE:
+			case RECORD_VALUE:
+				// A pure function can only hand a generator, an array, a
+				// dict or a record back, and then the cached result keeps it
+				// from being reused.
+				key->append((const char *)&v.generator_value_, sizeof(v.generator_value_));
+				break;
+			default:
+				break;
+			}
+		}
+	}
+
+	boolean MemoCache::Lookup(const std::string &key, Value *result)
+	{
+		std::unordered_map<std::string, EntryList::iterator>::iterator it = index_.find(key);
+
+		if (it == index_.end()) {
+			misses_++;
+			return 0;
+		}
+
+		hits_++;
+		entries_.splice(entries_.begin(), entries_, it->second);
+		*result = it->second->second;
+		return 1;
+	}
+
+	void MemoCache::Insert(const std::string &key, const Value &result)
+	{
+		// A recursive call may have cached the same arguments meanwhile.
+		if (index_.find(key) != index_.end()) {
+			return;
+		}
+
+		if (entries_.size() >= capacity_) {
+			index_.erase(entries_.back().first);
+			entries_.pop_back();
+			evictions_++;
+		}
+
+		entries_.push_front(std::make_pair(key, result));
+		index_[key] = entries_.begin();
+	}
+
+	void MemoCache::Mark(LJ_GC *gc)
+	{
+		for (EntryList::iterator it = entries_.begin(); it != entries_.end(); ++it) {
+			gc->MarkValue(it->second);
+		}
+	}
+}
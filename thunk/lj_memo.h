@@ -0,0 +1,42 @@
+#ifndef __LJ_MEMO_H__
+#define __LJ_MEMO_H__
+
+#include <list>
+#include <string>
+#include <unordered_map>
+#include "lj_val.h"
+
+namespace LJ {
+
+	class LJ_GC;
+
+	//
+	// Results of one memo function, keyed by its argument values. Keys are
+	// flat byte strings holding a copy of every argument, so they keep no
+	// heap object alive. A full cache evicts its least recently used entry.
+	//
+	class MemoCache {
+	public:
+		MemoCache(size_t capacity);
+		~MemoCache();
+
+		static void MakeKey(const Value *args, size_t count, std::string *key);
+
+		boolean Lookup(const std::string &key, Value *result);
+		void Insert(const std::string &key, const Value &result);
+		void Mark(LJ_GC *gc);
+
+		size_t hits_;
+		size_t misses_;
+		size_t evictions_;
+
+	private:
+		typedef std::list<std::pair<std::string, Value> > EntryList;
+
+		size_t capacity_;
+		EntryList entries_;
+		std::unordered_map<std::string, EntryList::iterator> index_;
+	};
+}
+
+#endif
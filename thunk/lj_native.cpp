@@ -0,0 +1,532 @@
+#include "lj_driver.hpp"
+#include "lj_native.h"
+#include "lj_scheduler.h"
+#include "lj_simd.h"
+
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+namespace LJ {
+
+	//
+	// open holds the arrays, dicts and records being printed, one inside
+	// itself is printed as [...] or {...}. A dict prints in table order, a
+	// record in the order its fields were added.
+	//
+	static void PrintValue(std::ostream &os, const Value &v, std::vector<HeapObject *> &open)
+	{
+		switch (v.GetType()) {
+		case BOOLEAN_VALUE:
+			os << (TO_BOOLEAN_VALUE(v) ? "true" : "false");
+			break;
+		case INT_VALUE:
+			os << TO_INT_VALUE(v);
+			break;
+		case DOUBLE_VALUE:
+			os << TO_DOUBLE_VALUE(v);
+			break;
+		case STRING_VALUE:
+			v.string_value_->Write(os);
+			break;
+		case NULL_VALUE:
+			os << "null";
+			break;
+		case GENERATOR_VALUE:
+			os << "generator";
+			break;
+		case ARRAY_VALUE: {
+			ArrayObject *a = TO_ARRAY_VALUE(v);
+			if (std::find(open.begin(), open.end(), a) != open.end()) {
+				os << "[...]";
+				break;
+			}
+
+			open.push_back(a);
+			os << "[";
+			for (size_t i = 0; i < a->GetLength(); i++) {
+				if (i != 0) {
+					os << ", ";
+				}
+				PrintValue(os, a->Get(i), open);
+			}
+			os << "]";
+			open.pop_back();
+			break;
+		}
+		case DICT_VALUE: {
+			DictObject *d = TO_DICT_VALUE(v);
+			if (std::find(open.begin(), open.end(), d) != open.end()) {
+				os << "{...}";
+				break;
+			}
+
+			open.push_back(d);
+			os << "{";
+			boolean first = 1;
+			for (std::vector<DictEntry>::iterator it = d->entries_.begin(); it != d->entries_.end(); ++it) {
+				if (it->hash_ == 0) {
+					continue;
+				}
+				if (!first) {
+					os << ", ";
+				}
+				PrintValue(os, it->key_, open);
+				os << ": ";
+				PrintValue(os, it->value_, open);
+				first = 0;
+			}
+			os << "}";
+			open.pop_back();
+			break;
+		}
+		case RECORD_VALUE: {
+			RecordObject *r = TO_RECORD_VALUE(v);
+			if (std::find(open.begin(), open.end(), r) != open.end()) {
+				os << "{...}";
+				break;
+			}
+
+			open.push_back(r);
+			os << "{";
+			for (size_t i = 0; i < r->slots_.size(); i++) {
+				if (i != 0) {
+					os << ", ";
+				}
+				os << "." << r->shape_->GetFieldName(i) << ": ";
+				PrintValue(os, r->slots_[i], open);
+			}
+			os << "}";
+			open.pop_back();
+			break;
+		}
+		default:
+			LJ_TRAP();
+		}
+	}
+
+	void PrintValue(std::ostream &os, const Value &v)
+	{
+		std::vector<HeapObject *> open;
+		PrintValue(os, v, open);
+	}
+
+	static Value NativePrint(LJ_Driver *driver, int arg_count, Value *args, const location &l)
+	{
+		std::ostream &os = *driver->out_;
+
+		for (int i = 0; i < arg_count; i++) {
+			if (i != 0) {
+				os << " ";
+			}
+			PrintValue(os, args[i]);
+		}
+		os << std::endl;
+
+		return NullValue();
+	}
+
+	//
+	// next(g) resumes the generator g and returns what it yields, or null
+	// once it has finished.
+	//
+	static Value NativeNext(LJ_Driver *driver, int arg_count, Value *args, const location &l)
+	{
+		Value v;
+
+		if (arg_count != 1 || args[0].GetType() != GENERATOR_VALUE) {
+			driver->Error(l, "NativeNext error");
+		}
+
+		// The body runs on the value stack args may point into.
+		GeneratorObject *g = TO_GENERATOR_VALUE(args[0]);
+		if (!driver->ResumeGenerator(g, &v, l)) {
+			return NullValue();
+		}
+		return v;
+	}
+
+	//
+	// sleep(ms) waits ms milliseconds and returns null. A task gives its
+	// worker to other tasks meanwhile, anything else blocks its thread.
+	//
+	static Value NativeSleep(LJ_Driver *driver, int arg_count, Value *args, const location &l)
+	{
+		__int64 ms = 0;
+
+		if (arg_count != 1) {
+			driver->Error(l, "NativeSleep error");
+		}
+		if (args[0].GetType() == INT_VALUE) {
+			ms = TO_INT_VALUE(args[0]);
+		}
+		else if (args[0].GetType() == DOUBLE_VALUE) {
+			ms = (__int64)TO_DOUBLE_VALUE(args[0]);
+		}
+		else {
+			driver->Error(l, "NativeSleep error");
+		}
+
+		if (driver->task_ != NULL) {
+			driver->task_->Sleep(ms);
+		}
+		else if (ms > 0) {
+			std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+		}
+		return NullValue();
+	}
+
+	//
+	// len(a) returns the number of elements of the array a, or the number of
+	// keys of the dict a.
+	//
+	static Value NativeLen(LJ_Driver *driver, int arg_count, Value *args, const location &l)
+	{
+		if (arg_count != 1 || (args[0].GetType() != ARRAY_VALUE && args[0].GetType() != DICT_VALUE)) {
+			driver->Error(l, "NativeLen error");
+		}
+		if (args[0].GetType() == DICT_VALUE) {
+			return IntValue((__int64)TO_DICT_VALUE(args[0])->GetLength());
+		}
+		return IntValue((__int64)TO_ARRAY_VALUE(args[0])->GetLength());
+	}
+
+	//
+	// push(a, v) appends v to the array a and returns null. The array stays
+	// packed while v fits its element type.
+	//
+	static Value NativePush(LJ_Driver *driver, int arg_count, Value *args, const location &l)
+	{
+		if (arg_count != 2 || args[0].GetType() != ARRAY_VALUE) {
+			driver->Error(l, "NativePush error");
+		}
+		PushArrayElement(driver->gc_, TO_ARRAY_VALUE(args[0]), args[1]);
+		return NullValue();
+	}
+
+	//
+	// has(d, k) returns whether the dict d has the key k.
+	//
+	static Value NativeHas(LJ_Driver *driver, int arg_count, Value *args, const location &l)
+	{
+		if (arg_count != 2 || args[0].GetType() != DICT_VALUE || !DictObject::IsKey(args[1])) {
+			driver->Error(l, "NativeHas error");
+		}
+		FlattenKey(driver->gc_, args[1]);
+		return BooleanValue(TO_DICT_VALUE(args[0])->Find(args[1]) != NULL);
+	}
+
+	//
+	// keys(d) returns a new array of the keys of the dict d, in the order
+	// print shows them.
+	//
+	static Value NativeKeys(LJ_Driver *driver, int arg_count, Value *args, const location &l)
+	{
+		std::vector<Value> keys;
+
+		if (arg_count != 1 || args[0].GetType() != DICT_VALUE) {
+			driver->Error(l, "NativeKeys error");
+		}
+
+		// String keys stay reachable through the dict in args.
+		DictObject *d = TO_DICT_VALUE(args[0]);
+		for (std::vector<DictEntry>::iterator it = d->entries_.begin(); it != d->entries_.end(); ++it) {
+			if (it->hash_ != 0) {
+				keys.push_back(it->key_);
+			}
+		}
+		return NewArrayValue(driver->gc_, keys.empty() ? NULL : &keys[0], keys.size());
+	}
+
+	//
+	// remove(d, k) removes the key k from the dict d and returns whether it
+	// was there.
+	//
+	static Value NativeRemove(LJ_Driver *driver, int arg_count, Value *args, const location &l)
+	{
+		if (arg_count != 2 || args[0].GetType() != DICT_VALUE || !DictObject::IsKey(args[1])) {
+			driver->Error(l, "NativeRemove error");
+		}
+		FlattenKey(driver->gc_, args[1]);
+		return BooleanValue(TO_DICT_VALUE(args[0])->Remove(args[1]));
+	}
+
+	//
+	// record() returns a new record without fields, storing to one adds it.
+	//
+	static Value NativeRecord(LJ_Driver *driver, int arg_count, Value *args, const location &l)
+	{
+		if (arg_count != 0) {
+			driver->Error(l, "NativeRecord error");
+		}
+
+		driver->gc_.CheckCollect();
+		RecordObject *r = new RecordObject(driver->shapes_.GetRoot());
+		driver->gc_.Register(r);
+		return RecordValue(r);
+	}
+
+	//
+	// clock() returns a time in milliseconds, only the difference between
+	// two calls means anything.
+	//
+	static Value NativeClock(LJ_Driver *driver, int arg_count, Value *args, const location &l)
+	{
+		if (arg_count != 0) {
+			driver->Error(l, "NativeClock error");
+		}
+		return DoubleValue(std::chrono::duration<double, std::milli>(
+			std::chrono::steady_clock::now().time_since_epoch()).count());
+	}
+
+	//
+	// The v builtins below run the kernels of lj_simd.h over whole packed
+	// arrays. A boxed array is an error, it has no storage to run them on.
+	//
+	static ArrayObject *ToPackedArray(LJ_Driver *driver, const Value &v, const char *error, const location &l)
+	{
+		if (v.GetType() != ARRAY_VALUE || TO_ARRAY_VALUE(v)->kind_ == BOXED_ARRAY) {
+			driver->Error(l, error);
+		}
+		return TO_ARRAY_VALUE(v);
+	}
+
+	static ArrayObject *ToMatchingArray(LJ_Driver *driver, ArrayObject *x, const Value &v, const char *error,
+		const location &l)
+	{
+		ArrayObject *a = ToPackedArray(driver, v, error, l);
+		if (a->kind_ != x->kind_ || a->GetLength() != x->GetLength()) {
+			driver->Error(l, error);
+		}
+		return a;
+	}
+
+	static __int64 ToIntScalar(LJ_Driver *driver, const Value &v, const char *error, const location &l)
+	{
+		if (v.GetType() != INT_VALUE) {
+			driver->Error(l, error);
+		}
+		return TO_INT_VALUE(v);
+	}
+
+	static double ToDoubleScalar(LJ_Driver *driver, const Value &v, const char *error, const location &l)
+	{
+		if (v.GetType() == INT_VALUE) {
+			return (double)TO_INT_VALUE(v);
+		}
+		if (v.GetType() != DOUBLE_VALUE) {
+			driver->Error(l, error);
+		}
+		return TO_DOUBLE_VALUE(v);
+	}
+
+	//
+	// The second operand of an elementwise builtin on x: an array matching
+	// x, or a scalar that broadcast is filled with. An int array only takes
+	// an int scalar, a double array takes either.
+	//
+	static ArrayObject *ToOperand(LJ_Driver *driver, ArrayObject *x, const Value &v, ArrayObject *broadcast,
+		const char *error, const location &l)
+	{
+		if (v.GetType() == ARRAY_VALUE) {
+			return ToMatchingArray(driver, x, v, error, l);
+		}
+
+		if (x->kind_ == INT_ARRAY) {
+			broadcast->ints_.assign(x->GetLength(), ToIntScalar(driver, v, error, l));
+		}
+		else {
+			broadcast->doubles_.assign(x->GetLength(), ToDoubleScalar(driver, v, error, l));
+		}
+		return broadcast;
+	}
+
+	//
+	// vsum(x) returns the sum of the elements of x, 0 for [].
+	//
+	static Value NativeVSum(LJ_Driver *driver, int arg_count, Value *args, const location &l)
+	{
+		const SimdKernels &k = GetSimdKernels();
+
+		if (arg_count != 1) {
+			driver->Error(l, "NativeVSum error");
+		}
+
+		ArrayObject *x = ToPackedArray(driver, args[0], "NativeVSum error", l);
+		if (x->kind_ == INT_ARRAY) {
+			return IntValue(k.sum_int_(x->ints_.data(), x->GetLength()));
+		}
+		return DoubleValue(k.sum_double_(x->doubles_.data(), x->GetLength()));
+	}
+
+	//
+	// vdot(x, y) returns the dot product of two arrays of the same kind and
+	// length.
+	//
+	static Value NativeVDot(LJ_Driver *driver, int arg_count, Value *args, const location &l)
+	{
+		const SimdKernels &k = GetSimdKernels();
+
+		if (arg_count != 2) {
+			driver->Error(l, "NativeVDot error");
+		}
+
+		ArrayObject *x = ToPackedArray(driver, args[0], "NativeVDot error", l);
+		ArrayObject *y = ToMatchingArray(driver, x, args[1], "NativeVDot error", l);
+		if (x->kind_ == INT_ARRAY) {
+			return IntValue(k.dot_int_(x->ints_.data(), y->ints_.data(), x->GetLength()));
+		}
+		return DoubleValue(k.dot_double_(x->doubles_.data(), y->doubles_.data(), x->GetLength()));
+	}
+
+	//
+	// vaxpy(a, x, y) adds a * x to y in place and returns null.
+	//
+	static Value NativeVAxpy(LJ_Driver *driver, int arg_count, Value *args, const location &l)
+	{
+		const SimdKernels &k = GetSimdKernels();
+
+		if (arg_count != 3) {
+			driver->Error(l, "NativeVAxpy error");
+		}
+
+		ArrayObject *x = ToPackedArray(driver, args[1], "NativeVAxpy error", l);
+		ArrayObject *y = ToMatchingArray(driver, x, args[2], "NativeVAxpy error", l);
+		if (x->kind_ == INT_ARRAY) {
+			k.axpy_int_(ToIntScalar(driver, args[0], "NativeVAxpy error", l), x->ints_.data(), y->ints_.data(),
+				x->GetLength());
+		}
+		else {
+			k.axpy_double_(ToDoubleScalar(driver, args[0], "NativeVAxpy error", l), x->doubles_.data(),
+				y->doubles_.data(), x->GetLength());
+		}
+		return NullValue();
+	}
+
+	//
+	// vadd(x, y) and vmul(x, y) return a new array of x[i] + y[i] and
+	// x[i] * y[i].
+	//
+	static Value NativeVArith(LJ_Driver *driver, int arg_count, Value *args, boolean mul, const char *error,
+		const location &l)
+	{
+		const SimdKernels &k = GetSimdKernels();
+
+		if (arg_count != 2) {
+			driver->Error(l, error);
+		}
+
+		ArrayObject *x = ToPackedArray(driver, args[0], error, l);
+		ArrayObject broadcast(x->kind_);
+		ArrayObject *y = ToOperand(driver, x, args[1], &broadcast, error, l);
+
+		// x and y stay alive in args while the result is allocated.
+		ArrayObject *out = NewPackedArray(driver->gc_, x->kind_, x->GetLength());
+		if (x->kind_ == INT_ARRAY) {
+			(mul ? k.mul_int_ : k.add_int_)(x->ints_.data(), y->ints_.data(), out->ints_.data(), x->GetLength());
+		}
+		else {
+			(mul ? k.mul_double_ : k.add_double_)(x->doubles_.data(), y->doubles_.data(), out->doubles_.data(),
+				x->GetLength());
+		}
+		return ArrayValue(out);
+	}
+
+	static Value NativeVAdd(LJ_Driver *driver, int arg_count, Value *args, const location &l)
+	{
+		return NativeVArith(driver, arg_count, args, 0, "NativeVAdd error", l);
+	}
+
+	static Value NativeVMul(LJ_Driver *driver, int arg_count, Value *args, const location &l)
+	{
+		return NativeVArith(driver, arg_count, args, 1, "NativeVMul error", l);
+	}
+
+	//
+	// vmin(x) and vmax(x) return the least and the greatest element of a
+	// non-empty array.
+	//
+	static Value NativeVMinMax(LJ_Driver *driver, int arg_count, Value *args, boolean max, const char *error,
+		const location &l)
+	{
+		const SimdKernels &k = GetSimdKernels();
+
+		if (arg_count != 1) {
+			driver->Error(l, error);
+		}
+
+		ArrayObject *x = ToPackedArray(driver, args[0], error, l);
+		if (x->GetLength() == 0) {
+			driver->Error(l, error);
+		}
+		if (x->kind_ == INT_ARRAY) {
+			return IntValue((max ? k.max_int_ : k.min_int_)(x->ints_.data(), x->GetLength()));
+		}
+		return DoubleValue((max ? k.max_double_ : k.min_double_)(x->doubles_.data(), x->GetLength()));
+	}
+
+	static Value NativeVMin(LJ_Driver *driver, int arg_count, Value *args, const location &l)
+	{
+		return NativeVMinMax(driver, arg_count, args, 0, "NativeVMin error", l);
+	}
+
+	static Value NativeVMax(LJ_Driver *driver, int arg_count, Value *args, const location &l)
+	{
+		return NativeVMinMax(driver, arg_count, args, 1, "NativeVMax error", l);
+	}
+
+	//
+	// vlt(x, y) and the other compares return an int array with 1 where
+	// x[i] < y[i] holds and 0 elsewhere.
+	//
+	template<ExpressionType OP>
+	static Value NativeVCompare(LJ_Driver *driver, int arg_count, Value *args, const location &l)
+	{
+		const SimdKernels &k = GetSimdKernels();
+
+		if (arg_count != 2) {
+			driver->Error(l, "NativeVCompare error");
+		}
+
+		ArrayObject *x = ToPackedArray(driver, args[0], "NativeVCompare error", l);
+		ArrayObject broadcast(x->kind_);
+		ArrayObject *y = ToOperand(driver, x, args[1], &broadcast, "NativeVCompare error", l);
+
+		ArrayObject *out = NewPackedArray(driver->gc_, INT_ARRAY, x->GetLength());
+		if (x->kind_ == INT_ARRAY) {
+			k.compare_int_(OP, x->ints_.data(), y->ints_.data(), out->ints_.data(), x->GetLength());
+		}
+		else {
+			k.compare_double_(OP, x->doubles_.data(), y->doubles_.data(), out->ints_.data(), x->GetLength());
+		}
+		return ArrayValue(out);
+	}
+
+	void AddNativeFunctions(LJ_Driver *driver)
+	{
+		driver->AddFunction(new NativeFunction("print", NativePrint));
+		driver->AddFunction(new NativeFunction("next", NativeNext));
+		driver->AddFunction(new NativeFunction("sleep", NativeSleep));
+		driver->AddFunction(new NativeFunction("len", NativeLen));
+		driver->AddFunction(new NativeFunction("push", NativePush));
+		driver->AddFunction(new NativeFunction("has", NativeHas));
+		driver->AddFunction(new NativeFunction("keys", NativeKeys));
+		driver->AddFunction(new NativeFunction("remove", NativeRemove));
+		driver->AddFunction(new NativeFunction("record", NativeRecord));
+		driver->AddFunction(new NativeFunction("clock", NativeClock));
+		driver->AddFunction(new NativeFunction("vsum", NativeVSum));
+		driver->AddFunction(new NativeFunction("vdot", NativeVDot));
+		driver->AddFunction(new NativeFunction("vaxpy", NativeVAxpy));
+		driver->AddFunction(new NativeFunction("vadd", NativeVAdd));
+		driver->AddFunction(new NativeFunction("vmul", NativeVMul));
+		driver->AddFunction(new NativeFunction("vmin", NativeVMin));
+		driver->AddFunction(new NativeFunction("vmax", NativeVMax));
+		driver->AddFunction(new NativeFunction("veq", NativeVCompare<EQ_EXPRESSION>));
+		driver->AddFunction(new NativeFunction("vne", NativeVCompare<NE_EXPRESSION>));
+		driver->AddFunction(new NativeFunction("vgt", NativeVCompare<GT_EXPRESSION>));
+		driver->AddFunction(new NativeFunction("vge", NativeVCompare<GE_EXPRESSION>));
+		driver->AddFunction(new NativeFunction("vlt", NativeVCompare<LT_EXPRESSION>));
+		driver->AddFunction(new NativeFunction("vle", NativeVCompare<LE_EXPRESSION>));
+	}
+}
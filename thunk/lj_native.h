@@ -0,0 +1,33 @@
+#ifndef __LJ_NATIVE_H__
+#define __LJ_NATIVE_H__
+
+#include <iostream>
+#include "lj_ast.h"
+#include "lj_val.h"
+
+namespace LJ {
+
+	typedef Value (*NativeFunctionProc)(LJ_Driver *driver, int arg_count, Value *args, const location &l);
+
+	class NativeFunction : public FunctionDefinition {
+	public:
+		NativeFunction(const std::string &name, NativeFunctionProc proc) :
+			FunctionDefinition(name, NULL, NULL, location()), proc_(proc) {}
+		~NativeFunction() {}
+
+		FunctionType GetType() override {
+			return NATIVE_FUNCTION;
+		}
+
+		NativeFunctionProc GetProc() { return proc_; }
+
+	private:
+		NativeFunctionProc proc_;
+	};
+
+	void PrintValue(std::ostream &os, const Value &v);
+
+	void AddNativeFunctions(LJ_Driver *driver);
+}
+
+#endif
@@ -0,0 +1,503 @@
+#include "lj_driver.hpp"
+#include "lj_optimizer.h"
+
+#include <stdint.h>
+
+namespace LJ {
+
+	LJ_Optimizer::LJ_Optimizer(LJ_Driver *driver)
+		: driver_(driver)
+	{
+
+	}
+
+	LJ_Optimizer::~LJ_Optimizer()
+	{
+
+	}
+
+	void LJ_Optimizer::Optimize()
+	{
+		std::list<FunctionDefinition *> &function_list = driver_->GetFunctionList();
+
+		for (std::list<FunctionDefinition *>::iterator it = function_list.begin();
+			it != function_list.end(); ++it) {
+
+			if ((*it)->GetType() == FUNCTION_DEFINITION) {
+				OptimizeBlock((*it)->GetBlock());
+			}
+		}
+
+		driver_->statement_list_ = OptimizeStatementList(driver_->statement_list_);
+	}
+
+	void LJ_Optimizer::Dump()
+	{
+		std::list<FunctionDefinition *> &function_list = driver_->GetFunctionList();
+
+		for (std::list<FunctionDefinition *>::iterator it = function_list.begin();
+			it != function_list.end(); ++it) {
+
+			if ((*it)->GetType() == FUNCTION_DEFINITION) {
+				std::cout << "FUNCTION_DEFINITION = [" << (*it)->GetFunctionName() << "]" << std::endl;
+				(*it)->GetBlock()->Dump(1);
+			}
+		}
+
+		driver_->Dump();
+	}
+
+	StatementList *LJ_Optimizer::OptimizeStatementList(StatementList *list)
+	{
+		LJ_Driver &driver = *driver_;
+		StatementList *out;
+
+		if (list == NULL) {
+			return NULL;
+		}
+
+		out = AST_NEW(StatementList(AST_ARENA));
+		for (StatementList::iterator it = list->begin(); it != list->end(); ++it) {
+			if (OptimizeStatement(*it, out)) {
+				break;
+			}
+		}
+
+		return out->empty() ? NULL : out;
+	}
+
+	void LJ_Optimizer::OptimizeBlock(Block *block)
+	{
+		if (block != NULL) {
+			block->SetValue(0, OptimizeStatementList((StatementList *)block->GetValue(0)));
+		}
+	}
+
+	//
+	// Appends the statements of an already optimized block to out, blocks do
+	// not open a scope so this keeps the meaning of every name. Returns true
+	// when the spliced code never falls through.
+	//
+	boolean LJ_Optimizer::SpliceBlock(Block *block, StatementList *out)
+	{
+		StatementList *list;
+
+		if (block == NULL || (list = (StatementList *)block->GetValue(0)) == NULL) {
+			return false;
+		}
+
+		for (StatementList::iterator it = list->begin(); it != list->end(); ++it) {
+			out->push_back(*it);
+		}
+
+		switch (list->back()->GetType()) {
+		case RETURN_STATEMENT:
+		case BREAK_STATEMENT:
+		case CONTINUE_STATEMENT:
+			return true;
+		default:
+			return false;
+		}
+	}
+
+	//
+	// Appends what is left of statement to out. Returns true when nothing
+	// after it in the same list can run.
+	//
+	boolean LJ_Optimizer::OptimizeStatement(Statement *statement, StatementList *out)
+	{
+		Value v;
+		Expression *expr;
+
+		switch (statement->GetType()) {
+		case EXPRESSION_STATEMENT:
+			expr = FoldExpression((Expression *)statement->GetValue(0));
+			if (GetConstant(expr, &v) || expr->GetType() == STRING_EXPRESSION) {
+				return false;
+			}
+			statement->SetValue(0, expr);
+			break;
+		case GLOBAL_STATEMENT:
+			break;
+		case IF_STATEMENT:
+			return OptimizeIfStatement(statement, out);
+		case WHILE_STATEMENT:
+			expr = FoldExpression((Expression *)statement->GetValue(0));
+			if (expr->GetType() == FALSE_EXPRESSION) {
+				return false;
+			}
+			statement->SetValue(0, expr);
+			OptimizeBlock((Block *)statement->GetValue(1));
+			break;
+		case FOR_STATEMENT:
+			for (int i = 0; i < 3; i++) {
+				if (statement->GetValue(i) != NULL) {
+					statement->SetValue(i, FoldExpression((Expression *)statement->GetValue(i)));
+				}
+			}
+			OptimizeBlock((Block *)statement->GetValue(3));
+			break;
+		case FOREACH_STATEMENT:
+			statement->SetValue(1, FoldExpression((Expression *)statement->GetValue(1)));
+			if (statement->GetValue(2) != NULL) {
+				statement->SetValue(2, FoldExpression((Expression *)statement->GetValue(2)));
+			}
+			OptimizeBlock((Block *)statement->GetValue(3));
+			break;
+		case YIELD_STATEMENT:
+			statement->SetValue(0, FoldExpression((Expression *)statement->GetValue(0)));
+			break;
+		case RETURN_STATEMENT:
+			if (statement->GetValue(0) != NULL) {
+				statement->SetValue(0, FoldExpression((Expression *)statement->GetValue(0)));
+			}
+			out->push_back(statement);
+			return true;
+		case BREAK_STATEMENT:
+		case CONTINUE_STATEMENT:
+			out->push_back(statement);
+			return true;
+		default:
+			LJ_TRAP();
+		}
+
+		out->push_back(statement);
+		return false;
+	}
+
+	//
+	// Drops every arm whose condition is the constant false and cuts the
+	// chain at the first arm whose condition is the constant true. If no
+	// arm with a runtime condition is left the taken block is spliced into
+	// the enclosing list. An elseif is never promoted to the if, so that
+	// its condition still fails as ExecuteElseif; the if keeps its false
+	// condition in front of it instead.
+	//
+	boolean LJ_Optimizer::OptimizeIfStatement(Statement *statement, StatementList *out)
+	{
+		LJ_Driver &driver = *driver_;
+		ElseifList *elseif_list = (ElseifList *)statement->GetValue(2);
+		ElseifList *new_elseif_list = NULL;
+		Expression *cond = NULL;
+		Block *then_b = NULL;
+		Block *else_b = (Block *)statement->GetValue(3);
+		Expression *e;
+		Block *b;
+		size_t count = elseif_list == NULL ? 0 : elseif_list->size();
+
+		OptimizeBlock(else_b);
+
+		for (size_t i = 0; i <= count; i++) {
+			if (i == 0) {
+				e = (Expression *)statement->GetValue(0);
+				b = (Block *)statement->GetValue(1);
+			}
+			else {
+				e = (Expression *)(*elseif_list)[i - 1]->GetValue(0);
+				b = (Block *)(*elseif_list)[i - 1]->GetValue(1);
+			}
+
+			e = FoldExpression(e);
+			if (i == 0) {
+				statement->SetValue(0, e);
+			}
+			if (e->GetType() == FALSE_EXPRESSION) {
+				continue;
+			}
+
+			OptimizeBlock(b);
+			if (e->GetType() == TRUE_EXPRESSION && cond == NULL) {
+				return SpliceBlock(b, out);
+			}
+			if (e->GetType() == TRUE_EXPRESSION) {
+				else_b = b;
+				break;
+			}
+
+			if (i == 0) {
+				cond = e;
+				then_b = b;
+			}
+			else {
+				if (cond == NULL) {
+					cond = (Expression *)statement->GetValue(0);
+					then_b = (Block *)statement->GetValue(1);
+				}
+				Elseif *elseif = (*elseif_list)[i - 1];
+				elseif->SetValue(0, e);
+				if (new_elseif_list == NULL) {
+					MAKE_ELSEIF_LIST(new_elseif_list, elseif);
+				}
+				else {
+					new_elseif_list->push_back(elseif);
+				}
+			}
+		}
+
+		if (cond == NULL) {
+			return SpliceBlock(else_b, out);
+		}
+
+		statement->SetValue(0, cond);
+		statement->SetValue(1, then_b);
+		statement->SetValue(2, new_elseif_list);
+		statement->SetValue(3, else_b);
+		out->push_back(statement);
+		return false;
+	}
+
+	Expression *LJ_Optimizer::FoldExpression(Expression *expr)
+	{
+		ExpressionType type = expr->GetType();
+
+		if (type == MINUS_EXPRESSION || type == EXCLAMATION_EXPRESSION) {
+			return FoldUnaryExpression(expr);
+		}
+
+		if (type == ASSIGN_EXPRESSION) {
+			Expression *left = (Expression *)expr->GetValue(0);
+			if (left->GetType() == INDEX_EXPRESSION || left->GetType() == MEMBER_EXPRESSION) {
+				FoldExpression(left);
+			}
+			expr->SetValue(1, FoldExpression((Expression *)expr->GetValue(1)));
+			return expr;
+		}
+
+		if (type == INDEX_EXPRESSION) {
+			expr->SetValue(0, FoldExpression((Expression *)expr->GetValue(0)));
+			expr->SetValue(1, FoldExpression((Expression *)expr->GetValue(1)));
+			return expr;
+		}
+
+		if (type == MEMBER_EXPRESSION) {
+			expr->SetValue(0, FoldExpression((Expression *)expr->GetValue(0)));
+			return expr;
+		}
+
+		if (IsLogicalOperator(type)) {
+			return FoldLogicalExpression(expr);
+		}
+
+		if (IsMathOperator(type) || IsCompareOperator(type)) {
+			return FoldBinaryExpression(expr);
+		}
+
+		if (type == FUNCTION_CALL_EXPRESSION && expr->GetValue(1) != NULL) {
+			ArgumentList *args = (ArgumentList *)expr->GetValue(1);
+			for (size_t i = 0; i < args->size(); i++) {
+				(*args)[i] = FoldExpression((*args)[i]);
+			}
+		}
+
+		if (type == ARRAY_EXPRESSION || type == DICT_EXPRESSION || type == RECORD_EXPRESSION) {
+			ArgumentList *elements = (ArgumentList *)expr->GetValue(0);
+			for (size_t i = 0; i < elements->size(); i++) {
+				(*elements)[i] = FoldExpression((*elements)[i]);
+			}
+		}
+
+		return expr;
+	}
+
+	Expression *LJ_Optimizer::FoldUnaryExpression(Expression *expr)
+	{
+		Expression *operand = FoldExpression((Expression *)expr->GetValue(0));
+		Value v;
+
+		expr->SetValue(0, operand);
+		if (!GetConstant(operand, &v)) {
+			return expr;
+		}
+
+		if (expr->GetType() == MINUS_EXPRESSION) {
+			if (v.GetType() == INT_VALUE) {
+				return MakeConstant(IntValue(-TO_INT_VALUE(v)), expr->GetLocation());
+			}
+			if (v.GetType() == DOUBLE_VALUE) {
+				return MakeConstant(DoubleValue(-TO_DOUBLE_VALUE(v)), expr->GetLocation());
+			}
+		}
+		else if (v.GetType() == BOOLEAN_VALUE) {
+			return MakeConstant(BooleanValue(!TO_BOOLEAN_VALUE(v)), expr->GetLocation());
+		}
+
+		return expr;
+	}
+
+	Expression *LJ_Optimizer::FoldBinaryExpression(Expression *expr)
+	{
+		LJ_Driver &driver = *driver_;
+		ExpressionType op = expr->GetType();
+		Expression *left = FoldExpression((Expression *)expr->GetValue(0));
+		Expression *right = FoldExpression((Expression *)expr->GetValue(1));
+		Value left_val, right_val;
+		boolean numeric;
+
+		expr->SetValue(0, left);
+		expr->SetValue(1, right);
+
+		if (left->GetType() == STRING_EXPRESSION && right->GetType() == STRING_EXPRESSION) {
+			std::string &left_str = *(std::string *)left->GetValue(0);
+			std::string &right_str = *(std::string *)right->GetValue(0);
+
+			if (op == ADD_EXPRESSION) {
+				return MAKE_VALUE_EXP(STRING_EXPRESSION, std::string, left_str + right_str, expr->GetLocation());
+			}
+			if (IsCompareOperator(op)) {
+				return MakeConstant(driver_->EvalCompareString(op, left_str, right_str, expr->GetLocation()),
+					expr->GetLocation());
+			}
+			return expr;
+		}
+
+		if (!GetConstant(left, &left_val) || !GetConstant(right, &right_val)) {
+			return SimplifyIdentity(expr);
+		}
+
+		// Only fold what EvalBinaryOperator evaluates without an error.
+		numeric = (left_val.GetType() == INT_VALUE || left_val.GetType() == DOUBLE_VALUE)
+			&& (right_val.GetType() == INT_VALUE || right_val.GetType() == DOUBLE_VALUE);
+		if (numeric) {
+			if (left_val.GetType() == INT_VALUE && right_val.GetType() == INT_VALUE
+				&& (op == DIV_EXPRESSION || op == MOD_EXPRESSION)
+				&& (TO_INT_VALUE(right_val) == 0 || (TO_INT_VALUE(right_val) == -1 && TO_INT_VALUE(left_val) == INT64_MIN))) {
+				return expr;
+			}
+		}
+		else if (op != EQ_EXPRESSION && op != NE_EXPRESSION) {
+			return expr;
+		}
+		else if (!(left_val.GetType() == BOOLEAN_VALUE && right_val.GetType() == BOOLEAN_VALUE)
+			&& left_val.GetType() != NULL_VALUE && right_val.GetType() != NULL_VALUE) {
+			return expr;
+		}
+
+		return MakeConstant(driver_->EvalBinaryOperator(op, left_val, right_val, expr->GetLocation()),
+			expr->GetLocation());
+	}
+
+	//
+	// A constant left operand decides the result or reduces the expression
+	// to its right operand. The right operand alone is only dropped when it
+	// is a constant boolean, a runtime value still has to be checked.
+	//
+	Expression *LJ_Optimizer::FoldLogicalExpression(Expression *expr)
+	{
+		ExpressionType op = expr->GetType();
+		Expression *left = FoldExpression((Expression *)expr->GetValue(0));
+		Expression *right = FoldExpression((Expression *)expr->GetValue(1));
+
+		expr->SetValue(0, left);
+		expr->SetValue(1, right);
+
+		if (left->GetType() != TRUE_EXPRESSION && left->GetType() != FALSE_EXPRESSION) {
+			return expr;
+		}
+
+		if ((op == LOGICAL_AND_EXPRESSION) == (left->GetType() == FALSE_EXPRESSION)) {
+			return left;
+		}
+
+		if (right->GetType() == TRUE_EXPRESSION || right->GetType() == FALSE_EXPRESSION) {
+			return right;
+		}
+
+		return expr;
+	}
+
+	//
+	// x - 0, x * 1, 1 * x and x / 1 reduce to x when x is known to be a number.
+	// x + 0 is kept because it turns -0.0 into 0.0.
+	//
+	Expression *LJ_Optimizer::SimplifyIdentity(Expression *expr)
+	{
+		ExpressionType op = expr->GetType();
+		Expression *left = (Expression *)expr->GetValue(0);
+		Expression *right = (Expression *)expr->GetValue(1);
+		Value v;
+
+		if (GetConstant(right, &v) && v.GetType() == INT_VALUE && IsNumeric(left)) {
+			if (op == SUB_EXPRESSION && TO_INT_VALUE(v) == 0) {
+				return left;
+			}
+			if ((op == MUL_EXPRESSION || op == DIV_EXPRESSION) && TO_INT_VALUE(v) == 1) {
+				return left;
+			}
+		}
+
+		if (GetConstant(left, &v) && v.GetType() == INT_VALUE && IsNumeric(right)) {
+			if (op == MUL_EXPRESSION && TO_INT_VALUE(v) == 1) {
+				return right;
+			}
+		}
+
+		return expr;
+	}
+
+	boolean LJ_Optimizer::GetConstant(Expression *expr, Value *v)
+	{
+		switch (expr->GetType()) {
+		case INT_EXPRESSION:
+			*v = IntValue(*(__int64 *)expr->GetValue(0));
+			return true;
+		case DOUBLE_EXPRESSION:
+			*v = DoubleValue(*(double *)expr->GetValue(0));
+			return true;
+		case TRUE_EXPRESSION:
+			*v = BooleanValue(true);
+			return true;
+		case FALSE_EXPRESSION:
+			*v = BooleanValue(false);
+			return true;
+		case NULL_EXPRESSION:
+			*v = NullValue();
+			return true;
+		default:
+			return false;
+		}
+	}
+
+	//
+	// True when expr either yields an int or a double or fails on its own.
+	//
+	boolean LJ_Optimizer::IsNumeric(Expression *expr)
+	{
+		switch (expr->GetType()) {
+		case INT_EXPRESSION:
+		case DOUBLE_EXPRESSION:
+		case MINUS_EXPRESSION:
+		case SUB_EXPRESSION:
+		case MUL_EXPRESSION:
+		case DIV_EXPRESSION:
+		case MOD_EXPRESSION:
+			return true;
+		case ADD_EXPRESSION:
+			return IsNumeric((Expression *)expr->GetValue(0)) && IsNumeric((Expression *)expr->GetValue(1));
+		default:
+			return false;
+		}
+	}
+
+	Expression *LJ_Optimizer::MakeConstant(const Value &v, const location &l)
+	{
+		LJ_Driver &driver = *driver_;
+
+		switch (v.GetType()) {
+		case INT_VALUE:
+			return MAKE_VALUE_EXP(INT_EXPRESSION, __int64, TO_INT_VALUE(v), l);
+		case DOUBLE_VALUE:
+			return MAKE_VALUE_EXP(DOUBLE_EXPRESSION, double, TO_DOUBLE_VALUE(v), l);
+		case BOOLEAN_VALUE:
+			if (TO_BOOLEAN_VALUE(v)) {
+				return MAKE_EXP(TRUE_EXPRESSION, l);
+			}
+			return MAKE_EXP(FALSE_EXPRESSION, l);
+		case NULL_VALUE:
+			return MAKE_EXP(NULL_EXPRESSION, l);
+		default:
+			LJ_TRAP();
+		}
+
+		return NULL;
+	}
+}
@@ -0,0 +1,47 @@
+#ifndef __LJ_OPTIMIZER_H__
+#define __LJ_OPTIMIZER_H__
+
+#include "lj_ast.h"
+#include "lj_val.h"
+
+namespace LJ {
+
+	class LJ_Driver;
+
+	//
+	// Runs after LJ_Resolver and rewrites the tree in place. Constant
+	// subtrees are folded only where evaluating them cannot fail, so every
+	// runtime error stays where it was. Branches on constant conditions are
+	// pruned and statements behind return, break or continue are dropped.
+	// Replacement nodes and lists come from the driver's arena.
+	//
+	class LJ_Optimizer {
+	public:
+		LJ_Optimizer(LJ_Driver *driver);
+		~LJ_Optimizer();
+
+		void Optimize();
+		void Dump();
+
+	private:
+		StatementList *OptimizeStatementList(StatementList *list);
+		boolean OptimizeStatement(Statement *statement, StatementList *out);
+		boolean OptimizeIfStatement(Statement *statement, StatementList *out);
+		void OptimizeBlock(Block *block);
+		boolean SpliceBlock(Block *block, StatementList *out);
+
+		Expression *FoldExpression(Expression *expr);
+		Expression *FoldUnaryExpression(Expression *expr);
+		Expression *FoldBinaryExpression(Expression *expr);
+		Expression *FoldLogicalExpression(Expression *expr);
+		Expression *SimplifyIdentity(Expression *expr);
+
+		boolean GetConstant(Expression *expr, Value *v);
+		boolean IsNumeric(Expression *expr);
+		Expression *MakeConstant(const Value &v, const location &l);
+
+		LJ_Driver *driver_;
+	};
+}
+
+#endif
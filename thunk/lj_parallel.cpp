@@ -0,0 +1,306 @@
+#include "lj_parallel.h"
+
+#include <thread>
+
+namespace LJ {
+
+	LJ_ParallelForeach::LJ_ParallelForeach(LJ_Driver *driver, ForeachStatement *statement)
+		: driver_(driver), statement_(statement), failed_(false), error_iteration_(0)
+	{
+
+	}
+
+	LJ_ParallelForeach::~LJ_ParallelForeach()
+	{
+		for (std::vector<Worker *>::iterator it = workers_.begin(); it != workers_.end(); ++it) {
+			delete *it;
+		}
+	}
+
+	//
+	// frame is the enclosing function's first slot, NULL at top level. The
+	// running driver does nothing until the last worker is joined.
+	//
+	void LJ_ParallelForeach::Run(__int64 from, __int64 to, FunctionDefinition *func, Value *frame)
+	{
+		std::vector<IdentifierExpression *> &reductions = statement_->GetReductions();
+		std::vector<std::thread> threads;
+		size_t worker_count = driver_->parallel_workers_;
+		unsigned __int64 count;
+		unsigned __int64 grain;
+		unsigned __int64 chunk_count;
+
+		// Workers start their sums from 0 and steal each other's chunks, so
+		// only numbers, which add up the same in any order, are reduced.
+		for (std::vector<IdentifierExpression *>::iterator it = reductions.begin(); it != reductions.end(); ++it) {
+			Value *target = (*it)->GetSlotType() == LOCAL_SLOT ? &frame[(*it)->GetSlotIndex()]
+				: &driver_->global_value_[(*it)->GetSlotIndex()];
+			if (target->type_ != INT_VALUE && target->type_ != DOUBLE_VALUE) {
+				driver_->Error((*it)->GetLocation(), "ExecuteForeachStatement error");
+			}
+		}
+
+		if (from >= to) {
+			return;
+		}
+		count = (unsigned __int64)to - (unsigned __int64)from;
+
+		if (worker_count == 0) {
+			worker_count = std::thread::hardware_concurrency();
+		}
+		if (worker_count == 0) {
+			worker_count = 1;
+		}
+		if (worker_count > count) {
+			worker_count = (size_t)count;
+		}
+
+		grain = count / (worker_count * PARALLEL_CHUNKS_PER_WORKER);
+		if (grain == 0) {
+			grain = 1;
+		}
+		chunk_count = (count + grain - 1) / grain;
+
+		for (size_t w = 0; w < worker_count; w++) {
+			Worker *worker = new Worker;
+
+			workers_.push_back(worker);
+			for (unsigned __int64 c = chunk_count * w / worker_count; c < chunk_count * (w + 1) / worker_count; c++) {
+				Chunk chunk;
+				chunk.from_ = (__int64)((unsigned __int64)from + c * grain);
+				chunk.to_ = c == chunk_count - 1 ? to : (__int64)((unsigned __int64)chunk.from_ + grain);
+				worker->chunks_.push_back(chunk);
+			}
+			StartWorker(worker, func, frame);
+		}
+
+		for (size_t w = 0; w < worker_count; w++) {
+			threads.push_back(std::thread([this, w]() { WorkerMain(w); }));
+		}
+		for (size_t w = 0; w < worker_count; w++) {
+			threads[w].join();
+		}
+		for (size_t w = 0; w < worker_count; w++) {
+			ShapeStats &stats = workers_[w]->driver_.shape_stats_;
+			driver_->shape_stats_.hits_ += stats.hits_;
+			driver_->shape_stats_.misses_ += stats.misses_;
+			driver_->shape_stats_.transitions_ += stats.transitions_;
+		}
+
+		if (error_) {
+			std::rethrow_exception(error_);
+		}
+		Reduce(func, frame);
+	}
+
+	//
+	// Strings, arrays, dicts and records are copied into the worker's heap,
+	// no heap object is shared between two drivers. One reachable twice is
+	// copied once. Workers run on the AST of this driver and leave its
+	// inline caches and operand states as they are.
+	//
+	void LJ_ParallelForeach::StartWorker(Worker *worker, FunctionDefinition *func, Value *frame)
+	{
+		LJ_Driver *driver = &worker->driver_;
+		std::vector<IdentifierExpression *> &reductions = statement_->GetReductions();
+		std::map<HeapObject *, Value> copies;
+
+		driver->out_ = driver_->out_;
+		driver->call_depth_limit_ = driver_->call_depth_limit_;
+		driver->memo_capacity_ = driver_->memo_capacity_;
+		driver->gc_.SetThreshold(driver_->gc_.GetThreshold());
+
+		// A parallel foreach nested in the body runs on its worker alone.
+		driver->parallel_workers_ = 1;
+		driver->inline_caches_ = 0;
+
+		driver->global_value_.resize(driver_->global_value_.size(), UndefinedValue());
+		for (size_t i = 0; i < driver_->global_value_.size(); i++) {
+			driver->global_value_[i] = CopyValue(driver, driver_->global_value_[i], copies);
+		}
+
+		if (frame != NULL) {
+			driver->value_stack_.Grow(func->GetSlotCount(), UndefinedValue());
+			driver->frame_stack_.push_back(LocalFrame(func, 0));
+			for (int i = 0; i < func->GetSlotCount(); i++) {
+				driver->value_stack_[i] = CopyValue(driver, frame[i], copies);
+			}
+		}
+
+		for (std::vector<IdentifierExpression *>::iterator it = reductions.begin(); it != reductions.end(); ++it) {
+			*driver->GetIdentifierLValue(*it) = IntValue(0);
+		}
+	}
+
+	Value LJ_ParallelForeach::CopyValue(LJ_Driver *to, const Value &v, std::map<HeapObject *, Value> &copies)
+	{
+		if (v.GetType() == STRING_VALUE) {
+			Value s = NewStringValue(to->gc_, FlatString(driver_->gc_, v));
+			s.string_value_->hash_ = v.string_value_->hash_;
+			return s;
+		}
+		if (v.GetType() == ARRAY_VALUE) {
+			ArrayObject *from = TO_ARRAY_VALUE(v);
+			std::map<HeapObject *, Value>::iterator it = copies.find(from);
+			if (it != copies.end()) {
+				return it->second;
+			}
+
+			ArrayObject *a = new ArrayObject(from->kind_);
+			a->ints_ = from->ints_;
+			a->doubles_ = from->doubles_;
+			a->values_.resize(from->values_.size(), UndefinedValue());
+			to->gc_.Register(a);
+
+			// Copying an element may collect before the array is reachable.
+			Value copy = ArrayValue(a);
+			GCRootGuard root(to->gc_, &copy);
+			copies[from] = copy;
+			for (size_t i = 0; i < from->values_.size(); i++) {
+				a->values_[i] = CopyValue(to, from->values_[i], copies);
+			}
+			return copy;
+		}
+		// The copy keeps every entry in its slot, keys hash the same in any
+		// driver.
+		if (v.GetType() == DICT_VALUE) {
+			DictObject *from = TO_DICT_VALUE(v);
+			std::map<HeapObject *, Value>::iterator it = copies.find(from);
+			if (it != copies.end()) {
+				return it->second;
+			}
+
+			DictObject *d = new DictObject;
+			d->entries_.resize(from->entries_.size(), DictEntry());
+			d->count_ = from->count_;
+			to->gc_.Register(d);
+
+			Value copy = DictValue(d);
+			GCRootGuard root(to->gc_, &copy);
+			copies[from] = copy;
+			for (size_t i = 0; i < from->entries_.size(); i++) {
+				const DictEntry &e = from->entries_[i];
+				if (e.hash_ != 0) {
+					// The key is traced once hash_ is set, the value is
+					// undefined until copied.
+					d->entries_[i].key_ = CopyValue(to, e.key_, copies);
+					d->entries_[i].hash_ = e.hash_;
+					d->entries_[i].value_ = CopyValue(to, e.value_, copies);
+				}
+			}
+			return copy;
+		}
+		// Shapes are shared by all drivers, the copy keeps the record's.
+		if (v.GetType() == RECORD_VALUE) {
+			RecordObject *from = TO_RECORD_VALUE(v);
+			std::map<HeapObject *, Value>::iterator it = copies.find(from);
+			if (it != copies.end()) {
+				return it->second;
+			}
+
+			RecordObject *r = new RecordObject(from->shape_);
+			r->slots_.resize(from->slots_.size(), UndefinedValue());
+			to->gc_.Register(r);
+
+			Value copy = RecordValue(r);
+			GCRootGuard root(to->gc_, &copy);
+			copies[from] = copy;
+			for (size_t i = 0; i < from->slots_.size(); i++) {
+				r->slots_[i] = CopyValue(to, from->slots_[i], copies);
+			}
+			return copy;
+		}
+		// A generator belongs to the driver that made it, the body can not
+		// resume it anyway.
+		if (v.GetType() == GENERATOR_VALUE) {
+			return UndefinedValue();
+		}
+		return v;
+	}
+
+	//
+	// A worker takes its own chunks in iteration order and steals the last
+	// chunk of the next worker that has any left.
+	//
+	boolean LJ_ParallelForeach::TakeChunk(size_t w, Chunk *chunk)
+	{
+		{
+			Worker *self = workers_[w];
+			std::lock_guard<std::mutex> guard(self->lock_);
+
+			if (!self->chunks_.empty()) {
+				*chunk = self->chunks_.front();
+				self->chunks_.pop_front();
+				return 1;
+			}
+		}
+
+		for (size_t k = 1; k < workers_.size(); k++) {
+			Worker *victim = workers_[(w + k) % workers_.size()];
+			std::lock_guard<std::mutex> guard(victim->lock_);
+
+			if (!victim->chunks_.empty()) {
+				*chunk = victim->chunks_.back();
+				victim->chunks_.pop_back();
+				return 1;
+			}
+		}
+		return 0;
+	}
+
+	void LJ_ParallelForeach::WorkerMain(size_t w)
+	{
+		LJ_Driver *driver = &workers_[w]->driver_;
+		Expression *var = (Expression *)statement_->GetValue(0);
+		StatementList *body = (StatementList *)((Block *)statement_->GetValue(3))->GetValue(0);
+		Chunk chunk;
+		__int64 i = 0;
+		char marker;
+
+		driver->stack_base_ = &marker;
+		try {
+			while (!failed_ && TakeChunk(w, &chunk)) {
+				for (i = chunk.from_; i < chunk.to_ && !failed_; i++) {
+					*driver->GetLValue(var) = IntValue(i);
+					driver->ExecuteStatementList(body);
+				}
+			}
+		}
+		catch (...) {
+			Fail(i, std::current_exception());
+		}
+	}
+
+	void LJ_ParallelForeach::Fail(__int64 iteration, std::exception_ptr error)
+	{
+		std::lock_guard<std::mutex> guard(error_lock_);
+
+		if (!error_ || iteration < error_iteration_) {
+			error_ = error;
+			error_iteration_ = iteration;
+		}
+		failed_ = true;
+	}
+
+	//
+	// Partial sums are added in worker order, which is the order of the
+	// ranges the workers started with.
+	//
+	void LJ_ParallelForeach::Reduce(FunctionDefinition *func, Value *frame)
+	{
+		std::vector<IdentifierExpression *> &reductions = statement_->GetReductions();
+
+		for (std::vector<IdentifierExpression *>::iterator it = reductions.begin(); it != reductions.end(); ++it) {
+			Value *target = (*it)->GetSlotType() == LOCAL_SLOT ? &frame[(*it)->GetSlotIndex()]
+				: &driver_->global_value_[(*it)->GetSlotIndex()];
+			Value sum = *target;
+			GCRootGuard guard(driver_->gc_, &sum);
+
+			for (std::vector<Worker *>::iterator worker = workers_.begin(); worker != workers_.end(); ++worker) {
+				sum = driver_->EvalBinaryOperator(ADD_EXPRESSION, sum, *(*worker)->driver_.GetIdentifierLValue(*it),
+					(*it)->GetLocation());
+			}
+			*target = sum;
+		}
+	}
+}
@@ -0,0 +1,65 @@
+#ifndef __LJ_PARALLEL_H__
+#define __LJ_PARALLEL_H__
+
+#include <atomic>
+#include <deque>
+#include <exception>
+#include <map>
+#include <mutex>
+#include <vector>
+#include "lj_driver.hpp"
+
+namespace LJ {
+
+// Chunks every worker's deque starts with, the rest of a worker's share
+// is left for idle workers to steal.
+#define PARALLEL_CHUNKS_PER_WORKER	8
+
+	//
+	// Runs the iterations of one parallel foreach on a pool of threads. Every
+	// worker is a driver of its own that shares the AST with the running one
+	// and starts from a copy of its globals and of the enclosing frame, so
+	// writes in the body stay in the worker. The range is cut into chunks
+	// dealt out in order to per-worker deques; a worker takes its own chunks
+	// from the front and, once they run out, steals from the back of the
+	// others. The reductions of the loop are added up when all workers are
+	// done, an error stops the pool and the one of the lowest failing
+	// iteration is rethrown.
+	//
+	class LJ_ParallelForeach {
+	public:
+		LJ_ParallelForeach(LJ_Driver *driver, ForeachStatement *statement);
+		~LJ_ParallelForeach();
+
+		void Run(__int64 from, __int64 to, FunctionDefinition *func, Value *frame);
+
+	private:
+		struct Chunk {
+			__int64 from_;
+			__int64 to_;
+		};
+
+		struct Worker {
+			LJ_Driver driver_;
+			std::mutex lock_;
+			std::deque<Chunk> chunks_;
+		};
+
+		void StartWorker(Worker *worker, FunctionDefinition *func, Value *frame);
+		Value CopyValue(LJ_Driver *to, const Value &v, std::map<HeapObject *, Value> &copies);
+		boolean TakeChunk(size_t w, Chunk *chunk);
+		void WorkerMain(size_t w);
+		void Fail(__int64 iteration, std::exception_ptr error);
+		void Reduce(FunctionDefinition *func, Value *frame);
+
+		LJ_Driver *driver_;
+		ForeachStatement *statement_;
+		std::vector<Worker *> workers_;
+		std::atomic<bool> failed_;
+		std::mutex error_lock_;
+		__int64 error_iteration_;
+		std::exception_ptr error_;
+	};
+}
+
+#endif
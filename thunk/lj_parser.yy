@@ -12,8 +12,6 @@
 
 #include "lj_ast.h"
 
-extern LJ::location loc;
-
 namespace LJ {
 class LJ_Driver;
 }
@@ -23,6 +21,7 @@ class LJ_Driver;
 
 // The parsing context.
 %param { LJ_Driver& driver }
+%param { void *scanner }
 
 %locations
 %initial-action
@@ -85,7 +84,9 @@ class LJ_Driver;
   DO				"do"      
   FOR				"for"     
   FOREACH			"foreach" 
+  PARALLEL			"parallel"
   RETURN			"return"  
+  YIELD				"yield"
   BREAK				"break"   
   CONTINUE			"continue"
   NULL				"null"    
@@ -93,6 +94,7 @@ class LJ_Driver;
   FALSE				"false"
   GLOBAL			"global"
   FUNCTION			"function"
+  MEMO				"memo"
 ;
 
 %token <__int64>     INT_LITERAL
@@ -100,21 +102,22 @@ class LJ_Driver;
 %token <std::string>     STRING_LITERAL
 %token <std::string>      IDENTIFIER
 
-%type   <std::list<std::string> *> parameter_list
-%type   <ArgumentList *> argument_list
+%type   <ArenaVector<std::string *> *> parameter_list
+%type   <ArgumentList *> argument_list entry_list
+%type   <RecordExpression *> field_list
 %type   <Expression *> expression expression_opt
         logical_and_expression logical_or_expression
         equality_expression relational_expression
         additive_expression multiplicative_expression
         unary_expression primary_expression
 %type   <Statement *> statement global_statement
-        if_statement while_statement for_statement
-        return_statement break_statement continue_statement
+        if_statement while_statement for_statement foreach_statement
+        return_statement yield_statement break_statement continue_statement
 %type   <StatementList *> statement_list
 %type   <Block *> block
 %type	<Elseif *> elseif
 %type   <ElseifList *> elseif_list
-%type   <std::list<std::string> *> identifier_list
+%type   <ArenaVector<std::string *> *> identifier_list
 
 
 %printer { debug_stream () << $$; } <*>;
@@ -134,18 +137,33 @@ definition_or_statement
         : function_definition
         | statement
         {
-			MAKE_STATEMENT_LIST(driver.statement_list_, $1);	
+			if (driver.statement_list_ == NULL) {
+				MAKE_STATEMENT_LIST(driver.statement_list_, $1);
+			}
+			else {
+				ADD_STATEMENT_LIST(driver.statement_list_, driver.statement_list_, $1);
+			}
         }
         ;
 
 function_definition
         : FUNCTION IDENTIFIER LP parameter_list RP block
         {
-            MAKE_FUNCTION_DEF($2, $4, $6, loc);
+            MAKE_FUNCTION_DEF($2, $4, $6, driver.loc_);
         }
         | FUNCTION IDENTIFIER LP RP block
         {
-            MAKE_FUNCTION_DEF($2, NULL, $5, loc);
+            MAKE_FUNCTION_DEF($2, NULL, $5, driver.loc_);
+        }
+        | MEMO FUNCTION IDENTIFIER LP parameter_list RP block
+        {
+            MAKE_FUNCTION_DEF($3, $5, $7, driver.loc_);
+            f->SetMemo(1);
+        }
+        | MEMO FUNCTION IDENTIFIER LP RP block
+        {
+            MAKE_FUNCTION_DEF($3, NULL, $6, driver.loc_);
+            f->SetMemo(1);
         }
         ;
 parameter_list
@@ -168,6 +186,28 @@ argument_list
 			ADD_ARGUMENT_LIST($$, $1, $3);
         }
         ;
+entry_list
+        : expression COLON expression
+        {
+            MAKE_ARGUMENT_LIST($$, $1);
+            ADD_ARGUMENT_LIST($$, $$, $3);
+        }
+        | entry_list COMMA expression COLON expression
+        {
+            ADD_ARGUMENT_LIST($$, $1, $3);
+            ADD_ARGUMENT_LIST($$, $$, $5);
+        }
+        ;
+field_list
+        : DOT IDENTIFIER COLON expression
+        {
+            MAKE_RECORD_EXP($$, $2, $4, driver.loc_);
+        }
+        | field_list COMMA DOT IDENTIFIER COLON expression
+        {
+            ADD_RECORD_FIELD($$, $1, $4, $6);
+        }
+        ;
 statement_list
         : statement
         {
@@ -182,149 +222,179 @@ expression
         : logical_or_expression {$$ = $1;}
         | primary_expression ASSIGN expression
         {
-            $$ = MAKE_BIN_EXP(ASSIGN_EXPRESSION, $1, $3, loc);
+            $$ = MAKE_BIN_EXP(ASSIGN_EXPRESSION, $1, $3, driver.loc_);
         }
         ;
 logical_or_expression
         : logical_and_expression {$$ = $1;}
         | logical_or_expression LOGICAL_OR logical_and_expression
         {
-            $$ = MAKE_BIN_EXP(LOGICAL_OR_EXPRESSION, $1, $3, loc);
+            $$ = MAKE_BIN_EXP(LOGICAL_OR_EXPRESSION, $1, $3, driver.loc_);
         }
         ;
 logical_and_expression
         : equality_expression {$$ = $1;}
         | logical_and_expression LOGICAL_AND equality_expression
         {
-            $$ = MAKE_BIN_EXP(LOGICAL_AND_EXPRESSION, $1, $3, loc);
+            $$ = MAKE_BIN_EXP(LOGICAL_AND_EXPRESSION, $1, $3, driver.loc_);
         }
         ;
 equality_expression
         : relational_expression {$$ = $1;}
         | equality_expression EQ relational_expression
         {
-            $$ = MAKE_BIN_EXP(EQ_EXPRESSION, $1, $3, loc);
+            $$ = MAKE_BIN_EXP(EQ_EXPRESSION, $1, $3, driver.loc_);
         }
         | equality_expression NE relational_expression
         {
-            $$ = MAKE_BIN_EXP(NE_EXPRESSION, $1, $3, loc);
+            $$ = MAKE_BIN_EXP(NE_EXPRESSION, $1, $3, driver.loc_);
         }
         ;
 relational_expression
         : additive_expression {$$ = $1;}
         | relational_expression GT additive_expression
         {
-            $$ = MAKE_BIN_EXP(GT_EXPRESSION, $1, $3, loc);
+            $$ = MAKE_BIN_EXP(GT_EXPRESSION, $1, $3, driver.loc_);
         }
         | relational_expression GE additive_expression
         {
-            $$ = MAKE_BIN_EXP(GE_EXPRESSION, $1, $3, loc);
+            $$ = MAKE_BIN_EXP(GE_EXPRESSION, $1, $3, driver.loc_);
         }
         | relational_expression LT additive_expression
         {
-            $$ = MAKE_BIN_EXP(LT_EXPRESSION, $1, $3, loc);
+            $$ = MAKE_BIN_EXP(LT_EXPRESSION, $1, $3, driver.loc_);
         }
         | relational_expression LE additive_expression
         {
-            $$ = MAKE_BIN_EXP(LE_EXPRESSION, $1, $3, loc);
+            $$ = MAKE_BIN_EXP(LE_EXPRESSION, $1, $3, driver.loc_);
         }
         ;
 additive_expression
         : multiplicative_expression {$$ = $1;}
         | additive_expression ADD multiplicative_expression
         {
-            $$ = MAKE_BIN_EXP(ADD_EXPRESSION, $1, $3, loc);
+            $$ = MAKE_BIN_EXP(ADD_EXPRESSION, $1, $3, driver.loc_);
         }
         | additive_expression SUB multiplicative_expression
         {
-            $$ = MAKE_BIN_EXP(SUB_EXPRESSION, $1, $3, loc);
+            $$ = MAKE_BIN_EXP(SUB_EXPRESSION, $1, $3, driver.loc_);
         }
         ;
 multiplicative_expression
         : unary_expression {$$ = $1;}
         | multiplicative_expression MUL unary_expression
         {
-            $$ = MAKE_BIN_EXP(MUL_EXPRESSION, $1, $3, loc);
+            $$ = MAKE_BIN_EXP(MUL_EXPRESSION, $1, $3, driver.loc_);
         }
         | multiplicative_expression DIV unary_expression
         {
-            $$ = MAKE_BIN_EXP(DIV_EXPRESSION, $1, $3, loc);
+            $$ = MAKE_BIN_EXP(DIV_EXPRESSION, $1, $3, driver.loc_);
         }
         | multiplicative_expression MOD unary_expression
         {
-            $$ = MAKE_BIN_EXP(MOD_EXPRESSION, $1, $3, loc);
+            $$ = MAKE_BIN_EXP(MOD_EXPRESSION, $1, $3, driver.loc_);
         }
         ;
 unary_expression
         : primary_expression {$$ = $1;}
 		| EXCLAMATION unary_expression
 		{
-			$$ = MAKE_UNARY_EXP(EXCLAMATION_EXPRESSION, $2, loc);
+			$$ = MAKE_UNARY_EXP(EXCLAMATION_EXPRESSION, $2, driver.loc_);
 		}
         | SUB unary_expression
         {
-            $$ = MAKE_UNARY_EXP(MINUS_EXPRESSION, $2, loc);
+            $$ = MAKE_UNARY_EXP(MINUS_EXPRESSION, $2, driver.loc_);
         }
         ;
 primary_expression
         : IDENTIFIER LP argument_list RP
         {
-            $$ = MAKE_BIN_EXP(FUNCTION_CALL_EXPRESSION, $1, $3, loc);
+            $$ = MAKE_BIN_EXP(FUNCTION_CALL_EXPRESSION, $1, $3, driver.loc_);
         }
         | IDENTIFIER LP RP
         {
-            $$ = MAKE_BIN_EXP(FUNCTION_CALL_EXPRESSION, $1, NULL, loc);
+            $$ = MAKE_BIN_EXP(FUNCTION_CALL_EXPRESSION, $1, NULL, driver.loc_);
         }
         | LP expression RP
         {
             $$ = $2;
         }
+        | primary_expression LB expression RB
+        {
+            $$ = MAKE_BIN_EXP(INDEX_EXPRESSION, $1, $3, driver.loc_);
+        }
+        | primary_expression DOT IDENTIFIER
+        {
+            $$ = MAKE_MEMBER_EXP($1, $3, driver.loc_);
+        }
+        | LB argument_list RB
+        {
+            $$ = MAKE_ARRAY_EXP($2, driver.loc_);
+        }
+        | LB RB
+        {
+            $$ = MAKE_ARRAY_EXP(AST_NEW(ArgumentList(AST_ARENA)), driver.loc_);
+        }
+        | LC entry_list RC
+        {
+            $$ = MAKE_DICT_EXP($2, driver.loc_);
+        }
+        | LC RC
+        {
+            $$ = MAKE_DICT_EXP(AST_NEW(ArgumentList(AST_ARENA)), driver.loc_);
+        }
+        | LC field_list RC
+        {
+            $$ = $2;
+        }
         | IDENTIFIER
         {
-            $$ = MAKE_VALUE_EXP(IDENTIFIER_EXPRESSION, std::string, $1, loc);
+            $$ = MAKE_IDENTIFIER_EXP($1, driver.loc_);
         }
 		| INT_LITERAL
 		{
-			$$ = MAKE_VALUE_EXP(INT_EXPRESSION, __int64, $1, loc);
+			$$ = MAKE_VALUE_EXP(INT_EXPRESSION, __int64, $1, driver.loc_);
 		}
         | DOUBLE_LITERAL
 		{
-			$$ = MAKE_VALUE_EXP(DOUBLE_EXPRESSION, double, $1, loc);
+			$$ = MAKE_VALUE_EXP(DOUBLE_EXPRESSION, double, $1, driver.loc_);
 		}
         | STRING_LITERAL
 		{
-			$$ = MAKE_VALUE_EXP(STRING_EXPRESSION, std::string, $1, loc);
+			$$ = MAKE_VALUE_EXP(STRING_EXPRESSION, std::string, $1, driver.loc_);
 		}
         | TRUE
         {
-            $$ = MAKE_EXP(TRUE_EXPRESSION, loc);
+            $$ = MAKE_EXP(TRUE_EXPRESSION, driver.loc_);
         }
         | FALSE
         {
-            $$ = MAKE_EXP(FALSE_EXPRESSION, loc);
+            $$ = MAKE_EXP(FALSE_EXPRESSION, driver.loc_);
         }
         | NULL
         {
-            $$ = MAKE_EXP(NULL_EXPRESSION, loc);
+            $$ = MAKE_EXP(NULL_EXPRESSION, driver.loc_);
         }
         ;
 statement
         : expression SEMICOLON
         {
-          $$ = MAKE_EXP_STAT($1, loc);
+          $$ = MAKE_EXP_STAT($1, driver.loc_);
         }
 		| global_statement
         | if_statement
         | while_statement
         | for_statement
+        | foreach_statement
         | return_statement
+        | yield_statement
         | break_statement
         | continue_statement
         ;
 global_statement
         : GLOBAL identifier_list SEMICOLON
         {
-            $$ = MAKE_GLOBAL_STAT($2, loc);
+            $$ = MAKE_GLOBAL_STAT($2, driver.loc_);
         }
         ;
 
@@ -341,19 +411,19 @@ identifier_list
 if_statement
         : IF LP expression RP block
         {
-            $$ = MAKE_If_STAT($3, $5, NULL, NULL, loc);
+            $$ = MAKE_If_STAT($3, $5, NULL, NULL, driver.loc_);
         }
         | IF LP expression RP block ELSE block
         {
-            $$ = MAKE_If_STAT($3, $5, NULL, $7, loc);
+            $$ = MAKE_If_STAT($3, $5, NULL, $7, driver.loc_);
         }
         | IF LP expression RP block elseif_list
         {
-            $$ = MAKE_If_STAT($3, $5, $6, NULL, loc);
+            $$ = MAKE_If_STAT($3, $5, $6, NULL, driver.loc_);
         }
         | IF LP expression RP block elseif_list ELSE block
         {
-            $$ = MAKE_If_STAT($3, $5, $6, $8, loc);
+            $$ = MAKE_If_STAT($3, $5, $6, $8, driver.loc_);
         }
         ;
 elseif_list
@@ -369,20 +439,34 @@ elseif_list
 elseif
         : ELSEIF LP expression RP block
         {
-            MAKE_ELSEIF($$, $3, $5, loc);
+            MAKE_ELSEIF($$, $3, $5, driver.loc_);
         }
         ;
 while_statement
         : WHILE LP expression RP block
         {
-            $$ = MAKE_WHILE_STAT($3, $5, loc);
+            $$ = MAKE_WHILE_STAT($3, $5, driver.loc_);
         }
         ;
 for_statement
         : FOR LP expression_opt SEMICOLON expression_opt SEMICOLON
           expression_opt RP block
         {
-            $$ = MAKE_FOR_STAT($3, $5, $7, $9, loc);
+            $$ = MAKE_FOR_STAT($3, $5, $7, $9, driver.loc_);
+        }
+        ;
+foreach_statement
+        : FOREACH LP IDENTIFIER COLON expression COMMA expression RP block
+        {
+            $$ = MAKE_FOREACH_STAT(MAKE_IDENTIFIER_EXP($3, driver.loc_), $5, $7, $9, 0, driver.loc_);
+        }
+        | FOREACH LP IDENTIFIER COLON expression RP block
+        {
+            $$ = MAKE_FOREACH_STAT(MAKE_IDENTIFIER_EXP($3, driver.loc_), $5, NULL, $7, 0, driver.loc_);
+        }
+        | PARALLEL FOREACH LP IDENTIFIER COLON expression COMMA expression RP block
+        {
+            $$ = MAKE_FOREACH_STAT(MAKE_IDENTIFIER_EXP($4, driver.loc_), $6, $8, $10, 1, driver.loc_);
         }
         ;
 expression_opt
@@ -395,29 +479,35 @@ expression_opt
 return_statement
         : RETURN expression_opt SEMICOLON
         {
-            $$ = MAKE_RETURN_STAT($2, loc);
+            $$ = MAKE_RETURN_STAT($2, driver.loc_);
+        }
+        ;
+yield_statement
+        : YIELD expression SEMICOLON
+        {
+            $$ = MAKE_YIELD_STAT($2, driver.loc_);
         }
         ;
 break_statement
         : BREAK SEMICOLON
         {
-            $$ = MAKE_SIMPLE_STAT(BREAK_STATEMENT, loc);
+            $$ = MAKE_SIMPLE_STAT(BREAK_STATEMENT, driver.loc_);
         }
         ;
 continue_statement
         : CONTINUE SEMICOLON
         {
-            $$ = MAKE_SIMPLE_STAT(CONTINUE_STATEMENT, loc);
+            $$ = MAKE_SIMPLE_STAT(CONTINUE_STATEMENT, driver.loc_);
         }
         ;
 block
         : LC statement_list RC
         {
-			MAKE_BLOCK($$, $2, loc);
+			MAKE_BLOCK($$, $2, driver.loc_);
         }
         | LC RC
         {
-            MAKE_BLOCK($$, NULL, loc);
+            MAKE_BLOCK($$, NULL, driver.loc_);
         }
         ;
 %%
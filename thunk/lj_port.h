@@ -0,0 +1,14 @@
+#ifndef __LJ_PORT_H__
+#define __LJ_PORT_H__
+
+//
+// MSVC keywords the sources use, spelled for the other compilers.
+//
+#ifdef _MSC_VER
+#define LJ_TRAP()			__debugbreak()
+#else
+#define LJ_TRAP()			__builtin_trap()
+#define __int64				long long
+#endif
+
+#endif
@@ -0,0 +1,604 @@
+#include "lj_driver.hpp"
+#include "lj_resolver.h"
+
+namespace LJ {
+
+	LJ_Resolver::LJ_Resolver(LJ_Driver *driver)
+		: driver_(driver), pass_(GLOBAL_PASS), top_level_(true), slot_count_(0), pure_(true), generator_(false),
+		function_(NULL), parallel_loop_(NULL), parallel_function_(NULL)
+	{
+
+	}
+
+	LJ_Resolver::~LJ_Resolver()
+	{
+
+	}
+
+	void LJ_Resolver::Resolve()
+	{
+		std::list<FunctionDefinition *> &function_list = driver_->GetFunctionList();
+
+		for (std::list<FunctionDefinition *>::iterator it = function_list.begin();
+			it != function_list.end(); ++it) {
+
+			if ((*it)->GetType() == FUNCTION_DEFINITION) {
+				ResolveFunction(*it);
+			}
+		}
+
+		ResolveMain(driver_->statement_list_);
+		MarkPureFunctions();
+
+		for (std::vector<std::pair<ForeachStatement *, FunctionDefinition *> >::iterator it = parallel_loops_.begin();
+			it != parallel_loops_.end(); ++it) {
+			parallel_function_ = it->second;
+			CheckParallelForeach(it->first);
+		}
+	}
+
+	void LJ_Resolver::ResolveFunction(FunctionDefinition *func)
+	{
+		StatementList *list = (StatementList *)func->GetBlock()->GetValue(0);
+
+		top_level_ = false;
+		function_ = func;
+		slot_count_ = 0;
+		locals_.clear();
+		globals_.clear();
+
+		// A repeated parameter name refers to the last argument bound to it.
+		if (func->GetParamList() != NULL) {
+			for (ParameterList::iterator it = func->GetParamList()->begin();
+				it != func->GetParamList()->end(); ++it) {
+				locals_[**it] = slot_count_++;
+			}
+		}
+
+		pass_ = GLOBAL_PASS;
+		ResolveStatementList(list);
+		pass_ = LOCAL_PASS;
+		ResolveStatementList(list);
+		pass_ = RESOLVE_PASS;
+		pure_ = true;
+		generator_ = false;
+		callees_.clear();
+		ResolveStatementList(list);
+
+		// Every call of a generator function returns a new generator, so it
+		// is never memoized.
+		func->SetSlotCount(slot_count_);
+		func->SetGenerator(generator_);
+		func->SetPure(pure_ && !generator_);
+		call_graph_[func] = callees_;
+	}
+
+	void LJ_Resolver::ResolveMain(StatementList *list)
+	{
+		top_level_ = true;
+		function_ = NULL;
+		slot_count_ = 0;
+		locals_.clear();
+		globals_.clear();
+
+		pass_ = GLOBAL_PASS;
+		ResolveStatementList(list);
+		pass_ = RESOLVE_PASS;
+		ResolveStatementList(list);
+	}
+
+	void LJ_Resolver::ResolveStatementList(StatementList *list)
+	{
+		if (list == NULL) {
+			return;
+		}
+
+		for (StatementList::iterator it = list->begin(); it != list->end(); ++it) {
+			ResolveStatement(*it);
+		}
+	}
+
+	void LJ_Resolver::ResolveStatement(Statement *statement)
+	{
+		switch (statement->GetType()) {
+		case EXPRESSION_STATEMENT:
+		case RETURN_STATEMENT:
+			ResolveExpression((Expression *)statement->GetValue(0));
+			break;
+		case GLOBAL_STATEMENT:
+			ResolveGlobalStatement(statement);
+			break;
+		case IF_STATEMENT: {
+			ResolveExpression((Expression *)statement->GetValue(0));
+			ResolveStatementList((StatementList *)((Block *)statement->GetValue(1))->GetValue(0));
+			ElseifList *elseif_list = (ElseifList *)statement->GetValue(2);
+			if (elseif_list != NULL) {
+				for (ElseifList::iterator it = elseif_list->begin(); it != elseif_list->end(); ++it) {
+					ResolveExpression((Expression *)(*it)->GetValue(0));
+					ResolveStatementList((StatementList *)((Block *)(*it)->GetValue(1))->GetValue(0));
+				}
+			}
+			if (statement->GetValue(3) != NULL) {
+				ResolveStatementList((StatementList *)((Block *)statement->GetValue(3))->GetValue(0));
+			}
+			break;
+		}
+		case WHILE_STATEMENT:
+			ResolveExpression((Expression *)statement->GetValue(0));
+			ResolveStatementList((StatementList *)((Block *)statement->GetValue(1))->GetValue(0));
+			break;
+		case FOR_STATEMENT:
+			ResolveExpression((Expression *)statement->GetValue(0));
+			ResolveExpression((Expression *)statement->GetValue(1));
+			ResolveExpression((Expression *)statement->GetValue(2));
+			ResolveStatementList((StatementList *)((Block *)statement->GetValue(3))->GetValue(0));
+			break;
+		case FOREACH_STATEMENT:
+			if (pass_ == LOCAL_PASS) {
+				ResolveAssignTarget((Expression *)statement->GetValue(0));
+			}
+			else if (pass_ == RESOLVE_PASS && static_cast<ForeachStatement *>(statement)->IsParallel()) {
+				parallel_loops_.push_back(std::make_pair(static_cast<ForeachStatement *>(statement), function_));
+			}
+			// Resuming a generator changes it.
+			if (pass_ == RESOLVE_PASS && static_cast<ForeachStatement *>(statement)->IteratesGenerator()) {
+				pure_ = false;
+			}
+			ResolveExpression((Expression *)statement->GetValue(0));
+			ResolveExpression((Expression *)statement->GetValue(1));
+			ResolveExpression((Expression *)statement->GetValue(2));
+			ResolveStatementList((StatementList *)((Block *)statement->GetValue(3))->GetValue(0));
+			break;
+		case YIELD_STATEMENT:
+			if (top_level_) {
+				driver_->Error(statement->GetLocation(), "ExecuteYieldStatement error");
+			}
+			generator_ = true;
+			ResolveExpression((Expression *)statement->GetValue(0));
+			break;
+		case BREAK_STATEMENT:
+		case CONTINUE_STATEMENT:
+			break;
+		default:
+			LJ_TRAP();
+		}
+	}
+
+	void LJ_Resolver::ResolveGlobalStatement(Statement *statement)
+	{
+		if (pass_ != GLOBAL_PASS) {
+			return;
+		}
+
+		if (top_level_) {
+			driver_->Error(statement->GetLocation(), "ExecuteGlobalStatement error");
+		}
+
+		IdentifierList *identifier_list = (IdentifierList *)statement->GetValue(0);
+		for (IdentifierList::iterator it = identifier_list->begin(); it != identifier_list->end(); ++it) {
+			globals_.insert(**it);
+		}
+	}
+
+	void LJ_Resolver::ResolveExpression(Expression *expr)
+	{
+		if (expr == NULL || pass_ == GLOBAL_PASS) {
+			return;
+		}
+
+		switch (expr->GetType()) {
+		case IDENTIFIER_EXPRESSION:
+			if (pass_ == RESOLVE_PASS) {
+				ResolveIdentifier(expr);
+			}
+			break;
+		case ASSIGN_EXPRESSION:
+			if (pass_ == LOCAL_PASS) {
+				ResolveAssignTarget((Expression *)expr->GetValue(0));
+			}
+			ResolveExpression((Expression *)expr->GetValue(0));
+			ResolveExpression((Expression *)expr->GetValue(1));
+			break;
+		case ADD_EXPRESSION:
+		case SUB_EXPRESSION:
+		case MUL_EXPRESSION:
+		case DIV_EXPRESSION:
+		case MOD_EXPRESSION:
+		case EQ_EXPRESSION:
+		case NE_EXPRESSION:
+		case GT_EXPRESSION:
+		case GE_EXPRESSION:
+		case LT_EXPRESSION:
+		case LE_EXPRESSION:
+		case LOGICAL_AND_EXPRESSION:
+		case LOGICAL_OR_EXPRESSION:
+			ResolveExpression((Expression *)expr->GetValue(0));
+			ResolveExpression((Expression *)expr->GetValue(1));
+			break;
+		case MINUS_EXPRESSION:
+		case EXCLAMATION_EXPRESSION:
+			ResolveExpression((Expression *)expr->GetValue(0));
+			break;
+		case FUNCTION_CALL_EXPRESSION: {
+			if (pass_ == RESOLVE_PASS) {
+				LinkFunctionCall(expr);
+			}
+			ArgumentList *arg_list = (ArgumentList *)expr->GetValue(1);
+			if (arg_list != NULL) {
+				for (ArgumentList::iterator it = arg_list->begin(); it != arg_list->end(); ++it) {
+					ResolveExpression(*it);
+				}
+			}
+			break;
+		}
+		case INDEX_EXPRESSION:
+			// Arrays are shared and mutable, a call that touches one is not
+			// memoized.
+			if (pass_ == RESOLVE_PASS) {
+				pure_ = false;
+			}
+			ResolveExpression((Expression *)expr->GetValue(0));
+			ResolveExpression((Expression *)expr->GetValue(1));
+			break;
+		case ARRAY_EXPRESSION:
+		case DICT_EXPRESSION: {
+			if (pass_ == RESOLVE_PASS) {
+				pure_ = false;
+			}
+			ArgumentList *elements = (ArgumentList *)expr->GetValue(0);
+			for (ArgumentList::iterator it = elements->begin(); it != elements->end(); ++it) {
+				ResolveExpression(*it);
+			}
+			break;
+		}
+		case MEMBER_EXPRESSION:
+			// Records are shared and mutable like arrays.
+			if (pass_ == RESOLVE_PASS) {
+				pure_ = false;
+			}
+			ResolveExpression((Expression *)expr->GetValue(0));
+			break;
+		case RECORD_EXPRESSION: {
+			if (pass_ == RESOLVE_PASS) {
+				pure_ = false;
+				ResolveRecordShape(static_cast<RecordExpression *>(expr));
+			}
+			ArgumentList *values = (ArgumentList *)expr->GetValue(0);
+			for (ArgumentList::iterator it = values->begin(); it != values->end(); ++it) {
+				ResolveExpression(*it);
+			}
+			break;
+		}
+		default:
+			break;
+		}
+	}
+
+	// A record literal starts out with all of its fields, in their order.
+	void LJ_Resolver::ResolveRecordShape(RecordExpression *expr)
+	{
+		Shape *shape = driver_->shapes_.GetRoot();
+
+		for (IdentifierList::iterator it = expr->GetNames()->begin(); it != expr->GetNames()->end(); ++it) {
+			if (shape->Find(**it) >= 0) {
+				driver_->Error(expr->GetLocation(), "EvalRecordExpression error");
+			}
+			shape = shape->AddField(**it);
+		}
+		expr->SetShape(shape);
+	}
+
+	void LJ_Resolver::ResolveAssignTarget(Expression *expr)
+	{
+		if (top_level_ || expr->GetType() != IDENTIFIER_EXPRESSION) {
+			return;
+		}
+
+		std::string &name = *(std::string *)expr->GetValue(0);
+		if (globals_.find(name) == globals_.end() && locals_.find(name) == locals_.end()) {
+			locals_[name] = slot_count_++;
+		}
+	}
+
+	void LJ_Resolver::ResolveIdentifier(Expression *expr)
+	{
+		IdentifierExpression *identifier = static_cast<IdentifierExpression *>(expr);
+		std::string &name = *(std::string *)expr->GetValue(0);
+
+		if (!top_level_) {
+			std::map<std::string, int>::iterator it = locals_.find(name);
+			if (it != locals_.end()) {
+				identifier->SetSlot(LOCAL_SLOT, it->second);
+				reference_counts_[std::make_pair(function_, std::make_pair((int)LOCAL_SLOT, it->second))]++;
+				return;
+			}
+		}
+
+		identifier->SetSlot(GLOBAL_SLOT, driver_->ResolveGlobal(name));
+		reference_counts_[std::make_pair((FunctionDefinition *)NULL, std::make_pair((int)GLOBAL_SLOT, identifier->GetSlotIndex()))]++;
+		pure_ = false;
+	}
+
+	void LJ_Resolver::LinkFunctionCall(Expression *e)
+	{
+		BinaryExpression<FUNCTION_CALL_EXPRESSION> *expr = static_cast<BinaryExpression<FUNCTION_CALL_EXPRESSION> *>(e);
+		FunctionDefinition *func = driver_->FindFunction(expr->GetFunctionName());
+
+		// Calls to unknown functions stay unbound and fail when evaluated.
+		expr->SetFunction(func);
+		if (func == NULL || func->GetType() != FUNCTION_DEFINITION) {
+			pure_ = false;
+			return;
+		}
+		callees_.insert(func);
+
+		size_t arg_count = expr->GetArgList() != NULL ? expr->GetArgList()->size() : 0;
+		size_t param_count = func->GetParamList() != NULL ? func->GetParamList()->size() : 0;
+		if (arg_count != param_count) {
+			driver_->Error(expr->GetLocation(), "CallFunction error");
+		}
+	}
+
+	//
+	// A function stays pure only while all of its callees are, which is
+	// repeated until nothing changes so cycles of calls are handled.
+	//
+	void LJ_Resolver::MarkPureFunctions()
+	{
+		bool changed;
+
+		do {
+			changed = false;
+			for (std::map<FunctionDefinition *, std::set<FunctionDefinition *> >::iterator it = call_graph_.begin();
+				it != call_graph_.end(); ++it) {
+
+				if (!it->first->IsPure()) {
+					continue;
+				}
+				for (std::set<FunctionDefinition *>::iterator callee = it->second.begin(); callee != it->second.end(); ++callee) {
+					if (!(*callee)->IsPure()) {
+						it->first->SetPure(0);
+						changed = true;
+						break;
+					}
+				}
+			}
+		} while (changed);
+
+		// A cached result stands in for running the body, which only a pure
+		// function allows.
+		std::list<FunctionDefinition *> &function_list = driver_->GetFunctionList();
+		for (std::list<FunctionDefinition *>::iterator it = function_list.begin(); it != function_list.end(); ++it) {
+			if ((*it)->GetType() == FUNCTION_DEFINITION && (*it)->IsMemo() && !(*it)->IsPure()) {
+				driver_->Error((*it)->GetLocation(), "MarkPureFunctions error");
+			}
+		}
+	}
+
+	//
+	// Iterations of a parallel foreach run in any order on their own copies
+	// of the variables, so the body may not leave the loop or call anything
+	// with side effects. A variable the body assigns is private to a worker,
+	// and is only allowed when nothing outside the body names it, since the
+	// write would be lost. The only writes that survive the loop are
+	// reductions: a variable the body names in nothing but
+	// v = v + e1 + ... + en, with v in none of the e. Each worker sums its
+	// iterations starting from 0 and the partial sums are added to the value
+	// v had before the loop. Reading a variable that is updated but never
+	// assigned would see the sums of whatever iterations ran before on the
+	// same worker, which is a conflict. The loop variable keeps its value
+	// from before the loop.
+	//
+	void LJ_Resolver::CheckParallelForeach(ForeachStatement *statement)
+	{
+		IdentifierExpression *var = static_cast<IdentifierExpression *>((Expression *)statement->GetValue(0));
+
+		parallel_loop_ = statement;
+		parallel_uses_.clear();
+
+		RecordParallelUse(var, PARALLEL_ASSIGN);
+		CheckParallelStatementList((StatementList *)((Block *)statement->GetValue(3))->GetValue(0), 0);
+
+		for (std::map<std::pair<int, int>, ParallelUse>::iterator it = parallel_uses_.begin();
+			it != parallel_uses_.end(); ++it) {
+
+			ParallelUse &use = it->second;
+			if (it->first == std::make_pair((int)var->GetSlotType(), var->GetSlotIndex())) {
+				continue;
+			}
+			if (use.counts_[PARALLEL_ASSIGN] != 0) {
+				FunctionDefinition *scope = it->first.first == LOCAL_SLOT ? parallel_function_ : NULL;
+				if (reference_counts_[std::make_pair(scope, it->first)] != use.references_) {
+					driver_->Error(use.first_->GetLocation(), "CheckParallelForeach error");
+				}
+				continue;
+			}
+			if (use.counts_[PARALLEL_UPDATE] == 0) {
+				continue;
+			}
+			if (use.counts_[PARALLEL_READ] != 0) {
+				driver_->Error(use.first_->GetLocation(), "CheckParallelForeach error");
+			}
+			statement->GetReductions().push_back(use.first_);
+		}
+		parallel_loop_ = NULL;
+	}
+
+	void LJ_Resolver::CheckParallelStatementList(StatementList *list, int loop_depth)
+	{
+		if (list == NULL) {
+			return;
+		}
+
+		for (StatementList::iterator it = list->begin(); it != list->end(); ++it) {
+			Statement *statement = *it;
+
+			switch (statement->GetType()) {
+			case EXPRESSION_STATEMENT:
+				CheckParallelExpression((Expression *)statement->GetValue(0));
+				break;
+			case GLOBAL_STATEMENT:
+				break;
+			case IF_STATEMENT: {
+				CheckParallelExpression((Expression *)statement->GetValue(0));
+				CheckParallelStatementList((StatementList *)((Block *)statement->GetValue(1))->GetValue(0), loop_depth);
+				ElseifList *elseif_list = (ElseifList *)statement->GetValue(2);
+				if (elseif_list != NULL) {
+					for (ElseifList::iterator elseif = elseif_list->begin(); elseif != elseif_list->end(); ++elseif) {
+						CheckParallelExpression((Expression *)(*elseif)->GetValue(0));
+						CheckParallelStatementList((StatementList *)((Block *)(*elseif)->GetValue(1))->GetValue(0), loop_depth);
+					}
+				}
+				if (statement->GetValue(3) != NULL) {
+					CheckParallelStatementList((StatementList *)((Block *)statement->GetValue(3))->GetValue(0), loop_depth);
+				}
+				break;
+			}
+			case WHILE_STATEMENT:
+				CheckParallelExpression((Expression *)statement->GetValue(0));
+				CheckParallelStatementList((StatementList *)((Block *)statement->GetValue(1))->GetValue(0), loop_depth + 1);
+				break;
+			case FOR_STATEMENT:
+				CheckParallelExpression((Expression *)statement->GetValue(0));
+				CheckParallelExpression((Expression *)statement->GetValue(1));
+				CheckParallelExpression((Expression *)statement->GetValue(2));
+				CheckParallelStatementList((StatementList *)((Block *)statement->GetValue(3))->GetValue(0), loop_depth + 1);
+				break;
+			case FOREACH_STATEMENT:
+				if (static_cast<ForeachStatement *>(statement)->IteratesGenerator()) {
+					driver_->Error(statement->GetLocation(), "CheckParallelStatementList error");
+				}
+				RecordParallelUse(static_cast<IdentifierExpression *>((Expression *)statement->GetValue(0)), PARALLEL_ASSIGN);
+				CheckParallelExpression((Expression *)statement->GetValue(1));
+				CheckParallelExpression((Expression *)statement->GetValue(2));
+				CheckParallelStatementList((StatementList *)((Block *)statement->GetValue(3))->GetValue(0), loop_depth + 1);
+				break;
+			case RETURN_STATEMENT:
+			case YIELD_STATEMENT:
+				driver_->Error(statement->GetLocation(), "CheckParallelStatementList error");
+				break;
+			case BREAK_STATEMENT:
+				if (loop_depth == 0) {
+					driver_->Error(statement->GetLocation(), "CheckParallelStatementList error");
+				}
+				break;
+			case CONTINUE_STATEMENT:
+				break;
+			default:
+				LJ_TRAP();
+			}
+		}
+	}
+
+	void LJ_Resolver::CheckParallelExpression(Expression *expr)
+	{
+		if (expr == NULL) {
+			return;
+		}
+
+		switch (expr->GetType()) {
+		case IDENTIFIER_EXPRESSION:
+			RecordParallelUse(static_cast<IdentifierExpression *>(expr), PARALLEL_READ);
+			break;
+		case ASSIGN_EXPRESSION: {
+			Expression *left = (Expression *)expr->GetValue(0);
+			Expression *right = (Expression *)expr->GetValue(1);
+
+			if (left->GetType() == IDENTIFIER_EXPRESSION && right->GetType() == ADD_EXPRESSION) {
+				IdentifierExpression *target = static_cast<IdentifierExpression *>(left);
+				Expression *sum = right;
+
+				// v + e1 + e2 is (v + e1) + e2, v is at the bottom of the chain.
+				while (sum->GetType() == ADD_EXPRESSION) {
+					sum = (Expression *)sum->GetValue(0);
+				}
+				if (sum->GetType() == IDENTIFIER_EXPRESSION
+					&& static_cast<IdentifierExpression *>(sum)->GetSlotType() == target->GetSlotType()
+					&& static_cast<IdentifierExpression *>(sum)->GetSlotIndex() == target->GetSlotIndex()) {
+
+					RecordParallelUse(target, PARALLEL_UPDATE);
+					parallel_uses_[std::make_pair((int)target->GetSlotType(), target->GetSlotIndex())].references_++;
+					for (Expression *add = right; add->GetType() == ADD_EXPRESSION; add = (Expression *)add->GetValue(0)) {
+						CheckParallelExpression((Expression *)add->GetValue(1));
+					}
+					break;
+				}
+			}
+			if (left->GetType() == IDENTIFIER_EXPRESSION) {
+				RecordParallelUse(static_cast<IdentifierExpression *>(left), PARALLEL_ASSIGN);
+			}
+			else if (left->GetType() == INDEX_EXPRESSION || left->GetType() == MEMBER_EXPRESSION) {
+				// Every worker stores into its own copy of the array or record.
+				driver_->Error(left->GetLocation(), "CheckParallelExpression error");
+			}
+			CheckParallelExpression(right);
+			break;
+		}
+		case ADD_EXPRESSION:
+		case SUB_EXPRESSION:
+		case MUL_EXPRESSION:
+		case DIV_EXPRESSION:
+		case MOD_EXPRESSION:
+		case EQ_EXPRESSION:
+		case NE_EXPRESSION:
+		case GT_EXPRESSION:
+		case GE_EXPRESSION:
+		case LT_EXPRESSION:
+		case LE_EXPRESSION:
+		case LOGICAL_AND_EXPRESSION:
+		case LOGICAL_OR_EXPRESSION:
+			CheckParallelExpression((Expression *)expr->GetValue(0));
+			CheckParallelExpression((Expression *)expr->GetValue(1));
+			break;
+		case MINUS_EXPRESSION:
+		case EXCLAMATION_EXPRESSION:
+			CheckParallelExpression((Expression *)expr->GetValue(0));
+			break;
+		case FUNCTION_CALL_EXPRESSION: {
+			BinaryExpression<FUNCTION_CALL_EXPRESSION> *call = static_cast<BinaryExpression<FUNCTION_CALL_EXPRESSION> *>(expr);
+			FunctionDefinition *func = call->GetFunction();
+
+			// Unknown functions are left to fail when called.
+			if (func != NULL && (func->GetType() != FUNCTION_DEFINITION || !func->IsPure())) {
+				driver_->Error(expr->GetLocation(), "CheckParallelExpression error");
+			}
+			ArgumentList *arg_list = call->GetArgList();
+			if (arg_list != NULL) {
+				for (ArgumentList::iterator it = arg_list->begin(); it != arg_list->end(); ++it) {
+					CheckParallelExpression(*it);
+				}
+			}
+			break;
+		}
+		case INDEX_EXPRESSION:
+			CheckParallelExpression((Expression *)expr->GetValue(0));
+			CheckParallelExpression((Expression *)expr->GetValue(1));
+			break;
+		case MEMBER_EXPRESSION:
+			CheckParallelExpression((Expression *)expr->GetValue(0));
+			break;
+		case ARRAY_EXPRESSION:
+		case DICT_EXPRESSION:
+		case RECORD_EXPRESSION: {
+			ArgumentList *elements = (ArgumentList *)expr->GetValue(0);
+			for (ArgumentList::iterator it = elements->begin(); it != elements->end(); ++it) {
+				CheckParallelExpression(*it);
+			}
+			break;
+		}
+		default:
+			break;
+		}
+	}
+
+	void LJ_Resolver::RecordParallelUse(IdentifierExpression *identifier, int kind)
+	{
+		ParallelUse &use = parallel_uses_[std::make_pair((int)identifier->GetSlotType(), identifier->GetSlotIndex())];
+
+		if (use.first_ == NULL || (kind == PARALLEL_UPDATE && use.counts_[PARALLEL_UPDATE] == 0)) {
+			use.first_ = identifier;
+		}
+		use.counts_[kind]++;
+		use.references_++;
+	}
+}
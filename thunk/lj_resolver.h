@@ -0,0 +1,104 @@
+#ifndef __LJ_RESOLVER_H__
+#define __LJ_RESOLVER_H__
+
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+#include "lj_ast.h"
+
+namespace LJ {
+
+	class LJ_Driver;
+
+	//
+	// Runs once after parsing and places every IdentifierExpression. At top
+	// level all names are globals. Inside a function, parameters and names
+	// assigned without a global declaration get frame slots, numbered from
+	// the parameters up; every other name is a global. Globals are numbered
+	// in the driver's global table. Function calls are bound to their
+	// FunctionDefinition here and their argument counts checked, and
+	// functions that touch no global and call only pure functions are
+	// marked pure, a function that yields is marked a generator and is
+	// never pure, and a memo function has to be pure. Record literals get the shape their fields make. Last,
+	// the body of every parallel foreach is checked to be safe to split
+	// across threads and its reductions are recorded.
+	//
+	class LJ_Resolver {
+	public:
+		LJ_Resolver(LJ_Driver *driver);
+		~LJ_Resolver();
+
+		void Resolve();
+
+	private:
+		enum ResolvePass {
+			GLOBAL_PASS = 1,
+			LOCAL_PASS,
+			RESOLVE_PASS,
+		};
+
+		void ResolveFunction(FunctionDefinition *func);
+		void ResolveMain(StatementList *list);
+
+		void ResolveStatementList(StatementList *list);
+		void ResolveStatement(Statement *statement);
+		void ResolveGlobalStatement(Statement *statement);
+		void ResolveExpression(Expression *expr);
+		void ResolveIdentifier(Expression *expr);
+		void ResolveAssignTarget(Expression *expr);
+		void ResolveRecordShape(RecordExpression *expr);
+		void LinkFunctionCall(Expression *expr);
+		void MarkPureFunctions();
+		void CheckParallelForeach(ForeachStatement *statement);
+		void CheckParallelStatementList(StatementList *list, int loop_depth);
+		void CheckParallelExpression(Expression *expr);
+		void RecordParallelUse(IdentifierExpression *identifier, int kind);
+
+		LJ_Driver *driver_;
+		ResolvePass pass_;
+		bool top_level_;
+		int slot_count_;
+		std::map<std::string, int> locals_;
+		std::set<std::string> globals_;
+		bool pure_;
+		bool generator_;
+		std::set<FunctionDefinition *> callees_;
+		std::map<FunctionDefinition *, std::set<FunctionDefinition *> > call_graph_;
+
+		// The function being resolved, NULL at top level.
+		FunctionDefinition *function_;
+
+		// How often the whole program names each variable. A local is keyed
+		// by its function as well, a global by NULL.
+		typedef std::pair<FunctionDefinition *, std::pair<int, int> > VariableKey;
+		std::map<VariableKey, int> reference_counts_;
+
+		enum ParallelUseKind {
+			PARALLEL_READ = 0,
+			PARALLEL_ASSIGN,
+			PARALLEL_UPDATE,
+		};
+
+		//
+		// How often the body of the parallel foreach being checked reads a
+		// variable, assigns it and updates it as v = v + e1 + ... + en, and
+		// how often it names the variable in all.
+		//
+		struct ParallelUse {
+			ParallelUse() : first_(NULL), references_(0) { counts_[0] = counts_[1] = counts_[2] = 0; }
+
+			int counts_[3];
+			IdentifierExpression *first_;
+			int references_;
+		};
+
+		// Each parallel foreach with the function it is in.
+		std::vector<std::pair<ForeachStatement *, FunctionDefinition *> > parallel_loops_;
+		ForeachStatement *parallel_loop_;
+		FunctionDefinition *parallel_function_;
+		std::map<std::pair<int, int>, ParallelUse> parallel_uses_;
+	};
+}
+
+#endif
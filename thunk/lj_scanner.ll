@@ -2,127 +2,161 @@
 #include <cerrno>
 #include <climits>
 #include <cstdlib>
+#include <cstring>
 #include <string>
+#ifdef _WIN32
 #include <io.h>
+#endif
 
 #include "lj_driver.hpp"
 #include "lj_parser.hpp"
 
+#ifdef _WIN32
 #define YY_NO_UNISTD_H
+#endif
 
-#undef yywrap
-#define yywrap() 1
-
-// The location of the current token.
-LJ::location loc;
+// A broken scanner must not take the other drivers of the process down.
+#define YY_FATAL_ERROR(msg) throw LJ::LJ_Error(msg)
 %}
 
-%option noyywrap nounput batch debug
+%option reentrant noyywrap nounput batch debug
 
 %{
   // Code run each time a pattern is matched.
-  # define YY_USER_ACTION  loc.columns(yyleng);
+  // The location of the current token is kept by the driver.
+  # define YY_USER_ACTION  driver.loc_.columns(yyleng);
 %}
 %%
 %{
   // Code run each time yylex is called.
-  loc.step();
+  driver.loc_.step();
 %}
-[ \t]+		loc.step();
-[\n]+		loc.lines (yyleng); loc.step();
-
-<INITIAL>"if"           return LJ::Parser::make_IF(loc);
-<INITIAL>"else"         return LJ::Parser::make_ELSE(loc);
-<INITIAL>"elseif"       return LJ::Parser::make_ELSEIF(loc);
-<INITIAL>"while"        return LJ::Parser::make_WHILE(loc);
-<INITIAL>"do"           return LJ::Parser::make_DO(loc);
-<INITIAL>"for"          return LJ::Parser::make_FOR(loc);
-<INITIAL>"foreach"      return LJ::Parser::make_FOREACH(loc);
-<INITIAL>"return"       return LJ::Parser::make_RETURN(loc);
-<INITIAL>"break"        return LJ::Parser::make_BREAK(loc);
-<INITIAL>"continue"     return LJ::Parser::make_CONTINUE(loc);
-<INITIAL>"null"         return LJ::Parser::make_NULL(loc);
-<INITIAL>"true"         return LJ::Parser::make_TRUE(loc);
-<INITIAL>"false"        return LJ::Parser::make_FALSE(loc);
-<INITIAL>"global"       return LJ::Parser::make_GLOBAL(loc);
-<INITIAL>"function"     return LJ::Parser::make_FUNCTION(loc);
-<INITIAL>"("            return LJ::Parser::make_LP(loc);
-<INITIAL>")"            return LJ::Parser::make_RP(loc);
-<INITIAL>"{"            return LJ::Parser::make_LC(loc);
-<INITIAL>"}"            return LJ::Parser::make_RC(loc);
-<INITIAL>"["            return LJ::Parser::make_LB(loc);
-<INITIAL>"]"            return LJ::Parser::make_RB(loc);
-<INITIAL>";"            return LJ::Parser::make_SEMICOLON(loc);
-<INITIAL>":"            return LJ::Parser::make_COLON(loc);
-<INITIAL>","            return LJ::Parser::make_COMMA(loc);
-<INITIAL>"&&"           return LJ::Parser::make_LOGICAL_AND(loc);
-<INITIAL>"||"           return LJ::Parser::make_LOGICAL_OR(loc);
-<INITIAL>"="            return LJ::Parser::make_ASSIGN(loc);
-<INITIAL>"=="           return LJ::Parser::make_EQ(loc);
-<INITIAL>"!="           return LJ::Parser::make_NE(loc);
-<INITIAL>">"            return LJ::Parser::make_GT(loc);
-<INITIAL>">="           return LJ::Parser::make_GE(loc);
-<INITIAL>"<"            return LJ::Parser::make_LT(loc);
-<INITIAL>"<="           return LJ::Parser::make_LE(loc);
-<INITIAL>"+"            return LJ::Parser::make_ADD(loc);
-<INITIAL>"-"            return LJ::Parser::make_SUB(loc);
-<INITIAL>"*"            return LJ::Parser::make_MUL(loc);
-<INITIAL>"/"            return LJ::Parser::make_DIV(loc);
-<INITIAL>"%"            return LJ::Parser::make_MOD(loc);
-<INITIAL>"&"            return LJ::Parser::make_BIT_AND(loc);
-<INITIAL>"|"            return LJ::Parser::make_BIT_OR(loc);
-<INITIAL>"^"            return LJ::Parser::make_BIT_XOR(loc);
-<INITIAL>"~"            return LJ::Parser::make_BIT_NOT(loc);
-<INITIAL>"+="           return LJ::Parser::make_ADD_ASSIGN(loc);
-<INITIAL>"-="           return LJ::Parser::make_SUB_ASSIGN(loc);
-<INITIAL>"*="           return LJ::Parser::make_MUL_ASSIGN(loc);
-<INITIAL>"/="           return LJ::Parser::make_DIV_ASSIGN(loc);
-<INITIAL>"%="           return LJ::Parser::make_MOD_ASSIGN(loc);
-<INITIAL>"++"           return LJ::Parser::make_INCREMENT(loc);
-<INITIAL>"--"           return LJ::Parser::make_DECREMENT(loc);
-<INITIAL>"!"            return LJ::Parser::make_EXCLAMATION(loc);
-<INITIAL>"."            return LJ::Parser::make_DOT(loc);
+[ \t]+		driver.loc_.step();
+[\n]+		driver.loc_.lines (yyleng); driver.loc_.step();
+
+<INITIAL>"if"           return LJ::Parser::make_IF(driver.loc_);
+<INITIAL>"else"         return LJ::Parser::make_ELSE(driver.loc_);
+<INITIAL>"elseif"       return LJ::Parser::make_ELSEIF(driver.loc_);
+<INITIAL>"while"        return LJ::Parser::make_WHILE(driver.loc_);
+<INITIAL>"do"           return LJ::Parser::make_DO(driver.loc_);
+<INITIAL>"for"          return LJ::Parser::make_FOR(driver.loc_);
+<INITIAL>"foreach"      return LJ::Parser::make_FOREACH(driver.loc_);
+<INITIAL>"parallel"     return LJ::Parser::make_PARALLEL(driver.loc_);
+<INITIAL>"return"       return LJ::Parser::make_RETURN(driver.loc_);
+<INITIAL>"yield"        return LJ::Parser::make_YIELD(driver.loc_);
+<INITIAL>"break"        return LJ::Parser::make_BREAK(driver.loc_);
+<INITIAL>"continue"     return LJ::Parser::make_CONTINUE(driver.loc_);
+<INITIAL>"null"         return LJ::Parser::make_NULL(driver.loc_);
+<INITIAL>"true"         return LJ::Parser::make_TRUE(driver.loc_);
+<INITIAL>"false"        return LJ::Parser::make_FALSE(driver.loc_);
+<INITIAL>"global"       return LJ::Parser::make_GLOBAL(driver.loc_);
+<INITIAL>"function"     return LJ::Parser::make_FUNCTION(driver.loc_);
+<INITIAL>"memo"         return LJ::Parser::make_MEMO(driver.loc_);
+<INITIAL>"("            return LJ::Parser::make_LP(driver.loc_);
+<INITIAL>")"            return LJ::Parser::make_RP(driver.loc_);
+<INITIAL>"{"            return LJ::Parser::make_LC(driver.loc_);
+<INITIAL>"}"            return LJ::Parser::make_RC(driver.loc_);
+<INITIAL>"["            return LJ::Parser::make_LB(driver.loc_);
+<INITIAL>"]"            return LJ::Parser::make_RB(driver.loc_);
+<INITIAL>";"            return LJ::Parser::make_SEMICOLON(driver.loc_);
+<INITIAL>":"            return LJ::Parser::make_COLON(driver.loc_);
+<INITIAL>","            return LJ::Parser::make_COMMA(driver.loc_);
+<INITIAL>"&&"           return LJ::Parser::make_LOGICAL_AND(driver.loc_);
+<INITIAL>"||"           return LJ::Parser::make_LOGICAL_OR(driver.loc_);
+<INITIAL>"="            return LJ::Parser::make_ASSIGN(driver.loc_);
+<INITIAL>"=="           return LJ::Parser::make_EQ(driver.loc_);
+<INITIAL>"!="           return LJ::Parser::make_NE(driver.loc_);
+<INITIAL>">"            return LJ::Parser::make_GT(driver.loc_);
+<INITIAL>">="           return LJ::Parser::make_GE(driver.loc_);
+<INITIAL>"<"            return LJ::Parser::make_LT(driver.loc_);
+<INITIAL>"<="           return LJ::Parser::make_LE(driver.loc_);
+<INITIAL>"+"            return LJ::Parser::make_ADD(driver.loc_);
+<INITIAL>"-"            return LJ::Parser::make_SUB(driver.loc_);
+<INITIAL>"*"            return LJ::Parser::make_MUL(driver.loc_);
+<INITIAL>"/"            return LJ::Parser::make_DIV(driver.loc_);
+<INITIAL>"%"            return LJ::Parser::make_MOD(driver.loc_);
+<INITIAL>"&"            return LJ::Parser::make_BIT_AND(driver.loc_);
+<INITIAL>"|"            return LJ::Parser::make_BIT_OR(driver.loc_);
+<INITIAL>"^"            return LJ::Parser::make_BIT_XOR(driver.loc_);
+<INITIAL>"~"            return LJ::Parser::make_BIT_NOT(driver.loc_);
+<INITIAL>"+="           return LJ::Parser::make_ADD_ASSIGN(driver.loc_);
+<INITIAL>"-="           return LJ::Parser::make_SUB_ASSIGN(driver.loc_);
+<INITIAL>"*="           return LJ::Parser::make_MUL_ASSIGN(driver.loc_);
+<INITIAL>"/="           return LJ::Parser::make_DIV_ASSIGN(driver.loc_);
+<INITIAL>"%="           return LJ::Parser::make_MOD_ASSIGN(driver.loc_);
+<INITIAL>"++"           return LJ::Parser::make_INCREMENT(driver.loc_);
+<INITIAL>"--"           return LJ::Parser::make_DECREMENT(driver.loc_);
+<INITIAL>"!"            return LJ::Parser::make_EXCLAMATION(driver.loc_);
+<INITIAL>"."            return LJ::Parser::make_DOT(driver.loc_);
 
 
 <INITIAL>[0-9]+	{
 	errno = 0;
-	__int64 n = 0;
-	sscanf(yytext, "%I64d", &n);
-	return LJ::Parser::make_INT_LITERAL(n, loc);
+	__int64 n = strtoll(yytext, NULL, 10);
+	if (errno == ERANGE) {
+		driver.Error(driver.loc_, "integer literal out of range");
+	}
+	return LJ::Parser::make_INT_LITERAL(n, driver.loc_);
 }
 
 <INITIAL>"0"[xX][0-9a-fA-F]+ {
-	__int64 n = 0;
-    sscanf(yytext, "%I64x", &n);
-    return LJ::Parser::make_INT_LITERAL(n, loc);
+	__int64 n = (__int64)strtoull(yytext, NULL, 16);
+    return LJ::Parser::make_INT_LITERAL(n, driver.loc_);
 }
 
 <INITIAL>[0-9]+\.[0-9]+ {
     double n = 0.0;
     sscanf(yytext, "%lf", &n);
-    return LJ::Parser::make_DOUBLE_LITERAL(n, loc);
+    return LJ::Parser::make_DOUBLE_LITERAL(n, driver.loc_);
+}
+
+<INITIAL>\"([^"\\\n]|\\.)*\"	{
+	std::string s;
+	for (int i = 1; i < yyleng - 1; i++) {
+		if (yytext[i] == '\\') {
+			i++;
+			switch (yytext[i]) {
+			case 'n': s += '\n'; break;
+			case 't': s += '\t'; break;
+			default: s += yytext[i]; break;
+			}
+		}
+		else {
+			s += yytext[i];
+		}
+	}
+	return LJ::Parser::make_STRING_LITERAL(s, driver.loc_);
 }
 
 <INITIAL>[A-Za-z_][A-Za-z_0-9]*      {
-	return LJ::Parser::make_IDENTIFIER(yytext, loc);
+	return LJ::Parser::make_IDENTIFIER(yytext, driver.loc_);
 }
-.          driver.Error(loc, "invalid character");
-<<EOF>>    return LJ::Parser::make_END(loc);
+.          driver.Error(driver.loc_, "invalid character");
+<<EOF>>    return LJ::Parser::make_END(driver.loc_);
 %%
 
 void LJ::LJ_Driver::ScanBegin()
 {
-	yy_flex_debug = trace_scanning_;
+	FILE *in;
+
+	loc_.initialize();
 	if (file_ == "-")
-		yyin = stdin;
-	else if (!(yyin = fopen(file_.c_str (), "r")))
-	{
+		in = stdin;
+	else if (!(in = fopen(file_.c_str (), "r")))
 		Error(std::string ("cannot open ") + file_ + ": " + strerror(errno));
-		exit(1);
-	}
+
+	yylex_init(&scanner_);
+	yyset_debug(trace_scanning_, scanner_);
+	yyset_in(in, scanner_);
 }
 
 void LJ::LJ_Driver::ScanEnd()
 {
-	fclose(yyin);
+	if (scanner_ == NULL)
+		return;
+
+	if (yyget_in(scanner_) != stdin)
+		fclose(yyget_in(scanner_));
+	yylex_destroy(scanner_);
+	scanner_ = NULL;
 }
@@ -0,0 +1,274 @@
+#include <stdint.h>
+#include "lj_scheduler.h"
+#include "lj_closure.h"
+#include "lj_vm.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+namespace LJ {
+
+	LJ_Task::LJ_Task(LJ_Scheduler *scheduler, const std::string &file)
+		: driver_(new LJ_Driver), closure_(0), bytecode_(0), scheduler_(scheduler), file_(file), state_(TASK_READY),
+		spawn_time_(std::chrono::steady_clock::now()),
+#ifdef _WIN32
+		fiber_(NULL), worker_fiber_(NULL)
+#else
+		worker_context_(NULL), stack_(NULL)
+#endif
+	{
+		driver_->out_ = &out_;
+		driver_->task_ = this;
+	}
+
+	LJ_Task::~LJ_Task()
+	{
+		delete driver_;
+#ifdef _WIN32
+		if (fiber_ != NULL) {
+			DeleteFiber(fiber_);
+		}
+#else
+		delete[] stack_;
+#endif
+	}
+
+	//
+	// Runs the script the way a driver on its own thread would, and switches
+	// back to the worker for good once it has finished.
+	//
+	void LJ_Task::Main(LJ_Task *task)
+	{
+		task->Run();
+		task->state_ = TASK_DONE;
+		task->finish_time_ = std::chrono::steady_clock::now();
+		task->SwitchOut();
+	}
+
+#ifdef _WIN32
+	static VOID CALLBACK TaskEntry(LPVOID task)
+	{
+		LJ_Task::Main((LJ_Task *)task);
+	}
+#else
+	// makecontext passes int arguments only, the task pointer comes in halves.
+	static void TaskEntry(int high, int low)
+	{
+		LJ_Task::Main((LJ_Task *)(((uintptr_t)(unsigned)high << 16 << 16) | (uintptr_t)(unsigned)low));
+	}
+#endif
+
+	void LJ_Task::Run()
+	{
+		try {
+			if (!driver_->Parse(file_)) {
+				if (closure_) {
+					LJ_ClosureEngine engine(driver_);
+					engine.Execute();
+				}
+				else if (bytecode_) {
+					// Compiled code has no safepoints.
+					LJ_VM vm(driver_);
+					vm.use_jit_ = false;
+					vm.Execute();
+				}
+				else {
+					driver_->Execute();
+				}
+			}
+		}
+		catch (LJ_Error &e) {
+			out_ << e.what() << std::endl;
+		}
+	}
+
+	void LJ_Task::SwitchOut()
+	{
+#ifdef _WIN32
+		SwitchToFiber(worker_fiber_);
+#else
+		swapcontext(&context_, worker_context_);
+#endif
+	}
+
+	void LJ_Task::Yield()
+	{
+		SwitchOut();
+	}
+
+	void LJ_Task::Sleep(__int64 ms)
+	{
+		wake_time_ = std::chrono::steady_clock::now() + std::chrono::milliseconds(ms > 0 ? ms : 0);
+		state_ = TASK_SLEEPING;
+		SwitchOut();
+		state_ = TASK_READY;
+	}
+
+	double LJ_Task::GetLatency() const
+	{
+		return std::chrono::duration<double, std::milli>(finish_time_ - spawn_time_).count();
+	}
+
+	LJ_Scheduler::LJ_Scheduler(size_t worker_count)
+		: worker_count_(worker_count), live_(0)
+	{
+		if (worker_count_ == 0) {
+			worker_count_ = std::thread::hardware_concurrency();
+		}
+		if (worker_count_ == 0) {
+			worker_count_ = 1;
+		}
+	}
+
+	LJ_Scheduler::~LJ_Scheduler()
+	{
+		DeleteElems(tasks_);
+	}
+
+	//
+	// Queues a new task for file. The task does not start before Run, its
+	// driver and engine can be set up until then.
+	//
+	LJ_Task * LJ_Scheduler::Spawn(const std::string &file)
+	{
+		std::lock_guard<std::mutex> lock(lock_);
+		LJ_Task *task = new LJ_Task(this, file);
+
+		tasks_.push_back(task);
+		ready_.push_back(task);
+		live_++;
+		return task;
+	}
+
+	void LJ_Scheduler::Run()
+	{
+		std::vector<std::thread> workers;
+
+		for (size_t i = 0; i < worker_count_; i++) {
+			workers.push_back(std::thread(&LJ_Scheduler::WorkerMain, this));
+		}
+		for (size_t i = 0; i < worker_count_; i++) {
+			workers[i].join();
+		}
+	}
+
+	//
+	// Returns the next task to run, waiting while none is ready, or NULL
+	// once every task has finished.
+	//
+	LJ_Task * LJ_Scheduler::Take()
+	{
+		std::unique_lock<std::mutex> lock(lock_);
+
+		for (;;) {
+			if (live_ == 0) {
+				return NULL;
+			}
+
+			TaskTime now = std::chrono::steady_clock::now();
+			while (!sleeping_.empty() && sleeping_.begin()->first <= now) {
+				ready_.push_back(sleeping_.begin()->second);
+				sleeping_.erase(sleeping_.begin());
+			}
+
+			if (!ready_.empty()) {
+				LJ_Task *task = ready_.front();
+				ready_.pop_front();
+				return task;
+			}
+
+			if (!sleeping_.empty()) {
+				wake_.wait_until(lock, sleeping_.begin()->first);
+			}
+			else {
+				wake_.wait(lock);
+			}
+		}
+	}
+
+	void LJ_Scheduler::Put(LJ_Task *task)
+	{
+		std::lock_guard<std::mutex> lock(lock_);
+
+		switch (task->state_) {
+		case TASK_READY:
+			ready_.push_back(task);
+			break;
+		case TASK_SLEEPING:
+			sleeping_.insert(std::make_pair(task->wake_time_, task));
+			break;
+		case TASK_DONE:
+			if (--live_ == 0) {
+				wake_.notify_all();
+			}
+			return;
+		default:
+			LJ_TRAP();
+		}
+
+		// An idle worker may be waiting for a later wake time.
+		wake_.notify_one();
+	}
+
+	//
+	// Switches into one task after another until all have finished. A task
+	// gets its native stack when it first runs and gives it back when done,
+	// so only started tasks hold one. Its driver goes at the same time, so
+	// memory grows with the tasks alive at once, not with all spawned.
+	//
+	void LJ_Scheduler::WorkerMain()
+	{
+		LJ_Task *task;
+#ifdef _WIN32
+		void *worker_fiber = ConvertThreadToFiber(NULL);
+#else
+		ucontext_t worker_context;
+#endif
+
+		while ((task = Take()) != NULL) {
+			task->driver_->safepoint_budget_ = TASK_TIME_SLICE;
+
+#ifdef _WIN32
+			if (task->fiber_ == NULL) {
+				task->fiber_ = CreateFiber(TASK_STACK_SIZE, TaskEntry, task);
+			}
+			task->worker_fiber_ = worker_fiber;
+			SwitchToFiber(task->fiber_);
+
+			if (task->state_ == TASK_DONE) {
+				DeleteFiber(task->fiber_);
+				task->fiber_ = NULL;
+				delete task->driver_;
+				task->driver_ = NULL;
+			}
+#else
+			if (task->stack_ == NULL) {
+				uintptr_t p = (uintptr_t)task;
+
+				task->stack_ = new char[TASK_STACK_SIZE];
+				getcontext(&task->context_);
+				task->context_.uc_stack.ss_sp = task->stack_;
+				task->context_.uc_stack.ss_size = TASK_STACK_SIZE;
+				task->context_.uc_link = NULL;
+				makecontext(&task->context_, (void (*)())TaskEntry, 2, (int)(p >> 16 >> 16), (int)(unsigned)p);
+			}
+			task->worker_context_ = &worker_context;
+			swapcontext(&worker_context, &task->context_);
+
+			if (task->state_ == TASK_DONE) {
+				delete[] task->stack_;
+				task->stack_ = NULL;
+				delete task->driver_;
+				task->driver_ = NULL;
+			}
+#endif
+
+			Put(task);
+		}
+
+#ifdef _WIN32
+		ConvertFiberToThread();
+#endif
+	}
+}
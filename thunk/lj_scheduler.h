@@ -0,0 +1,123 @@
+#ifndef __LJ_SCHEDULER_H__
+#define __LJ_SCHEDULER_H__
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include "lj_driver.hpp"
+
+#ifndef _WIN32
+#include <ucontext.h>
+#endif
+
+namespace LJ {
+
+// Native stack of every task. The driver moves deeper recursion to a fresh
+// thread after NATIVE_STACK_SEGMENT_SIZE, so this leaves it headroom. Only
+// the pages a task touches are ever committed.
+#define TASK_STACK_SIZE			(2 * NATIVE_STACK_SEGMENT_SIZE)
+
+// Safepoints a task passes before it goes to the back of the run queue.
+#define TASK_TIME_SLICE			10000
+
+	enum TaskState {
+		TASK_READY = 1,
+		TASK_SLEEPING,
+		TASK_DONE,
+	};
+
+	typedef std::chrono::steady_clock::time_point TaskTime;
+
+	class LJ_Scheduler;
+
+	//
+	// One script run by LJ_Scheduler. The task owns its driver and a native
+	// stack of its own, it switches back to the worker thread that runs it
+	// at safepoints and when a builtin would block, and may continue later
+	// on any other worker. Once the script has finished both are freed and
+	// only its output and timestamps are kept.
+	//
+	class LJ_Task {
+	public:
+		LJ_Task(LJ_Scheduler *scheduler, const std::string &file);
+		~LJ_Task();
+
+		void Yield();
+		void Sleep(__int64 ms);
+
+		// Everything the script printed, including the error that stopped it.
+		std::string GetOutput() const { return out_.str(); }
+		double GetLatency() const;
+
+		// Set up until Run, NULL once the task is done.
+		LJ_Driver *driver_;
+		boolean closure_;
+		boolean bytecode_;
+
+		// First function on the task's own stack, never returns.
+		static void Main(LJ_Task *task);
+
+	private:
+		friend class LJ_Scheduler;
+
+		void Run();
+		void SwitchOut();
+
+		LJ_Scheduler *scheduler_;
+		std::string file_;
+		std::ostringstream out_;
+		TaskState state_;
+		TaskTime spawn_time_;
+		TaskTime finish_time_;
+		TaskTime wake_time_;
+#ifdef _WIN32
+		void *fiber_;
+		void *worker_fiber_;
+#else
+		ucontext_t context_;
+		ucontext_t *worker_context_;
+		char *stack_;
+#endif
+	};
+
+	//
+	// Runs any number of tasks on a fixed pool of worker threads. Ready
+	// tasks wait in one queue and are run in turn for a time slice each;
+	// sleeping ones wait in order of their wake time and rejoin the queue
+	// when it has passed. An idle worker waits for whichever comes first.
+	//
+	class LJ_Scheduler {
+	public:
+		LJ_Scheduler(size_t worker_count);
+		~LJ_Scheduler();
+
+		LJ_Task *Spawn(const std::string &file);
+		void Run();
+
+		std::vector<LJ_Task *>& GetTasks() { return tasks_; }
+		size_t GetWorkerCount() const { return worker_count_; }
+
+	private:
+		friend class LJ_Task;
+
+		LJ_Task *Take();
+		void Put(LJ_Task *task);
+		void WorkerMain();
+
+		size_t worker_count_;
+		std::vector<LJ_Task *> tasks_;
+		std::mutex lock_;
+		std::condition_variable wake_;
+		std::deque<LJ_Task *> ready_;
+		std::multimap<TaskTime, LJ_Task *> sleeping_;
+		size_t live_;
+	};
+}
+
+#endif
@@ -0,0 +1,39 @@
+#include "lj_shape.h"
+
+namespace LJ {
+
+	Shape::Shape(const Shape &parent, const std::string &name)
+		: tree_(parent.tree_), names_(parent.names_)
+	{
+		names_.push_back(name);
+	}
+
+	// Only the root is destroyed, with its tree, and takes the rest along.
+	Shape::~Shape()
+	{
+		for (std::map<std::string, Shape *>::iterator it = transitions_.begin(); it != transitions_.end(); ++it) {
+			delete it->second;
+		}
+	}
+
+	int Shape::Find(const std::string &name) const
+	{
+		for (size_t i = 0; i < names_.size(); i++) {
+			if (names_[i] == name) {
+				return (int)i;
+			}
+		}
+		return -1;
+	}
+
+	Shape *Shape::AddField(const std::string &name)
+	{
+		Shape *&next = transitions_[name];
+
+		if (next == NULL) {
+			next = new Shape(*this, name);
+			tree_->count_++;
+		}
+		return next;
+	}
+}
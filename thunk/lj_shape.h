@@ -0,0 +1,108 @@
+#ifndef __LJ_SHAPE_H__
+#define __LJ_SHAPE_H__
+
+#include <map>
+#include <string>
+#include <vector>
+
+// Shapes one member expression remembers before it goes megamorphic.
+#define INLINE_CACHE_SIZE		4
+
+namespace LJ {
+
+	class ShapeTree;
+
+	//
+	// Hidden class of a record: the names of its fields in slot order.
+	// Records that get the same fields in the same order share one shape, so
+	// a shape and a slot are all an access needs to remember. Shapes form a
+	// tree of transitions from the empty root of their ShapeTree, and never
+	// change once made but for their transitions.
+	//
+	class Shape {
+	public:
+		~Shape();
+
+		size_t GetFieldCount() const { return names_.size(); }
+		const std::string &GetFieldName(size_t slot) const { return names_[slot]; }
+
+		// The slot of name, or -1 when the shape has no such field.
+		int Find(const std::string &name) const;
+
+		// The shape with name added as the last field, made on first use.
+		Shape *AddField(const std::string &name);
+
+	private:
+		friend class ShapeTree;
+
+		explicit Shape(ShapeTree *tree) : tree_(tree) {}
+		Shape(const Shape &parent, const std::string &name);
+
+		ShapeTree *tree_;
+		std::vector<std::string> names_;
+		std::map<std::string, Shape *> transitions_;
+	};
+
+	//
+	// The shapes of one driver, freed with it. Parallel foreach workers run
+	// on the AST of the driver that started them and see its shapes, but a
+	// worker never stores to a member, so only that driver makes transitions.
+	//
+	class ShapeTree {
+	public:
+		ShapeTree() : root_(this), count_(1) {}
+
+		Shape *GetRoot() { return &root_; }
+		size_t GetShapeCount() const { return count_; }
+
+	private:
+		friend class Shape;
+
+		Shape root_;
+		size_t count_;
+	};
+
+	struct InlineCacheEntry {
+		Shape *shape_;
+		// For a store that adds the field, the shape the record moves to.
+		Shape *transition_;
+		size_t slot_;
+	};
+
+	//
+	// The shapes one member expression has seen and the slot of its field
+	// in each. One entry is monomorphic, up to INLINE_CACHE_SIZE polymorphic;
+	// once full the cache is megamorphic and other shapes are looked up on
+	// every access.
+	//
+	class InlineCache {
+	public:
+		InlineCache() : count_(0) {}
+
+		void Add(Shape *shape, Shape *transition, size_t slot) {
+			if (count_ < INLINE_CACHE_SIZE) {
+				entries_[count_].shape_ = shape;
+				entries_[count_].transition_ = transition;
+				entries_[count_].slot_ = slot;
+				count_++;
+			}
+		}
+
+		InlineCacheEntry entries_[INLINE_CACHE_SIZE];
+		size_t count_;
+	};
+
+	//
+	// Counted by each driver over all of its engines. A transition is a
+	// record moving to a new shape as a field is added to it.
+	//
+	struct ShapeStats {
+		ShapeStats() : hits_(0), misses_(0), transitions_(0) {}
+
+		size_t hits_;
+		size_t misses_;
+		size_t transitions_;
+	};
+}
+
+#endif
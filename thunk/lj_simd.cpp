@@ -0,0 +1,806 @@
+#include <atomic>
+#include "lj_simd.h"
+
+#if LJ_SIMD_SUPPORTED
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
+// Functions using AVX2 are compiled for it one by one, the rest of the
+// program still runs on any x64 CPU.
+#if defined(__GNUC__)
+#define LJ_AVX2		__attribute__((target("avx2")))
+#else
+#define LJ_AVX2
+#endif
+
+namespace LJ {
+
+	const char *GetSimdLevelString(int level)
+	{
+		switch (level) {
+		case SIMD_SCALAR: return "scalar";
+		case SIMD_SSE2: return "sse2";
+		case SIMD_AVX2: return "avx2";
+		}
+
+		return "SIMD_ERROR";
+	}
+
+	//
+	// Scalar kernels, also used for the elements left over by the vector
+	// ones. Ints are added and multiplied unsigned so that they wrap.
+	//
+	typedef unsigned __int64 uint64;
+
+	static double SumLanes(const double *lanes)
+	{
+		return ((lanes[0] + lanes[1]) + (lanes[2] + lanes[3])) + ((lanes[4] + lanes[5]) + (lanes[6] + lanes[7]));
+	}
+
+	static __int64 SumIntScalar(const __int64 *x, size_t n)
+	{
+		uint64 s = 0;
+
+		for (size_t i = 0; i < n; i++) {
+			s += (uint64)x[i];
+		}
+		return (__int64)s;
+	}
+
+	static double SumDoubleScalar(const double *x, size_t n)
+	{
+		double lanes[8] = { 0, 0, 0, 0, 0, 0, 0, 0 };
+		size_t i = 0;
+
+		for (; i + 8 <= n; i += 8) {
+			for (int k = 0; k < 8; k++) {
+				lanes[k] += x[i + k];
+			}
+		}
+
+		double s = SumLanes(lanes);
+		for (; i < n; i++) {
+			s += x[i];
+		}
+		return s;
+	}
+
+	static __int64 DotIntScalar(const __int64 *x, const __int64 *y, size_t n)
+	{
+		uint64 s = 0;
+
+		for (size_t i = 0; i < n; i++) {
+			s += (uint64)x[i] * (uint64)y[i];
+		}
+		return (__int64)s;
+	}
+
+	static double DotDoubleScalar(const double *x, const double *y, size_t n)
+	{
+		double lanes[8] = { 0, 0, 0, 0, 0, 0, 0, 0 };
+		size_t i = 0;
+
+		for (; i + 8 <= n; i += 8) {
+			for (int k = 0; k < 8; k++) {
+				lanes[k] += x[i + k] * y[i + k];
+			}
+		}
+
+		double s = SumLanes(lanes);
+		for (; i < n; i++) {
+			s += x[i] * y[i];
+		}
+		return s;
+	}
+
+	static void AxpyIntScalar(__int64 a, const __int64 *x, __int64 *y, size_t n)
+	{
+		for (size_t i = 0; i < n; i++) {
+			y[i] = (__int64)((uint64)a * (uint64)x[i] + (uint64)y[i]);
+		}
+	}
+
+	static void AxpyDoubleScalar(double a, const double *x, double *y, size_t n)
+	{
+		for (size_t i = 0; i < n; i++) {
+			y[i] = a * x[i] + y[i];
+		}
+	}
+
+	static void AddIntScalar(const __int64 *x, const __int64 *y, __int64 *out, size_t n)
+	{
+		for (size_t i = 0; i < n; i++) {
+			out[i] = (__int64)((uint64)x[i] + (uint64)y[i]);
+		}
+	}
+
+	static void AddDoubleScalar(const double *x, const double *y, double *out, size_t n)
+	{
+		for (size_t i = 0; i < n; i++) {
+			out[i] = x[i] + y[i];
+		}
+	}
+
+	static void MulIntScalar(const __int64 *x, const __int64 *y, __int64 *out, size_t n)
+	{
+		for (size_t i = 0; i < n; i++) {
+			out[i] = (__int64)((uint64)x[i] * (uint64)y[i]);
+		}
+	}
+
+	static void MulDoubleScalar(const double *x, const double *y, double *out, size_t n)
+	{
+		for (size_t i = 0; i < n; i++) {
+			out[i] = x[i] * y[i];
+		}
+	}
+
+	template<class T>
+	static T MinScalar(const T *x, size_t n)
+	{
+		T m = x[0];
+
+		for (size_t i = 1; i < n; i++) {
+			m = x[i] < m ? x[i] : m;
+		}
+		return m;
+	}
+
+	template<class T>
+	static T MaxScalar(const T *x, size_t n)
+	{
+		T m = x[0];
+
+		for (size_t i = 1; i < n; i++) {
+			m = x[i] > m ? x[i] : m;
+		}
+		return m;
+	}
+
+	template<ExpressionType OP, class T>
+	static __inline boolean CompareElements(T x, T y)
+	{
+		switch (OP) {
+		case EQ_EXPRESSION: return x == y;
+		case NE_EXPRESSION: return x != y;
+		case GT_EXPRESSION: return x > y;
+		case GE_EXPRESSION: return x >= y;
+		case LT_EXPRESSION: return x < y;
+		default: return x <= y;
+		}
+	}
+
+	template<ExpressionType OP, class T>
+	static void CompareLoop(const T *x, const T *y, __int64 *out, size_t n)
+	{
+		for (size_t i = 0; i < n; i++) {
+			out[i] = CompareElements<OP>(x[i], y[i]);
+		}
+	}
+
+	template<class T>
+	static void CompareScalar(ExpressionType op, const T *x, const T *y, __int64 *out, size_t n)
+	{
+		switch (op) {
+		case EQ_EXPRESSION: CompareLoop<EQ_EXPRESSION>(x, y, out, n); break;
+		case NE_EXPRESSION: CompareLoop<NE_EXPRESSION>(x, y, out, n); break;
+		case GT_EXPRESSION: CompareLoop<GT_EXPRESSION>(x, y, out, n); break;
+		case GE_EXPRESSION: CompareLoop<GE_EXPRESSION>(x, y, out, n); break;
+		case LT_EXPRESSION: CompareLoop<LT_EXPRESSION>(x, y, out, n); break;
+		case LE_EXPRESSION: CompareLoop<LE_EXPRESSION>(x, y, out, n); break;
+		default:
+			LJ_TRAP();
+		}
+	}
+
+	static const SimdKernels scalar_kernels = {
+		SumIntScalar, SumDoubleScalar, DotIntScalar, DotDoubleScalar,
+		AxpyIntScalar, AxpyDoubleScalar, AddIntScalar, AddDoubleScalar, MulIntScalar, MulDoubleScalar,
+		MinScalar<__int64>, MinScalar<double>, MaxScalar<__int64>, MaxScalar<double>,
+		CompareScalar<__int64>, CompareScalar<double>,
+	};
+
+#if LJ_SIMD_SUPPORTED
+	//
+	// SSE2 kernels, every x64 CPU has them. There is no 64 bit compare
+	// before SSE4.2, int min, max and compare stay scalar.
+	//
+
+	// Low 64 bits of each product, from three 32 bit multiplies.
+	static __inline __m128i MulInt64Sse2(__m128i a, __m128i b)
+	{
+		__m128i cross = _mm_add_epi64(_mm_mul_epu32(_mm_srli_epi64(a, 32), b), _mm_mul_epu32(a, _mm_srli_epi64(b, 32)));
+		return _mm_add_epi64(_mm_mul_epu32(a, b), _mm_slli_epi64(cross, 32));
+	}
+
+	static __int64 SumIntSse2(const __int64 *x, size_t n)
+	{
+		__m128i acc = _mm_setzero_si128();
+		__int64 lanes[2];
+		size_t i = 0;
+
+		for (; i + 2 <= n; i += 2) {
+			acc = _mm_add_epi64(acc, _mm_loadu_si128((const __m128i *)(x + i)));
+		}
+		_mm_storeu_si128((__m128i *)lanes, acc);
+		return (__int64)((uint64)lanes[0] + (uint64)lanes[1] + (uint64)SumIntScalar(x + i, n - i));
+	}
+
+	static double SumDoubleSse2(const double *x, size_t n)
+	{
+		__m128d acc[4] = { _mm_setzero_pd(), _mm_setzero_pd(), _mm_setzero_pd(), _mm_setzero_pd() };
+		double lanes[8];
+		size_t i = 0;
+
+		for (; i + 8 <= n; i += 8) {
+			for (int k = 0; k < 4; k++) {
+				acc[k] = _mm_add_pd(acc[k], _mm_loadu_pd(x + i + 2 * k));
+			}
+		}
+		for (int k = 0; k < 4; k++) {
+			_mm_storeu_pd(lanes + 2 * k, acc[k]);
+		}
+
+		double s = SumLanes(lanes);
+		for (; i < n; i++) {
+			s += x[i];
+		}
+		return s;
+	}
+
+	static __int64 DotIntSse2(const __int64 *x, const __int64 *y, size_t n)
+	{
+		__m128i acc = _mm_setzero_si128();
+		__int64 lanes[2];
+		size_t i = 0;
+
+		for (; i + 2 <= n; i += 2) {
+			acc = _mm_add_epi64(acc, MulInt64Sse2(_mm_loadu_si128((const __m128i *)(x + i)),
+				_mm_loadu_si128((const __m128i *)(y + i))));
+		}
+		_mm_storeu_si128((__m128i *)lanes, acc);
+		return (__int64)((uint64)lanes[0] + (uint64)lanes[1] + (uint64)DotIntScalar(x + i, y + i, n - i));
+	}
+
+	static double DotDoubleSse2(const double *x, const double *y, size_t n)
+	{
+		__m128d acc[4] = { _mm_setzero_pd(), _mm_setzero_pd(), _mm_setzero_pd(), _mm_setzero_pd() };
+		double lanes[8];
+		size_t i = 0;
+
+		for (; i + 8 <= n; i += 8) {
+			for (int k = 0; k < 4; k++) {
+				acc[k] = _mm_add_pd(acc[k], _mm_mul_pd(_mm_loadu_pd(x + i + 2 * k), _mm_loadu_pd(y + i + 2 * k)));
+			}
+		}
+		for (int k = 0; k < 4; k++) {
+			_mm_storeu_pd(lanes + 2 * k, acc[k]);
+		}
+
+		double s = SumLanes(lanes);
+		for (; i < n; i++) {
+			s += x[i] * y[i];
+		}
+		return s;
+	}
+
+	static void AxpyIntSse2(__int64 a, const __int64 *x, __int64 *y, size_t n)
+	{
+		__m128i va = _mm_set1_epi64x(a);
+		size_t i = 0;
+
+		for (; i + 2 <= n; i += 2) {
+			__m128i v = MulInt64Sse2(va, _mm_loadu_si128((const __m128i *)(x + i)));
+			_mm_storeu_si128((__m128i *)(y + i), _mm_add_epi64(v, _mm_loadu_si128((const __m128i *)(y + i))));
+		}
+		AxpyIntScalar(a, x + i, y + i, n - i);
+	}
+
+	static void AxpyDoubleSse2(double a, const double *x, double *y, size_t n)
+	{
+		__m128d va = _mm_set1_pd(a);
+		size_t i = 0;
+
+		for (; i + 2 <= n; i += 2) {
+			_mm_storeu_pd(y + i, _mm_add_pd(_mm_mul_pd(va, _mm_loadu_pd(x + i)), _mm_loadu_pd(y + i)));
+		}
+		AxpyDoubleScalar(a, x + i, y + i, n - i);
+	}
+
+	static void AddIntSse2(const __int64 *x, const __int64 *y, __int64 *out, size_t n)
+	{
+		size_t i = 0;
+
+		for (; i + 2 <= n; i += 2) {
+			_mm_storeu_si128((__m128i *)(out + i), _mm_add_epi64(_mm_loadu_si128((const __m128i *)(x + i)),
+				_mm_loadu_si128((const __m128i *)(y + i))));
+		}
+		AddIntScalar(x + i, y + i, out + i, n - i);
+	}
+
+	static void AddDoubleSse2(const double *x, const double *y, double *out, size_t n)
+	{
+		size_t i = 0;
+
+		for (; i + 2 <= n; i += 2) {
+			_mm_storeu_pd(out + i, _mm_add_pd(_mm_loadu_pd(x + i), _mm_loadu_pd(y + i)));
+		}
+		AddDoubleScalar(x + i, y + i, out + i, n - i);
+	}
+
+	static void MulIntSse2(const __int64 *x, const __int64 *y, __int64 *out, size_t n)
+	{
+		size_t i = 0;
+
+		for (; i + 2 <= n; i += 2) {
+			_mm_storeu_si128((__m128i *)(out + i), MulInt64Sse2(_mm_loadu_si128((const __m128i *)(x + i)),
+				_mm_loadu_si128((const __m128i *)(y + i))));
+		}
+		MulIntScalar(x + i, y + i, out + i, n - i);
+	}
+
+	static void MulDoubleSse2(const double *x, const double *y, double *out, size_t n)
+	{
+		size_t i = 0;
+
+		for (; i + 2 <= n; i += 2) {
+			_mm_storeu_pd(out + i, _mm_mul_pd(_mm_loadu_pd(x + i), _mm_loadu_pd(y + i)));
+		}
+		MulDoubleScalar(x + i, y + i, out + i, n - i);
+	}
+
+	// minpd(x, m) is x < m ? x : m lane by lane, like MinScalar.
+	static double MinDoubleSse2(const double *x, size_t n)
+	{
+		__m128d m = _mm_set1_pd(x[0]);
+		double lanes[2];
+		size_t i = 0;
+
+		for (; i + 2 <= n; i += 2) {
+			m = _mm_min_pd(_mm_loadu_pd(x + i), m);
+		}
+		_mm_storeu_pd(lanes, m);
+		if (i < n) {
+			lanes[0] = MinScalar(x + i, n - i) < lanes[0] ? MinScalar(x + i, n - i) : lanes[0];
+		}
+		return MinScalar(lanes, 2);
+	}
+
+	static double MaxDoubleSse2(const double *x, size_t n)
+	{
+		__m128d m = _mm_set1_pd(x[0]);
+		double lanes[2];
+		size_t i = 0;
+
+		for (; i + 2 <= n; i += 2) {
+			m = _mm_max_pd(_mm_loadu_pd(x + i), m);
+		}
+		_mm_storeu_pd(lanes, m);
+		if (i < n) {
+			lanes[0] = MaxScalar(x + i, n - i) > lanes[0] ? MaxScalar(x + i, n - i) : lanes[0];
+		}
+		return MaxScalar(lanes, 2);
+	}
+
+	template<ExpressionType OP>
+	static __inline __m128d CompareSse2(__m128d x, __m128d y)
+	{
+		switch (OP) {
+		case EQ_EXPRESSION: return _mm_cmpeq_pd(x, y);
+		case NE_EXPRESSION: return _mm_cmpneq_pd(x, y);
+		case GT_EXPRESSION: return _mm_cmpgt_pd(x, y);
+		case GE_EXPRESSION: return _mm_cmpge_pd(x, y);
+		case LT_EXPRESSION: return _mm_cmplt_pd(x, y);
+		default: return _mm_cmple_pd(x, y);
+		}
+	}
+
+	// An all ones lane and 1 is 1.
+	template<ExpressionType OP>
+	static void CompareDoubleLoopSse2(const double *x, const double *y, __int64 *out, size_t n)
+	{
+		__m128i one = _mm_set1_epi64x(1);
+		size_t i = 0;
+
+		for (; i + 2 <= n; i += 2) {
+			__m128d mask = CompareSse2<OP>(_mm_loadu_pd(x + i), _mm_loadu_pd(y + i));
+			_mm_storeu_si128((__m128i *)(out + i), _mm_and_si128(_mm_castpd_si128(mask), one));
+		}
+		CompareLoop<OP>(x + i, y + i, out + i, n - i);
+	}
+
+	static void CompareDoubleSse2(ExpressionType op, const double *x, const double *y, __int64 *out, size_t n)
+	{
+		switch (op) {
+		case EQ_EXPRESSION: CompareDoubleLoopSse2<EQ_EXPRESSION>(x, y, out, n); break;
+		case NE_EXPRESSION: CompareDoubleLoopSse2<NE_EXPRESSION>(x, y, out, n); break;
+		case GT_EXPRESSION: CompareDoubleLoopSse2<GT_EXPRESSION>(x, y, out, n); break;
+		case GE_EXPRESSION: CompareDoubleLoopSse2<GE_EXPRESSION>(x, y, out, n); break;
+		case LT_EXPRESSION: CompareDoubleLoopSse2<LT_EXPRESSION>(x, y, out, n); break;
+		case LE_EXPRESSION: CompareDoubleLoopSse2<LE_EXPRESSION>(x, y, out, n); break;
+		default:
+			LJ_TRAP();
+		}
+	}
+
+	static const SimdKernels sse2_kernels = {
+		SumIntSse2, SumDoubleSse2, DotIntSse2, DotDoubleSse2,
+		AxpyIntSse2, AxpyDoubleSse2, AddIntSse2, AddDoubleSse2, MulIntSse2, MulDoubleSse2,
+		MinScalar<__int64>, MinDoubleSse2, MaxScalar<__int64>, MaxDoubleSse2,
+		CompareScalar<__int64>, CompareDoubleSse2,
+	};
+
+	//
+	// AVX2 kernels, four lanes of 64 bits.
+	//
+
+	LJ_AVX2 static __inline __m256i MulInt64Avx2(__m256i a, __m256i b)
+	{
+		__m256i cross = _mm256_add_epi64(_mm256_mul_epu32(_mm256_srli_epi64(a, 32), b),
+			_mm256_mul_epu32(a, _mm256_srli_epi64(b, 32)));
+		return _mm256_add_epi64(_mm256_mul_epu32(a, b), _mm256_slli_epi64(cross, 32));
+	}
+
+	LJ_AVX2 static __int64 SumIntAvx2(const __int64 *x, size_t n)
+	{
+		__m256i acc = _mm256_setzero_si256();
+		__int64 lanes[4];
+		size_t i = 0;
+
+		for (; i + 4 <= n; i += 4) {
+			acc = _mm256_add_epi64(acc, _mm256_loadu_si256((const __m256i *)(x + i)));
+		}
+		_mm256_storeu_si256((__m256i *)lanes, acc);
+		return (__int64)((uint64)lanes[0] + (uint64)lanes[1] + (uint64)lanes[2] + (uint64)lanes[3]
+			+ (uint64)SumIntScalar(x + i, n - i));
+	}
+
+	LJ_AVX2 static double SumDoubleAvx2(const double *x, size_t n)
+	{
+		__m256d acc0 = _mm256_setzero_pd();
+		__m256d acc1 = _mm256_setzero_pd();
+		double lanes[8];
+		size_t i = 0;
+
+		for (; i + 8 <= n; i += 8) {
+			acc0 = _mm256_add_pd(acc0, _mm256_loadu_pd(x + i));
+			acc1 = _mm256_add_pd(acc1, _mm256_loadu_pd(x + i + 4));
+		}
+		_mm256_storeu_pd(lanes, acc0);
+		_mm256_storeu_pd(lanes + 4, acc1);
+
+		double s = SumLanes(lanes);
+		for (; i < n; i++) {
+			s += x[i];
+		}
+		return s;
+	}
+
+	LJ_AVX2 static __int64 DotIntAvx2(const __int64 *x, const __int64 *y, size_t n)
+	{
+		__m256i acc = _mm256_setzero_si256();
+		__int64 lanes[4];
+		size_t i = 0;
+
+		for (; i + 4 <= n; i += 4) {
+			acc = _mm256_add_epi64(acc, MulInt64Avx2(_mm256_loadu_si256((const __m256i *)(x + i)),
+				_mm256_loadu_si256((const __m256i *)(y + i))));
+		}
+		_mm256_storeu_si256((__m256i *)lanes, acc);
+		return (__int64)((uint64)lanes[0] + (uint64)lanes[1] + (uint64)lanes[2] + (uint64)lanes[3]
+			+ (uint64)DotIntScalar(x + i, y + i, n - i));
+	}
+
+	LJ_AVX2 static double DotDoubleAvx2(const double *x, const double *y, size_t n)
+	{
+		__m256d acc0 = _mm256_setzero_pd();
+		__m256d acc1 = _mm256_setzero_pd();
+		double lanes[8];
+		size_t i = 0;
+
+		// No FMA, the products are rounded like in the other kernels.
+		for (; i + 8 <= n; i += 8) {
+			acc0 = _mm256_add_pd(acc0, _mm256_mul_pd(_mm256_loadu_pd(x + i), _mm256_loadu_pd(y + i)));
+			acc1 = _mm256_add_pd(acc1, _mm256_mul_pd(_mm256_loadu_pd(x + i + 4), _mm256_loadu_pd(y + i + 4)));
+		}
+		_mm256_storeu_pd(lanes, acc0);
+		_mm256_storeu_pd(lanes + 4, acc1);
+
+		double s = SumLanes(lanes);
+		for (; i < n; i++) {
+			s += x[i] * y[i];
+		}
+		return s;
+	}
+
+	LJ_AVX2 static void AxpyIntAvx2(__int64 a, const __int64 *x, __int64 *y, size_t n)
+	{
+		__m256i va = _mm256_set1_epi64x(a);
+		size_t i = 0;
+
+		for (; i + 4 <= n; i += 4) {
+			__m256i v = MulInt64Avx2(va, _mm256_loadu_si256((const __m256i *)(x + i)));
+			_mm256_storeu_si256((__m256i *)(y + i), _mm256_add_epi64(v, _mm256_loadu_si256((const __m256i *)(y + i))));
+		}
+		AxpyIntScalar(a, x + i, y + i, n - i);
+	}
+
+	LJ_AVX2 static void AxpyDoubleAvx2(double a, const double *x, double *y, size_t n)
+	{
+		__m256d va = _mm256_set1_pd(a);
+		size_t i = 0;
+
+		for (; i + 4 <= n; i += 4) {
+			_mm256_storeu_pd(y + i, _mm256_add_pd(_mm256_mul_pd(va, _mm256_loadu_pd(x + i)), _mm256_loadu_pd(y + i)));
+		}
+		AxpyDoubleScalar(a, x + i, y + i, n - i);
+	}
+
+	LJ_AVX2 static void AddIntAvx2(const __int64 *x, const __int64 *y, __int64 *out, size_t n)
+	{
+		size_t i = 0;
+
+		for (; i + 4 <= n; i += 4) {
+			_mm256_storeu_si256((__m256i *)(out + i), _mm256_add_epi64(_mm256_loadu_si256((const __m256i *)(x + i)),
+				_mm256_loadu_si256((const __m256i *)(y + i))));
+		}
+		AddIntScalar(x + i, y + i, out + i, n - i);
+	}
+
+	LJ_AVX2 static void AddDoubleAvx2(const double *x, const double *y, double *out, size_t n)
+	{
+		size_t i = 0;
+
+		for (; i + 4 <= n; i += 4) {
+			_mm256_storeu_pd(out + i, _mm256_add_pd(_mm256_loadu_pd(x + i), _mm256_loadu_pd(y + i)));
+		}
+		AddDoubleScalar(x + i, y + i, out + i, n - i);
+	}
+
+	LJ_AVX2 static void MulIntAvx2(const __int64 *x, const __int64 *y, __int64 *out, size_t n)
+	{
+		size_t i = 0;
+
+		for (; i + 4 <= n; i += 4) {
+			_mm256_storeu_si256((__m256i *)(out + i), MulInt64Avx2(_mm256_loadu_si256((const __m256i *)(x + i)),
+				_mm256_loadu_si256((const __m256i *)(y + i))));
+		}
+		MulIntScalar(x + i, y + i, out + i, n - i);
+	}
+
+	LJ_AVX2 static void MulDoubleAvx2(const double *x, const double *y, double *out, size_t n)
+	{
+		size_t i = 0;
+
+		for (; i + 4 <= n; i += 4) {
+			_mm256_storeu_pd(out + i, _mm256_mul_pd(_mm256_loadu_pd(x + i), _mm256_loadu_pd(y + i)));
+		}
+		MulDoubleScalar(x + i, y + i, out + i, n - i);
+	}
+
+	LJ_AVX2 static __int64 MinIntAvx2(const __int64 *x, size_t n)
+	{
+		__m256i m = _mm256_set1_epi64x(x[0]);
+		__int64 lanes[4];
+		size_t i = 0;
+
+		for (; i + 4 <= n; i += 4) {
+			__m256i v = _mm256_loadu_si256((const __m256i *)(x + i));
+			m = _mm256_blendv_epi8(m, v, _mm256_cmpgt_epi64(m, v));
+		}
+		_mm256_storeu_si256((__m256i *)lanes, m);
+		if (i < n) {
+			lanes[0] = MinScalar(x + i, n - i) < lanes[0] ? MinScalar(x + i, n - i) : lanes[0];
+		}
+		return MinScalar(lanes, 4);
+	}
+
+	LJ_AVX2 static __int64 MaxIntAvx2(const __int64 *x, size_t n)
+	{
+		__m256i m = _mm256_set1_epi64x(x[0]);
+		__int64 lanes[4];
+		size_t i = 0;
+
+		for (; i + 4 <= n; i += 4) {
+			__m256i v = _mm256_loadu_si256((const __m256i *)(x + i));
+			m = _mm256_blendv_epi8(m, v, _mm256_cmpgt_epi64(v, m));
+		}
+		_mm256_storeu_si256((__m256i *)lanes, m);
+		if (i < n) {
+			lanes[0] = MaxScalar(x + i, n - i) > lanes[0] ? MaxScalar(x + i, n - i) : lanes[0];
+		}
+		return MaxScalar(lanes, 4);
+	}
+
+	LJ_AVX2 static double MinDoubleAvx2(const double *x, size_t n)
+	{
+		__m256d m = _mm256_set1_pd(x[0]);
+		double lanes[4];
+		size_t i = 0;
+
+		for (; i + 4 <= n; i += 4) {
+			m = _mm256_min_pd(_mm256_loadu_pd(x + i), m);
+		}
+		_mm256_storeu_pd(lanes, m);
+		if (i < n) {
+			lanes[0] = MinScalar(x + i, n - i) < lanes[0] ? MinScalar(x + i, n - i) : lanes[0];
+		}
+		return MinScalar(lanes, 4);
+	}
+
+	LJ_AVX2 static double MaxDoubleAvx2(const double *x, size_t n)
+	{
+		__m256d m = _mm256_set1_pd(x[0]);
+		double lanes[4];
+		size_t i = 0;
+
+		for (; i + 4 <= n; i += 4) {
+			m = _mm256_max_pd(_mm256_loadu_pd(x + i), m);
+		}
+		_mm256_storeu_pd(lanes, m);
+		if (i < n) {
+			lanes[0] = MaxScalar(x + i, n - i) > lanes[0] ? MaxScalar(x + i, n - i) : lanes[0];
+		}
+		return MaxScalar(lanes, 4);
+	}
+
+	// GE and LE are the complements of LT and GT, NE that of EQ.
+	template<ExpressionType OP>
+	LJ_AVX2 static __inline __m256i CompareIntAvx2(__m256i x, __m256i y)
+	{
+		switch (OP) {
+		case EQ_EXPRESSION: return _mm256_cmpeq_epi64(x, y);
+		case NE_EXPRESSION: return _mm256_xor_si256(_mm256_cmpeq_epi64(x, y), _mm256_set1_epi64x(-1));
+		case GT_EXPRESSION: return _mm256_cmpgt_epi64(x, y);
+		case GE_EXPRESSION: return _mm256_xor_si256(_mm256_cmpgt_epi64(y, x), _mm256_set1_epi64x(-1));
+		case LT_EXPRESSION: return _mm256_cmpgt_epi64(y, x);
+		default: return _mm256_xor_si256(_mm256_cmpgt_epi64(x, y), _mm256_set1_epi64x(-1));
+		}
+	}
+
+	// Ordered predicates but NE, which holds for NaN like != does.
+	template<ExpressionType OP>
+	LJ_AVX2 static __inline __m256d CompareDoubleAvx2(__m256d x, __m256d y)
+	{
+		switch (OP) {
+		case EQ_EXPRESSION: return _mm256_cmp_pd(x, y, _CMP_EQ_OQ);
+		case NE_EXPRESSION: return _mm256_cmp_pd(x, y, _CMP_NEQ_UQ);
+		case GT_EXPRESSION: return _mm256_cmp_pd(x, y, _CMP_GT_OQ);
+		case GE_EXPRESSION: return _mm256_cmp_pd(x, y, _CMP_GE_OQ);
+		case LT_EXPRESSION: return _mm256_cmp_pd(x, y, _CMP_LT_OQ);
+		default: return _mm256_cmp_pd(x, y, _CMP_LE_OQ);
+		}
+	}
+
+	template<ExpressionType OP>
+	LJ_AVX2 static void CompareIntLoopAvx2(const __int64 *x, const __int64 *y, __int64 *out, size_t n)
+	{
+		__m256i one = _mm256_set1_epi64x(1);
+		size_t i = 0;
+
+		for (; i + 4 <= n; i += 4) {
+			__m256i mask = CompareIntAvx2<OP>(_mm256_loadu_si256((const __m256i *)(x + i)),
+				_mm256_loadu_si256((const __m256i *)(y + i)));
+			_mm256_storeu_si256((__m256i *)(out + i), _mm256_and_si256(mask, one));
+		}
+		CompareLoop<OP>(x + i, y + i, out + i, n - i);
+	}
+
+	template<ExpressionType OP>
+	LJ_AVX2 static void CompareDoubleLoopAvx2(const double *x, const double *y, __int64 *out, size_t n)
+	{
+		__m256i one = _mm256_set1_epi64x(1);
+		size_t i = 0;
+
+		for (; i + 4 <= n; i += 4) {
+			__m256d mask = CompareDoubleAvx2<OP>(_mm256_loadu_pd(x + i), _mm256_loadu_pd(y + i));
+			_mm256_storeu_si256((__m256i *)(out + i), _mm256_and_si256(_mm256_castpd_si256(mask), one));
+		}
+		CompareLoop<OP>(x + i, y + i, out + i, n - i);
+	}
+
+	static void CompareIntAvx2(ExpressionType op, const __int64 *x, const __int64 *y, __int64 *out, size_t n)
+	{
+		switch (op) {
+		case EQ_EXPRESSION: CompareIntLoopAvx2<EQ_EXPRESSION>(x, y, out, n); break;
+		case NE_EXPRESSION: CompareIntLoopAvx2<NE_EXPRESSION>(x, y, out, n); break;
+		case GT_EXPRESSION: CompareIntLoopAvx2<GT_EXPRESSION>(x, y, out, n); break;
+		case GE_EXPRESSION: CompareIntLoopAvx2<GE_EXPRESSION>(x, y, out, n); break;
+		case LT_EXPRESSION: CompareIntLoopAvx2<LT_EXPRESSION>(x, y, out, n); break;
+		case LE_EXPRESSION: CompareIntLoopAvx2<LE_EXPRESSION>(x, y, out, n); break;
+		default:
+			LJ_TRAP();
+		}
+	}
+
+	static void CompareDoubleAvx2(ExpressionType op, const double *x, const double *y, __int64 *out, size_t n)
+	{
+		switch (op) {
+		case EQ_EXPRESSION: CompareDoubleLoopAvx2<EQ_EXPRESSION>(x, y, out, n); break;
+		case NE_EXPRESSION: CompareDoubleLoopAvx2<NE_EXPRESSION>(x, y, out, n); break;
+		case GT_EXPRESSION: CompareDoubleLoopAvx2<GT_EXPRESSION>(x, y, out, n); break;
+		case GE_EXPRESSION: CompareDoubleLoopAvx2<GE_EXPRESSION>(x, y, out, n); break;
+		case LT_EXPRESSION: CompareDoubleLoopAvx2<LT_EXPRESSION>(x, y, out, n); break;
+		case LE_EXPRESSION: CompareDoubleLoopAvx2<LE_EXPRESSION>(x, y, out, n); break;
+		default:
+			LJ_TRAP();
+		}
+	}
+
+	static const SimdKernels avx2_kernels = {
+		SumIntAvx2, SumDoubleAvx2, DotIntAvx2, DotDoubleAvx2,
+		AxpyIntAvx2, AxpyDoubleAvx2, AddIntAvx2, AddDoubleAvx2, MulIntAvx2, MulDoubleAvx2,
+		MinIntAvx2, MinDoubleAvx2, MaxIntAvx2, MaxDoubleAvx2,
+		CompareIntAvx2, CompareDoubleAvx2,
+	};
+#endif
+
+	//
+	// AVX2 needs the CPU to have it and the OS to save the YMM registers on
+	// a context switch.
+	//
+	SimdLevel DetectSimdLevel()
+	{
+#if LJ_SIMD_SUPPORTED
+#ifdef _MSC_VER
+		int info[4];
+
+		__cpuid(info, 0);
+		if (info[0] >= 7) {
+			__cpuid(info, 1);
+			boolean osxsave = (info[2] & (1 << 27)) != 0;
+			boolean avx = (info[2] & (1 << 28)) != 0;
+
+			__cpuidex(info, 7, 0);
+			if (osxsave && avx && (info[1] & (1 << 5)) != 0 && (_xgetbv(0) & 6) == 6) {
+				return SIMD_AVX2;
+			}
+		}
+#else
+		__builtin_cpu_init();
+		if (__builtin_cpu_supports("avx2")) {
+			return SIMD_AVX2;
+		}
+#endif
+		return SIMD_SSE2;
+#else
+		return SIMD_SCALAR;
+#endif
+	}
+
+	static std::atomic<int> simd_level(-1);
+
+	void SetSimdLevel(SimdLevel level)
+	{
+		SimdLevel detected = DetectSimdLevel();
+		simd_level = level < detected ? level : detected;
+	}
+
+	SimdLevel GetSimdLevel()
+	{
+		int level = simd_level;
+
+		if (level < 0) {
+			level = DetectSimdLevel();
+			simd_level = level;
+		}
+		return (SimdLevel)level;
+	}
+
+	const SimdKernels &GetSimdKernels()
+	{
+		switch (GetSimdLevel()) {
+#if LJ_SIMD_SUPPORTED
+		case SIMD_AVX2:
+			return avx2_kernels;
+		case SIMD_SSE2:
+			return sse2_kernels;
+#endif
+		default:
+			return scalar_kernels;
+		}
+	}
+}
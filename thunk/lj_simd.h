@@ -0,0 +1,61 @@
+#ifndef __LJ_SIMD_H__
+#define __LJ_SIMD_H__
+
+#include <stddef.h>
+#include "lj_ast.h"
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define LJ_SIMD_SUPPORTED	1
+#else
+#define LJ_SIMD_SUPPORTED	0
+#endif
+
+namespace LJ {
+
+	enum SimdLevel {
+		SIMD_SCALAR = 0,
+		SIMD_SSE2,
+		SIMD_AVX2,
+	};
+
+	const char *GetSimdLevelString(int level);
+
+	//
+	// Kernels over packed array storage, one table per instruction set.
+	// Ints wrap around like EvalBinaryInt. Double sums and dot products add
+	// in eight interleaved lanes at every level, so a result does not
+	// depend on the CPU, but may differ in the last bits from a loop that
+	// adds one element after the other. min and max need n > 0. Compare
+	// writes 1 where x[i] op y[i] holds and 0 elsewhere, op is one of
+	// EQ_EXPRESSION to LE_EXPRESSION.
+	//
+	struct SimdKernels {
+		__int64 (*sum_int_)(const __int64 *x, size_t n);
+		double (*sum_double_)(const double *x, size_t n);
+		__int64 (*dot_int_)(const __int64 *x, const __int64 *y, size_t n);
+		double (*dot_double_)(const double *x, const double *y, size_t n);
+		void (*axpy_int_)(__int64 a, const __int64 *x, __int64 *y, size_t n);
+		void (*axpy_double_)(double a, const double *x, double *y, size_t n);
+		void (*add_int_)(const __int64 *x, const __int64 *y, __int64 *out, size_t n);
+		void (*add_double_)(const double *x, const double *y, double *out, size_t n);
+		void (*mul_int_)(const __int64 *x, const __int64 *y, __int64 *out, size_t n);
+		void (*mul_double_)(const double *x, const double *y, double *out, size_t n);
+		__int64 (*min_int_)(const __int64 *x, size_t n);
+		double (*min_double_)(const double *x, size_t n);
+		__int64 (*max_int_)(const __int64 *x, size_t n);
+		double (*max_double_)(const double *x, size_t n);
+		void (*compare_int_)(ExpressionType op, const __int64 *x, const __int64 *y, __int64 *out, size_t n);
+		void (*compare_double_)(ExpressionType op, const double *x, const double *y, __int64 *out, size_t n);
+	};
+
+	// The best level the CPU and the OS support.
+	SimdLevel DetectSimdLevel();
+
+	// Selects the kernels for all drivers, at most the detected level.
+	void SetSimdLevel(SimdLevel level);
+	SimdLevel GetSimdLevel();
+
+	const SimdKernels &GetSimdKernels();
+}
+
+#endif
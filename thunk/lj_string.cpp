@@ -0,0 +1,61 @@
+#include <ostream>
+#include "lj_driver.hpp"
+
+namespace LJ {
+
+	//
+	// Calls f on every flat leaf of s from left to right. Repeated ADDs make
+	// ropes as deep as the number of pieces, so the walk keeps its own stack
+	// rather than recursing.
+	//
+	template<class F>
+	static void ForEachLeaf(const StringObject *s, F f)
+	{
+		std::vector<const StringObject *> pending;
+
+		pending.push_back(s);
+		while (!pending.empty()) {
+			const StringObject *node = pending.back();
+			pending.pop_back();
+			if (node->IsRope()) {
+				pending.push_back(node->right_);
+				pending.push_back(node->left_);
+			}
+			else {
+				f(node->value_);
+			}
+		}
+	}
+
+	//
+	// The pieces are let go; those no other rope shares are freed by the
+	// next collection.
+	//
+	void StringObject::Flatten(LJ_GC &gc)
+	{
+		std::string flat;
+		size_t size = GetSize();
+
+		if (!IsRope()) {
+			return;
+		}
+
+		AppendTo(flat);
+		value_.swap(flat);
+		left_ = NULL;
+		right_ = NULL;
+		length_ = 0;
+		gc.Resize(this, size);
+	}
+
+	void StringObject::AppendTo(std::string &out) const
+	{
+		out.reserve(out.size() + GetLength());
+		ForEachLeaf(this, [&out](const std::string &leaf) { out.append(leaf); });
+	}
+
+	void StringObject::Write(std::ostream &os) const
+	{
+		ForEachLeaf(this, [&os](const std::string &leaf) { os << leaf; });
+	}
+}
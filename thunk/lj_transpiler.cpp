@@ -0,0 +1,1194 @@
+#include <math.h>
+#include <stdint.h>
+#include <iomanip>
+#include <sstream>
+#include "lj_driver.hpp"
+#include "lj_transpiler.h"
+
+namespace LJ {
+
+	LJ_Transpiler::LJ_Transpiler(LJ_Driver *driver)
+		: driver_(driver), os_(NULL), indent_(0), temp_count_(0), label_count_(0), in_function_(0), function_(NULL),
+		tail_call_(0)
+	{
+
+	}
+
+	LJ_Transpiler::~LJ_Transpiler()
+	{
+
+	}
+
+	//
+	// The translation unit is built in memory and written to os only once
+	// all of it is emitted, a program that can not be translated writes
+	// nothing.
+	//
+	void LJ_Transpiler::Emit(std::ostream &os)
+	{
+		std::list<FunctionDefinition *> &function_list = driver_->GetFunctionList();
+		std::list<FunctionDefinition *>::iterator it;
+		std::ostringstream unit;
+
+		os_ = &unit;
+		indent_ = 0;
+
+		Line("// Generated by lj --emit-cpp, build with the directory of lj_aot.h on the");
+		Line("// include path and with thread support.");
+		Line("#define LJ_CALL_DEPTH_LIMIT " + std::to_string(driver_->call_depth_limit_));
+		Line("#include \"lj_aot.h\"");
+		Line("");
+		Line("using namespace LJ::AOT;");
+		Line("");
+
+		for (size_t i = 0; i < driver_->global_names_.size(); i++) {
+			Line("static Value " + GlobalName((int)i) + " = Undefined();");
+		}
+		Line("");
+
+		for (it = function_list.begin(); it != function_list.end(); ++it) {
+			if ((*it)->GetType() != FUNCTION_DEFINITION || driver_->FindFunction((*it)->GetFunctionName()) != *it) {
+				continue;
+			}
+
+			std::string params;
+			size_t param_count = (*it)->GetParamList() != NULL ? (*it)->GetParamList()->size() : 0;
+			for (size_t i = 0; i < param_count; i++) {
+				params += (i != 0 ? ", Value a" : "Value a") + std::to_string(i);
+			}
+			Line("static Value f_" + (*it)->GetFunctionName() + "(" + params + ");");
+		}
+		Line("");
+
+		for (it = function_list.begin(); it != function_list.end(); ++it) {
+			if ((*it)->GetType() == FUNCTION_DEFINITION && driver_->FindFunction((*it)->GetFunctionName()) == *it) {
+				EmitFunction(*it);
+			}
+		}
+
+		EmitMain();
+
+		Line("int main()");
+		Line("{");
+		Line("\tlj_main();");
+		Line("\treturn 0;");
+		Line("}");
+
+		os_ = NULL;
+		os << unit.str();
+	}
+
+	void LJ_Transpiler::CollectExpressions(Expression *expr, std::vector<Expression *> &out)
+	{
+		out.push_back(expr);
+
+		switch (expr->GetType()) {
+		case ASSIGN_EXPRESSION:
+		case ADD_EXPRESSION:
+		case SUB_EXPRESSION:
+		case MUL_EXPRESSION:
+		case DIV_EXPRESSION:
+		case MOD_EXPRESSION:
+		case EQ_EXPRESSION:
+		case NE_EXPRESSION:
+		case GT_EXPRESSION:
+		case GE_EXPRESSION:
+		case LT_EXPRESSION:
+		case LE_EXPRESSION:
+		case LOGICAL_AND_EXPRESSION:
+		case LOGICAL_OR_EXPRESSION:
+		case INDEX_EXPRESSION:
+			CollectExpressions((Expression *)expr->GetValue(0), out);
+			CollectExpressions((Expression *)expr->GetValue(1), out);
+			break;
+		case MINUS_EXPRESSION:
+		case EXCLAMATION_EXPRESSION:
+		case MEMBER_EXPRESSION:
+			CollectExpressions((Expression *)expr->GetValue(0), out);
+			break;
+		case FUNCTION_CALL_EXPRESSION: {
+			ArgumentList *arg_list = (ArgumentList *)expr->GetValue(1);
+			if (arg_list != NULL) {
+				for (ArgumentList::iterator it = arg_list->begin(); it != arg_list->end(); ++it) {
+					CollectExpressions(*it, out);
+				}
+			}
+			break;
+		}
+		case ARRAY_EXPRESSION:
+		case DICT_EXPRESSION:
+		case RECORD_EXPRESSION: {
+			ArgumentList *elements = (ArgumentList *)expr->GetValue(0);
+			for (ArgumentList::iterator it = elements->begin(); it != elements->end(); ++it) {
+				CollectExpressions(*it, out);
+			}
+			break;
+		}
+		default:
+			break;
+		}
+	}
+
+	void LJ_Transpiler::CollectExpressions(Statement *statement, std::vector<Expression *> &out)
+	{
+		switch (statement->GetType()) {
+		case EXPRESSION_STATEMENT:
+		case RETURN_STATEMENT:
+			if (statement->GetValue(0) != NULL) {
+				CollectExpressions((Expression *)statement->GetValue(0), out);
+			}
+			break;
+		case IF_STATEMENT: {
+			CollectExpressions((Expression *)statement->GetValue(0), out);
+			CollectExpressions((StatementList *)((Block *)statement->GetValue(1))->GetValue(0), out);
+
+			ElseifList *elseif_list = (ElseifList *)statement->GetValue(2);
+			if (elseif_list != NULL) {
+				for (ElseifList::iterator it = elseif_list->begin(); it != elseif_list->end(); ++it) {
+					CollectExpressions((Expression *)(*it)->GetValue(0), out);
+					CollectExpressions((StatementList *)((Block *)(*it)->GetValue(1))->GetValue(0), out);
+				}
+			}
+			if (statement->GetValue(3) != NULL) {
+				CollectExpressions((StatementList *)((Block *)statement->GetValue(3))->GetValue(0), out);
+			}
+			break;
+		}
+		case WHILE_STATEMENT:
+			CollectExpressions((Expression *)statement->GetValue(0), out);
+			CollectExpressions((StatementList *)((Block *)statement->GetValue(1))->GetValue(0), out);
+			break;
+		case FOR_STATEMENT:
+			for (int i = 0; i < 3; i++) {
+				if (statement->GetValue(i) != NULL) {
+					CollectExpressions((Expression *)statement->GetValue(i), out);
+				}
+			}
+			CollectExpressions((StatementList *)((Block *)statement->GetValue(3))->GetValue(0), out);
+			break;
+		case FOREACH_STATEMENT: {
+			IdentifierExpression *var = static_cast<IdentifierExpression *>((Expression *)statement->GetValue(0));
+			if (var->GetSlotType() == LOCAL_SLOT) {
+				counter_slots_.insert(var->GetSlotIndex());
+			}
+			for (int i = 0; i < 3; i++) {
+				if (statement->GetValue(i) != NULL) {
+					CollectExpressions((Expression *)statement->GetValue(i), out);
+				}
+			}
+			CollectExpressions((StatementList *)((Block *)statement->GetValue(3))->GetValue(0), out);
+			break;
+		}
+		default:
+			break;
+		}
+	}
+
+	void LJ_Transpiler::CollectExpressions(StatementList *list, std::vector<Expression *> &out)
+	{
+		if (list == NULL) {
+			return;
+		}
+
+		for (StatementList::iterator it = list->begin(); it != list->end(); ++it) {
+			CollectExpressions(*it, out);
+		}
+	}
+
+	boolean LJ_Transpiler::Mentions(const std::vector<Expression *> &exprs, int slot)
+	{
+		for (std::vector<Expression *>::const_iterator it = exprs.begin(); it != exprs.end(); ++it) {
+			if ((*it)->GetType() == IDENTIFIER_EXPRESSION) {
+				IdentifierExpression *identifier = static_cast<IdentifierExpression *>(*it);
+				if (identifier->GetSlotType() == LOCAL_SLOT && identifier->GetSlotIndex() == slot) {
+					return 1;
+				}
+			}
+		}
+		return 0;
+	}
+
+	//
+	// A local is unboxed when the first top level statement using it starts
+	// with an assignment to it, so it is never read before it holds a value,
+	// and every assignment to it has the same static type. Types start
+	// unknown and only move towards DYNAMIC_TYPE, so the loop ends.
+	//
+	void LJ_Transpiler::InferLocals(FunctionDefinition *func)
+	{
+		StatementList *list = (StatementList *)func->GetBlock()->GetValue(0);
+		int param_count = func->GetParamList() != NULL ? (int)func->GetParamList()->size() : 0;
+		std::vector<std::vector<Expression *> > statement_exprs;
+		std::vector<Expression *> all_exprs;
+
+		local_types_.assign(func->GetSlotCount(), DYNAMIC_TYPE);
+		local_names_.assign(func->GetSlotCount(), std::string());
+		counter_slots_.clear();
+
+		for (int i = 0; i < param_count; i++) {
+			local_names_[i] = *(*func->GetParamList())[i];
+		}
+
+		if (list != NULL) {
+			for (StatementList::iterator it = list->begin(); it != list->end(); ++it) {
+				statement_exprs.push_back(std::vector<Expression *>());
+				CollectExpressions(*it, statement_exprs.back());
+			}
+		}
+		CollectExpressions(list, all_exprs);
+
+		for (std::vector<Expression *>::iterator it = all_exprs.begin(); it != all_exprs.end(); ++it) {
+			if ((*it)->GetType() == IDENTIFIER_EXPRESSION) {
+				IdentifierExpression *identifier = static_cast<IdentifierExpression *>(*it);
+				if (identifier->GetSlotType() == LOCAL_SLOT) {
+					local_names_[identifier->GetSlotIndex()] = identifier->GetValue();
+				}
+			}
+		}
+
+		for (int slot = param_count; slot < func->GetSlotCount(); slot++) {
+			size_t i = 0;
+			while (i < statement_exprs.size() && !Mentions(statement_exprs[i], slot)) {
+				i++;
+			}
+			if (i == statement_exprs.size() || statement_exprs[i][0]->GetType() != ASSIGN_EXPRESSION) {
+				continue;
+			}
+
+			// An expression statement or the init of a for statement runs
+			// first, the assignment's own node comes first in the list.
+			Statement *statement = (*list)[i];
+			Expression *left = (Expression *)statement_exprs[i][0]->GetValue(0);
+			std::vector<Expression *> right_exprs;
+			CollectExpressions((Expression *)statement_exprs[i][0]->GetValue(1), right_exprs);
+
+			if ((statement->GetType() == EXPRESSION_STATEMENT
+				|| (statement->GetType() == FOR_STATEMENT && statement->GetValue(0) == statement_exprs[i][0]))
+				&& left->GetType() == IDENTIFIER_EXPRESSION
+				&& static_cast<IdentifierExpression *>(left)->GetSlotType() == LOCAL_SLOT
+				&& static_cast<IdentifierExpression *>(left)->GetSlotIndex() == slot
+				&& !Mentions(right_exprs, slot)) {
+				local_types_[slot] = UNKNOWN_TYPE;
+			}
+		}
+
+		for (int pass = 0; pass < 2; pass++) {
+			boolean changed = 1;
+			while (changed) {
+				changed = 0;
+
+				// A foreach assigns ints to its variable.
+				for (std::set<int>::iterator it = counter_slots_.begin(); it != counter_slots_.end(); ++it) {
+					StaticType type = local_types_[*it] == UNKNOWN_TYPE || local_types_[*it] == INT_TYPE ? INT_TYPE : DYNAMIC_TYPE;
+					if (local_types_[*it] != type) {
+						local_types_[*it] = type;
+						changed = 1;
+					}
+				}
+
+				for (std::vector<Expression *>::iterator it = all_exprs.begin(); it != all_exprs.end(); ++it) {
+					if ((*it)->GetType() != ASSIGN_EXPRESSION) {
+						continue;
+					}
+
+					Expression *left = (Expression *)(*it)->GetValue(0);
+					if (left->GetType() != IDENTIFIER_EXPRESSION
+						|| static_cast<IdentifierExpression *>(left)->GetSlotType() != LOCAL_SLOT) {
+						continue;
+					}
+
+					int slot = static_cast<IdentifierExpression *>(left)->GetSlotIndex();
+					StaticType type = TypeOf((Expression *)(*it)->GetValue(1));
+					if (local_types_[slot] == DYNAMIC_TYPE || type == UNKNOWN_TYPE) {
+						continue;
+					}
+					if (local_types_[slot] != UNKNOWN_TYPE && local_types_[slot] != type) {
+						type = DYNAMIC_TYPE;
+					}
+					if (local_types_[slot] != type) {
+						local_types_[slot] = type;
+						changed = 1;
+					}
+				}
+			}
+
+			// What is still unknown only depends on itself, box it and check
+			// the assignments that relied on it once more.
+			for (size_t i = 0; i < local_types_.size(); i++) {
+				if (local_types_[i] == UNKNOWN_TYPE) {
+					local_types_[i] = DYNAMIC_TYPE;
+				}
+			}
+		}
+	}
+
+	LJ_Transpiler::StaticType LJ_Transpiler::TypeOf(Expression *expr)
+	{
+		switch (expr->GetType()) {
+		case BOOLEAN_EXPRESSION:
+		case TRUE_EXPRESSION:
+		case FALSE_EXPRESSION:
+			return BOOL_TYPE;
+		case INT_EXPRESSION:
+			return INT_TYPE;
+		case DOUBLE_EXPRESSION:
+			return DOUBLE_TYPE;
+		case IDENTIFIER_EXPRESSION: {
+			IdentifierExpression *identifier = static_cast<IdentifierExpression *>(expr);
+			if (in_function_ && identifier->GetSlotType() == LOCAL_SLOT) {
+				return local_types_[identifier->GetSlotIndex()];
+			}
+			return DYNAMIC_TYPE;
+		}
+		case ASSIGN_EXPRESSION:
+			return TypeOf((Expression *)expr->GetValue(1));
+		case ADD_EXPRESSION:
+		case SUB_EXPRESSION:
+		case MUL_EXPRESSION:
+		case DIV_EXPRESSION:
+		case MOD_EXPRESSION: {
+			StaticType left = TypeOf((Expression *)expr->GetValue(0));
+			StaticType right = TypeOf((Expression *)expr->GetValue(1));
+			if (left == DYNAMIC_TYPE || left == BOOL_TYPE || right == DYNAMIC_TYPE || right == BOOL_TYPE) {
+				return DYNAMIC_TYPE;
+			}
+			if (left == UNKNOWN_TYPE || right == UNKNOWN_TYPE) {
+				return UNKNOWN_TYPE;
+			}
+			return left == INT_TYPE && right == INT_TYPE ? INT_TYPE : DOUBLE_TYPE;
+		}
+		case EQ_EXPRESSION:
+		case NE_EXPRESSION:
+		case GT_EXPRESSION:
+		case GE_EXPRESSION:
+		case LT_EXPRESSION:
+		case LE_EXPRESSION:
+		case LOGICAL_AND_EXPRESSION:
+		case LOGICAL_OR_EXPRESSION:
+		case EXCLAMATION_EXPRESSION:
+			// These yield a boolean or fail.
+			return BOOL_TYPE;
+		case MINUS_EXPRESSION: {
+			StaticType type = TypeOf((Expression *)expr->GetValue(0));
+			return type == BOOL_TYPE ? DYNAMIC_TYPE : type;
+		}
+		default:
+			return DYNAMIC_TYPE;
+		}
+	}
+
+	//
+	// The body is written out after it is emitted, lj_tail only goes in
+	// front of the locals when a self tail call jumps to it.
+	//
+	void LJ_Transpiler::EmitFunction(FunctionDefinition *func)
+	{
+		int param_count = func->GetParamList() != NULL ? (int)func->GetParamList()->size() : 0;
+		StatementList *list = (StatementList *)func->GetBlock()->GetValue(0);
+		std::ostream *os = os_;
+		std::ostringstream body;
+		std::string params;
+
+		in_function_ = 1;
+		function_ = func;
+		tail_call_ = 0;
+		temp_count_ = 0;
+		label_count_ = 0;
+		loop_labels_.clear();
+		continue_labels_.clear();
+		InferLocals(func);
+
+		for (int i = 0; i < param_count; i++) {
+			params += (i != 0 ? ", Value a" : "Value a") + std::to_string(i);
+		}
+		Line("static Value f_" + func->GetFunctionName() + "(" + params + ")");
+		Line("{");
+		indent_++;
+
+		os_ = &body;
+
+		for (int slot = 0; slot < func->GetSlotCount(); slot++) {
+			if (slot < param_count) {
+				Line("Value " + LocalName(slot) + " = a" + std::to_string(slot) + ";");
+				continue;
+			}
+
+			switch (local_types_[slot]) {
+			case INT_TYPE:
+				Line("int64_t " + LocalName(slot) + " = 0;");
+				break;
+			case DOUBLE_TYPE:
+				Line("double " + LocalName(slot) + " = 0.0;");
+				break;
+			case BOOL_TYPE:
+				Line("bool " + LocalName(slot) + " = false;");
+				break;
+			default:
+				Line("Value " + LocalName(slot) + " = Undefined();");
+				break;
+			}
+		}
+
+		EmitStatementList(list);
+
+		// Falling off the end returns null, a last statement that leaves
+		// already has.
+		StatementType last = list != NULL && !list->empty() ? list->back()->GetType() : EXPRESSION_STATEMENT;
+		if (last != RETURN_STATEMENT && last != BREAK_STATEMENT && last != CONTINUE_STATEMENT) {
+			Line("return Null();");
+		}
+
+		os_ = os;
+		if (tail_call_) {
+			Line("lj_tail:");
+		}
+		*os_ << body.str();
+
+		indent_--;
+		Line("}");
+		Line("");
+		function_ = NULL;
+	}
+
+	void LJ_Transpiler::EmitMain()
+	{
+		in_function_ = 0;
+		temp_count_ = 0;
+		label_count_ = 0;
+		loop_labels_.clear();
+		local_types_.clear();
+		local_names_.clear();
+
+		Line("static void lj_main()");
+		Line("{");
+		indent_++;
+		EmitStatementList(driver_->statement_list_);
+		indent_--;
+		Line("}");
+		Line("");
+	}
+
+	void LJ_Transpiler::EmitStatementList(StatementList *list)
+	{
+		if (list == NULL) {
+			return;
+		}
+
+		for (StatementList::iterator it = list->begin(); it != list->end(); ++it) {
+			EmitStatement(*it);
+		}
+	}
+
+	void LJ_Transpiler::EmitStatement(Statement *statement)
+	{
+		switch (statement->GetType()) {
+		case EXPRESSION_STATEMENT:
+			EmitExpression((Expression *)statement->GetValue(0));
+			break;
+		case GLOBAL_STATEMENT:
+			break;
+		case IF_STATEMENT:
+			EmitIfStatement(statement);
+			break;
+		case WHILE_STATEMENT:
+			EmitWhileStatement(statement);
+			break;
+		case FOR_STATEMENT:
+			EmitForStatement(statement);
+			break;
+		case FOREACH_STATEMENT:
+			EmitForeachStatement(statement);
+			break;
+		case RETURN_STATEMENT:
+			EmitLeave((Expression *)statement->GetValue(0));
+			break;
+		case YIELD_STATEMENT:
+			// Emitted functions run on the native stack and can not suspend.
+			driver_->Error(statement->GetLocation(), "EmitYieldStatement error");
+			break;
+		case BREAK_STATEMENT:
+			if (loop_labels_.size() == 0) {
+				EmitLeave(NULL);
+			}
+			else {
+				Line("break;");
+			}
+			break;
+		case CONTINUE_STATEMENT:
+			if (loop_labels_.size() == 0) {
+				EmitLeave(NULL);
+			}
+			else if (loop_labels_.back() < 0) {
+				Line("continue;");
+			}
+			else {
+				continue_labels_.insert(loop_labels_.back());
+				Line("goto lj_continue_" + std::to_string(loop_labels_.back()) + ";");
+			}
+			break;
+		default:
+			LJ_TRAP();
+		}
+	}
+
+	void LJ_Transpiler::EmitIfStatement(Statement *statement)
+	{
+		ElseifList *elseif_list = (ElseifList *)statement->GetValue(2);
+		int nesting = 0;
+
+		std::string c = EmitCondition((Expression *)statement->GetValue(0), statement->GetLocation(), "ExecuteIfStatement error");
+		Line("if (" + c + ") {");
+		indent_++;
+		EmitStatementList((StatementList *)((Block *)statement->GetValue(1))->GetValue(0));
+		indent_--;
+
+		// An elseif condition may need statements of its own, so every
+		// elseif opens a nested else block.
+		if (elseif_list != NULL) {
+			for (ElseifList::iterator it = elseif_list->begin(); it != elseif_list->end(); ++it) {
+				Line("}");
+				Line("else {");
+				indent_++;
+				nesting++;
+
+				c = EmitCondition((Expression *)(*it)->GetValue(0), (*it)->GetLocation(), "ExecuteElseif error");
+				Line("if (" + c + ") {");
+				indent_++;
+				EmitStatementList((StatementList *)((Block *)(*it)->GetValue(1))->GetValue(0));
+				indent_--;
+			}
+		}
+
+		if (statement->GetValue(3) != NULL) {
+			Line("}");
+			Line("else {");
+			indent_++;
+			EmitStatementList((StatementList *)((Block *)statement->GetValue(3))->GetValue(0));
+			indent_--;
+		}
+		Line("}");
+
+		while (nesting-- > 0) {
+			indent_--;
+			Line("}");
+		}
+	}
+
+	void LJ_Transpiler::EmitWhileStatement(Statement *statement)
+	{
+		Line("for (;;) {");
+		indent_++;
+
+		std::string c = EmitCondition((Expression *)statement->GetValue(0), statement->GetLocation(), "ExecuteWhileStatement error");
+		Line("if (!" + c + ") break;");
+
+		loop_labels_.push_back(-1);
+		Line("{");
+		indent_++;
+		EmitStatementList((StatementList *)((Block *)statement->GetValue(1))->GetValue(0));
+		indent_--;
+		Line("}");
+		loop_labels_.pop_back();
+
+		indent_--;
+		Line("}");
+	}
+
+	void LJ_Transpiler::EmitForStatement(Statement *statement)
+	{
+		int label = label_count_++;
+
+		Line("{");
+		indent_++;
+		if (statement->GetValue(0) != NULL) {
+			EmitExpression((Expression *)statement->GetValue(0));
+		}
+
+		Line("for (;;) {");
+		indent_++;
+		if (statement->GetValue(1) != NULL) {
+			std::string c = EmitCondition((Expression *)statement->GetValue(1), statement->GetLocation(), "ExecuteForStatement error");
+			Line("if (!" + c + ") break;");
+		}
+
+		// continue has to run the post expression, it jumps out of the
+		// body block to the label in front of it.
+		loop_labels_.push_back(label);
+		Line("{");
+		indent_++;
+		EmitStatementList((StatementList *)((Block *)statement->GetValue(3))->GetValue(0));
+		indent_--;
+		Line("}");
+		loop_labels_.pop_back();
+
+		if (continue_labels_.count(label) != 0) {
+			Line("lj_continue_" + std::to_string(label) + ":;");
+		}
+		if (statement->GetValue(2) != NULL) {
+			Line("{");
+			indent_++;
+			EmitExpression((Expression *)statement->GetValue(2));
+			indent_--;
+			Line("}");
+		}
+
+		indent_--;
+		Line("}");
+		indent_--;
+		Line("}");
+	}
+
+	//
+	// A parallel foreach runs on one thread with the semantics of one worker:
+	// every variable the body names is restored after the loop, except the
+	// reductions, which start from 0 and are added to their value before.
+	//
+	void LJ_Transpiler::EmitForeachStatement(Statement *statement)
+	{
+		ForeachStatement *foreach = static_cast<ForeachStatement *>(statement);
+		IdentifierExpression *var = static_cast<IdentifierExpression *>((Expression *)statement->GetValue(0));
+		StatementList *body = (StatementList *)((Block *)statement->GetValue(3))->GetValue(0);
+		std::vector<IdentifierExpression *> &reductions = foreach->GetReductions();
+		std::string where = Where(statement->GetLocation());
+		std::string bounds[2];
+		std::vector<std::pair<std::string, std::string> > restores;
+		std::vector<std::pair<IdentifierExpression *, std::string> > entries;
+
+		// Generators only come from functions that yield, which are rejected.
+		if (foreach->IteratesGenerator()) {
+			driver_->Error(statement->GetLocation(), "EmitForeachStatement error");
+		}
+
+		Line("{");
+		indent_++;
+		for (int k = 0; k < 2; k++) {
+			Operand v = EmitExpression((Expression *)statement->GetValue(k + 1));
+			if (v.type_ == INT_TYPE) {
+				bounds[k] = v.code_;
+			}
+			else if (v.type_ == DYNAMIC_TYPE) {
+				Line("if (" + v.code_ + ".type_ != INT_VALUE) Error(" + where + ", \"ExecuteForeachStatement error\");");
+				bounds[k] = v.code_ + ".int_value_";
+			}
+			else {
+				Line("Error(" + where + ", \"ExecuteForeachStatement error\");");
+				bounds[k] = "(int64_t)0";
+			}
+		}
+
+		if (foreach->IsParallel()) {
+			std::vector<Expression *> exprs;
+			std::set<std::string> names;
+
+			exprs.push_back(var);
+			CollectExpressions(body, exprs);
+			for (std::vector<Expression *>::iterator it = exprs.begin(); it != exprs.end(); ++it) {
+				if ((*it)->GetType() != IDENTIFIER_EXPRESSION) {
+					continue;
+				}
+
+				IdentifierExpression *identifier = static_cast<IdentifierExpression *>(*it);
+				std::string name = VariableName(identifier);
+				if (!names.insert(name).second) {
+					continue;
+				}
+
+				std::string t = "t" + std::to_string(temp_count_++);
+				Line("const auto " + t + " = " + name + ";");
+
+				std::vector<IdentifierExpression *>::iterator r = reductions.begin();
+				while (r != reductions.end()
+					&& ((*r)->GetSlotType() != identifier->GetSlotType() || (*r)->GetSlotIndex() != identifier->GetSlotIndex())) {
+					++r;
+				}
+				if (r == reductions.end()) {
+					restores.push_back(std::make_pair(name, t));
+				}
+				else {
+					entries.push_back(std::make_pair(*r, t));
+					EmitStore(*r, Operand("0", INT_TYPE));
+				}
+			}
+		}
+
+		std::string counter = "t" + std::to_string(temp_count_++);
+		Line("for (int64_t " + counter + " = " + bounds[0] + "; " + counter + " < " + bounds[1] + "; " + counter + "++) {");
+		indent_++;
+		EmitStore(var, Operand(counter, INT_TYPE));
+
+		loop_labels_.push_back(-1);
+		Line("{");
+		indent_++;
+		EmitStatementList(body);
+		indent_--;
+		Line("}");
+		loop_labels_.pop_back();
+
+		indent_--;
+		Line("}");
+
+		for (std::vector<std::pair<std::string, std::string> >::iterator it = restores.begin(); it != restores.end(); ++it) {
+			Line(it->first + " = " + it->second + ";");
+		}
+		for (std::vector<std::pair<IdentifierExpression *, std::string> >::iterator it = entries.begin(); it != entries.end(); ++it) {
+			std::string name = VariableName(it->first);
+			StaticType type = TypeOf(it->first);
+
+			if (type == INT_TYPE) {
+				Line(name + " = AddInt(" + it->second + ", " + name + ");");
+			}
+			else if (type == DOUBLE_TYPE) {
+				Line(name + " = " + it->second + " + " + name + ";");
+			}
+			else {
+				Line(name + " = Binary(ADD_OP, " + it->second + ", " + name + ", " + Where(it->first->GetLocation()) + ");");
+			}
+		}
+
+		indent_--;
+		Line("}");
+	}
+
+	//
+	// return, and break or continue outside of a loop, leave the function.
+	// At the top level they end the script.
+	//
+	void LJ_Transpiler::EmitLeave(Expression *expr)
+	{
+		if (expr == NULL) {
+			Line(in_function_ ? "return Null();" : "return;");
+			return;
+		}
+
+		if (in_function_ && expr->GetType() == FUNCTION_CALL_EXPRESSION) {
+			FunctionDefinition *callee = static_cast<BinaryExpression<FUNCTION_CALL_EXPRESSION> *>(expr)->GetFunction();
+			if (callee != NULL && callee->GetType() == FUNCTION_DEFINITION) {
+				EmitTailCall(expr);
+				return;
+			}
+		}
+
+		Operand v = EmitExpression(expr);
+		Line(in_function_ ? "return " + Box(v) + ";" : "return;");
+	}
+
+	//
+	// Like the interpreter's tail calls, return f(...) does not count as a
+	// call. Inside f it takes the new arguments and starts over, the other
+	// locals are declared again, so it runs in constant native stack. A tail
+	// call to another function still takes native stack, which grows on
+	// fresh threads as deep calls do.
+	//
+	void LJ_Transpiler::EmitTailCall(Expression *e)
+	{
+		BinaryExpression<FUNCTION_CALL_EXPRESSION> *expr = static_cast<BinaryExpression<FUNCTION_CALL_EXPRESSION> *>(e);
+		FunctionDefinition *func = expr->GetFunction();
+		std::vector<std::string> args;
+
+		if (expr->GetArgList() != NULL) {
+			for (ArgumentList::iterator it = expr->GetArgList()->begin(); it != expr->GetArgList()->end(); ++it) {
+				args.push_back(Box(EmitExpression(*it)));
+			}
+		}
+
+		if (func != function_) {
+			std::string list;
+			for (size_t i = 0; i < args.size(); i++) {
+				list += (i != 0 ? ", " : "") + args[i];
+			}
+			Line("return TailCall([&]() { return f_" + func->GetFunctionName() + "(" + list + "); });");
+			return;
+		}
+
+		for (size_t i = 0; i < args.size(); i++) {
+			Line("a" + std::to_string(i) + " = " + args[i] + ";");
+		}
+		Line("goto lj_tail;");
+		tail_call_ = 1;
+	}
+
+	std::string LJ_Transpiler::EmitCondition(Expression *expr, const location &l, const char *error)
+	{
+		Operand c = EmitExpression(expr);
+
+		if (c.type_ == BOOL_TYPE) {
+			return c.code_;
+		}
+		return "Test(" + Box(c) + ", " + Where(l) + ", \"" + error + "\")";
+	}
+
+	LJ_Transpiler::Operand LJ_Transpiler::EmitExpression(Expression *expr)
+	{
+		switch (expr->GetType()) {
+		case BOOLEAN_EXPRESSION:
+			return Operand(*(boolean *)expr->GetValue(0) ? "true" : "false", BOOL_TYPE);
+		case INT_EXPRESSION:
+			return Operand(IntLiteral(*(__int64 *)expr->GetValue(0)), INT_TYPE);
+		case DOUBLE_EXPRESSION:
+			return Operand(DoubleLiteral(*(double *)expr->GetValue(0)), DOUBLE_TYPE);
+		case STRING_EXPRESSION:
+			return Operand("String(" + StringLiteral(*(std::string *)expr->GetValue(0)) + ")", DYNAMIC_TYPE);
+		case IDENTIFIER_EXPRESSION:
+			return EmitIdentifierExpression(expr);
+		case ASSIGN_EXPRESSION:
+			return EmitAssignExpression(expr);
+		case ADD_EXPRESSION:
+		case SUB_EXPRESSION:
+		case MUL_EXPRESSION:
+		case DIV_EXPRESSION:
+		case MOD_EXPRESSION:
+		case EQ_EXPRESSION:
+		case NE_EXPRESSION:
+		case GT_EXPRESSION:
+		case GE_EXPRESSION:
+		case LT_EXPRESSION:
+		case LE_EXPRESSION:
+			return EmitBinaryExpression(expr);
+		case LOGICAL_AND_EXPRESSION:
+		case LOGICAL_OR_EXPRESSION:
+			return EmitLogicalAndOrExpression(expr);
+		case MINUS_EXPRESSION:
+		case EXCLAMATION_EXPRESSION:
+			return EmitUnaryExpression(expr);
+		case FUNCTION_CALL_EXPRESSION:
+			return EmitFunctionCallExpression(expr);
+		case TRUE_EXPRESSION:
+			return Operand("true", BOOL_TYPE);
+		case FALSE_EXPRESSION:
+			return Operand("false", BOOL_TYPE);
+		case NULL_EXPRESSION:
+			return Operand("Null()", DYNAMIC_TYPE);
+		case INDEX_EXPRESSION:
+			// The emitted runtime has no heap objects besides strings.
+			driver_->Error(expr->GetLocation(), "EmitIndexExpression error");
+			return Operand("Null()", DYNAMIC_TYPE);
+		case ARRAY_EXPRESSION:
+			driver_->Error(expr->GetLocation(), "EmitArrayExpression error");
+			return Operand("Null()", DYNAMIC_TYPE);
+		case DICT_EXPRESSION:
+			driver_->Error(expr->GetLocation(), "EmitDictExpression error");
+			return Operand("Null()", DYNAMIC_TYPE);
+		case MEMBER_EXPRESSION:
+			driver_->Error(expr->GetLocation(), "EmitMemberExpression error");
+			return Operand("Null()", DYNAMIC_TYPE);
+		case RECORD_EXPRESSION:
+			driver_->Error(expr->GetLocation(), "EmitRecordExpression error");
+			return Operand("Null()", DYNAMIC_TYPE);
+		default:
+			LJ_TRAP();
+			return Operand("Null()", DYNAMIC_TYPE);
+		}
+	}
+
+	LJ_Transpiler::Operand LJ_Transpiler::EmitIdentifierExpression(Expression *expr)
+	{
+		IdentifierExpression *identifier = static_cast<IdentifierExpression *>(expr);
+		StaticType type = TypeOf(expr);
+
+		// Reads are copied, a later operand may assign the variable.
+		if (in_function_ && identifier->GetSlotType() == LOCAL_SLOT) {
+			if (type != DYNAMIC_TYPE) {
+				return Operand(Temp(type, LocalName(identifier->GetSlotIndex())), type);
+			}
+			return Operand(Temp(type, "Check(" + LocalName(identifier->GetSlotIndex()) + ", " + Where(expr->GetLocation()) + ")"), type);
+		}
+		return Operand(Temp(type, "Check(" + GlobalName(identifier->GetSlotIndex()) + ", " + Where(expr->GetLocation()) + ")"), type);
+	}
+
+	LJ_Transpiler::Operand LJ_Transpiler::EmitAssignExpression(Expression *expr)
+	{
+		Expression *left = (Expression *)expr->GetValue(0);
+		Operand v = EmitExpression((Expression *)expr->GetValue(1));
+
+		if (left->GetType() == INDEX_EXPRESSION) {
+			driver_->Error(left->GetLocation(), "EmitIndexExpression error");
+		}
+		if (left->GetType() == MEMBER_EXPRESSION) {
+			driver_->Error(left->GetLocation(), "EmitMemberExpression error");
+		}
+
+		if (left->GetType() != IDENTIFIER_EXPRESSION) {
+			Line("Error(" + Where(left->GetLocation()) + ", \"GetLValue error\");");
+			return v;
+		}
+
+		EmitStore(static_cast<IdentifierExpression *>(left), v);
+		return v;
+	}
+
+	void LJ_Transpiler::EmitStore(IdentifierExpression *identifier, const Operand &v)
+	{
+		if (in_function_ && identifier->GetSlotType() == LOCAL_SLOT) {
+			StaticType type = local_types_[identifier->GetSlotIndex()];
+			Line(LocalName(identifier->GetSlotIndex()) + " = " + (type != DYNAMIC_TYPE ? Convert(v, type) : Box(v)) + ";");
+		}
+		else {
+			Line(GlobalName(identifier->GetSlotIndex()) + " = " + Box(v) + ";");
+		}
+	}
+
+	LJ_Transpiler::Operand LJ_Transpiler::EmitBinaryExpression(Expression *expr)
+	{
+		static const char *const c_operators[] = { "+", "-", "*", "/", "%", "==", "!=", ">", ">=", "<", "<=" };
+		static const char *const aot_operators[] = { "ADD_OP", "SUB_OP", "MUL_OP", "DIV_OP", "MOD_OP",
+			"EQ_OP", "NE_OP", "GT_OP", "GE_OP", "LT_OP", "LE_OP" };
+
+		ExpressionType op = expr->GetType();
+		int index = op - ADD_EXPRESSION;
+		Expression *left = (Expression *)expr->GetValue(0);
+		Operand l = EmitExpression(left);
+		Operand r = EmitExpression((Expression *)expr->GetValue(1));
+		boolean numeric = (l.type_ == INT_TYPE || l.type_ == DOUBLE_TYPE) && (r.type_ == INT_TYPE || r.type_ == DOUBLE_TYPE);
+
+		if (numeric && l.type_ == INT_TYPE && r.type_ == INT_TYPE) {
+			switch (op) {
+			case ADD_EXPRESSION:
+				return Operand(Temp(INT_TYPE, "AddInt(" + l.code_ + ", " + r.code_ + ")"), INT_TYPE);
+			case SUB_EXPRESSION:
+				return Operand(Temp(INT_TYPE, "SubInt(" + l.code_ + ", " + r.code_ + ")"), INT_TYPE);
+			case MUL_EXPRESSION:
+				return Operand(Temp(INT_TYPE, "MulInt(" + l.code_ + ", " + r.code_ + ")"), INT_TYPE);
+			case DIV_EXPRESSION:
+				return Operand(Temp(INT_TYPE, "DivInt(" + l.code_ + ", " + r.code_ + ", " + Where(left->GetLocation()) + ")"),
+					INT_TYPE);
+			case MOD_EXPRESSION:
+				return Operand(Temp(INT_TYPE, "ModInt(" + l.code_ + ", " + r.code_ + ", " + Where(left->GetLocation()) + ")"),
+					INT_TYPE);
+			default:
+				return Operand(Temp(BOOL_TYPE, l.code_ + " " + c_operators[index] + " " + r.code_), BOOL_TYPE);
+			}
+		}
+
+		if (numeric) {
+			std::string a = Convert(l, DOUBLE_TYPE);
+			std::string b = Convert(r, DOUBLE_TYPE);
+			if (op == MOD_EXPRESSION) {
+				return Operand(Temp(DOUBLE_TYPE, "fmod(" + a + ", " + b + ")"), DOUBLE_TYPE);
+			}
+			StaticType type = IsMathOperator(op) ? DOUBLE_TYPE : BOOL_TYPE;
+			return Operand(Temp(type, a + " " + c_operators[index] + " " + b), type);
+		}
+
+		if (l.type_ == BOOL_TYPE && r.type_ == BOOL_TYPE && (op == EQ_EXPRESSION || op == NE_EXPRESSION)) {
+			return Operand(Temp(BOOL_TYPE, l.code_ + " " + c_operators[index] + " " + r.code_), BOOL_TYPE);
+		}
+
+		std::string args = std::string(aot_operators[index]) + ", " + Box(l) + ", " + Box(r) + ", " + Where(left->GetLocation());
+		if (IsMathOperator(op)) {
+			return Operand(Temp(DYNAMIC_TYPE, "Binary(" + args + ")"), DYNAMIC_TYPE);
+		}
+		return Operand(Temp(BOOL_TYPE, "Compare(" + args + ")"), BOOL_TYPE);
+	}
+
+	LJ_Transpiler::Operand LJ_Transpiler::EmitLogicalAndOrExpression(Expression *expr)
+	{
+		Expression *left = (Expression *)expr->GetValue(0);
+		Expression *right = (Expression *)expr->GetValue(1);
+		boolean is_and = expr->GetType() == LOGICAL_AND_EXPRESSION;
+		std::string t = "t" + std::to_string(temp_count_++);
+
+		Line("bool " + t + ";");
+		std::string c = EmitCondition(left, left->GetLocation(), "EvalLogicalAndOrExpression error");
+		Line(std::string(is_and ? "if (!" : "if (") + c + ") {");
+		Line(std::string("\t") + t + (is_and ? " = false;" : " = true;"));
+		Line("}");
+		Line("else {");
+		indent_++;
+		c = EmitCondition(right, right->GetLocation(), "EvalLogicalAndOrExpression error");
+		Line(t + " = " + c + ";");
+		indent_--;
+		Line("}");
+
+		return Operand(t, BOOL_TYPE);
+	}
+
+	LJ_Transpiler::Operand LJ_Transpiler::EmitUnaryExpression(Expression *expr)
+	{
+		Expression *operand = (Expression *)expr->GetValue(0);
+		Operand v = EmitExpression(operand);
+
+		if (expr->GetType() == EXCLAMATION_EXPRESSION) {
+			if (v.type_ == BOOL_TYPE) {
+				return Operand(Temp(BOOL_TYPE, "!" + v.code_), BOOL_TYPE);
+			}
+			return Operand(Temp(BOOL_TYPE, "Not(" + Box(v) + ", " + Where(operand->GetLocation()) + ")"), BOOL_TYPE);
+		}
+
+		switch (v.type_) {
+		case INT_TYPE:
+			return Operand(Temp(INT_TYPE, "NegInt(" + v.code_ + ")"), INT_TYPE);
+		case DOUBLE_TYPE:
+			return Operand(Temp(DOUBLE_TYPE, "-" + v.code_), DOUBLE_TYPE);
+		default:
+			return Operand(Temp(DYNAMIC_TYPE, "Minus(" + Box(v) + ", " + Where(operand->GetLocation()) + ")"), DYNAMIC_TYPE);
+		}
+	}
+
+	LJ_Transpiler::Operand LJ_Transpiler::EmitFunctionCallExpression(Expression *e)
+	{
+		BinaryExpression<FUNCTION_CALL_EXPRESSION> *expr = static_cast<BinaryExpression<FUNCTION_CALL_EXPRESSION> *>(e);
+		FunctionDefinition *func = expr->GetFunction();
+		std::string args;
+
+		if (func == NULL) {
+			Line("Error(" + Where(expr->GetLocation()) + ", \"EvalFunctionCallExpression error\");");
+			return Operand("Null()", DYNAMIC_TYPE);
+		}
+		if (func->GetType() != NATIVE_FUNCTION) {
+			Line("CheckCall(" + Where(expr->GetLocation()) + ");");
+		}
+
+		if (expr->GetArgList() != NULL) {
+			for (ArgumentList::iterator it = expr->GetArgList()->begin(); it != expr->GetArgList()->end(); ++it) {
+				Operand v = EmitExpression(*it);
+				args += (args.empty() ? "" : ", ") + Box(v);
+			}
+		}
+
+		if (func->GetType() == NATIVE_FUNCTION) {
+			if (func->GetFunctionName() != "print") {
+				driver_->Error(expr->GetLocation(), "EmitFunctionCallExpression error");
+			}
+			return Operand(Temp(DYNAMIC_TYPE, "Print({" + args + "})"), DYNAMIC_TYPE);
+		}
+		return Operand(Temp(DYNAMIC_TYPE, "Call([&]() { return f_" + func->GetFunctionName() + "(" + args + "); })"), DYNAMIC_TYPE);
+	}
+
+	std::string LJ_Transpiler::Temp(StaticType type, const std::string &code)
+	{
+		std::string t = "t" + std::to_string(temp_count_++);
+
+		Line(std::string("const ") + TypeName(type) + " " + t + " = " + code + ";");
+		return t;
+	}
+
+	std::string LJ_Transpiler::Box(const Operand &op)
+	{
+		switch (op.type_) {
+		case INT_TYPE:
+			return "Int(" + op.code_ + ")";
+		case DOUBLE_TYPE:
+			return "Double(" + op.code_ + ")";
+		case BOOL_TYPE:
+			return "Bool(" + op.code_ + ")";
+		default:
+			return op.code_;
+		}
+	}
+
+	std::string LJ_Transpiler::Convert(const Operand &op, StaticType type)
+	{
+		if (op.type_ == INT_TYPE && type == DOUBLE_TYPE) {
+			return "(double)" + op.code_;
+		}
+		return op.code_;
+	}
+
+	std::string LJ_Transpiler::LocalName(int slot)
+	{
+		return "l" + std::to_string(slot) + "_" + local_names_[slot];
+	}
+
+	std::string LJ_Transpiler::VariableName(IdentifierExpression *identifier)
+	{
+		if (in_function_ && identifier->GetSlotType() == LOCAL_SLOT) {
+			return LocalName(identifier->GetSlotIndex());
+		}
+		return GlobalName(identifier->GetSlotIndex());
+	}
+
+	std::string LJ_Transpiler::GlobalName(int index)
+	{
+		return "g" + std::to_string(index) + "_" + driver_->global_names_[index];
+	}
+
+	std::string LJ_Transpiler::Where(const location &l)
+	{
+		std::ostringstream os;
+		os << l;
+		return StringLiteral(os.str());
+	}
+
+	const char *LJ_Transpiler::TypeName(StaticType type)
+	{
+		switch (type) {
+		case INT_TYPE:
+			return "int64_t";
+		case DOUBLE_TYPE:
+			return "double";
+		case BOOL_TYPE:
+			return "bool";
+		default:
+			return "Value";
+		}
+	}
+
+	std::string LJ_Transpiler::IntLiteral(__int64 v)
+	{
+		if (v == INT64_MIN) {
+			return "(-INT64_C(9223372036854775807) - 1)";
+		}
+		return "INT64_C(" + std::to_string(v) + ")";
+	}
+
+	std::string LJ_Transpiler::DoubleLiteral(double v)
+	{
+		std::ostringstream os;
+
+		if (isnan(v)) {
+			return "NAN";
+		}
+		if (isinf(v)) {
+			return v > 0 ? "HUGE_VAL" : "(-HUGE_VAL)";
+		}
+
+		// 17 digits read back as the same double.
+		os << std::setprecision(17) << v;
+		std::string s = os.str();
+		if (s.find_first_of(".e") == std::string::npos) {
+			s += ".0";
+		}
+		return v < 0 || (v == 0 && signbit(v)) ? "(" + s + ")" : s;
+	}
+
+	std::string LJ_Transpiler::StringLiteral(const std::string &s)
+	{
+		std::string out = "\"";
+
+		for (size_t i = 0; i < s.size(); i++) {
+			unsigned char c = (unsigned char)s[i];
+			if (c == '"' || c == '\\') {
+				out += '\\';
+				out += (char)c;
+			}
+			else if (c == '\n') {
+				out += "\\n";
+			}
+			else if (c == '\t') {
+				out += "\\t";
+			}
+			else if (c < 0x20 || c >= 0x7f || c == '?') {
+				// Three octal digits, so no following character joins the escape.
+				out += '\\';
+				out += (char)('0' + (c >> 6));
+				out += (char)('0' + ((c >> 3) & 7));
+				out += (char)('0' + (c & 7));
+			}
+			else {
+				out += (char)c;
+			}
+		}
+
+		return out + "\"";
+	}
+
+	void LJ_Transpiler::Line(const std::string &s)
+	{
+		if (!s.empty()) {
+			for (int i = 0; i < indent_; i++) {
+				*os_ << '\t';
+			}
+		}
+		*os_ << s << '\n';
+	}
+}
@@ -0,0 +1,108 @@
+#ifndef __LJ_TRANSPILER_H__
+#define __LJ_TRANSPILER_H__
+
+#include <iostream>
+#include <set>
+#include <string>
+#include <vector>
+#include "lj_ast.h"
+
+namespace LJ {
+
+	class LJ_Driver;
+
+	//
+	// Writes the parsed program of a driver as one C++ translation unit for
+	// lj_aot.h. Every script function becomes a C++ function and the top
+	// level statements become lj_main. A function local whose first use is
+	// a plain assignment and which is only ever assigned int, double or
+	// boolean values of one type lives in an unboxed C++ variable, so is
+	// arithmetic on such locals. Everything else is a boxed Value and goes
+	// through the same dynamic operators as the interpreter. Expressions are
+	// split into temporaries so side effects and errors keep their order.
+	// Calls count against the call depth limit lj runs with, and a function
+	// returning a call to itself jumps back to its start instead.
+	//
+	class LJ_Transpiler {
+	public:
+		LJ_Transpiler(LJ_Driver *driver);
+		~LJ_Transpiler();
+
+		void Emit(std::ostream &os);
+
+	private:
+		enum StaticType {
+			UNKNOWN_TYPE = 0,
+			INT_TYPE,
+			DOUBLE_TYPE,
+			BOOL_TYPE,
+			DYNAMIC_TYPE,
+		};
+
+		struct Operand {
+			Operand(const std::string &code, StaticType type) : code_(code), type_(type) {}
+
+			std::string code_;
+			StaticType type_;
+		};
+
+		void CollectExpressions(Expression *expr, std::vector<Expression *> &out);
+		void CollectExpressions(Statement *statement, std::vector<Expression *> &out);
+		void CollectExpressions(StatementList *list, std::vector<Expression *> &out);
+		boolean Mentions(const std::vector<Expression *> &exprs, int slot);
+		void InferLocals(FunctionDefinition *func);
+		StaticType TypeOf(Expression *expr);
+
+		void EmitFunction(FunctionDefinition *func);
+		void EmitMain();
+		void EmitStatementList(StatementList *list);
+		void EmitStatement(Statement *statement);
+		void EmitIfStatement(Statement *statement);
+		void EmitWhileStatement(Statement *statement);
+		void EmitForStatement(Statement *statement);
+		void EmitForeachStatement(Statement *statement);
+		void EmitLeave(Expression *expr);
+		void EmitTailCall(Expression *expr);
+		std::string EmitCondition(Expression *expr, const location &l, const char *error);
+
+		Operand EmitExpression(Expression *expr);
+		Operand EmitIdentifierExpression(Expression *expr);
+		Operand EmitAssignExpression(Expression *expr);
+		Operand EmitBinaryExpression(Expression *expr);
+		Operand EmitLogicalAndOrExpression(Expression *expr);
+		Operand EmitUnaryExpression(Expression *expr);
+		Operand EmitFunctionCallExpression(Expression *expr);
+		void EmitStore(IdentifierExpression *identifier, const Operand &v);
+
+		std::string Temp(StaticType type, const std::string &code);
+		std::string Box(const Operand &op);
+		std::string Convert(const Operand &op, StaticType type);
+		std::string LocalName(int slot);
+		std::string VariableName(IdentifierExpression *identifier);
+		std::string GlobalName(int index);
+		std::string Where(const location &l);
+
+		static const char *TypeName(StaticType type);
+		static std::string IntLiteral(__int64 v);
+		static std::string DoubleLiteral(double v);
+		static std::string StringLiteral(const std::string &s);
+
+		void Line(const std::string &s);
+
+		LJ_Driver *driver_;
+		std::ostream *os_;
+		int indent_;
+		int temp_count_;
+		int label_count_;
+		boolean in_function_;
+		FunctionDefinition *function_;
+		boolean tail_call_;
+		std::vector<StaticType> local_types_;
+		std::vector<std::string> local_names_;
+		std::set<int> counter_slots_;
+		std::vector<int> loop_labels_;
+		std::set<int> continue_labels_;
+	};
+}
+
+#endif
@@ -1,47 +1,368 @@
 #ifndef __LJ_VALUE_H__
 #define __LJ_VALUE_H__
 
+#include <iosfwd>
+#include <string>
+#include <vector>
+#include "lj_port.h"
+
 namespace LJ {
 	enum ValueType {
+		UNDEFINED_VALUE = 0,
 		BOOLEAN_VALUE = 1,
 		INT_VALUE,
 		DOUBLE_VALUE,
 		STRING_VALUE,
 		NULL_VALUE,
+		GENERATOR_VALUE,
+		ARRAY_VALUE,
+		DICT_VALUE,
+		RECORD_VALUE,
 	};
 
-	struct NullType;
+	class LJ_GC;
+	class FunctionDefinition;
+	class GeneratorObject;
+	class ArrayObject;
+	class DictObject;
+	class RecordObject;
+	class Shape;
+
+	enum HeapObjectType {
+		STRING_OBJECT = 1,
+		GENERATOR_OBJECT,
+		ARRAY_OBJECT,
+		DICT_OBJECT,
+		RECORD_OBJECT,
+	};
 
-	class ValueBase {
+	//
+	// Base of everything allocated through LJ_GC. Objects are chained through
+	// next_ so the sweep phase can walk the whole heap.
+	//
+	class HeapObject {
 	public:
-		ValueBase() {}
-		virtual ~ValueBase() {}
+		HeapObject() : marked_(0), next_(NULL) {}
+		virtual ~HeapObject() {}
+
+		virtual HeapObjectType GetType() const = 0;
+		virtual size_t GetSize() const = 0;
+		virtual void Trace(LJ_GC *gc) {}
 
-		virtual ValueType GetType() const = 0;
+		boolean marked_;
+		HeapObject *next_;
 	};
 
-	template<class T, ValueType N>
-	class Value : public ValueBase {
+	//
+	// A string is flat, its characters in value_, or a rope: the
+	// concatenation of left_ and right_, made by an ADD that did not copy
+	// either side. A rope is flattened in place the first time something
+	// needs its characters in one piece, comparing it or hashing it, and
+	// TO_STRING_VALUE is only valid on a flat string. Writing or copying
+	// one out walks its leaves instead.
+	//
+	class StringObject : public HeapObject {
 	public:
-		Value() {}
-		~Value() {}
+		StringObject() : hash_(0), left_(NULL), right_(NULL), length_(0) {}
+		~StringObject() {}
+
+		HeapObjectType GetType() const override {
+			return STRING_OBJECT;
+		}
+
+		// Changes as a rope is flattened, Flatten keeps the heap size in step.
+		size_t GetSize() const override {
+			return sizeof(StringObject) + value_.capacity();
+		}
+
+		void Trace(LJ_GC *gc) override;
+
+		boolean IsRope() const {
+			return left_ != NULL;
+		}
+
+		size_t GetLength() const {
+			return left_ != NULL ? length_ : value_.size();
+		}
 
-		ValueType GetType() const override {
-			return N;
+		void Flatten(LJ_GC &gc);
+		void AppendTo(std::string &out) const;
+		void Write(std::ostream &os) const;
+
+		std::string value_;
+
+		// Computed when the string is first used as a dict key, 0 until then.
+		size_t hash_;
+
+		// Both NULL once flat.
+		StringObject *left_;
+		StringObject *right_;
+		size_t length_;
+	};
+
+	//
+	// Fixed size tagged value. Booleans, integers, doubles and null are held
+	// inline, strings, generators, arrays and dicts point to a heap object
+	// owned by LJ_GC.
+	//
+	class Value {
+	public:
+		ValueType GetType() const {
+			return type_;
 		}
 
-		T value_;
+		HeapObject *GetObject() const;
+
+		ValueType type_;
+		union {
+			boolean boolean_value_;
+			__int64 int_value_;
+			double double_value_;
+			StringObject *string_value_;
+			GeneratorObject *generator_value_;
+			ArrayObject *array_value_;
+			DictObject *dict_value_;
+			RecordObject *record_value_;
+		};
 	};
 
-	template<ValueType N>
-	class Value<NullType, N> :  public ValueBase {
+	//
+	// Where a suspended statement continues: the index of the next statement
+	// of a list, the branch an if took, or the state of a foreach.
+	//
+	struct ResumePoint {
+		ResumePoint(size_t index) : index_(index), counter_(0), limit_(0) { value_.type_ = NULL_VALUE; }
+		ResumePoint(__int64 counter, __int64 limit) : index_(0), counter_(counter), limit_(limit) { value_.type_ = NULL_VALUE; }
+		ResumePoint(const Value &v) : index_(0), counter_(0), limit_(0), value_(v) {}
+
+		size_t index_;
+		__int64 counter_;
+		__int64 limit_;
+		Value value_;
+	};
+
+	enum GeneratorState {
+		GENERATOR_NEW = 1,
+		GENERATOR_SUSPENDED,
+		GENERATOR_RUNNING,
+		GENERATOR_DONE,
+	};
+
+	//
+	// The frame of a call to a function that yields. While the generator is
+	// suspended its slots and the resume points of the statements it was
+	// executing are kept here, LJ_Driver::ResumeGenerator moves them back
+	// onto the value stack.
+	//
+	class GeneratorObject : public HeapObject {
 	public:
-		Value() {}
-		~Value() {}
+		GeneratorObject(FunctionDefinition *func) : func_(func), state_(GENERATOR_NEW) {}
+		~GeneratorObject() {}
 
-		ValueType GetType() const override {
-			return N;
+		HeapObjectType GetType() const override {
+			return GENERATOR_OBJECT;
 		}
+
+		// The slots are allocated once when the generator is created, the
+		// resume points are too short lived to count.
+		size_t GetSize() const override {
+			return sizeof(GeneratorObject) + slots_.capacity() * sizeof(Value);
+		}
+
+		void Trace(LJ_GC *gc) override;
+
+		FunctionDefinition *func_;
+		std::vector<Value> slots_;
+		std::vector<ResumePoint> resume_;
+		GeneratorState state_;
+	};
+
+	enum ArrayKind {
+		INT_ARRAY = 1,
+		DOUBLE_ARRAY,
+		BOXED_ARRAY,
+	};
+
+	//
+	// Elements of an array value. Only the vector of the array's kind is in
+	// use: packed ints while every element is an int, packed doubles while
+	// every element is a double, and boxed values once they are mixed. An
+	// empty array takes the kind of its first element, storing an element
+	// of another kind boxes the array for good.
+	//
+	class ArrayObject : public HeapObject {
+	public:
+		ArrayObject(ArrayKind kind) : kind_(kind) {}
+		~ArrayObject() {}
+
+		HeapObjectType GetType() const override {
+			return ARRAY_OBJECT;
+		}
+
+		// Changes with the length, LJ_GC::Resize keeps the heap size in step.
+		size_t GetSize() const override {
+			return sizeof(ArrayObject) + ints_.capacity() * sizeof(__int64) + doubles_.capacity() * sizeof(double)
+				+ values_.capacity() * sizeof(Value);
+		}
+
+		void Trace(LJ_GC *gc) override;
+
+		size_t GetLength() const {
+			switch (kind_) {
+			case INT_ARRAY: return ints_.size();
+			case DOUBLE_ARRAY: return doubles_.size();
+			default: return values_.size();
+			}
+		}
+
+		Value Get(size_t index) const;
+		boolean Fits(const Value &v) const;
+		void Box();
+
+		ArrayKind kind_;
+		std::vector<__int64> ints_;
+		std::vector<double> doubles_;
+		std::vector<Value> values_;
+	};
+
+	//
+	// One slot of a DictObject. hash_ is 0 for an empty slot, DictObject::Hash
+	// never returns 0.
+	//
+	struct DictEntry {
+		size_t hash_;
+		Value key_;
+		Value value_;
+	};
+
+	//
+	// Hash table of a dict value, keyed by ints and strings. The entries sit
+	// in one power of two vector probed linearly, Robin Hood style: an entry
+	// further from its home slot than the one in its way takes that slot, so
+	// probe lengths stay short even at 7/8 load and a lookup can stop at the
+	// first entry nearer its home than the key would be. A removal shifts the
+	// entries behind it back instead of leaving a tombstone.
+	//
+	class DictObject : public HeapObject {
+	public:
+		DictObject() : count_(0) {}
+		~DictObject() {}
+
+		HeapObjectType GetType() const override {
+			return DICT_OBJECT;
+		}
+
+		// Changes as the table grows, LJ_GC::Resize keeps the heap size in step.
+		size_t GetSize() const override {
+			return sizeof(DictObject) + entries_.capacity() * sizeof(DictEntry);
+		}
+
+		void Trace(LJ_GC *gc) override;
+
+		size_t GetLength() const {
+			return count_;
+		}
+
+		static boolean IsKey(const Value &key) {
+			return key.type_ == INT_VALUE || key.type_ == STRING_VALUE;
+		}
+
+		// key must be a valid key for all of these, a string key a flat one.
+		static size_t Hash(const Value &key);
+		Value *Find(const Value &key);
+		void Set(const Value &key, const Value &value);
+		boolean Remove(const Value &key);
+
+		std::vector<DictEntry> entries_;
+		size_t count_;
+
+	private:
+		size_t Lookup(const Value &key, size_t hash) const;
+		void Insert(DictEntry entry);
+		void Grow();
+	};
+
+	//
+	// Fields of a record value. Which field sits in which slot is kept by the
+	// shape, the record holds only the values.
+	//
+	class RecordObject : public HeapObject {
+	public:
+		RecordObject(Shape *shape) : shape_(shape) {}
+		~RecordObject() {}
+
+		HeapObjectType GetType() const override {
+			return RECORD_OBJECT;
+		}
+
+		// Changes as fields are added, LJ_GC::Resize keeps the heap size in step.
+		size_t GetSize() const override {
+			return sizeof(RecordObject) + slots_.capacity() * sizeof(Value);
+		}
+
+		void Trace(LJ_GC *gc) override;
+
+		Shape *shape_;
+		std::vector<Value> slots_;
+	};
+
+	__inline HeapObject *Value::GetObject() const
+	{
+		if (type_ == STRING_VALUE) {
+			return string_value_;
+		}
+		else if (type_ == GENERATOR_VALUE) {
+			return generator_value_;
+		}
+		else if (type_ == ARRAY_VALUE) {
+			return array_value_;
+		}
+		else if (type_ == DICT_VALUE) {
+			return dict_value_;
+		}
+		else if (type_ == RECORD_VALUE) {
+			return record_value_;
+		}
+		return NULL;
+	}
+
+	//
+	// Contiguous operand stack of the tree walker. Function frames live in it
+	// too, so indices stay valid across growth but pointers do not.
+	//
+	class ValueStack {
+	public:
+		ValueStack(size_t capacity) : values_(capacity), top_(0) {}
+		~ValueStack() {}
+
+		void Push(const Value &v) {
+			if (top_ == values_.size()) {
+				Value copy = v;
+				values_.resize(values_.size() * 2);
+				values_[top_++] = copy;
+				return;
+			}
+			values_[top_++] = v;
+		}
+
+		void Pop() { top_--; }
+		void Pop(size_t count) { top_ -= count; }
+		Value& Top() { return values_[top_ - 1]; }
+		size_t Size() const { return top_; }
+		Value& operator[](size_t index) { return values_[index]; }
+
+		void Grow(size_t count, const Value &v) {
+			while (top_ + count > values_.size()) {
+				values_.resize(values_.size() * 2);
+			}
+			for (size_t i = 0; i < count; i++) {
+				values_[top_++] = v;
+			}
+		}
+
+	private:
+		std::vector<Value> values_;
+		size_t top_;
 	};
 
 	enum StatementResultType {
@@ -49,28 +370,147 @@ namespace LJ {
 		RETURN_STATEMENT_RESULT,
 		BREAK_STATEMENT_RESULT,
 		CONTINUE_STATEMENT_RESULT,
+		SUSPEND_STATEMENT_RESULT,
 		STATEMENT_RESULT_TYPE_COUNT_PLUS_1
 	};
 
 	class StatementResult {
 	public:
-		StatementResult(StatementResultType t, ValueBase *v) :
+		StatementResult(StatementResultType t) :
+		type_(t) { value_.type_ = NULL_VALUE; }
+		StatementResult(StatementResultType t, const Value &v) :
 		value_(v), type_(t) {}
 		~StatementResult() {}
 
-		ValueBase *value_;
+		Value value_;
 		StatementResultType type_;
 	};
 
-	typedef Value<boolean, BOOLEAN_VALUE>		BooleanValue;
-	typedef Value<__int64, INT_VALUE>			IntValue;
-	typedef Value<double, DOUBLE_VALUE>			DoubleValue;
-	typedef Value<std::string, STRING_VALUE>	StringValue;
-	typedef Value<NullType, NULL_VALUE>			NullValue;
+	__inline Value UndefinedValue()
+	{
+		Value v;
+		v.type_ = UNDEFINED_VALUE;
+		v.int_value_ = 0;
+		return v;
+	}
+
+	__inline Value BooleanValue(boolean b)
+	{
+		Value v;
+		v.type_ = BOOLEAN_VALUE;
+		v.int_value_ = 0;
+		v.boolean_value_ = b;
+		return v;
+	}
+
+	__inline Value IntValue(__int64 i)
+	{
+		Value v;
+		v.type_ = INT_VALUE;
+		v.int_value_ = i;
+		return v;
+	}
+
+	__inline Value DoubleValue(double d)
+	{
+		Value v;
+		v.type_ = DOUBLE_VALUE;
+		v.double_value_ = d;
+		return v;
+	}
+
+	__inline Value StringValue(StringObject *s)
+	{
+		Value v;
+		v.type_ = STRING_VALUE;
+		v.string_value_ = s;
+		return v;
+	}
+
+	__inline Value GeneratorValue(GeneratorObject *g)
+	{
+		Value v;
+		v.type_ = GENERATOR_VALUE;
+		v.generator_value_ = g;
+		return v;
+	}
+
+	__inline Value ArrayValue(ArrayObject *a)
+	{
+		Value v;
+		v.type_ = ARRAY_VALUE;
+		v.array_value_ = a;
+		return v;
+	}
+
+	__inline Value DictValue(DictObject *d)
+	{
+		Value v;
+		v.type_ = DICT_VALUE;
+		v.dict_value_ = d;
+		return v;
+	}
+
+	__inline Value RecordValue(RecordObject *r)
+	{
+		Value v;
+		v.type_ = RECORD_VALUE;
+		v.record_value_ = r;
+		return v;
+	}
+
+	__inline Value NullValue()
+	{
+		Value v;
+		v.type_ = NULL_VALUE;
+		v.int_value_ = 0;
+		return v;
+	}
+
+#define TO_BOOLEAN_VALUE(v)		((v).boolean_value_)
+#define TO_INT_VALUE(v)			((v).int_value_)
+#define TO_DOUBLE_VALUE(v)		((v).double_value_)
+#define TO_STRING_VALUE(v)		((v).string_value_->value_)
+#define TO_GENERATOR_VALUE(v)	((v).generator_value_)
+#define TO_ARRAY_VALUE(v)		((v).array_value_)
+#define TO_DICT_VALUE(v)		((v).dict_value_)
+#define TO_RECORD_VALUE(v)		((v).record_value_)
+
+	__inline Value ArrayObject::Get(size_t index) const
+	{
+		switch (kind_) {
+		case INT_ARRAY: return IntValue(ints_[index]);
+		case DOUBLE_ARRAY: return DoubleValue(doubles_[index]);
+		default: return values_[index];
+		}
+	}
+
+	// True when v can be stored without boxing the array.
+	__inline boolean ArrayObject::Fits(const Value &v) const
+	{
+		switch (kind_) {
+		case INT_ARRAY: return v.type_ == INT_VALUE;
+		case DOUBLE_ARRAY: return v.type_ == DOUBLE_VALUE;
+		default: return 1;
+		}
+	}
+
+	__inline void ArrayObject::Box()
+	{
+		size_t length = GetLength();
+
+		values_.reserve(length);
+		for (size_t i = 0; i < length; i++) {
+			values_.push_back(Get(i));
+		}
+		std::vector<__int64>().swap(ints_);
+		std::vector<double>().swap(doubles_);
+		kind_ = BOXED_ARRAY;
+	}
 
 }
 
 
 
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,358 @@
+#include "lj_driver.hpp"
+#include "lj_vm.h"
+#include "lj_compiler.h"
+#include "lj_native.h"
+#include "lj_parallel.h"
+
+namespace LJ {
+
+	static const ExpressionType binary_expression_types[] = {
+		ADD_EXPRESSION,
+		SUB_EXPRESSION,
+		MUL_EXPRESSION,
+		DIV_EXPRESSION,
+		MOD_EXPRESSION,
+		EQ_EXPRESSION,
+		NE_EXPRESSION,
+		GT_EXPRESSION,
+		GE_EXPRESSION,
+		LT_EXPRESSION,
+		LE_EXPRESSION,
+	};
+
+	LJ_VM::LJ_VM(LJ_Driver *driver)
+		: use_jit_(LJ_JIT_SUPPORTED != 0), driver_(driver), main_(NULL)
+	{
+		driver_->gc_.AddRootSet(this);
+	}
+
+	LJ_VM::~LJ_VM()
+	{
+		driver_->gc_.RemoveRootSet(this);
+		DeleteElems(protos_);
+	}
+
+	void LJ_VM::MarkRoots(LJ_GC *gc)
+	{
+		for (std::vector<FunctionProto *>::iterator it = protos_.begin(); it != protos_.end(); ++it) {
+			for (std::vector<Value>::iterator k = (*it)->constants_.begin(); k != (*it)->constants_.end(); ++k) {
+				gc->MarkValue(*k);
+			}
+		}
+
+		// Registers above the innermost frame only hold dead values.
+		if (frames_.size() != 0) {
+			size_t top = frames_.back().base_ + frames_.back().proto_->register_count_;
+			for (size_t r = 0; r < top && r < registers_.size(); r++) {
+				gc->MarkValue(registers_[r]);
+			}
+		}
+	}
+
+	void LJ_VM::Compile()
+	{
+		LJ_Compiler compiler(driver_);
+		main_ = compiler.Compile(protos_);
+	}
+
+	void LJ_VM::Dump()
+	{
+		for (std::vector<FunctionProto *>::iterator it = protos_.begin(); it != protos_.end(); ++it) {
+			if ((*it)->definition_ == NULL || (*it)->definition_->GetType() == FUNCTION_DEFINITION) {
+				(*it)->Dump(driver_->global_names_);
+			}
+		}
+	}
+
+	void LJ_VM::Execute()
+	{
+		if (main_ == NULL) {
+			Compile();
+		}
+
+		registers_.assign(main_->register_count_, UndefinedValue());
+		frames_.clear();
+		frames_.push_back(CallFrame(main_, 0));
+
+		Run();
+	}
+
+	void LJ_VM::EnsureRegisters(size_t size)
+	{
+		if (registers_.size() < size) {
+			registers_.resize(size * 2, UndefinedValue());
+		}
+	}
+
+#define VM_LOCATION()		(proto->locations_[pc - 1])
+#define VM_CHECK(v) \
+	if ((v).GetType() == UNDEFINED_VALUE) { driver_->Error(VM_LOCATION(), "EvalIdentifierExpression error"); }
+
+	void LJ_VM::Run()
+	{
+		CallFrame *frame = &frames_.back();
+		FunctionProto *proto = frame->proto_;
+		const Instruction *code = &proto->code_[0];
+		Value *base = &registers_[frame->base_];
+		size_t pc = frame->pc_;
+		Value v;
+
+		for (;;) {
+			// Compiled functions run natively up to an instruction left to the VM.
+			if (proto->jit_entry_ != NULL) {
+				pc = proto->jit_entry_(base, pc);
+			}
+
+			const Instruction &i = code[pc++];
+
+			switch (i.op_) {
+			case OP_MOVE:
+				VM_CHECK(base[i.b_]);
+				base[i.a_] = base[i.b_];
+				break;
+			case OP_LOADK:
+				base[i.a_] = proto->constants_[i.bx_];
+				break;
+			case OP_LOADBOOL:
+				base[i.a_] = BooleanValue((boolean)i.b_);
+				break;
+			case OP_LOADNULL:
+				base[i.a_] = NullValue();
+				break;
+			case OP_GETGLOBAL:
+				VM_CHECK(driver_->global_value_[i.bx_]);
+				base[i.a_] = driver_->global_value_[i.bx_];
+				break;
+			case OP_SETGLOBAL:
+				VM_CHECK(base[i.a_]);
+				driver_->global_value_[i.bx_] = base[i.a_];
+				break;
+			case OP_ADD:
+			case OP_SUB:
+			case OP_MUL:
+			case OP_DIV:
+			case OP_MOD:
+			case OP_EQ:
+			case OP_NE:
+			case OP_GT:
+			case OP_GE:
+			case OP_LT:
+			case OP_LE:
+				VM_CHECK(base[i.b_]);
+				VM_CHECK(base[i.c_]);
+				base[i.a_] = driver_->EvalBinaryOperator(binary_expression_types[i.op_ - OP_ADD],
+					base[i.b_], base[i.c_], VM_LOCATION());
+				break;
+			case OP_MINUS:
+				VM_CHECK(base[i.b_]);
+				v = base[i.b_];
+				if (v.GetType() == INT_VALUE) {
+					base[i.a_] = IntValue(-TO_INT_VALUE(v));
+				}
+				else if (v.GetType() == DOUBLE_VALUE) {
+					base[i.a_] = DoubleValue(-TO_DOUBLE_VALUE(v));
+				}
+				else {
+					driver_->Error(VM_LOCATION(), "EvalMinusExpression error");
+				}
+				break;
+			case OP_NOT:
+				VM_CHECK(base[i.b_]);
+				v = base[i.b_];
+				if (v.GetType() != BOOLEAN_VALUE) {
+					driver_->Error(VM_LOCATION(), "EvalExclamationExpression error");
+				}
+				base[i.a_] = BooleanValue(!TO_BOOLEAN_VALUE(v));
+				break;
+			case OP_TESTBOOL:
+				VM_CHECK(base[i.a_]);
+				if (base[i.a_].GetType() != BOOLEAN_VALUE) {
+					driver_->Error(VM_LOCATION(), GetConditionErrorString(i.ext_));
+				}
+				break;
+			case OP_JMP:
+				pc += i.bx_;
+				// Native code of a hot loop takes over at the next instruction.
+				if (i.bx_ < 0 && ++proto->loop_count_ == JIT_LOOP_THRESHOLD && use_jit_) {
+					jit_.Compile(proto);
+				}
+				if (i.bx_ < 0) {
+					driver_->Safepoint();
+				}
+				break;
+			case OP_JMPFALSE:
+			case OP_JMPTRUE:
+				VM_CHECK(base[i.a_]);
+				v = base[i.a_];
+				if (v.GetType() != BOOLEAN_VALUE) {
+					driver_->Error(VM_LOCATION(), GetConditionErrorString(i.ext_));
+				}
+				if ((TO_BOOLEAN_VALUE(v) != 0) == (i.op_ == OP_JMPTRUE)) {
+					pc += i.bx_;
+				}
+				break;
+			case OP_CALL: {
+				FunctionProto *callee = proto->callees_[i.c_];
+				if (callee == NULL) {
+					driver_->Error(VM_LOCATION(), "EvalFunctionCallExpression error");
+				}
+
+				if (callee->definition_->GetType() == NATIVE_FUNCTION) {
+					NativeFunction *native = static_cast<NativeFunction *>(callee->definition_);
+					base[i.a_] = native->GetProc()(driver_, i.b_, base + i.a_, VM_LOCATION());
+					break;
+				}
+				if (callee->definition_->IsGenerator()) {
+					base[i.a_] = NewGeneratorValue(driver_->gc_, callee->definition_, base + i.a_, i.b_);
+					break;
+				}
+
+				// The main frame does not count towards the depth.
+				if (frames_.size() > driver_->call_depth_limit_) {
+					driver_->Error(VM_LOCATION(), "CallFunction error");
+				}
+				driver_->Safepoint();
+
+				MemoCache *memo = NULL;
+				if (callee->definition_->IsMemo() && driver_->memo_capacity_ != 0) {
+					memo = driver_->GetMemoCache(callee->definition_);
+					memo_keys_.push_back(std::string());
+					MemoCache::MakeKey(base + i.a_, i.b_, &memo_keys_.back());
+					if (memo->Lookup(memo_keys_.back(), &base[i.a_])) {
+						memo_keys_.pop_back();
+						break;
+					}
+				}
+				if (++callee->call_count_ == JIT_CALL_THRESHOLD && use_jit_) {
+					jit_.Compile(callee);
+				}
+
+				size_t callee_base = frame->base_ + i.a_;
+				frame->pc_ = pc;
+				EnsureRegisters(callee_base + callee->register_count_);
+				for (size_t r = callee_base + callee->param_count_;
+					r < callee_base + callee->register_count_; r++) {
+					registers_[r] = UndefinedValue();
+				}
+
+				frames_.push_back(CallFrame(callee, callee_base));
+				frame = &frames_.back();
+				frame->memo_ = memo;
+				proto = callee;
+				code = &proto->code_[0];
+				base = &registers_[callee_base];
+				pc = 0;
+				break;
+			}
+			case OP_TAILCALL: {
+				FunctionProto *callee = proto->callees_[i.c_];
+				driver_->Safepoint();
+				if (++callee->call_count_ == JIT_CALL_THRESHOLD && use_jit_) {
+					jit_.Compile(callee);
+				}
+
+				// The arguments become the first registers of the current frame.
+				size_t callee_base = frame->base_;
+				for (int r = 0; r < i.b_; r++) {
+					base[r] = base[i.a_ + r];
+				}
+				EnsureRegisters(callee_base + callee->register_count_);
+				for (size_t r = callee_base + callee->param_count_;
+					r < callee_base + callee->register_count_; r++) {
+					registers_[r] = UndefinedValue();
+				}
+
+				frame->proto_ = callee;
+				proto = callee;
+				code = &proto->code_[0];
+				base = &registers_[callee_base];
+				pc = 0;
+				break;
+			}
+			case OP_RETURN:
+			case OP_RETURNNULL: {
+				if (i.op_ == OP_RETURN) {
+					VM_CHECK(base[i.a_]);
+					v = base[i.a_];
+				}
+				else {
+					v = NullValue();
+				}
+
+				size_t callee_base = frame->base_;
+				if (frame->memo_ != NULL) {
+					frame->memo_->Insert(memo_keys_.back(), v);
+					memo_keys_.pop_back();
+				}
+				frames_.pop_back();
+				if (frames_.size() == 0) {
+					return;
+				}
+
+				registers_[callee_base] = v;
+				frame = &frames_.back();
+				proto = frame->proto_;
+				code = &proto->code_[0];
+				base = &registers_[frame->base_];
+				pc = frame->pc_;
+				break;
+			}
+			case OP_FORPREP:
+				if (base[i.a_].GetType() != INT_VALUE || base[i.b_].GetType() != INT_VALUE) {
+					driver_->Error(VM_LOCATION(), "ExecuteForeachStatement error");
+				}
+				break;
+			case OP_PARALLEL: {
+				// The local registers are the frame slots the workers copy.
+				LJ_ParallelForeach pool(driver_, proto->parallel_loops_[i.b_]);
+				pool.Run(TO_INT_VALUE(base[i.a_]), TO_INT_VALUE(base[i.a_ + 1]), proto->definition_,
+					proto->definition_ != NULL ? base : NULL);
+				break;
+			}
+			case OP_NEXT: {
+				// Generator bodies run on the tree walker.
+				if (base[i.b_].GetType() != GENERATOR_VALUE) {
+					driver_->Error(VM_LOCATION(), "ExecuteForeachStatement error");
+				}
+				boolean more = driver_->ResumeGenerator(TO_GENERATOR_VALUE(base[i.b_]), &v, VM_LOCATION());
+				if (more) {
+					base[i.a_] = v;
+				}
+				base[i.a_ + 1] = BooleanValue(more);
+				break;
+			}
+			case OP_NEWARRAY:
+				base[i.a_] = NewArrayValue(driver_->gc_, base + i.a_, i.b_);
+				break;
+			case OP_GETINDEX:
+				VM_CHECK(base[i.b_]);
+				VM_CHECK(base[i.c_]);
+				base[i.a_] = driver_->GetElement(base[i.b_], base[i.c_], VM_LOCATION());
+				break;
+			case OP_SETINDEX:
+				VM_CHECK(base[i.c_]);
+				VM_CHECK(base[i.a_]);
+				VM_CHECK(base[i.b_]);
+				driver_->SetElement(base[i.a_], base[i.b_], base[i.c_], VM_LOCATION());
+				break;
+			case OP_NEWDICT:
+				base[i.a_] = driver_->NewDict(base + i.a_, i.b_, VM_LOCATION());
+				break;
+			case OP_GETFIELD:
+				VM_CHECK(base[i.b_]);
+				base[i.a_] = driver_->GetField(base[i.b_], proto->members_[i.c_]);
+				break;
+			case OP_SETFIELD:
+				VM_CHECK(base[i.c_]);
+				VM_CHECK(base[i.a_]);
+				driver_->SetField(base[i.a_], proto->members_[i.b_], base[i.c_]);
+				break;
+			case OP_NEWRECORD:
+				base[i.a_] = driver_->NewRecord(proto->records_[i.b_], base + i.a_);
+				break;
+			default:
+				LJ_TRAP();
+			}
+		}
+	}
+}
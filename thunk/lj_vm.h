@@ -0,0 +1,60 @@
+#ifndef __LJ_VM_H__
+#define __LJ_VM_H__
+
+#include <vector>
+#include "lj_bytecode.h"
+#include "lj_gc.h"
+#include "lj_jit.h"
+#include "lj_memo.h"
+
+namespace LJ {
+
+	class LJ_Driver;
+
+	class CallFrame {
+	public:
+		CallFrame(FunctionProto *proto, size_t base) :
+			proto_(proto), base_(base), pc_(0), memo_(NULL) {}
+
+		FunctionProto *proto_;
+		size_t base_;
+		size_t pc_;
+		// Set on the frame of a memo function, its key is on top of
+		// LJ_VM::memo_keys_ until the frame returns.
+		MemoCache *memo_;
+	};
+
+	//
+	// Executes the FunctionProtos produced by LJ_Compiler. All frames share one
+	// register file; a callee's frame starts at the caller register holding
+	// its first argument, so arguments are passed without copying and calls
+	// do not recurse on the native stack.
+	//
+	class LJ_VM : public GCRootSet {
+	public:
+		LJ_VM(LJ_Driver *driver);
+		~LJ_VM();
+
+		void Compile();
+		void Dump();
+		void Execute();
+
+		void MarkRoots(LJ_GC *gc) override;
+
+		bool use_jit_;
+
+	private:
+		void Run();
+		void EnsureRegisters(size_t size);
+
+		LJ_Driver *driver_;
+		FunctionProto *main_;
+		std::vector<FunctionProto *> protos_;
+		std::vector<Value> registers_;
+		std::vector<CallFrame> frames_;
+		std::vector<std::string> memo_keys_;
+		LJ_JIT jit_;
+	};
+}
+
+#endif
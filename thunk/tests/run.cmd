@@ -0,0 +1,20 @@
+@echo off
+rem Runs every script in this directory on each engine and compares what it
+rem prints, errors included, with the .out file of the same name. Arguments
+rem in a .args file of the same name come before the engine's. The path
+rem of lj.exe may be given, Release\lj.exe is used otherwise.
+setlocal enabledelayedexpansion
+set lj=%~dp0..\Release\lj.exe
+if not "%~1"=="" set lj=%~f1
+set failed=0
+pushd "%~dp0"
+for %%f in (*.lj) do (
+	set args=
+	if exist "%%~nf.args" set /p args=<"%%~nf.args"
+	for %%e in ("" "-c" "-b --no-jit" "-b") do (
+		"%lj%" !args! %%~e "%%f" > "%TEMP%\lj_test.out" 2>&1
+		fc "%TEMP%\lj_test.out" "%%~nf.out" > nul || (echo %%f !args! %%~e: FAILED & set failed=1)
+	)
+)
+popd
+exit /b %failed%
@@ -0,0 +1,21 @@
+#!/bin/sh
+# Runs every script in this directory on each engine and compares what it
+# prints, errors included, with the .out file of the same name. Arguments
+# in a .args file of the same name come before the engine's. The path of
+# lj may be given, ../lj is used otherwise.
+dir=$(cd "$(dirname "$0")" && pwd)
+lj=${1:-$dir/../lj}
+case $lj in /*) ;; *) lj=$(pwd)/$lj ;; esac
+out=${TMPDIR:-/tmp}/lj_test.$$.out
+failed=0
+cd "$dir"
+for f in *.lj; do
+	args=
+	[ -f "${f%.lj}.args" ] && args=$(cat "${f%.lj}.args")
+	for e in "" "-c" "-b --no-jit" "-b"; do
+		"$lj" $args $e "$f" > "$out" 2>&1
+		cmp -s "$out" "${f%.lj}.out" || { echo "$f $args $e: FAILED"; failed=1; }
+	done
+done
+rm -f "$out"
+exit $failed